@@ -16,10 +16,35 @@
 #include "blockhash.h"
 #include <stdint.h>  // uint32_t
 #include <string.h>  // memcpy, memcmp
-#include <algorithm>  // std::min
+#include <algorithm>  // std::fill, std::min
+#include <vector>
 #include "compile_assert.h"
 #include "logging.h"
+#include "parallel.h"
 #include "rolling_hash.h"
+#include "unique_ptr.h" // auto_ptr, unique_ptr
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>  // SSE2 intrinsics
+#define VCDIFF_USE_SSE2 1
+#ifdef _MSC_VER
+#include <intrin.h>  // _BitScanForward, _BitScanReverse
+#endif  // _MSC_VER
+#endif
+
+// An AVX2 version of the match extension functions is compiled using
+// per-function target attributes, and is selected at run time only if
+// the processor supports AVX2.  This does not require building the library
+// with -mavx2.
+#if defined(VCDIFF_USE_SSE2) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || \
+     (defined(__GNUC__) && \
+      ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))))
+#include <immintrin.h>  // AVX2 intrinsics
+#define VCDIFF_USE_AVX2_DISPATCH 1
+#endif
 
 namespace open_vcdiff {
 
@@ -30,36 +55,86 @@ BlockHash::BlockHash(const char* source_data,
                      int starting_offset)
     : source_data_(source_data),
       source_size_(source_size),
+      block_size_(kBlockSize),
+      sampling_interval_(1),
+      block_spacing_(kBlockSize),
+      max_matches_to_check_(MaxMatchesToCheck(kBlockSize)),
+      hash_table_(NULL),
+      next_block_table_(NULL),
       hash_table_mask_(0),
+      buckets_(NULL),
+      bucket_mask_(0),
+      is_target_hash_(false),
+      starting_offset_(starting_offset),
+      last_block_added_(-1) {
+}
+
+BlockHash::BlockHash(const char* source_data,
+                     size_t source_size,
+                     int starting_offset,
+                     int block_size,
+                     int sampling_interval)
+    : source_data_(source_data),
+      source_size_(source_size),
+      block_size_(block_size),
+      sampling_interval_(sampling_interval),
+      block_spacing_(block_size * sampling_interval),
+      max_matches_to_check_(MaxMatchesToCheck(block_size)),
+      hash_table_(NULL),
+      next_block_table_(NULL),
+      hash_table_mask_(0),
+      buckets_(NULL),
+      bucket_mask_(0),
+      is_target_hash_(false),
       starting_offset_(starting_offset),
       last_block_added_(-1) {
 }
 
 BlockHash::~BlockHash() { }
 
-// kBlockSize must be at least 2 to be meaningful.  Since it's a compile-time
-// constant, check its value at compile time rather than wasting CPU cycles
-// on runtime checks.
-VCD_COMPILE_ASSERT(BlockHash::kBlockSize >= 2, kBlockSize_must_be_at_least_2);
-
-// kBlockSize is required to be a power of 2 because multiplication
-// (n * kBlockSize), division (n / kBlockSize) and MOD (n % kBlockSize)
-// are commonly-used operations.  If kBlockSize is a compile-time
-// constant and a power of 2, the compiler can convert these three operations
-// into bit-shift (>> or <<) and bitwise-AND (&) operations, which are much
-// more efficient than executing full integer multiply, divide, or remainder
-// instructions.
+// The block size must be at least 2 to be meaningful.  Since the limits are
+// compile-time constants, check their values at compile time rather than
+// wasting CPU cycles on runtime checks.
+VCD_COMPILE_ASSERT(BlockHash::kMinBlockSize >= 2,
+                   kMinBlockSize_must_be_at_least_2);
+
+// The block size is required to be a power of 2 because multiplication
+// (n * block_size), division (n / block_size) and MOD (n % block_size)
+// are commonly-used operations.  Comparisons of whole blocks are also
+// specialized for each of the allowed block sizes (see BlockContentsMatch.)
 VCD_COMPILE_ASSERT((BlockHash::kBlockSize & (BlockHash::kBlockSize - 1)) == 0,
                    kBlockSize_must_be_a_power_of_2);
+VCD_COMPILE_ASSERT((BlockHash::kBlockSize >= BlockHash::kMinBlockSize) &&
+                   (BlockHash::kBlockSize <= BlockHash::kMaxBlockSize),
+                   kBlockSize_must_be_a_valid_block_size);
+
+// The size of a cache line on most current processors.
+static const size_t kCacheLineSize = 64;
+
+// The fingerprint of an unused entry in a bucketized dictionary hash.
+// RollingHash values are always less than RollingHashUtil::kBase, so this
+// value never matches the hash value of a block.
+static const uint32_t kUnusedFingerprint = 0xFFFFFFFF;
+
+inline uint32_t BlockHash::HashBlock(const char* block_ptr) const {
+  switch (block_size_) {
+    case 8: return RollingHash<8>::Hash(block_ptr);
+    case 16: return RollingHash<16>::Hash(block_ptr);
+    case 32: return RollingHash<32>::Hash(block_ptr);
+    default: return RollingHash<64>::Hash(block_ptr);
+  }
+}
 
 bool BlockHash::Init(bool populate_hash_table) {
-  if (!hash_table_.empty() ||
-      !next_block_table_.empty() ||
+  if (hash_table_ ||
+      !hash_table_storage_.empty() ||
+      !next_block_table_storage_.empty() ||
       !last_block_table_.empty()) {
     VCD_DFATAL << "Init() called twice for same BlockHash object" << VCD_ENDL;
     return false;
   }
-  const size_t table_size = CalcTableSize(source_size_);
+  const size_t table_size =
+      CalcTableSize(source_size_, block_size_, sampling_interval_);
   if (table_size == 0) {
     VCD_DFATAL << "Error finding table size for source size " << source_size_
                << VCD_ENDL;
@@ -68,9 +143,12 @@ bool BlockHash::Init(bool populate_hash_table) {
   // Since table_size is a power of 2, (table_size - 1) is a bit mask
   // containing all the bits below table_size.
   hash_table_mask_ = static_cast<uint32_t>(table_size - 1);
-  hash_table_.resize(table_size, -1);
-  next_block_table_.resize(GetNumberOfBlocks(), -1);
+  hash_table_storage_.resize(table_size, -1);
+  next_block_table_storage_.resize(GetNumberOfBlocks(), -1);
   last_block_table_.resize(GetNumberOfBlocks(), -1);
+  hash_table_ = &hash_table_storage_[0];
+  next_block_table_ = next_block_table_storage_.empty() ?
+                          NULL : &next_block_table_storage_[0];
   if (populate_hash_table) {
     AddAllBlocks();
   }
@@ -79,10 +157,93 @@ bool BlockHash::Init(bool populate_hash_table) {
 
 const BlockHash* BlockHash::CreateDictionaryHash(const char* dictionary_data,
                                                  size_t dictionary_size) {
+  return CreateDictionaryHash(dictionary_data,
+                              dictionary_size,
+                              kBlockSize,
+                              /* sampling_interval = */ 1,
+                              /* thread_count = */ 1);
+}
+
+const BlockHash* BlockHash::CreateDictionaryHash(const char* dictionary_data,
+                                                 size_t dictionary_size,
+                                                 int thread_count) {
+  return CreateDictionaryHash(dictionary_data,
+                              dictionary_size,
+                              kBlockSize,
+                              /* sampling_interval = */ 1,
+                              thread_count);
+}
+
+// Returns false (and logs an error) if the block size or sampling interval
+// passed to a factory function is not valid.
+static bool CheckIndexParameters(int block_size, int sampling_interval) {
+  if (!BlockHash::IsValidBlockSize(block_size)) {
+    VCD_ERROR << "Invalid block size " << block_size << VCD_ENDL;
+    return false;
+  }
+  if ((sampling_interval < 1) ||
+      (sampling_interval > BlockHash::kMaxSamplingInterval)) {
+    VCD_ERROR << "Invalid sampling interval " << sampling_interval
+              << VCD_ENDL;
+    return false;
+  }
+  return true;
+}
+
+const BlockHash* BlockHash::CreateDictionaryHash(const char* dictionary_data,
+                                                 size_t dictionary_size,
+                                                 int block_size,
+                                                 int sampling_interval,
+                                                 int thread_count) {
+  if (!CheckIndexParameters(block_size, sampling_interval)) {
+    return NULL;
+  }
   BlockHash* new_dictionary_hash = new BlockHash(dictionary_data,
                                                  dictionary_size,
-                                                 0);
-  if (!new_dictionary_hash->Init(/* populate_hash_table = */ true)) {
+                                                 0,
+                                                 block_size,
+                                                 sampling_interval);
+  if (thread_count < 2) {
+    if (!new_dictionary_hash->Init(/* populate_hash_table = */ true)) {
+      delete new_dictionary_hash;
+      return NULL;
+    }
+  } else {
+    if (!new_dictionary_hash->Init(/* populate_hash_table = */ false)) {
+      delete new_dictionary_hash;
+      return NULL;
+    }
+    new_dictionary_hash->AddAllBlocksInParallel(thread_count);
+  }
+  // A dictionary hash is never modified after it has been populated, so the
+  // table that is only needed to add blocks can be released.
+  std::vector<int>().swap(new_dictionary_hash->last_block_table_);
+  return new_dictionary_hash;
+}
+
+const BlockHash* BlockHash::CreateBucketizedDictionaryHash(
+    const char* dictionary_data,
+    size_t dictionary_size) {
+  return CreateBucketizedDictionaryHash(dictionary_data,
+                                        dictionary_size,
+                                        kBlockSize,
+                                        /* sampling_interval = */ 1);
+}
+
+const BlockHash* BlockHash::CreateBucketizedDictionaryHash(
+    const char* dictionary_data,
+    size_t dictionary_size,
+    int block_size,
+    int sampling_interval) {
+  if (!CheckIndexParameters(block_size, sampling_interval)) {
+    return NULL;
+  }
+  BlockHash* new_dictionary_hash = new BlockHash(dictionary_data,
+                                                 dictionary_size,
+                                                 0,
+                                                 block_size,
+                                                 sampling_interval);
+  if (!new_dictionary_hash->InitBuckets()) {
     delete new_dictionary_hash;
     return NULL;
   } else {
@@ -90,28 +251,226 @@ const BlockHash* BlockHash::CreateDictionaryHash(const char* dictionary_data,
   }
 }
 
+bool BlockHash::InitBuckets() {
+  VCD_COMPILE_ASSERT(sizeof(HashBucket) == kCacheLineSize,
+                     HashBucket_must_fill_one_cache_line);
+  if (hash_table_ || buckets_) {
+    VCD_DFATAL << "InitBuckets() called twice for same BlockHash object"
+               << VCD_ENDL;
+    return false;
+  }
+  // Use the same amount of memory as the hash table of a chained BlockHash.
+  // This keeps the buckets at most half full on average.
+  const size_t table_size =
+      CalcTableSize(source_size_, block_size_, sampling_interval_);
+  if (table_size == 0) {
+    VCD_DFATAL << "Error finding table size for source size " << source_size_
+               << VCD_ENDL;
+    return false;
+  }
+  size_t number_of_buckets =
+      (table_size * sizeof(int)) / sizeof(HashBucket);  // NOLINT
+  if (number_of_buckets == 0) {
+    number_of_buckets = 1;
+  }
+  bucket_mask_ = static_cast<uint32_t>(number_of_buckets - 1);
+  bucket_storage_.resize((number_of_buckets * sizeof(HashBucket))
+                             + kCacheLineSize);
+  // Align the first bucket to a cache line boundary.
+  char* first_bucket = &bucket_storage_[0];
+  first_bucket += (kCacheLineSize
+                      - (reinterpret_cast<uintptr_t>(first_bucket)
+                            % kCacheLineSize)) % kCacheLineSize;
+  buckets_ = reinterpret_cast<HashBucket*>(first_bucket);
+  for (size_t i = 0; i < number_of_buckets; ++i) {
+    for (int j = 0; j < kBucketEntries; ++j) {
+      buckets_[i].block_numbers[j] = -1;
+      buckets_[i].fingerprints[j] = kUnusedFingerprint;
+    }
+  }
+  const int total_blocks = static_cast<int>(GetNumberOfBlocks());
+  const char* block_ptr = source_data_;
+  for (int block_number = 0; block_number < total_blocks; ++block_number) {
+    AddBlockToBuckets(block_number, HashBlock(block_ptr));
+    block_ptr += block_spacing_;
+  }
+  last_block_added_ = total_blocks - 1;
+  return true;
+}
+
+void BlockHash::AddBlockToBuckets(int block_number, uint32_t hash_value) {
+  uint32_t bucket_index = hash_value & bucket_mask_;
+  for (int probes = 0; probes < kMaxBucketProbes; ++probes) {
+    HashBucket* const bucket = &buckets_[bucket_index];
+    for (int i = 0; i < kBucketEntries; ++i) {
+      if (bucket->block_numbers[i] < 0) {
+        bucket->block_numbers[i] = block_number;
+        bucket->fingerprints[i] = hash_value;
+        return;
+      }
+    }
+    bucket_index = (bucket_index + 1) & bucket_mask_;
+  }
+  // All the buckets that could hold this block are full; leave it out.
+}
+
 BlockHash* BlockHash::CreateTargetHash(const char* target_data,
                                        size_t target_size,
                                        size_t dictionary_size) {
+  return CreateTargetHash(target_data,
+                          target_size,
+                          dictionary_size,
+                          kBlockSize);
+}
+
+BlockHash* BlockHash::CreateTargetHash(const char* target_data,
+                                       size_t target_size,
+                                       size_t dictionary_size,
+                                       int block_size) {
+  if (!IsValidBlockSize(block_size)) {
+    VCD_ERROR << "Invalid block size " << block_size << VCD_ENDL;
+    return NULL;
+  }
   BlockHash* new_target_hash = new BlockHash(target_data,
                                              target_size,
-                                             static_cast<int>(dictionary_size));
+                                             static_cast<int>(dictionary_size),
+                                             block_size,
+                                             /* sampling_interval = */ 1);
   if (!new_target_hash->Init(/* populate_hash_table = */ false)) {
     delete new_target_hash;
     return NULL;
   } else {
+    new_target_hash->is_target_hash_ = true;
     return new_target_hash;
   }
 }
 
+bool BlockHash::ResetTargetHash(const char* target_data,
+                                size_t target_size,
+                                size_t dictionary_size) {
+  if (!is_target_hash_) {
+    VCD_DFATAL << "BlockHash::ResetTargetHash() called"
+                  " for a dictionary hash" << VCD_ENDL;
+    return false;
+  }
+  const size_t table_size =
+      CalcTableSize(target_size, block_size_, sampling_interval_);
+  if (table_size == 0) {
+    return false;
+  }
+  // Clear the entries that were used for the previous target data.  Any
+  // entries beyond those are still -1.
+  for (size_t i = 0; i < used_hash_table_indices_.size(); ++i) {
+    hash_table_storage_[used_hash_table_indices_[i]] = -1;
+  }
+  used_hash_table_indices_.clear();
+  const size_t blocks_used = static_cast<size_t>(last_block_added_ + 1);
+  std::fill(next_block_table_storage_.begin(),
+            next_block_table_storage_.begin() + blocks_used,
+            -1);
+  std::fill(last_block_table_.begin(),
+            last_block_table_.begin() + blocks_used,
+            -1);
+  last_block_added_ = -1;
+  source_data_ = target_data;
+  source_size_ = target_size;
+  starting_offset_ = static_cast<int>(dictionary_size);
+  // If the tables are larger than necessary, only the beginning of the hash
+  // table is used, so that the chains of matching blocks, and therefore the
+  // encoding, are the same as for a newly created target hash.
+  if (table_size > hash_table_storage_.size()) {
+    hash_table_storage_.resize(table_size, -1);
+  }
+  hash_table_mask_ = static_cast<uint32_t>(table_size - 1);
+  if (GetNumberOfBlocks() > next_block_table_storage_.size()) {
+    next_block_table_storage_.resize(GetNumberOfBlocks(), -1);
+    last_block_table_.resize(GetNumberOfBlocks(), -1);
+  }
+  hash_table_ = &hash_table_storage_[0];
+  next_block_table_ = next_block_table_storage_.empty() ?
+                          NULL : &next_block_table_storage_[0];
+  return true;
+}
+
+const BlockHash* BlockHash::CreateDictionaryHashFromTables(
+    const char* dictionary_data,
+    size_t dictionary_size,
+    int block_size,
+    int sampling_interval,
+    const int* hash_table,
+    size_t hash_table_size,
+    const int* next_block_table,
+    size_t next_block_table_size) {
+  if (!CheckIndexParameters(block_size, sampling_interval)) {
+    return NULL;
+  }
+  UNIQUE_PTR<BlockHash> new_dictionary_hash(new BlockHash(dictionary_data,
+                                                          dictionary_size,
+                                                          0,
+                                                          block_size,
+                                                          sampling_interval));
+  const size_t number_of_blocks = new_dictionary_hash->GetNumberOfBlocks();
+  if ((hash_table_size == 0) ||
+      (hash_table_size !=
+           CalcTableSize(dictionary_size, block_size, sampling_interval)) ||
+      (next_block_table_size != number_of_blocks)) {
+    VCD_ERROR << "Hash table sizes (" << hash_table_size << ", "
+              << next_block_table_size << ") do not match dictionary size "
+              << dictionary_size << VCD_ENDL;
+    return NULL;
+  }
+  if (!hash_table || ((number_of_blocks > 0) && !next_block_table)) {
+    VCD_ERROR << "NULL hash table passed to CreateDictionaryHashFromTables"
+              << VCD_ENDL;
+    return NULL;
+  }
+  // Every entry must be either -1 or a valid block number, and every chain
+  // must visit blocks in increasing order (as AddBlock() would build it),
+  // which also guarantees that no chain contains a cycle.
+  const int last_block = static_cast<int>(number_of_blocks) - 1;
+  for (size_t i = 0; i < hash_table_size; ++i) {
+    if ((hash_table[i] < -1) || (hash_table[i] > last_block)) {
+      VCD_ERROR << "Invalid block number " << hash_table[i]
+                << " found in hash table" << VCD_ENDL;
+      return NULL;
+    }
+  }
+  for (int block_number = 0; block_number <= last_block; ++block_number) {
+    const int next_block = next_block_table[block_number];
+    if ((next_block != -1) &&
+        ((next_block <= block_number) || (next_block > last_block))) {
+      VCD_ERROR << "Invalid block number " << next_block
+                << " found in next block table" << VCD_ENDL;
+      return NULL;
+    }
+  }
+  new_dictionary_hash->hash_table_mask_ =
+      static_cast<uint32_t>(hash_table_size - 1);
+  new_dictionary_hash->hash_table_ = hash_table;
+  new_dictionary_hash->next_block_table_ = next_block_table;
+  new_dictionary_hash->last_block_added_ = last_block;
+  return new_dictionary_hash.release();
+}
+
 // Returns zero if an error occurs.
-size_t BlockHash::CalcTableSize(const size_t dictionary_size) {
+size_t BlockHash::CalcTableSize(const size_t dictionary_size,
+                                int block_size,
+                                int sampling_interval) {
   // Overallocate the hash table by making it the same size (in bytes)
-  // as the source data.  This is a trade-off between space and time:
-  // the empty entries in the hash table will reduce the
-  // probability of a hash collision to (sizeof(int) / kblockSize),
-  // and so save time comparing false matches.
-  const size_t min_size = (dictionary_size / sizeof(int)) + 1;  // NOLINT
+  // as the source data when using the default block size.  This is a
+  // trade-off between space and time: the empty entries in the hash table
+  // will reduce the probability of a hash collision to
+  // (sizeof(int) / kBlockSize), and so save time comparing false matches.
+  // The number of entries per indexed block is kept the same for other
+  // block sizes and sampling intervals.
+  size_t entries = dictionary_size / sizeof(int);  // NOLINT
+  if (block_size >= kBlockSize) {
+    entries /= (block_size / kBlockSize);
+  } else {
+    entries *= (kBlockSize / block_size);
+  }
+  entries /= sampling_interval;
+  const size_t min_size = entries + 1;
   size_t table_size = 1;
   // Find the smallest power of 2 that is >= min_size, and assign
   // that value to table_size.
@@ -147,18 +506,27 @@ size_t BlockHash::CalcTableSize(const size_t dictionary_size) {
   return table_size;
 }
 
+size_t BlockHash::CalcIndexSize(size_t dictionary_size,
+                                int block_size,
+                                int sampling_interval) {
+  return (CalcTableSize(dictionary_size, block_size, sampling_interval)
+              + CalcNumberOfBlocks(dictionary_size,
+                                   block_size,
+                                   block_size * sampling_interval))
+         * sizeof(int);  // NOLINT
+}
+
 // If the hash value is already available from the rolling hash,
 // call this function to save time.
 void BlockHash::AddBlock(uint32_t hash_value) {
-  if (hash_table_.empty()) {
+  if (hash_table_storage_.empty()) {
     VCD_DFATAL << "BlockHash::AddBlock() called before BlockHash::Init()"
                << VCD_ENDL;
     return;
   }
   // The initial value of last_block_added_ is -1.
   int block_number = last_block_added_ + 1;
-  const int total_blocks =
-      static_cast<int>(source_size_ / kBlockSize);  // round down
+  const int total_blocks = static_cast<int>(GetNumberOfBlocks());
   if (block_number >= total_blocks) {
     VCD_DFATAL << "BlockHash::AddBlock() called"
                   " with block number " << block_number
@@ -166,31 +534,34 @@ void BlockHash::AddBlock(uint32_t hash_value) {
                << VCD_ENDL;
     return;
   }
-  if (next_block_table_[block_number] != -1) {
+  if (next_block_table_storage_[block_number] != -1) {
     VCD_DFATAL << "Internal error in BlockHash::AddBlock(): "
                   "block number = " << block_number
                << ", next block should be -1 but is "
-               << next_block_table_[block_number] << VCD_ENDL;
+               << next_block_table_storage_[block_number] << VCD_ENDL;
     return;
   }
   const uint32_t hash_table_index = GetHashTableIndex(hash_value);
-  const int first_matching_block = hash_table_[hash_table_index];
+  const int first_matching_block = hash_table_storage_[hash_table_index];
   if (first_matching_block < 0) {
     // This is the first entry with this hash value
-    hash_table_[hash_table_index] = block_number;
+    hash_table_storage_[hash_table_index] = block_number;
     last_block_table_[block_number] = block_number;
+    if (is_target_hash_) {
+      used_hash_table_indices_.push_back(hash_table_index);
+    }
   } else {
     // Add this entry at the end of the chain of matching blocks
     const int last_matching_block = last_block_table_[first_matching_block];
-    if (next_block_table_[last_matching_block] != -1) {
+    if (next_block_table_storage_[last_matching_block] != -1) {
       VCD_DFATAL << "Internal error in BlockHash::AddBlock(): "
                     "first matching block = " << first_matching_block
                  << ", last matching block = " << last_matching_block
                  << ", next block should be -1 but is "
-                 << next_block_table_[last_matching_block] << VCD_ENDL;
+                 << next_block_table_storage_[last_matching_block] << VCD_ENDL;
       return;
     }
-    next_block_table_[last_matching_block] = block_number;
+    next_block_table_storage_[last_matching_block] = block_number;
     last_block_table_[first_matching_block] = block_number;
   }
   last_block_added_ = block_number;
@@ -207,7 +578,7 @@ void BlockHash::AddAllBlocksThroughIndex(int end_index) {
                << " higher than end index  " << source_size_ << VCD_ENDL;
     return;
   }
-  const int last_index_added = last_block_added_ * kBlockSize;
+  const int last_index_added = last_block_added_ * block_spacing_;
   if (end_index <= last_index_added) {
     VCD_DFATAL << "BlockHash::AddAllBlocksThroughIndex() called"
                   " with index " << end_index
@@ -215,7 +586,7 @@ void BlockHash::AddAllBlocksThroughIndex(int end_index) {
                << ")" << VCD_ENDL;
     return;
   }
-  if (source_size() < static_cast<size_t>(kBlockSize)) {
+  if (source_size() < static_cast<size_t>(block_size_)) {
     // Exit early if the source data is small enough that it does not contain
     // any blocks.  This avoids negative values of last_legal_hash_index.
     // See: https://github.com/google/open-vcdiff/issues/40
@@ -223,22 +594,223 @@ void BlockHash::AddAllBlocksThroughIndex(int end_index) {
   }
   int end_limit = end_index;
   // Don't allow reading any indices at or past source_size_.
-  // The Hash function extends (kBlockSize - 1) bytes past the index,
+  // The Hash function extends (block_size_ - 1) bytes past the index,
   // so leave a margin of that size.
-  int last_legal_hash_index = static_cast<int>(source_size() - kBlockSize);
+  int last_legal_hash_index = static_cast<int>(source_size() - block_size_);
   if (end_limit > last_legal_hash_index) {
     end_limit = last_legal_hash_index + 1;
   }
   const char* block_ptr = source_data() + NextIndexToAdd();
   const char* const end_ptr = source_data() + end_limit;
   while (block_ptr < end_ptr) {
-    AddBlock(RollingHash<kBlockSize>::Hash(block_ptr));
-    block_ptr += kBlockSize;
+    AddBlock(HashBlock(block_ptr));
+    block_ptr += block_spacing_;
   }
 }
 
-VCD_COMPILE_ASSERT((BlockHash::kBlockSize % sizeof(uword_t)) == 0,
-                   kBlockSize_must_be_a_multiple_of_machine_word_size);
+// Each ParallelBuildTask performs one phase of AddAllBlocksInParallel().
+// The hash table is divided into task_count ranges of equal size.  Piece
+// number N of the task handles the Nth of task_count ranges of blocks (for
+// kHashBlocks and kSortBlocks) or of hash table entries (for kLinkBlocks).
+//
+// block_offsets has task_count * task_count entries.  kHashBlocks sets the
+// entry [N * task_count + R] to the number of blocks in block range N whose
+// hash table index falls in table range R.  AddAllBlocksInParallel() then
+// replaces these counts by their prefix sums in (R, N) order, so that entry
+// is the position in sorted_blocks of the first of those blocks.
+// kSortBlocks stores the block numbers there, so that sorted_blocks lists
+// the blocks of each table range together, in ascending order, and
+// kLinkBlocks visits only the blocks of its own table range.
+class BlockHash::ParallelBuildTask : public ParallelTask {
+ public:
+  enum Phase { kHashBlocks, kSortBlocks, kLinkBlocks };
+
+  ParallelBuildTask(BlockHash* block_hash,
+                    Phase phase,
+                    int task_count,
+                    uint32_t* hash_table_indices,
+                    int* block_offsets,
+                    int* sorted_blocks)
+      : block_hash_(block_hash),
+        phase_(phase),
+        task_count_(task_count),
+        table_size_bits_(0),
+        hash_table_indices_(hash_table_indices),
+        block_offsets_(block_offsets),
+        sorted_blocks_(sorted_blocks) {
+    // The hash table size is a power of two.
+    while ((static_cast<size_t>(1) << table_size_bits_) <
+           block_hash_->hash_table_storage_.size()) {
+      ++table_size_bits_;
+    }
+  }
+
+  virtual void Run(int task_number) {
+    switch (phase_) {
+      case kHashBlocks:
+        HashBlocks(task_number);
+        break;
+      case kSortBlocks:
+        SortBlocks(task_number);
+        break;
+      case kLinkBlocks:
+        LinkBlocks(task_number);
+        break;
+    }
+  }
+
+ private:
+  // Returns the start of range number task_number when the range
+  // [0, total_size) is divided into task_count_ nearly equal parts.
+  uint64_t RangeStart(int task_number, uint64_t total_size) const {
+    return (total_size * task_number) / task_count_;
+  }
+
+  // Returns the number of the table range that contains hash_table_index.
+  int TableRange(uint32_t hash_table_index) const {
+    return static_cast<int>(
+        (static_cast<uint64_t>(hash_table_index) * task_count_) >>
+            table_size_bits_);
+  }
+
+  // Stores the hash table index of each block in the range into
+  // hash_table_indices_, and counts the blocks that fall in each table range.
+  void HashBlocks(int task_number) {
+    const uint64_t total_blocks = block_hash_->GetNumberOfBlocks();
+    const int first_block =
+        static_cast<int>(RangeStart(task_number, total_blocks));
+    const int end_block =
+        static_cast<int>(RangeStart(task_number + 1, total_blocks));
+    const char* block_ptr = block_hash_->source_data() +
+                            (first_block * block_hash_->block_spacing_);
+    int* const range_counts = &block_offsets_[task_number * task_count_];
+    for (int block_number = first_block;
+         block_number < end_block;
+         ++block_number) {
+      const uint32_t hash_table_index = block_hash_->GetHashTableIndex(
+          block_hash_->HashBlock(block_ptr));
+      hash_table_indices_[block_number] = hash_table_index;
+      ++range_counts[TableRange(hash_table_index)];
+      block_ptr += block_hash_->block_spacing_;
+    }
+  }
+
+  // Stores the number of each block in the range at the next free position
+  // of its table range in sorted_blocks_.
+  void SortBlocks(int task_number) {
+    const uint64_t total_blocks = block_hash_->GetNumberOfBlocks();
+    const int first_block =
+        static_cast<int>(RangeStart(task_number, total_blocks));
+    const int end_block =
+        static_cast<int>(RangeStart(task_number + 1, total_blocks));
+    std::vector<int> next_positions(
+        &block_offsets_[task_number * task_count_],
+        &block_offsets_[task_number * task_count_] + task_count_);
+    for (int block_number = first_block;
+         block_number < end_block;
+         ++block_number) {
+      const int range = TableRange(hash_table_indices_[block_number]);
+      sorted_blocks_[next_positions[range]++] = block_number;
+    }
+  }
+
+  // Adds every block whose hash table index falls within the range to the
+  // end of its chain.  This is the same as AddBlock(), but uses the hash
+  // table indices computed by HashBlocks().
+  void LinkBlocks(int task_number) {
+    int* const hash_table = &block_hash_->hash_table_storage_[0];
+    int* const next_block_table = &block_hash_->next_block_table_storage_[0];
+    int* const last_block_table = &block_hash_->last_block_table_[0];
+    const int first_position = block_offsets_[task_number];
+    const int end_position =
+        (task_number + 1 < task_count_)
+            ? block_offsets_[task_number + 1]
+            : static_cast<int>(block_hash_->GetNumberOfBlocks());
+    for (int position = first_position;
+         position < end_position;
+         ++position) {
+      const int block_number = sorted_blocks_[position];
+      const uint32_t hash_table_index = hash_table_indices_[block_number];
+      const int first_matching_block = hash_table[hash_table_index];
+      if (first_matching_block < 0) {
+        hash_table[hash_table_index] = block_number;
+        last_block_table[block_number] = block_number;
+      } else {
+        const int last_matching_block = last_block_table[first_matching_block];
+        next_block_table[last_matching_block] = block_number;
+        last_block_table[first_matching_block] = block_number;
+      }
+    }
+  }
+
+  BlockHash* const block_hash_;
+  const Phase phase_;
+  const int task_count_;
+  int table_size_bits_;
+  uint32_t* const hash_table_indices_;
+  int* const block_offsets_;
+  int* const sorted_blocks_;
+
+  // Making these private avoids implicit copy constructor & assignment operator
+  ParallelBuildTask(const ParallelBuildTask&);  // NOLINT
+  void operator=(const ParallelBuildTask&);
+};
+
+void BlockHash::AddAllBlocksInParallel(int thread_count) {
+  if (hash_table_storage_.empty() || (last_block_added_ != -1)) {
+    VCD_DFATAL << "BlockHash::AddAllBlocksInParallel() must be called"
+                  " immediately after BlockHash::Init(false)" << VCD_ENDL;
+    return;
+  }
+  const int total_blocks = static_cast<int>(GetNumberOfBlocks());
+  if (thread_count > total_blocks / kMinBlocksPerThread) {
+    thread_count = total_blocks / kMinBlocksPerThread;
+  }
+  if (thread_count < 2) {
+    AddAllBlocks();
+    return;
+  }
+  std::vector<uint32_t> hash_table_indices(total_blocks);
+  std::vector<int> block_offsets(thread_count * thread_count, 0);
+  std::vector<int> sorted_blocks(total_blocks);
+  ParallelBuildTask hash_task(this,
+                              ParallelBuildTask::kHashBlocks,
+                              thread_count,
+                              &hash_table_indices[0],
+                              &block_offsets[0],
+                              &sorted_blocks[0]);
+  RunInParallel(&hash_task, thread_count, thread_count);
+  // Turn the per-range block counts into positions in sorted_blocks.  The
+  // blocks of each table range are grouped together, with those of earlier
+  // block ranges first.
+  int position = 0;
+  for (int table_range = 0; table_range < thread_count; ++table_range) {
+    for (int block_range = 0; block_range < thread_count; ++block_range) {
+      int& offset = block_offsets[block_range * thread_count + table_range];
+      const int count = offset;
+      offset = position;
+      position += count;
+    }
+  }
+  ParallelBuildTask sort_task(this,
+                              ParallelBuildTask::kSortBlocks,
+                              thread_count,
+                              &hash_table_indices[0],
+                              &block_offsets[0],
+                              &sorted_blocks[0]);
+  RunInParallel(&sort_task, thread_count, thread_count);
+  ParallelBuildTask link_task(this,
+                              ParallelBuildTask::kLinkBlocks,
+                              thread_count,
+                              &hash_table_indices[0],
+                              &block_offsets[0],
+                              &sorted_blocks[0]);
+  RunInParallel(&link_task, thread_count, thread_count);
+  last_block_added_ = total_blocks - 1;
+}
+
+VCD_COMPILE_ASSERT((BlockHash::kMinBlockSize % sizeof(uword_t)) == 0,
+                   kMinBlockSize_must_be_a_multiple_of_machine_word_size);
 
 // A recursive template to compare a fixed number
 // of (possibly unaligned) machine words starting
@@ -273,31 +845,57 @@ inline bool CompareWholeWordValues<1>(const char* word1,
 // as memcmp (measured using gcc on a 64-bit platform, with a block size
 // of 32.)  For blocks with identical contents (a common case), this method
 // is over six times faster than memcmp.
+template<int block_size>
 inline bool BlockCompareWordsInline(const char* block1, const char* block2) {
-  static const size_t kWordsPerBlock = BlockHash::kBlockSize / sizeof(uword_t);
+  static const size_t kWordsPerBlock = block_size / sizeof(uword_t);
   return CompareWholeWordValues<kWordsPerBlock>(block1, block2);
 }
 
-bool BlockHash::BlockCompareWords(const char* block1, const char* block2) {
-  return BlockCompareWordsInline(block1, block2);
+bool BlockHash::BlockCompareWords(const char* block1,
+                                  const char* block2,
+                                  int block_size) {
+  switch (block_size) {
+    case 8: return BlockCompareWordsInline<8>(block1, block2);
+    case 16: return BlockCompareWordsInline<16>(block1, block2);
+    case 32: return BlockCompareWordsInline<32>(block1, block2);
+    default: return BlockCompareWordsInline<64>(block1, block2);
+  }
+}
+
+template<int block_size>
+inline bool FixedSizeBlockContentsMatch(const char* block1,
+                                        const char* block2) {
+#ifdef VCDIFF_USE_BLOCK_COMPARE_WORDS
+  return BlockCompareWordsInline<block_size>(block1, block2);
+#else  // !VCDIFF_USE_BLOCK_COMPARE_WORDS
+  return memcmp(block1, block2, block_size) == 0;
+#endif  // VCDIFF_USE_BLOCK_COMPARE_WORDS
 }
 
-inline bool BlockContentsMatchInline(const char* block1, const char* block2) {
+// The switch statement selects a comparison of a constant number of bytes,
+// which the compiler can expand into a few word comparisons, for each of
+// the allowed block sizes.
+inline bool BlockContentsMatchInline(const char* block1,
+                                     const char* block2,
+                                     int block_size) {
   // Optimize for mismatch in first byte.  Since this function is called only
   // when the hash values of the two blocks match, it is very likely that either
   // the blocks are identical, or else the first byte does not match.
   if (*block1 != *block2) {
     return false;
   }
-#ifdef VCDIFF_USE_BLOCK_COMPARE_WORDS
-  return BlockCompareWordsInline(block1, block2);
-#else  // !VCDIFF_USE_BLOCK_COMPARE_WORDS
-  return memcmp(block1, block2, BlockHash::kBlockSize) == 0;
-#endif  // VCDIFF_USE_BLOCK_COMPARE_WORDS
+  switch (block_size) {
+    case 8: return FixedSizeBlockContentsMatch<8>(block1, block2);
+    case 16: return FixedSizeBlockContentsMatch<16>(block1, block2);
+    case 32: return FixedSizeBlockContentsMatch<32>(block1, block2);
+    default: return FixedSizeBlockContentsMatch<64>(block1, block2);
+  }
 }
 
-bool BlockHash::BlockContentsMatch(const char* block1, const char* block2) {
-  return BlockContentsMatchInline(block1, block2);
+bool BlockHash::BlockContentsMatch(const char* block1,
+                                   const char* block2,
+                                   int block_size) {
+  return BlockContentsMatchInline(block1, block2, block_size);
 }
 
 inline int BlockHash::SkipNonMatchingBlocks(int block_number,
@@ -305,7 +903,9 @@ inline int BlockHash::SkipNonMatchingBlocks(int block_number,
   int probes = 0;
   while ((block_number >= 0) &&
          !BlockContentsMatchInline(block_ptr,
-                                   &source_data_[block_number * kBlockSize])) {
+                                   &source_data_[block_number *
+                                                     block_spacing_],
+                                   block_size_)) {
     if (++probes > kMaxProbes) {
       return -1;  // Avoid too much chaining
     }
@@ -343,30 +943,252 @@ int BlockHash::NextMatchingBlock(int block_number,
 // dictionary is made up of spaces (' ') and the search string is also
 // made up of spaces, there will be one match for each block in the
 // dictionary.
-inline bool BlockHash::TooManyMatches(int* match_counter) {
+inline bool BlockHash::TooManyMatches(int* match_counter) const {
   ++(*match_counter);
-  return (*match_counter) > kMaxMatchesToCheck;
+  return (*match_counter) > max_matches_to_check_;
+}
+
+namespace {
+
+typedef int (*MatchingBytesFunction)(const char* source_ptr,
+                                     const char* target_ptr,
+                                     int max_bytes);
+
+// The portable versions of MatchingBytesToLeft and MatchingBytesToRight.
+// They compare a machine word at a time (using memcpy, which the compiler
+// turns into unaligned loads), then find the first mismatch byte by byte.
+int MatchingBytesToLeftPortable(const char* source_match_start,
+                                const char* target_match_start,
+                                int max_bytes) {
+  static const int kWordSize = static_cast<int>(sizeof(uword_t));
+  int bytes_found = 0;
+  while ((max_bytes - bytes_found) >= kWordSize) {
+    uword_t source_word, target_word;
+    memcpy(&source_word,
+           source_match_start - bytes_found - kWordSize,
+           kWordSize);
+    memcpy(&target_word,
+           target_match_start - bytes_found - kWordSize,
+           kWordSize);
+    if (source_word != target_word) {
+      break;
+    }
+    bytes_found += kWordSize;
+  }
+  while ((bytes_found < max_bytes) &&
+         (source_match_start[-bytes_found - 1] ==
+              target_match_start[-bytes_found - 1])) {
+    ++bytes_found;
+  }
+  return bytes_found;
+}
+
+int MatchingBytesToRightPortable(const char* source_match_end,
+                                 const char* target_match_end,
+                                 int max_bytes) {
+  static const int kWordSize = static_cast<int>(sizeof(uword_t));
+  int bytes_found = 0;
+  while ((max_bytes - bytes_found) >= kWordSize) {
+    uword_t source_word, target_word;
+    memcpy(&source_word, source_match_end + bytes_found, kWordSize);
+    memcpy(&target_word, target_match_end + bytes_found, kWordSize);
+    if (source_word != target_word) {
+      break;
+    }
+    bytes_found += kWordSize;
+  }
+  while ((bytes_found < max_bytes) &&
+         (source_match_end[bytes_found] == target_match_end[bytes_found])) {
+    ++bytes_found;
+  }
+  return bytes_found;
+}
+
+#ifdef VCDIFF_USE_SSE2
+
+// Returns the index of the lowest set bit of bits, which must not be zero.
+inline int LowestSetBit(uint32_t bits) {
+#ifdef _MSC_VER
+  unsigned long index;  // NOLINT
+  _BitScanForward(&index, bits);
+  return static_cast<int>(index);
+#else
+  return __builtin_ctz(bits);
+#endif  // _MSC_VER
+}
+
+// Returns the index of the highest set bit of bits, which must not be zero.
+inline int HighestSetBit(uint32_t bits) {
+#ifdef _MSC_VER
+  unsigned long index;  // NOLINT
+  _BitScanReverse(&index, bits);
+  return static_cast<int>(index);
+#else
+  return 31 - __builtin_clz(bits);
+#endif  // _MSC_VER
+}
+
+// Returns a bit mask with bit i set if the 16 bytes at source_ptr and
+// target_ptr differ at byte i.
+inline uint32_t MismatchedBytes16(const char* source_ptr,
+                                  const char* target_ptr) {
+  const __m128i source_bytes =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(source_ptr));
+  const __m128i target_bytes =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(target_ptr));
+  return static_cast<uint32_t>(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(source_bytes, target_bytes))) ^ 0xFFFF;
+}
+
+// The SSE2 versions compare 16 bytes per step, then use a bit scan on the
+// mismatch mask to find the first differing byte.  Fewer than 16 remaining
+// bytes are handled by the portable versions.
+int MatchingBytesToLeftSSE2(const char* source_match_start,
+                            const char* target_match_start,
+                            int max_bytes) {
+  int bytes_found = 0;
+  while ((max_bytes - bytes_found) >= 16) {
+    const uint32_t mismatches =
+        MismatchedBytes16(source_match_start - bytes_found - 16,
+                          target_match_start - bytes_found - 16);
+    if (mismatches != 0) {
+      return bytes_found + 15 - HighestSetBit(mismatches);
+    }
+    bytes_found += 16;
+  }
+  return bytes_found +
+      MatchingBytesToLeftPortable(source_match_start - bytes_found,
+                                  target_match_start - bytes_found,
+                                  max_bytes - bytes_found);
+}
+
+int MatchingBytesToRightSSE2(const char* source_match_end,
+                             const char* target_match_end,
+                             int max_bytes) {
+  int bytes_found = 0;
+  while ((max_bytes - bytes_found) >= 16) {
+    const uint32_t mismatches =
+        MismatchedBytes16(source_match_end + bytes_found,
+                          target_match_end + bytes_found);
+    if (mismatches != 0) {
+      return bytes_found + LowestSetBit(mismatches);
+    }
+    bytes_found += 16;
+  }
+  return bytes_found +
+      MatchingBytesToRightPortable(source_match_end + bytes_found,
+                                   target_match_end + bytes_found,
+                                   max_bytes - bytes_found);
 }
 
+#endif  // VCDIFF_USE_SSE2
+
+#ifdef VCDIFF_USE_AVX2_DISPATCH
+
+// Like MismatchedBytes16, but for 32 bytes.
+__attribute__((target("avx2")))
+inline uint32_t MismatchedBytes32(const char* source_ptr,
+                                  const char* target_ptr) {
+  const __m256i source_bytes =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source_ptr));
+  const __m256i target_bytes =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(target_ptr));
+  return ~static_cast<uint32_t>(
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(source_bytes, target_bytes)));
+}
+
+// The AVX2 versions compare 32 bytes per step, and leave any remainder of
+// fewer than 32 bytes to the SSE2 versions.
+__attribute__((target("avx2")))
+int MatchingBytesToLeftAVX2(const char* source_match_start,
+                            const char* target_match_start,
+                            int max_bytes) {
+  int bytes_found = 0;
+  while ((max_bytes - bytes_found) >= 32) {
+    const uint32_t mismatches =
+        MismatchedBytes32(source_match_start - bytes_found - 32,
+                          target_match_start - bytes_found - 32);
+    if (mismatches != 0) {
+      return bytes_found + 31 - HighestSetBit(mismatches);
+    }
+    bytes_found += 32;
+  }
+  return bytes_found +
+      MatchingBytesToLeftSSE2(source_match_start - bytes_found,
+                              target_match_start - bytes_found,
+                              max_bytes - bytes_found);
+}
+
+__attribute__((target("avx2")))
+int MatchingBytesToRightAVX2(const char* source_match_end,
+                             const char* target_match_end,
+                             int max_bytes) {
+  int bytes_found = 0;
+  while ((max_bytes - bytes_found) >= 32) {
+    const uint32_t mismatches =
+        MismatchedBytes32(source_match_end + bytes_found,
+                          target_match_end + bytes_found);
+    if (mismatches != 0) {
+      return bytes_found + LowestSetBit(mismatches);
+    }
+    bytes_found += 32;
+  }
+  return bytes_found +
+      MatchingBytesToRightSSE2(source_match_end + bytes_found,
+                               target_match_end + bytes_found,
+                               max_bytes - bytes_found);
+}
+
+bool ProcessorSupportsAVX2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+}
+
+#endif  // VCDIFF_USE_AVX2_DISPATCH
+
+MatchingBytesFunction SelectMatchingBytesToLeft() {
+#ifdef VCDIFF_USE_AVX2_DISPATCH
+  if (ProcessorSupportsAVX2()) {
+    return &MatchingBytesToLeftAVX2;
+  }
+#endif  // VCDIFF_USE_AVX2_DISPATCH
+#ifdef VCDIFF_USE_SSE2
+  return &MatchingBytesToLeftSSE2;
+#else
+  return &MatchingBytesToLeftPortable;
+#endif  // VCDIFF_USE_SSE2
+}
+
+MatchingBytesFunction SelectMatchingBytesToRight() {
+#ifdef VCDIFF_USE_AVX2_DISPATCH
+  if (ProcessorSupportsAVX2()) {
+    return &MatchingBytesToRightAVX2;
+  }
+#endif  // VCDIFF_USE_AVX2_DISPATCH
+#ifdef VCDIFF_USE_SSE2
+  return &MatchingBytesToRightSSE2;
+#else
+  return &MatchingBytesToRightPortable;
+#endif  // VCDIFF_USE_SSE2
+}
+
+}  // anonymous namespace
+
 // Returns the number of bytes to the left of source_match_start
 // that match the corresponding bytes to the left of target_match_start.
 // Will not examine more than max_bytes bytes, which is to say that
 // the return value will be in the range [0, max_bytes] inclusive.
+//
+// The implementation is chosen the first time the function is called,
+// based on the instruction sets supported by the processor.
 int BlockHash::MatchingBytesToLeft(const char* source_match_start,
                                    const char* target_match_start,
                                    int max_bytes) {
-  const char* source_ptr = source_match_start;
-  const char* target_ptr = target_match_start;
-  int bytes_found = 0;
-  while (bytes_found < max_bytes) {
-    --source_ptr;
-    --target_ptr;
-    if (*source_ptr != *target_ptr) {
-      break;
-    }
-    ++bytes_found;
-  }
-  return bytes_found;
+  static const MatchingBytesFunction matching_bytes_to_left =
+      SelectMatchingBytesToLeft();
+  return matching_bytes_to_left(source_match_start,
+                                target_match_start,
+                                max_bytes);
 }
 
 // Returns the number of bytes starting at source_match_end
@@ -376,15 +1198,114 @@ int BlockHash::MatchingBytesToLeft(const char* source_match_start,
 int BlockHash::MatchingBytesToRight(const char* source_match_end,
                                     const char* target_match_end,
                                     int max_bytes) {
-  const char* source_ptr = source_match_end;
-  const char* target_ptr = target_match_end;
-  int bytes_found = 0;
-  while ((bytes_found < max_bytes) && (*source_ptr == *target_ptr)) {
-    ++bytes_found;
-    ++source_ptr;
-    ++target_ptr;
+  static const MatchingBytesFunction matching_bytes_to_right =
+      SelectMatchingBytesToRight();
+  return matching_bytes_to_right(source_match_end,
+                                 target_match_end,
+                                 max_bytes);
+}
+
+int BlockHash::RunSizeToRight(const char* run_start, int max_bytes) {
+  // run_start[i] == run_start[0] for all i < n + 1 if and only if
+  // run_start[i] == run_start[i + 1] for all i < n.
+  return 1 + MatchingBytesToRight(run_start, run_start + 1, max_bytes - 1);
+}
+
+int BlockHash::RunSizeToLeft(const char* run_start, int max_bytes) {
+  return MatchingBytesToLeft(run_start + 1, run_start, max_bytes);
+}
+
+inline void BlockHash::ExtendMatch(int block_number,
+                                   const char* target_candidate_start,
+                                   const char* target_start,
+                                   size_t target_size,
+                                   const char* target_window_start,
+                                   Match* best_match) const {
+  int source_match_offset = block_number * block_spacing_;
+  const int source_match_end = source_match_offset + block_size_;
+
+  int target_match_offset =
+      static_cast<int>(target_candidate_start - target_start);
+  const int target_match_end = target_match_offset + block_size_;
+
+  size_t match_size = block_size_;
+  {
+    // Extend match start towards beginning of unencoded data
+    const int limit_bytes_to_left = std::min(source_match_offset,
+                                             target_match_offset);
+    const int matching_bytes_to_left =
+        MatchingBytesToLeft(source_data_ + source_match_offset,
+                            target_start + target_match_offset,
+                            limit_bytes_to_left);
+    source_match_offset -= matching_bytes_to_left;
+    target_match_offset -= matching_bytes_to_left;
+    match_size += matching_bytes_to_left;
   }
-  return bytes_found;
+  {
+    // Extend match end towards end of unencoded data
+    const size_t source_bytes_to_right = source_size_ - source_match_end;
+    const size_t target_bytes_to_right = target_size - target_match_end;
+    const size_t limit_bytes_to_right = std::min(source_bytes_to_right,
+                                                 target_bytes_to_right);
+    const int matching_bytes_to_right =
+        MatchingBytesToRight(source_data_ + source_match_end,
+                             target_start + target_match_end,
+                             static_cast<int>(limit_bytes_to_right));
+    match_size += matching_bytes_to_right;
+    if (target_window_start &&
+        (static_cast<size_t>(matching_bytes_to_right)
+             == source_bytes_to_right)) {
+      // The match reached the end of the source data.  Continue it into
+      // the target window, which follows the source in the address space.
+      const size_t target_continuation_offset =
+          target_match_end + matching_bytes_to_right;
+      match_size +=
+          MatchingBytesToRight(target_window_start,
+                               target_start + target_continuation_offset,
+                               static_cast<int>(target_size
+                                   - target_continuation_offset));
+    }
+  }
+  // Update in/out parameter if the best match found was better
+  // than any match already stored in *best_match.
+  best_match->ReplaceIfBetterMatch(match_size,
+                                   source_match_offset + starting_offset_,
+                                   target_match_offset);
+}
+
+// Returns a bit mask with bit i set if fingerprints[i] == hash_value, for
+// each of the kBucketEntries fingerprints in a bucket.  All the fingerprints
+// are compared at once, without branching, so that the common case of
+// a bucket with no matching fingerprint is fast.  (A loop of scalar
+// comparisons executes enough instructions to limit the number of bucket
+// lookups whose cache misses the processor can overlap.)  Unused entries
+// have a fingerprint that no hash value can equal.
+inline unsigned int BlockHash::MatchingFingerprints(
+    const uint32_t* fingerprints,
+    uint32_t hash_value) {
+#ifdef VCDIFF_USE_SSE2
+  VCD_COMPILE_ASSERT(kBucketEntries == 8,
+                     MatchingFingerprints_assumes_8_entries_per_bucket);
+  const __m128i hash_vector = _mm_set1_epi32(static_cast<int>(hash_value));
+  const __m128i low = _mm_cmpeq_epi32(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(fingerprints)),
+      hash_vector);
+  const __m128i high = _mm_cmpeq_epi32(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(fingerprints + 4)),
+      hash_vector);
+  // Narrow each 32-bit comparison result to a single byte, then collect
+  // the top bit of each byte.
+  const __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(low, high),
+                                        _mm_setzero_si128());
+  return static_cast<unsigned int>(_mm_movemask_epi8(bytes));
+#else  // !VCDIFF_USE_SSE2
+  unsigned int candidates = 0;
+  for (int i = 0; i < kBucketEntries; ++i) {
+    candidates |=
+        static_cast<unsigned int>(fingerprints[i] == hash_value) << i;
+  }
+  return candidates;
+#endif  // VCDIFF_USE_SSE2
 }
 
 // No NULL checks are performed on the pointer arguments.  The caller
@@ -398,48 +1319,89 @@ void BlockHash::FindBestMatch(uint32_t hash_value,
                               const char* target_candidate_start,
                               const char* target_start,
                               size_t target_size,
-                              Match* best_match) const {
+                              Match* best_match,
+                              const char* target_window_start) const {
+  if (buckets_) {
+    // Handle the common case (no candidates in a bucket that is not full)
+    // here, so that it executes as few instructions as possible.  This allows
+    // the processor to overlap the cache misses of more consecutive calls.
+    const HashBucket* const bucket = &buckets_[hash_value & bucket_mask_];
+    if ((MatchingFingerprints(bucket->fingerprints, hash_value) == 0) &&
+        (bucket->block_numbers[kBucketEntries - 1] < 0)) {
+      return;
+    }
+    FindBestMatchInBuckets(hash_value,
+                           target_candidate_start,
+                           target_start,
+                           target_size,
+                           target_window_start,
+                           best_match);
+    return;
+  }
   int match_counter = 0;
   for (int block_number = FirstMatchingBlockInline(hash_value,
                                                    target_candidate_start);
        (block_number >= 0) && !TooManyMatches(&match_counter);
        block_number = NextMatchingBlock(block_number, target_candidate_start)) {
-    int source_match_offset = block_number * kBlockSize;
-    const int source_match_end = source_match_offset + kBlockSize;
-
-    int target_match_offset =
-        static_cast<int>(target_candidate_start - target_start);
-    const int target_match_end = target_match_offset + kBlockSize;
-
-    size_t match_size = kBlockSize;
-    {
-      // Extend match start towards beginning of unencoded data
-      const int limit_bytes_to_left = std::min(source_match_offset,
-                                               target_match_offset);
-      const int matching_bytes_to_left =
-          MatchingBytesToLeft(source_data_ + source_match_offset,
-                              target_start + target_match_offset,
-                              limit_bytes_to_left);
-      source_match_offset -= matching_bytes_to_left;
-      target_match_offset -= matching_bytes_to_left;
-      match_size += matching_bytes_to_left;
+    ExtendMatch(block_number,
+                target_candidate_start,
+                target_start,
+                target_size,
+                target_window_start,
+                best_match);
+  }
+}
+
+// Candidates are examined in the same order as for a chained BlockHash
+// (increasing block number), and the same limits kMaxProbes and
+// MaxMatchesToCheck() apply.  A candidate whose fingerprint differs from
+// hash_value cannot match, and is skipped without reading its source data.
+// Since a block is only placed in a later bucket when all the preceding
+// buckets (starting from the one selected by its hash value) are full,
+// the search can stop after the first bucket that has a free entry.
+void BlockHash::FindBestMatchInBuckets(uint32_t hash_value,
+                                       const char* target_candidate_start,
+                                       const char* target_start,
+                                       size_t target_size,
+                                       const char* target_window_start,
+                                       Match* best_match) const {
+  int match_counter = 0;
+  int probes = 0;
+  uint32_t bucket_index = hash_value & bucket_mask_;
+  for (int bucket_probes = 0;
+       bucket_probes < kMaxBucketProbes;
+       ++bucket_probes) {
+    const HashBucket* const bucket = &buckets_[bucket_index];
+    unsigned int candidates = MatchingFingerprints(bucket->fingerprints,
+                                                   hash_value);
+    for (int i = 0; candidates != 0; ++i, candidates >>= 1) {
+      if ((candidates & 1) == 0) {
+        continue;
+      }
+      const int block_number = bucket->block_numbers[i];
+      if (!BlockContentsMatchInline(target_candidate_start,
+                                    &source_data_[block_number *
+                                                      block_spacing_],
+                                    block_size_)) {
+        if (++probes > kMaxProbes) {
+          return;  // Avoid too many false matches
+        }
+        continue;
+      }
+      if (TooManyMatches(&match_counter)) {
+        return;
+      }
+      ExtendMatch(block_number,
+                  target_candidate_start,
+                  target_start,
+                  target_size,
+                  target_window_start,
+                  best_match);
     }
-    {
-      // Extend match end towards end of unencoded data
-      const size_t source_bytes_to_right = source_size_ - source_match_end;
-      const size_t target_bytes_to_right = target_size - target_match_end;
-      const size_t limit_bytes_to_right = std::min(source_bytes_to_right,
-                                                   target_bytes_to_right);
-      match_size +=
-          MatchingBytesToRight(source_data_ + source_match_end,
-                               target_start + target_match_end,
-                               static_cast<int>(limit_bytes_to_right));
+    if (bucket->block_numbers[kBucketEntries - 1] < 0) {
+      return;  // No entries in any following bucket
     }
-    // Update in/out parameter if the best match found was better
-    // than any match already stored in *best_match.
-    best_match->ReplaceIfBetterMatch(match_size,
-                                     source_match_offset + starting_offset_,
-                                     target_match_offset);
+    bucket_index = (bucket_index + 1) & bucket_mask_;
   }
 }
 
@@ -27,8 +27,9 @@
 namespace open_vcdiff {
 
 // A generic hash table which will be used to keep track of byte runs
-// of size kBlockSize in both the incrementally processed target data
-// and the preprocessed source dictionary.
+// of a fixed block size in both the incrementally processed target data
+// and the preprocessed source dictionary.  The block size is kBlockSize
+// unless a different one is passed to the factory functions below.
 //
 // A custom hash table implementation is used instead of the standard
 // hash_map template because we know that there will be exactly one
@@ -68,9 +69,38 @@ class BlockHash {
   // a representative data set to find the best tradeoff between
   // memory/CPU and the effectiveness of FindBestMatch().
   //
-  // If you change kBlockSize to a smaller value, please increase
-  // kMaxMatchesToCheck accordingly.
+  // kBlockSize is the default block size.  Any power of two between
+  // kMinBlockSize and kMaxBlockSize can be passed to the factory functions
+  // that take a block_size argument.  The number of hash table entries per
+  // block does not depend on the block size, so the memory used by the hash
+  // tables is roughly inversely proportional to the block size.
   static const int kBlockSize = 16;
+  static const int kMinBlockSize = 8;
+  static const int kMaxBlockSize = 64;
+
+  // Returns true if block_size is a power of two between kMinBlockSize and
+  // kMaxBlockSize (inclusive.)
+  static bool IsValidBlockSize(int block_size) {
+    return (block_size >= kMinBlockSize) &&
+           (block_size <= kMaxBlockSize) &&
+           ((block_size & (block_size - 1)) == 0);
+  }
+
+  // A dictionary BlockHash can index only every Nth block of the dictionary,
+  // where N is its sampling interval (between 1 and kMaxSamplingInterval.)
+  // This divides the memory used by the hash tables by N.  A match that
+  // contains a whole indexed block is still found, and is then extended
+  // in both directions as usual, so every match of at least
+  // (N + 1) * block_size - 1 bytes is found; shorter matches may be missed.
+  static const int kMaxSamplingInterval = 1 << 16;
+
+  // Returns the number of bytes used by the hash tables of a chained
+  // dictionary BlockHash for the given parameters.  (A bucketized dictionary
+  // hash uses less.)  The memory used to hold the dictionary itself is
+  // not included.
+  static size_t CalcIndexSize(size_t dictionary_size,
+                              int block_size,
+                              int sampling_interval);
 
   // This class is used to store the best match found by FindBestMatch()
   // and return it to the caller.
@@ -121,6 +151,15 @@ class BlockHash {
   //
   BlockHash(const char* source_data, size_t source_size, int starting_offset);
 
+  // Like the three-argument constructor, but uses blocks of block_size bytes,
+  // which must satisfy IsValidBlockSize(), and adds only every
+  // sampling_interval-th block to the hash table.
+  BlockHash(const char* source_data,
+            size_t source_size,
+            int starting_offset,
+            int block_size,
+            int sampling_interval);
+
   ~BlockHash();
 
   // Initializes the object before use.
@@ -166,13 +205,141 @@ class BlockHash {
   // (using the C++ delete operator) once it is no longer needed.
   static const BlockHash* CreateDictionaryHash(const char* dictionary_data,
                                                size_t dictionary_size);
+
+  // Like the two-argument version of CreateDictionaryHash(), but hashes the
+  // dictionary using up to thread_count threads.  The resulting object is
+  // identical to the one that the two-argument version would produce, so
+  // the encoder output does not depend on thread_count.  If thread_count is
+  // less than 2, or the dictionary is too small to benefit from multiple
+  // threads, the dictionary is hashed in the calling thread.
+  static const BlockHash* CreateDictionaryHash(const char* dictionary_data,
+                                               size_t dictionary_size,
+                                               int thread_count);
+
+  // Like the three-argument version of CreateDictionaryHash(), but uses
+  // blocks of block_size bytes instead of kBlockSize bytes, and indexes only
+  // every sampling_interval-th block (see kMaxSamplingInterval.)  Returns
+  // NULL if block_size does not satisfy IsValidBlockSize() or if
+  // sampling_interval is out of range.  The hash value passed to
+  // FindBestMatch() must be computed using RollingHash<block_size>, and
+  // a target hash used together with this dictionary hash must have the
+  // same block size.
+  static const BlockHash* CreateDictionaryHash(const char* dictionary_data,
+                                               size_t dictionary_size,
+                                               int block_size,
+                                               int sampling_interval,
+                                               int thread_count);
+
+  // Creates a dictionary BlockHash that uses a bucketized index in place of
+  // hash chains.  The index is an array of 64-byte (one cache line) buckets,
+  // each of which holds up to kBucketEntries candidate block numbers together
+  // with the full hash value (fingerprint) of each candidate block.
+  // FindBestMatch() examines a single bucket in the common case, and rejects
+  // any candidate whose fingerprint differs from the hash value of the target
+  // block without reading the source data, whereas the chained index requires
+  // dependent memory accesses into hash_table_, next_block_table_ and the
+  // source data for every candidate.  This is faster for large dictionaries,
+  // whose hash tables do not fit in the processor cache.
+  //
+  // The bucketized index uses about the same amount of memory as the chained
+  // one.  A block whose bucket is full is placed in one of the following
+  // kMaxBucketProbes - 1 buckets; if all of those are also full, the block is
+  // not indexed.  This only happens for data (such as long runs of a single
+  // byte value) that has many blocks with the same contents, so that an
+  // earlier copy of the same block will still be found.  It cannot cause
+  // incorrect output, but the encoding may differ slightly from the one
+  // produced using a chained dictionary hash.
+  static const BlockHash* CreateBucketizedDictionaryHash(
+      const char* dictionary_data,
+      size_t dictionary_size);
+
+  static const BlockHash* CreateBucketizedDictionaryHash(
+      const char* dictionary_data,
+      size_t dictionary_size,
+      int block_size,
+      int sampling_interval);
+
   static BlockHash* CreateTargetHash(const char* target_data,
                                      size_t target_size,
                                      size_t dictionary_size);
 
+  static BlockHash* CreateTargetHash(const char* target_data,
+                                     size_t target_size,
+                                     size_t dictionary_size,
+                                     int block_size);
+
+  // Makes a target hash created by CreateTargetHash() equivalent to a newly
+  // created CreateTargetHash(target_data, target_size, dictionary_size,
+  // block_size()), but reuses its tables instead of allocating new ones.
+  // Only the table entries that were filled in since the last reset are
+  // cleared, so the cost is proportional to the amount of data that was
+  // hashed rather than to the size of the tables.  The tables grow as needed
+  // and never shrink.  Returns false if this is not a target hash.
+  bool ResetTargetHash(const char* target_data,
+                       size_t target_size,
+                       size_t dictionary_size);
+
+  // Creates a dictionary BlockHash without hashing any of the dictionary data.
+  // Instead, the hash tables are taken from the arrays hash_table
+  // (hash_table_size elements) and next_block_table (one element for each
+  // indexed block of the dictionary), which must contain a copy of
+  // the values returned by hash_table() and next_block_table() for a
+  // dictionary BlockHash built from the same dictionary contents with the
+  // same block size and sampling interval.  This is used to load a hashed
+  // dictionary that was persisted to disk.
+  //
+  // The tables are not copied: they must remain valid and unchanged for the
+  // lifetime of the returned object.  The values in the tables are checked
+  // to make sure they will not cause an out-of-bounds memory access; if
+  // they do not pass these checks, or if the table sizes do not match
+  // dictionary_size, NULL is returned.  Tables that were produced from
+  // a different dictionary will not make the encoder produce incorrect
+  // output (because every candidate match is verified against the data),
+  // but few or no matches will be found.
+  static const BlockHash* CreateDictionaryHashFromTables(
+      const char* dictionary_data,
+      size_t dictionary_size,
+      int block_size,
+      int sampling_interval,
+      const int* hash_table,
+      size_t hash_table_size,
+      const int* next_block_table,
+      size_t next_block_table_size);
+
+  // Accessors for the contents of the hash tables, so that a dictionary hash
+  // can be persisted and later passed to CreateDictionaryHashFromTables().
+  // hash_table() has hash_table_size() elements, and next_block_table()
+  // has one element per indexed block of source data.
+  // Init() must have been called and returned true before using these.
+  const int* hash_table() const { return hash_table_; }
+  size_t hash_table_size() const { return hash_table_mask_ + 1; }
+  const int* next_block_table() const { return next_block_table_; }
+  size_t next_block_table_size() const { return GetNumberOfBlocks(); }
+
+  // The number of bytes in each block of source data.
+  int block_size() const { return block_size_; }
+
+  // Only every sampling_interval()-th block of source data is indexed.
+  int sampling_interval() const { return sampling_interval_; }
+
+  // Returns true if this object was created by
+  // CreateBucketizedDictionaryHash().  Such an object does not have a hash
+  // table or a next block table.
+  bool is_bucketized() const { return buckets_ != NULL; }
+
+  // The number of bytes of memory allocated for the tables of this object
+  // (not including the source data.)
+  size_t allocated_table_bytes() const {
+    return ((hash_table_storage_.capacity() +
+             next_block_table_storage_.capacity() +
+             last_block_table_.capacity()) * sizeof(int)) +  // NOLINT
+           (used_hash_table_indices_.capacity() * sizeof(uint32_t)) +
+           bucket_storage_.capacity();
+  }
+
   // This function will be called to add blocks incrementally to the target hash
   // as the encoding position advances through the target data.  It will be
-  // called for every kBlockSize-byte block in the target data, regardless
+  // called for every block-sized run of bytes in the target data, regardless
   // of whether the block is aligned evenly on a block boundary.  The
   // BlockHash will only store hash entries for the evenly-aligned blocks.
   //
@@ -182,9 +349,10 @@ class BlockHash {
     }
   }
 
-  // Calls AddBlock() for each kBlockSize-byte block in the range
-  // (last_block_added_ * kBlockSize, end_index), exclusive of the endpoints.
-  // If end_index <= the last index added (last_block_added_ * kBlockSize),
+  // Calls AddBlock() for each block in the range
+  // (last_block_added_ * block_spacing_, end_index), exclusive of the
+  // endpoints.  If end_index <= the last index added
+  // (last_block_added_ * block_spacing_),
   // this function does nothing.
   //
   // A partial block beginning anywhere up to (end_index - 1) is also added,
@@ -207,7 +375,7 @@ class BlockHash {
   void AddAllBlocksThroughIndex(int end_index);
 
   // FindBestMatch takes a position within the unencoded target data
-  // (target_candidate_start) and the hash value of the kBlockSize bytes
+  // (target_candidate_start) and the hash value of the block_size() bytes
   // beginning at that position (hash_value).  It attempts to find a matching
   // set of bytes within the source (== dictionary) data, expanding
   // the match both below and above the target block.  It cannot expand
@@ -290,15 +458,43 @@ class BlockHash {
   //                                  (offset of " LLOYD" in the target string),
   //     and best_match->size() = 6.
   //
+  // If target_window_start is not NULL, this BlockHash must hash the
+  // dictionary (starting_offset_ == 0), and target_window_start must point to
+  // the beginning of the target window, of which [target_start,
+  // target_start + target_size) is a part.  In the VCDIFF address space,
+  // the target window immediately follows the dictionary, so a match that
+  // reaches the end of the dictionary is then extended into the beginning of
+  // the target window.  Such a match can be encoded as a single COPY
+  // instruction that starts in the source data and ends in the target data.
+  // The decoder always produces each byte of the target window before
+  // a COPY can reach it in this way, so the match may even overlap the
+  // target data that it encodes.
   void FindBestMatch(uint32_t hash_value,
                      const char* target_candidate_start,
                      const char* target_start,
                      size_t target_size,
-                     Match* best_match) const;
+                     Match* best_match,
+                     const char* target_window_start = NULL) const;
+
+  // Returns the number of bytes starting at run_start that are equal to
+  // run_start[0].  Will not examine more than max_bytes bytes, which must be
+  // at least 1, so the return value is in the range [1, max_bytes].
+  // VCDiffEngine uses this to find runs of a single byte value that can be
+  // encoded as RUN instructions.
+  static int RunSizeToRight(const char* run_start, int max_bytes);
+
+  // Returns the number of bytes immediately before run_start that are equal
+  // to run_start[0].  Will not examine more than max_bytes bytes, so the
+  // return value is in the range [0, max_bytes].
+  //
+  // Both functions compare the data with itself shifted by one byte using
+  // MatchingBytesToLeft() and MatchingBytesToRight(), so they also compare
+  // 16 or 32 bytes at a time where possible.
+  static int RunSizeToLeft(const char* run_start, int max_bytes);
 
  protected:
-  // FindBestMatch() will not process more than this number
-  // of matching hash entries.
+  // FindBestMatch() will not process more than MaxMatchesToCheck(block_size_)
+  // matching hash entries.
   //
   // It is necessary to have a limit on the maximum number of matches
   // that will be checked in order to avoid the worst-case performance
@@ -312,30 +508,53 @@ class BlockHash {
   // Total complexity in the worst case is
   //     O([target size] * source_size_ * source_size_)
   // Placing a limit on the possible number of matches checked changes this to
-  //     O([target size] * source_size_ * kMaxMatchesToCheck)
+  //     O([target size] * source_size_ * MaxMatchesToCheck(block_size_))
   //
   // In empirical testing on real HTML text, using a block size of 4,
   // the number of true matches per call to FindBestMatch() did not exceed 78;
   // with a block size of 32, the number of matches did not exceed 3.
   //
   // The expected number of true matches scales super-linearly
-  // with the inverse of kBlockSize, but here a linear scale is used
+  // with the inverse of the block size, but here a linear scale is used
   // for block sizes smaller than 32.
-  static const int kMaxMatchesToCheck = (kBlockSize >= 32) ? 32 :
-                                            (32 * (32 / kBlockSize));
+  static int MaxMatchesToCheck(int block_size) {
+    return (block_size >= 32) ? 32 : (32 * (32 / block_size));
+  }
 
   // Do not skip more than this number of non-matching hash collisions
   // to find the next matching entry in the hash chain.
   static const int kMaxProbes = 16;
 
-  // Internal routine which calculates a hash table size based on kBlockSize and
-  // the dictionary_size.  Will return a power of two if successful, or 0 if an
-  // internal error occurs.  Some calculations (such as GetHashTableIndex())
-  // depend on the table size being a power of two.
-  static size_t CalcTableSize(const size_t dictionary_size);
+  // The number of candidate blocks held in each bucket of a bucketized
+  // dictionary hash.  Each candidate uses 8 bytes (a block number and
+  // a fingerprint), so a bucket fills one 64-byte cache line.
+  static const int kBucketEntries = 8;
+
+  // The maximum number of consecutive buckets that will be examined
+  // to insert or look up a block in a bucketized dictionary hash.
+  static const int kMaxBucketProbes = 4;
+
+  // Internal routine which calculates a hash table size based on block_size
+  // and the dictionary_size.  Will return a power of two if successful, or 0
+  // if an internal error occurs.  Some calculations (such as
+  // GetHashTableIndex()) depend on the table size being a power of two.
+  static size_t CalcTableSize(const size_t dictionary_size,
+                              int block_size,
+                              int sampling_interval);
+
+  // Returns the number of indexed blocks: the complete blocks of block_size
+  // bytes that start at a multiple of block_spacing bytes.
+  static size_t CalcNumberOfBlocks(size_t source_size,
+                                   int block_size,
+                                   int block_spacing) {
+    if (source_size < static_cast<size_t>(block_size)) {
+      return 0;
+    }
+    return ((source_size - block_size) / block_spacing) + 1;
+  }
 
   size_t GetNumberOfBlocks() const {
-    return source_size_ / kBlockSize;
+    return CalcNumberOfBlocks(source_size_, block_size_, block_spacing_);
   }
 
   // Use the lowest-order bits of the hash value
@@ -347,31 +566,90 @@ class BlockHash {
   // The index within source_data_ of the next block
   // for which AddBlock() should be called.
   int NextIndexToAdd() const {
-    return (last_block_added_ + 1) * kBlockSize;
+    return (last_block_added_ + 1) * block_spacing_;
   }
 
-  static inline bool TooManyMatches(int* match_counter);
+  inline bool TooManyMatches(int* match_counter) const;
+
+  // Returns the hash value of the block_size_ bytes starting at block_ptr.
+  inline uint32_t HashBlock(const char* block_ptr) const;
 
   const char* source_data() { return source_data_; }
   size_t source_size() { return source_size_; }
 
   // Adds an entry to the hash table for one block of source data of length
-  // kBlockSize, starting at source_data_[block_number * kBlockSize],
+  // block_size_, starting at source_data_[block_number * block_spacing_],
   // where block_number is always (last_block_added_ + 1).  That is,
   // AddBlock() must be called once for each block in source_data_
   // in increasing order.
   void AddBlock(uint32_t hash_value);
 
-  // Calls AddBlock() for each complete kBlockSize-byte block between
+  // Calls AddBlock() for each complete block between
   // source_data_ and (source_data_ + source_size_).  It is equivalent
   // to calling AddAllBlocksThroughIndex(source_data + source_size).
   // This function is called when Init(true) is invoked.
   void AddAllBlocks();
 
-  // Returns true if the contents of the kBlockSize-byte block
+  // Has the same effect as AddAllBlocks(), but uses up to thread_count
+  // threads.  AddBlock() cannot be parallelized directly, because each call
+  // appends to a chain that may have been extended by the previous call.
+  // Instead, the hash table index of every block is computed in parallel
+  // (each thread handling a contiguous range of blocks), and the blocks are
+  // grouped by the range of hash table entries they fall in; then the chains
+  // are linked in parallel (each thread handling the blocks of one range of
+  // hash table entries, in ascending order as AddBlock() does).
+  // Since no two threads modify the same chain, and each chain is built in
+  // the same order as by AddAllBlocks(), the resulting tables are identical.
+  // Must be called immediately after Init(false).
+  void AddAllBlocksInParallel(int thread_count);
+
+  // The minimum number of blocks for which AddAllBlocksInParallel() will
+  // actually start additional threads; for smaller sources, the overhead of
+  // starting threads outweighs any time saved.
+  static const int kMinBlocksPerThread = 4096;
+
+  // Used by AddAllBlocksInParallel() to divide its work among threads.
+  class ParallelBuildTask;
+
+  // Used instead of Init(true) by CreateBucketizedDictionaryHash().
+  // Allocates the buckets and adds all the source blocks to them.
+  bool InitBuckets();
+
+  // Adds the block with the given number and hash value to the first bucket
+  // that has a free entry, starting with the bucket selected by hash_value.
+  void AddBlockToBuckets(int block_number, uint32_t hash_value);
+
+  // The equivalent of FindBestMatch() for a bucketized dictionary hash.
+  void FindBestMatchInBuckets(uint32_t hash_value,
+                              const char* target_candidate_start,
+                              const char* target_start,
+                              size_t target_size,
+                              const char* target_window_start,
+                              Match* best_match) const;
+
+  // Returns a bit mask in which bit i is set if fingerprints[i] == hash_value,
+  // for each of the kBucketEntries fingerprints in a bucket.
+  static inline unsigned int MatchingFingerprints(const uint32_t* fingerprints,
+                                                  uint32_t hash_value);
+
+  // Extends the match between source block number block_number and the
+  // target block at target_candidate_start as far as possible in both
+  // directions, and updates *best_match if the result is better.  If
+  // target_window_start is not NULL, a match that reaches the end of the
+  // source data continues into the target window (see FindBestMatch.)
+  inline void ExtendMatch(int block_number,
+                          const char* target_candidate_start,
+                          const char* target_start,
+                          size_t target_size,
+                          const char* target_window_start,
+                          Match* best_match) const;
+
+  // Returns true if the contents of the block_size-byte block
   // beginning at block1 are identical to the contents of
   // the block beginning at block2; false otherwise.
-  static bool BlockContentsMatch(const char* block1, const char* block2);
+  static bool BlockContentsMatch(const char* block1,
+                                 const char* block2,
+                                 int block_size);
 
   // Compares each machine word of the two (possibly unaligned) blocks, rather
   // than each byte, thus reducing the number of test-and-branch instructions
@@ -386,7 +664,9 @@ class BlockHash {
   // nine times faster than the assembly instructions (repz and cmpsb) that gcc
   // uses by default for builtin memcmp.  On other architectures, or using
   // other compilers, this function has not shown to be faster than memcmp.
-  static bool BlockCompareWords(const char* block1, const char* block2);
+  static bool BlockCompareWords(const char* block1,
+                                const char* block2,
+                                int block_size);
 
   // Finds the first block number within the hashed data
   // that represents a match for the given hash value.
@@ -434,6 +714,10 @@ class BlockHash {
   // that match the corresponding bytes starting at target_match_end.
   // Will not examine more than max_bytes bytes, which is to say that
   // the return value will be in the range [0, max_bytes] inclusive.
+  //
+  // Both functions compare 16 or 32 bytes at a time using SSE2 or AVX2
+  // (selected at run time) where available, so they may read bytes beyond
+  // the first mismatch, although never more than max_bytes bytes.
   static int MatchingBytesToRight(const char* source_match_end,
                                   const char* target_match_end,
                                   int max_bytes);
@@ -444,23 +728,44 @@ class BlockHash {
   friend class BlockHashTest;
 
  private:
-  const char* const  source_data_;
-  const size_t       source_size_;
+  // These are changed only by ResetTargetHash().
+  const char*  source_data_;
+  size_t       source_size_;
+
+  // The number of bytes in each block.  Always satisfies IsValidBlockSize().
+  const int block_size_;
+
+  // Only every sampling_interval_-th block is indexed, so block number B
+  // starts at source_data_[B * block_spacing_], where block_spacing_ is
+  // (block_size_ * sampling_interval_).  sampling_interval_ is always 1 for
+  // a target hash.
+  const int sampling_interval_;
+  const int block_spacing_;
+
+  // MaxMatchesToCheck(block_size_), computed once.
+  const int max_matches_to_check_;
 
   // The size of this array is determined using CalcTableSize().  It has at
-  // least one element for each kBlockSize-byte block in the source data.
+  // least one element for each block in the source data.
   // GetHashTableIndex() returns an index into this table for a given hash
   // value.  The value of each element of hash_table_ is the lowest block
   // number in the source data whose hash value would return the same value from
   // GetHashTableIndex(), or -1 if there is no matching block.  This value can
   // then be used as an index into next_block_table_ to retrieve the entire set
   // of matching block numbers.
-  std::vector<int> hash_table_;
+  //
+  // hash_table_ and next_block_table_ point either to the contents of
+  // hash_table_storage_ and next_block_table_storage_ (if the tables were
+  // computed by this object) or to tables that were passed to
+  // CreateDictionaryHashFromTables() (which cannot be modified.)
+  const int* hash_table_;
+  std::vector<int> hash_table_storage_;
 
   // An array containing one element for each source block.  Each element is
   // either -1 (== not found) or the index of the next block whose hash value
   // would produce a matching result from GetHashTableIndex().
-  std::vector<int> next_block_table_;
+  const int* next_block_table_;
+  std::vector<int> next_block_table_storage_;
 
   // This vector has the same size as next_block_table_.  For every block number
   // B that is referenced in hash_table_, last_block_table_[B] will contain
@@ -479,6 +784,27 @@ class BlockHash {
   // from 0 to the number of elements in hash_table_.
   uint32_t hash_table_mask_;
 
+  // One bucket of a bucketized dictionary hash.  The entries are filled in
+  // order of increasing block number; unused entries have a block number
+  // of -1, and all of them follow the used entries.
+  struct HashBucket {
+    int block_numbers[kBucketEntries];
+    uint32_t fingerprints[kBucketEntries];
+  };
+
+  // For a bucketized dictionary hash, buckets_ points to a cache-line-aligned
+  // array of (bucket_mask_ + 1) buckets within bucket_storage_.  For any
+  // other BlockHash, buckets_ is NULL and bucket_storage_ is empty.
+  HashBucket* buckets_;
+  std::vector<char> bucket_storage_;
+  uint32_t bucket_mask_;
+
+  // For a target hash (see ResetTargetHash), the hash_table_ index of every
+  // element of hash_table_ that has been set since the last reset.  Always
+  // empty for a dictionary hash.
+  std::vector<uint32_t> used_hash_table_indices_;
+  bool is_target_hash_;
+
   // The offset of the first byte of source data (the data at source_data_[0]).
   // For the purpose of computing offsets, the source data and target data
   // are considered to be concatenated -- not literally in a single memory
@@ -488,8 +814,8 @@ class BlockHash {
   // the last byte of source data.
   // For a hash of source (dictionary) data, starting_offset_ will be zero;
   // for a hash of previously encoded target data, starting_offset_ will be
-  // equal to the dictionary size.
-  const int starting_offset_;
+  // equal to the dictionary size.  Changed only by ResetTargetHash().
+  int starting_offset_;
 
   // The last index added by AddBlock().  This determines the block number
   // for successive calls to AddBlock(), and is also
@@ -16,7 +16,9 @@
 #include "blockhash.h"
 #include <limits.h>  // INT_MIN
 #include <string.h>  // memcpy, memcmp, strlen
+#include <algorithm>  // std::min
 #include <iostream>
+#include <vector>
 #include "google/encodetable.h"
 #include "rolling_hash.h"
 #include "testing.h"
@@ -42,7 +44,7 @@ class BlockHashTest : public testing::Test {
   // BlockHashTest is a friend to BlockHash.  Expose the protected functions
   // that will be tested by the children of BlockHashTest.
   static bool BlockContentsMatch(const char* block1, const char* block2) {
-    return BlockHash::BlockContentsMatch(block1, block2);
+    return BlockHash::BlockContentsMatch(block1, block2, kBlockSize);
   }
 
   int FirstMatchingBlock(const BlockHash& block_hash,
@@ -327,7 +329,7 @@ void BlockHashTest::TestAndPrintTimesForCompareFunctions(
     const char* block1 = compare_buffer_1_;
     const char* block2 = compare_buffer_2_;
     while (block1 < block1_limit) {
-      if (!BlockHash::BlockCompareWords(block1, block2)) {
+      if (!BlockHash::BlockCompareWords(block1, block2, kBlockSize)) {
         ++block_compare_words_result;
       }
       block1 += kBlockSize;
@@ -345,7 +347,7 @@ void BlockHashTest::TestAndPrintTimesForCompareFunctions(
     const char* block1 = compare_buffer_1_;
     const char* block2 = compare_buffer_2_;
     while (block1 < block1_limit) {
-      if (!BlockHash::BlockContentsMatch(block1, block2)) {
+      if (!BlockHash::BlockContentsMatch(block1, block2, kBlockSize)) {
         ++block_contents_match_result;
       }
       block1 += kBlockSize;
@@ -497,6 +499,73 @@ TEST_F(BlockHashTest, RightNotLimited) {
       INT_MAX));
 }
 
+// Checks MatchingBytesToLeft and MatchingBytesToRight against a byte-by-byte
+// comparison for every combination of mismatch position and max_bytes up to
+// a size that exercises both the vectorized loops and their remainders,
+// at several alignments.
+TEST_F(BlockHashTest, MatchingBytesAgreesWithByteByByteComparison) {
+  static const int kBufferSize = 256;
+  static const int kMaxLength = 100;
+  char source[kBufferSize];
+  char target[kBufferSize];
+  for (int i = 0; i < kBufferSize; ++i) {
+    source[i] = static_cast<char>('a' + (i % 26));
+  }
+  for (int alignment = 0; alignment < 32; alignment += 7) {
+    const char* const source_middle = &source[alignment + 110];
+    for (int mismatch = 0; mismatch <= kMaxLength; ++mismatch) {
+      memcpy(target, source, kBufferSize);
+      const int middle = alignment + 110;
+      // Introduce one mismatch at distance "mismatch" on each side
+      // of the middle.
+      if (middle + mismatch < kBufferSize) {
+        target[middle + mismatch] = '!';
+      }
+      if (middle - mismatch - 1 >= 0) {
+        target[middle - mismatch - 1] = '!';
+      }
+      const char* const target_middle = &target[middle];
+      for (int max_bytes = 0; max_bytes <= kMaxLength; ++max_bytes) {
+        if ((middle + max_bytes > kBufferSize) || (middle < max_bytes)) {
+          continue;
+        }
+        const int expected = std::min(mismatch, max_bytes);
+        EXPECT_EQ(expected, MatchingBytesToRight(source_middle,
+                                                 target_middle,
+                                                 max_bytes))
+            << "mismatch " << mismatch << ", max_bytes " << max_bytes;
+        EXPECT_EQ(expected, MatchingBytesToLeft(source_middle,
+                                                target_middle,
+                                                max_bytes))
+            << "mismatch " << mismatch << ", max_bytes " << max_bytes;
+      }
+    }
+  }
+}
+
+// Checks RunSizeToLeft and RunSizeToRight for a run of a single byte value
+// long enough to exercise the vectorized loops and their remainders.
+TEST_F(BlockHashTest, RunSizeFindsBoundsOfRun) {
+  static const int kRunStart = 10;
+  static const int kRunSize = 77;
+  char buffer[kRunStart + kRunSize + 10];
+  memset(buffer, 'x', sizeof(buffer));
+  memset(&buffer[kRunStart], '\0', kRunSize);
+  const char* const run_start = &buffer[kRunStart];
+  EXPECT_EQ(kRunSize, BlockHash::RunSizeToRight(run_start, kRunSize + 10));
+  EXPECT_EQ(kRunSize, BlockHash::RunSizeToRight(run_start, kRunSize + 1));
+  EXPECT_EQ(kRunSize - 1, BlockHash::RunSizeToRight(run_start, kRunSize - 1));
+  EXPECT_EQ(1, BlockHash::RunSizeToRight(run_start, 1));
+  EXPECT_EQ(1, BlockHash::RunSizeToRight(&buffer[kRunStart - 1], 10));
+  const char* const run_last = run_start + kRunSize - 1;
+  EXPECT_EQ(kRunSize - 1,
+            BlockHash::RunSizeToLeft(run_last, kRunStart + kRunSize - 1));
+  EXPECT_EQ(kRunSize - 1, BlockHash::RunSizeToLeft(run_last, kRunSize - 1));
+  EXPECT_EQ(kRunSize - 2, BlockHash::RunSizeToLeft(run_last, kRunSize - 2));
+  EXPECT_EQ(0, BlockHash::RunSizeToLeft(run_last, 0));
+  EXPECT_EQ(0, BlockHash::RunSizeToLeft(run_start + kRunSize, 10));
+}
+
 // If this test fails in a non-x86 or non-gcc environment, consider adding
 // -DVCDIFF_USE_BLOCK_COMPARE_WORDS to AM_CXXFLAGS in Makefile.am and
 // Makefile.in, and reconstructing the Makefile.  That will cause blockhash.cc
@@ -890,7 +959,7 @@ TEST_F(BlockHashTest, WrongFootprintFindsNoMatch) {
 // is not throttled to find a maximum number of matches, this
 // will take a very long time -- several seconds at least.
 // If this test appears to hang, it is because the throttling code
-// (see BlockHash::kMaxMatchesToCheck for details) is not working.
+// (see BlockHash::MaxMatchesToCheck for details) is not working.
 TEST_F(BlockHashTest, SearchStringFindsTooManyMatches) {
   const int kTestSize = 1 << 20;  // 1M
   char* huge_dictionary = new char[kTestSize];
@@ -925,6 +994,402 @@ TEST_F(BlockHashTest, SearchStringFindsTooManyMatches) {
   delete[] huge_dictionary;
 }
 
+// Building a dictionary hash with several threads must produce exactly
+// the same tables as building it sequentially.
+TEST_F(BlockHashTest, ParallelBuildMatchesSequentialBuild) {
+  const int kTestSize = 1 << 20;  // 1M
+  std::vector<char> dictionary(kTestSize);
+  // Use a small alphabet so that many blocks are repeated and the chains
+  // of matching blocks become long.
+  uint32_t random_value = 1;
+  for (int i = 0; i < kTestSize; ++i) {
+    random_value = random_value * 1103515245 + 12345;
+    dictionary[i] = static_cast<char>('a' + ((random_value >> 16) % 3));
+  }
+  // Repeat whole blocks, too, so that some chains contain blocks
+  // handled by different threads.
+  for (int i = kTestSize / 2; i < kTestSize; i += 64 * kBlockSize) {
+    memcpy(&dictionary[i], &dictionary[kBlockSize], kBlockSize);
+  }
+  UNIQUE_PTR<const BlockHash> sequential_hash(
+      BlockHash::CreateDictionaryHash(&dictionary[0], kTestSize));
+  ASSERT_TRUE(sequential_hash.get() != NULL);
+  const int thread_counts[] = { 0, 1, 2, 3, 8, 64 };
+  for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]);
+       ++i) {
+    UNIQUE_PTR<const BlockHash> parallel_hash(
+        BlockHash::CreateDictionaryHash(&dictionary[0],
+                                        kTestSize,
+                                        thread_counts[i]));
+    ASSERT_TRUE(parallel_hash.get() != NULL);
+    ASSERT_EQ(sequential_hash->hash_table_size(),
+              parallel_hash->hash_table_size());
+    ASSERT_EQ(sequential_hash->next_block_table_size(),
+              parallel_hash->next_block_table_size());
+    EXPECT_EQ(0, memcmp(sequential_hash->hash_table(),
+                        parallel_hash->hash_table(),
+                        sequential_hash->hash_table_size() * sizeof(int)))
+        << "thread count " << thread_counts[i];
+    EXPECT_EQ(0, memcmp(sequential_hash->next_block_table(),
+                        parallel_hash->next_block_table(),
+                        sequential_hash->next_block_table_size()
+                            * sizeof(int)))
+        << "thread count " << thread_counts[i];
+  }
+}
+
+// A target hash that is reset for new target data, whether larger or smaller
+// than before, must have the same tables as a newly created one.
+TEST_F(BlockHashTest, ResetTargetHashMatchesNewTargetHash) {
+  std::vector<char> data(1 << 17);  // 128K
+  uint32_t random_value = 1;
+  for (size_t i = 0; i < data.size(); ++i) {
+    random_value = random_value * 1103515245 + 12345;
+    data[i] = static_cast<char>('a' + ((random_value >> 16) % 3));
+  }
+  const size_t target_sizes[] = { 4096, 65536, 1000, 100000, 0, 5000, 7 };
+  UNIQUE_PTR<BlockHash> reused_hash;
+  for (size_t i = 0; i < sizeof(target_sizes) / sizeof(target_sizes[0]);
+       ++i) {
+    const char* const target = &data[i * 16];
+    const size_t target_size = target_sizes[i];
+    const size_t dictionary_size = 100 * i;
+    if (i == 0) {
+      reused_hash.reset(BlockHash::CreateTargetHash(target, target_size,
+                                                    dictionary_size));
+    } else {
+      EXPECT_TRUE(reused_hash->ResetTargetHash(target, target_size,
+                                               dictionary_size));
+    }
+    UNIQUE_PTR<BlockHash> new_hash(
+        BlockHash::CreateTargetHash(target, target_size, dictionary_size));
+    ASSERT_TRUE(reused_hash.get() != NULL);
+    ASSERT_TRUE(new_hash.get() != NULL);
+    reused_hash->AddAllBlocksThroughIndex(static_cast<int>(target_size));
+    new_hash->AddAllBlocksThroughIndex(static_cast<int>(target_size));
+    ASSERT_EQ(new_hash->hash_table_size(), reused_hash->hash_table_size());
+    ASSERT_EQ(new_hash->next_block_table_size(),
+              reused_hash->next_block_table_size());
+    EXPECT_EQ(0, memcmp(new_hash->hash_table(),
+                        reused_hash->hash_table(),
+                        new_hash->hash_table_size() * sizeof(int)))
+        << "target size " << target_size;
+    EXPECT_EQ(0, memcmp(new_hash->next_block_table(),
+                        reused_hash->next_block_table(),
+                        new_hash->next_block_table_size() * sizeof(int)))
+        << "target size " << target_size;
+    if (target_size >= static_cast<size_t>(kBlockSize)) {
+      BlockHash::Match new_match;
+      BlockHash::Match reused_match;
+      const char* const search = &data[data.size() - 1000];
+      const uint32_t hash_value = RollingHash<kBlockSize>::Hash(search);
+      new_hash->FindBestMatch(hash_value, search, search, 1000, &new_match);
+      reused_hash->FindBestMatch(hash_value, search, search, 1000,
+                                 &reused_match);
+      EXPECT_EQ(new_match.size(), reused_match.size());
+      EXPECT_EQ(new_match.source_offset(), reused_match.source_offset());
+    }
+  }
+}
+
+// Fills *data with pseudo-random bytes.  The same seed always produces
+// the same data.
+static void FillWithRandomBytes(uint32_t seed, std::vector<char>* data) {
+  uint32_t random_value = seed;
+  for (size_t i = 0; i < data->size(); ++i) {
+    random_value = random_value * 1103515245 + 12345;
+    (*data)[i] = static_cast<char>(random_value >> 24);
+  }
+}
+
+// Makes a target that consists of pieces of the dictionary of varying
+// lengths and at varying (unaligned) offsets, separated by random bytes.
+static void MakeTargetFromDictionary(const std::vector<char>& dictionary,
+                                     std::vector<char>* target) {
+  FillWithRandomBytes(7, target);
+  uint32_t random_value = 11;
+  for (size_t i = 0; i + 1024 < target->size(); i += 1024) {
+    random_value = random_value * 1103515245 + 12345;
+    const size_t source_offset =
+        (random_value >> 4) % (dictionary.size() - 1024);
+    const size_t length = 64 + ((random_value >> 8) % 900);
+    memcpy(&(*target)[i], &dictionary[source_offset], length);
+  }
+}
+
+// Calls FindBestMatch() for every position in the target, and returns
+// the sum of the sizes of the best matches found.
+static size_t FindBestMatchesForEveryPosition(
+    const BlockHash& block_hash,
+    const std::vector<char>& target) {
+  size_t total_match_size = 0;
+  for (size_t i = 0; i + kBlockSize <= target.size(); ++i) {
+    BlockHash::Match best_match;
+    block_hash.FindBestMatch(RollingHash<kBlockSize>::Hash(&target[i]),
+                             &target[i],
+                             &target[0],
+                             target.size(),
+                             &best_match);
+    total_match_size += best_match.size();
+  }
+  return total_match_size;
+}
+
+// Finds the match for a copy of part of the dictionary at an unaligned
+// offset, using each of the allowed block sizes.
+template<int block_size>
+static void TestFindBestMatchWithBlockSize(
+    const std::vector<char>& dictionary) {
+  UNIQUE_PTR<const BlockHash> dictionary_hash(
+      BlockHash::CreateDictionaryHash(&dictionary[0],
+                                      dictionary.size(),
+                                      block_size,
+                                      /* sampling_interval = */ 1,
+                                      /* thread_count = */ 1));
+  ASSERT_TRUE(dictionary_hash.get() != NULL);
+  EXPECT_EQ(block_size, dictionary_hash->block_size());
+  EXPECT_EQ(dictionary.size() / block_size,
+            dictionary_hash->next_block_table_size());
+  const int kSourceOffset = 1003;
+  const int kMatchSize = 200;
+  std::vector<char> target(300);
+  FillWithRandomBytes(17, &target);
+  memcpy(&target[50], &dictionary[kSourceOffset], kMatchSize);
+  // The first position in the target at which an aligned dictionary block
+  // begins.
+  const int candidate_offset =
+      50 + (block_size - (kSourceOffset % block_size)) % block_size;
+  BlockHash::Match best_match;
+  dictionary_hash->FindBestMatch(
+      RollingHash<block_size>::Hash(&target[candidate_offset]),
+      &target[candidate_offset],
+      &target[0],
+      target.size(),
+      &best_match);
+  EXPECT_EQ(static_cast<size_t>(kMatchSize), best_match.size())
+      << "block size " << block_size;
+  EXPECT_EQ(kSourceOffset, best_match.source_offset());
+  EXPECT_EQ(50, best_match.target_offset());
+}
+
+TEST_F(BlockHashTest, NonDefaultBlockSizes) {
+  std::vector<char> dictionary(1 << 16);
+  FillWithRandomBytes(3, &dictionary);
+  TestFindBestMatchWithBlockSize<8>(dictionary);
+  TestFindBestMatchWithBlockSize<16>(dictionary);
+  TestFindBestMatchWithBlockSize<32>(dictionary);
+  TestFindBestMatchWithBlockSize<64>(dictionary);
+  // Larger blocks need smaller hash tables.
+  UNIQUE_PTR<const BlockHash> small_blocks(
+      BlockHash::CreateDictionaryHash(&dictionary[0],
+                                      dictionary.size(),
+                                      8, 1, 1));
+  UNIQUE_PTR<const BlockHash> large_blocks(
+      BlockHash::CreateDictionaryHash(&dictionary[0],
+                                      dictionary.size(),
+                                      64, 1, 1));
+  EXPECT_GT(small_blocks->hash_table_size(), large_blocks->hash_table_size());
+  // Parallel building gives the same result for other block sizes, too.
+  UNIQUE_PTR<const BlockHash> parallel_small_blocks(
+      BlockHash::CreateDictionaryHash(&dictionary[0],
+                                      dictionary.size(),
+                                      8, 1, 2));
+  ASSERT_TRUE(parallel_small_blocks.get() != NULL);
+  EXPECT_EQ(0, memcmp(small_blocks->next_block_table(),
+                      parallel_small_blocks->next_block_table(),
+                      small_blocks->next_block_table_size() * sizeof(int)));
+}
+
+// Returns the best match found by trying every position in target as the
+// start of a candidate block.
+template<int block_size>
+static size_t LongestMatchAtAnyPosition(const BlockHash& block_hash,
+                                        const std::vector<char>& target,
+                                        int* source_offset) {
+  BlockHash::Match longest_match;
+  for (size_t i = 0; i + block_size <= target.size(); ++i) {
+    block_hash.FindBestMatch(RollingHash<block_size>::Hash(&target[i]),
+                             &target[i],
+                             &target[0],
+                             target.size(),
+                             &longest_match);
+  }
+  *source_offset = longest_match.source_offset();
+  return longest_match.size();
+}
+
+// A sampled dictionary hash indexes fewer blocks, but still finds every
+// match that contains a whole indexed block, wherever it starts.
+TEST_F(BlockHashTest, SampledDictionaryHashFindsLongMatches) {
+  const int kSamplingInterval = 4;
+  const int kMatchSize = (kSamplingInterval + 1) * kBlockSize - 1;
+  std::vector<char> dictionary(1 << 16);
+  FillWithRandomBytes(5, &dictionary);
+  UNIQUE_PTR<const BlockHash> full_hash(
+      BlockHash::CreateDictionaryHash(&dictionary[0], dictionary.size()));
+  const BlockHash* sampled_hashes[2] = {
+      BlockHash::CreateDictionaryHash(&dictionary[0],
+                                      dictionary.size(),
+                                      kBlockSize,
+                                      kSamplingInterval,
+                                      /* thread_count = */ 1),
+      BlockHash::CreateBucketizedDictionaryHash(&dictionary[0],
+                                                dictionary.size(),
+                                                kBlockSize,
+                                                kSamplingInterval) };
+  ASSERT_TRUE(sampled_hashes[0] != NULL);
+  ASSERT_TRUE(sampled_hashes[1] != NULL);
+  EXPECT_EQ(kSamplingInterval, sampled_hashes[0]->sampling_interval());
+  EXPECT_EQ((dictionary.size() - kBlockSize) / (kSamplingInterval * kBlockSize)
+                + 1,
+            sampled_hashes[0]->next_block_table_size());
+  EXPECT_EQ(full_hash->hash_table_size() / kSamplingInterval,
+            sampled_hashes[0]->hash_table_size());
+  EXPECT_EQ(BlockHash::CalcIndexSize(dictionary.size(),
+                                     kBlockSize,
+                                     kSamplingInterval),
+            (sampled_hashes[0]->hash_table_size()
+                 + sampled_hashes[0]->next_block_table_size()) * sizeof(int));
+  for (int h = 0; h < 2; ++h) {
+    for (int source_offset = 1000;
+         source_offset < 1000 + kSamplingInterval * kBlockSize;
+         source_offset += 7) {
+      std::vector<char> target(200);
+      FillWithRandomBytes(source_offset, &target);
+      memcpy(&target[40], &dictionary[source_offset], kMatchSize);
+      int found_offset = -1;
+      EXPECT_EQ(static_cast<size_t>(kMatchSize),
+                LongestMatchAtAnyPosition<kBlockSize>(*sampled_hashes[h],
+                                                      target,
+                                                      &found_offset))
+          << "source offset " << source_offset;
+      EXPECT_EQ(source_offset, found_offset);
+    }
+    delete sampled_hashes[h];
+  }
+  EXPECT_TRUE(BlockHash::CreateDictionaryHash(&dictionary[0],
+                                              dictionary.size(),
+                                              kBlockSize,
+                                              0,
+                                              1) == NULL);
+  EXPECT_TRUE(BlockHash::CreateDictionaryHash(
+      &dictionary[0],
+      dictionary.size(),
+      kBlockSize,
+      BlockHash::kMaxSamplingInterval + 1,
+      1) == NULL);
+}
+
+TEST_F(BlockHashTest, InvalidBlockSizesAreRejected) {
+  const int invalid_block_sizes[] = { -16, 0, 4, 12, 24, 128 };
+  for (size_t i = 0;
+       i < sizeof(invalid_block_sizes) / sizeof(invalid_block_sizes[0]);
+       ++i) {
+    EXPECT_FALSE(BlockHash::IsValidBlockSize(invalid_block_sizes[i]));
+    EXPECT_TRUE(BlockHash::CreateDictionaryHash(sample_text,
+                                                strlen(sample_text),
+                                                invalid_block_sizes[i],
+                                                1,
+                                                1) == NULL);
+    EXPECT_TRUE(BlockHash::CreateTargetHash(sample_text,
+                                            strlen(sample_text),
+                                            0,
+                                            invalid_block_sizes[i]) == NULL);
+  }
+}
+
+// For data without many repeated blocks, the bucketized index must find
+// exactly the same matches as the chained one.
+TEST_F(BlockHashTest, BucketizedHashFindsSameMatches) {
+  std::vector<char> dictionary(1 << 20);  // 1M
+  FillWithRandomBytes(3, &dictionary);
+  std::vector<char> target(1 << 16);  // 64K
+  MakeTargetFromDictionary(dictionary, &target);
+  UNIQUE_PTR<const BlockHash> chained_hash(
+      BlockHash::CreateDictionaryHash(&dictionary[0], dictionary.size()));
+  UNIQUE_PTR<const BlockHash> bucketized_hash(
+      BlockHash::CreateBucketizedDictionaryHash(&dictionary[0],
+                                                dictionary.size()));
+  ASSERT_TRUE(chained_hash.get() != NULL);
+  ASSERT_TRUE(bucketized_hash.get() != NULL);
+  EXPECT_FALSE(chained_hash->is_bucketized());
+  EXPECT_TRUE(bucketized_hash->is_bucketized());
+  for (size_t i = 0; i + kBlockSize <= target.size(); ++i) {
+    const uint32_t hash_value = RollingHash<kBlockSize>::Hash(&target[i]);
+    BlockHash::Match chained_match;
+    BlockHash::Match bucketized_match;
+    chained_hash->FindBestMatch(hash_value, &target[i], &target[0],
+                                target.size(), &chained_match);
+    bucketized_hash->FindBestMatch(hash_value, &target[i], &target[0],
+                                   target.size(), &bucketized_match);
+    ASSERT_EQ(chained_match.size(), bucketized_match.size()) << i;
+    ASSERT_EQ(chained_match.source_offset(),
+              bucketized_match.source_offset()) << i;
+    ASSERT_EQ(chained_match.target_offset(),
+              bucketized_match.target_offset()) << i;
+  }
+}
+
+// The bucketized index must still find matches within data that has more
+// identical blocks than its buckets can hold.
+TEST_F(BlockHashTest, BucketizedHashFindsTooManyMatches) {
+  const int kTestSize = 1 << 20;  // 1M
+  std::vector<char> huge_dictionary(kTestSize, 'Q');
+  UNIQUE_PTR<const BlockHash> bucketized_hash(
+      BlockHash::CreateBucketizedDictionaryHash(&huge_dictionary[0],
+                                                kTestSize));
+  ASSERT_TRUE(bucketized_hash.get() != NULL);
+  std::vector<char> huge_target(kTestSize, 'Q');
+  bucketized_hash->FindBestMatch(hashed_all_Qs,
+                                 &huge_target[kTestSize / 2],
+                                 &huge_target[0],
+                                 kTestSize,
+                                 &best_match_);
+  EXPECT_GT((kTestSize / 2), best_match_.source_offset());
+  EXPECT_GT((kTestSize / 2), best_match_.target_offset());
+  EXPECT_LT(static_cast<size_t>(kTestSize / 2), best_match_.size());
+}
+
+// Compares the time taken by FindBestMatch() using the chained and the
+// bucketized index, for a dictionary whose index does not fit in the cache.
+// Most calls to FindBestMatch() find no match (see the comments for that
+// function), so the target is random data that contains few matches.
+TEST_F(BlockHashTest, TimingTestForChainedAndBucketizedHash) {
+  std::vector<char> dictionary(1 << 24);  // 16M
+  FillWithRandomBytes(5, &dictionary);
+  std::vector<char> target(1 << 20);  // 1M
+  FillWithRandomBytes(9, &target);
+  // Make every 256th block of the dictionary a collision with the
+  // target, so that some hash chains are not empty.
+  for (size_t i = 0; i + kBlockSize <= target.size(); i += 256 * kBlockSize) {
+    memcpy(&dictionary[i * 4], &target[i], kBlockSize);
+  }
+  UNIQUE_PTR<const BlockHash> chained_hash(
+      BlockHash::CreateDictionaryHash(&dictionary[0], dictionary.size()));
+  UNIQUE_PTR<const BlockHash> bucketized_hash(
+      BlockHash::CreateBucketizedDictionaryHash(&dictionary[0],
+                                                dictionary.size()));
+  ASSERT_TRUE(chained_hash.get() != NULL);
+  ASSERT_TRUE(bucketized_hash.get() != NULL);
+  CycleTimer chained_timer;
+  chained_timer.Start();
+  const size_t chained_match_size =
+      FindBestMatchesForEveryPosition(*chained_hash, target);
+  chained_timer.Stop();
+  CycleTimer bucketized_timer;
+  bucketized_timer.Start();
+  const size_t bucketized_match_size =
+      FindBestMatchesForEveryPosition(*bucketized_hash, target);
+  bucketized_timer.Stop();
+  const double positions = static_cast<double>(target.size());
+  std::cout << "Time to search for best match with 16M dictionary: "
+            << (chained_timer.GetInUsec() * 1000.0 / positions)
+            << " ns/byte (chained), "
+            << (bucketized_timer.GetInUsec() * 1000.0 / positions)
+            << " ns/byte (bucketized)" << std::endl;
+  EXPECT_EQ(chained_match_size, bucketized_match_size);
+}
+
 #ifdef GTEST_HAS_DEATH_TEST
 TEST_F(BlockHashDeathTest, AddTooManyBlocks) {
   for (int i = 0; i < StringLengthAsInt(sample_text_without_spaces); ++i) {
@@ -31,6 +31,19 @@ VCDiffCodeTableReader::VCDiffCodeTableReader()
       last_instruction_start_(NULL),
       pending_second_instruction_(kNoOpcode),
       last_pending_second_instruction_(kNoOpcode) {
+  BuildOpcodeTable();
+}
+
+void VCDiffCodeTableReader::BuildOpcodeTable() {
+  for (int i = 0; i < VCDiffCodeTableData::kCodeTableSize; ++i) {
+    OpcodeEntry& entry = opcode_table_[i];
+    entry.inst1 = code_table_data_->inst1[i];
+    entry.size1 = code_table_data_->size1[i];
+    entry.mode1 = code_table_data_->mode1[i];
+    entry.inst2 = code_table_data_->inst2[i];
+    entry.size2 = code_table_data_->size2[i];
+    entry.mode2 = code_table_data_->mode2[i];
+  }
 }
 
 bool VCDiffCodeTableReader::UseCodeTable(
@@ -41,6 +54,7 @@ bool VCDiffCodeTableReader::UseCodeTable(
   }
   *non_default_code_table_data_ = code_table_data;
   code_table_data_ = non_default_code_table_data_.get();
+  BuildOpcodeTable();
   return true;
 }
 
@@ -54,40 +68,51 @@ VCDiffInstructionType VCDiffCodeTableReader::GetNextInstruction(
   }
   last_instruction_start_ = *instructions_and_sizes_;
   last_pending_second_instruction_ = pending_second_instruction_;
-  unsigned char opcode = 0;
   unsigned char instruction_type = VCD_NOOP;
-  int32_t instruction_size = 0;
+  unsigned char instruction_size = 0;
   unsigned char instruction_mode = 0;
-  do {
-    if (pending_second_instruction_ != kNoOpcode) {
-      // There is a second instruction left over
-      // from the most recently processed opcode.
-      opcode = static_cast<unsigned char>(pending_second_instruction_);
-      pending_second_instruction_ = kNoOpcode;
-      instruction_type = code_table_data_->inst2[opcode];
-      instruction_size = code_table_data_->size2[opcode];
-      instruction_mode = code_table_data_->mode2[opcode];
-      break;
-    }
-    if (*instructions_and_sizes_ >= instructions_and_sizes_end_) {
-      // Ran off end of instruction stream
-      return VCD_INSTRUCTION_END_OF_DATA;
-    }
-    opcode = **instructions_and_sizes_;
-    if (code_table_data_->inst2[opcode] != VCD_NOOP) {
-      // This opcode contains two instructions; process the first one now, and
-      // save a pointer to the second instruction, which should be returned
-      // by the next call to GetNextInstruction
-      pending_second_instruction_ = **instructions_and_sizes_;
+  if (pending_second_instruction_ != kNoOpcode) {
+    // There is a second instruction left over
+    // from the most recently processed opcode.
+    const OpcodeEntry& entry = opcode_table_[pending_second_instruction_];
+    pending_second_instruction_ = kNoOpcode;
+    instruction_type = entry.inst2;
+    instruction_size = entry.size2;
+    instruction_mode = entry.mode2;
+  } else {
+    // This loop is necessary in case an opcode that was actually used in the
+    // encoding contains only VCD_NOOP instructions.  That case is unusual,
+    // but it is not prohibited by the standard.
+    for (;;) {
+      if (*instructions_and_sizes_ >= instructions_and_sizes_end_) {
+        // Ran off end of instruction stream
+        return VCD_INSTRUCTION_END_OF_DATA;
+      }
+      const unsigned char opcode =
+          static_cast<unsigned char>(**instructions_and_sizes_);
+      ++(*instructions_and_sizes_);
+      const OpcodeEntry& entry = opcode_table_[opcode];
+      if (entry.inst1 != VCD_NOOP) {
+        if (entry.inst2 != VCD_NOOP) {
+          // This opcode contains two instructions; process the first one now,
+          // and save the opcode so that the second instruction will be
+          // returned by the next call to GetNextInstruction
+          pending_second_instruction_ = opcode;
+        }
+        instruction_type = entry.inst1;
+        instruction_size = entry.size1;
+        instruction_mode = entry.mode1;
+        break;
+      }
+      if (entry.inst2 != VCD_NOOP) {
+        // The first instruction is a VCD_NOOP; go straight to the second.
+        instruction_type = entry.inst2;
+        instruction_size = entry.size2;
+        instruction_mode = entry.mode2;
+        break;
+      }
     }
-    ++(*instructions_and_sizes_);
-    instruction_type = code_table_data_->inst1[opcode];
-    instruction_size = code_table_data_->size1[opcode];
-    instruction_mode = code_table_data_->mode1[opcode];
-  // This do-while loop is necessary in case inst1 == VCD_NOOP for an opcode
-  // that was actually used in the encoding.  That case is unusual, but it
-  // is not prohibited by the standard.
-  } while (instruction_type == VCD_NOOP);
+  }
   if (instruction_size == 0) {
     // Parse the size as a Varint in the instruction stream.
     switch (*size = VarintBE<int32_t>::Parse(instructions_and_sizes_end_,
@@ -121,6 +121,25 @@ class VCDiffCodeTableReader {
     }
   }
 
+  // The fields of one code table entry, packed together so that
+  // GetNextInstruction() can interpret an opcode (or the second half of a
+  // double-instruction opcode) using a single table lookup, rather than
+  // reading from six separate arrays in the VCDiffCodeTableData.
+  struct OpcodeEntry {
+    unsigned char inst1;  // from enum VCDiffInstructionType
+    unsigned char size1;
+    unsigned char mode1;
+    unsigned char inst2;  // from enum VCDiffInstructionType
+    unsigned char size2;
+    unsigned char mode2;
+  };
+
+  // Returns the packed entries for the code table in use, indexed by opcode.
+  // A decoder that has the whole instructions section in memory, and so never
+  // needs to stop partway through an opcode, can interpret the opcodes itself
+  // using this table instead of calling GetNextInstruction().
+  const OpcodeEntry* opcode_table() const { return opcode_table_; }
+
  private:
   // A pointer to the code table.  This is the object that will be used
   // to interpret opcodes in GetNextInstruction().
@@ -135,6 +154,12 @@ class VCDiffCodeTableReader {
   //
   UNIQUE_PTR<VCDiffCodeTableData> non_default_code_table_data_;
 
+  // Fills opcode_table_ from the contents of *code_table_data_.  Must be
+  // called whenever code_table_data_ changes.
+  void BuildOpcodeTable();
+
+  OpcodeEntry opcode_table_[VCDiffCodeTableData::kCodeTableSize];
+
   const char** instructions_and_sizes_;
   const char* instructions_and_sizes_end_;
   const char* last_instruction_start_;
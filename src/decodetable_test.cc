@@ -386,6 +386,28 @@ TEST_F(DecodeTableTest, ReReadIncomplete) {
   EXPECT_EQ(&instructions_and_sizes_[4], instructions_and_sizes_ptr_);
 }
 
+TEST_F(DecodeTableTest, ReReadIncompleteAfterNoop) {
+  EXPECT_TRUE(reader_.UseCodeTable(*g_exercise_code_table_, kLastExerciseMode));
+  instructions_and_sizes_[0] = 4;    // Noop + Add(0)
+  instructions_and_sizes_[1] = 111;  // with size 111
+
+  reader_.Init(&instructions_and_sizes_ptr_,
+               instructions_and_sizes_ptr_ + 1);  // 1 byte available
+  // The opcode is available, but the separately encoded size is not
+  EXPECT_EQ(VCD_INSTRUCTION_END_OF_DATA,
+            reader_.GetNextInstruction(&found_size_, &found_mode_));
+  EXPECT_EQ(&instructions_and_sizes_[0], instructions_and_sizes_ptr_);
+
+  reader_.Init(&instructions_and_sizes_ptr_,
+               instructions_and_sizes_ptr_ + 2);  // 2 bytes available
+  EXPECT_EQ(VCD_ADD, reader_.GetNextInstruction(&found_size_, &found_mode_));
+  EXPECT_EQ(111, found_size_);
+  EXPECT_EQ(0, found_mode_);
+  EXPECT_EQ(VCD_INSTRUCTION_END_OF_DATA,
+            reader_.GetNextInstruction(&found_size_, &found_mode_));
+  EXPECT_EQ(&instructions_and_sizes_[2], instructions_and_sizes_ptr_);
+}
+
 TEST_F(DecodeTableTest, ExerciseCodeTableReader) {
   char* instruction_ptr = &instructions_and_sizes_[0];
   for (int opcode = 0; opcode < VCDiffCodeTableData::kCodeTableSize; ++opcode) {
@@ -14,6 +14,7 @@
 
 #include <config.h>
 #include <limits.h>  // UCHAR_MAX
+#include <string.h>  // memcpy
 #include <string>
 #include "addrcache.h"
 #include "codetable.h"
@@ -56,6 +57,9 @@ static const DeltaFileHeader kHeaderExtendedFormat = {
 VCDiffCodeTableWriter::VCDiffCodeTableWriter(bool interleaved)
     : max_mode_(VCDiffAddressCache::DefaultLastMode()),
       dictionary_size_(0),
+      win_indicator_source_(VCD_SOURCE),
+      source_segment_size_(0),
+      source_segment_position_(0),
       target_length_(0),
       code_table_data_(&VCDiffCodeTableData::kDefaultCodeTableData),
       instruction_map_(NULL),
@@ -74,6 +78,9 @@ VCDiffCodeTableWriter::VCDiffCodeTableWriter(
     : max_mode_(max_mode),
       address_cache_(near_cache_size, same_cache_size),
       dictionary_size_(0),
+      win_indicator_source_(VCD_SOURCE),
+      source_segment_size_(0),
+      source_segment_position_(0),
       target_length_(0),
       code_table_data_(&code_table_data),
       instruction_map_(NULL),
@@ -101,6 +108,9 @@ void VCDiffCodeTableWriter::InitSectionPointers(bool interleaved) {
 
 bool VCDiffCodeTableWriter::Init(size_t dictionary_size) {
   dictionary_size_ = dictionary_size;
+  win_indicator_source_ = VCD_SOURCE;
+  source_segment_size_ = dictionary_size;
+  source_segment_position_ = 0;
   if (!instruction_map_) {
     if (code_table_data_ == &VCDiffCodeTableData::kDefaultCodeTableData) {
       instruction_map_ = VCDiffInstructionMap::GetDefaultInstructionMap();
@@ -234,6 +244,39 @@ void VCDiffCodeTableWriter::EncodeInstruction(VCDiffInstructionType inst,
   AppendSizeToString(size, &instructions_and_sizes_);
 }
 
+void VCDiffCodeTableWriter::SetTargetSourceSegment(
+    size_t source_segment_position,
+    size_t source_segment_size) {
+  if (target_length_ > 0) {
+    VCD_DFATAL << "VCDiffCodeTableWriter::SetTargetSourceSegment() called"
+                  " after instructions were added to the window" << VCD_ENDL;
+    return;
+  }
+  win_indicator_source_ = VCD_TARGET;
+  source_segment_size_ = source_segment_size;
+  source_segment_position_ = source_segment_position;
+}
+
+void VCDiffCodeTableWriter::SwapSectionBuffers(
+    std::string* instructions_and_sizes,
+    std::string* data_for_add_and_run,
+    std::string* addresses_for_copy) {
+  if (!instructions_and_sizes_.empty()) {
+    VCD_DFATAL << "VCDiffCodeTableWriter::SwapSectionBuffers() called"
+                  " while a window is being built" << VCD_ENDL;
+    return;
+  }
+  instructions_and_sizes_.swap(*instructions_and_sizes);
+  separate_data_for_add_and_run_.swap(*data_for_add_and_run);
+  separate_addresses_for_copy_.swap(*addresses_for_copy);
+  instructions_and_sizes_.clear();
+  separate_data_for_add_and_run_.clear();
+  separate_addresses_for_copy_.clear();
+  instructions_and_sizes->clear();
+  data_for_add_and_run->clear();
+  addresses_for_copy->clear();
+}
+
 void VCDiffCodeTableWriter::Add(const char* data, size_t size) {
   EncodeInstruction(VCD_ADD, size);
   data_for_add_and_run_->append(data, size);
@@ -254,7 +297,7 @@ void VCDiffCodeTableWriter::Copy(int32_t offset, size_t size) {
   int32_t encoded_addr = 0;
   const unsigned char mode = address_cache_.EncodeAddress(
       offset,
-      static_cast<VCDAddress>(dictionary_size_ + target_length_),
+      static_cast<VCDAddress>(source_segment_size_ + target_length_),
       &encoded_addr);
   EncodeInstruction(VCD_COPY, size, mode);
   if (address_cache_.WriteAddressAsVarintForMode(mode)) {
@@ -271,99 +314,86 @@ void VCDiffCodeTableWriter::Run(size_t size, unsigned char byte) {
   target_length_ += size;
 }
 
-size_t VCDiffCodeTableWriter::CalculateLengthOfSizeAsVarint(size_t size) {
-  return VarintBE<int32_t>::Length(static_cast<int32_t>(size));
-}
-
 void VCDiffCodeTableWriter::AppendSizeToString(size_t size, string* out) {
   VarintBE<int32_t>::AppendToString(static_cast<int32_t>(size), out);
 }
 
-void VCDiffCodeTableWriter::AppendSizeToOutputString(
-    size_t size,
-    OutputStringInterface* out) {
-  VarintBE<int32_t>::AppendToOutputString(static_cast<int32_t>(size), out);
+char* VCDiffCodeTableWriter::EncodeSize(size_t size, char* ptr) {
+  return ptr + VarintBE<int32_t>::Encode(static_cast<int32_t>(size), ptr);
 }
 
-// This calculation must match the items added between "Start of Delta Encoding"
-// and "End of Delta Encoding" in Output(), below.
-size_t VCDiffCodeTableWriter::CalculateLengthOfTheDeltaEncoding() const {
-  size_t length_of_the_delta_encoding =
-    CalculateLengthOfSizeAsVarint(target_length_) +
-    1 +  // Delta_Indicator
-    CalculateLengthOfSizeAsVarint(separate_data_for_add_and_run_.size()) +
-    CalculateLengthOfSizeAsVarint(instructions_and_sizes_.size()) +
-    CalculateLengthOfSizeAsVarint(separate_addresses_for_copy_.size()) +
-    separate_data_for_add_and_run_.size() +
-    instructions_and_sizes_.size() +
-    separate_addresses_for_copy_.size();
-  if (add_checksum_) {
-    length_of_the_delta_encoding +=
-        VarintBE<int64_t>::Length(static_cast<int64_t>(checksum_));
-  }
-  return length_of_the_delta_encoding;
-}
+// The maximum size of the header fields that Output() writes before the
+// delta encoding: the Win_Indicator byte and three sizes.
+static const size_t kMaxWindowPrefixSize =
+    1 + (3 * VarintBE<int32_t>::kMaxBytes);
+
+// The maximum size of the header fields that Output() writes at the start of
+// the delta encoding, before the sections: the Delta_Indicator byte, four
+// sizes, and the checksum.
+static const size_t kMaxDeltaEncodingHeaderSize =
+    1 + (4 * VarintBE<int32_t>::kMaxBytes) + VarintBE<int64_t>::kMaxBytes;
 
 void VCDiffCodeTableWriter::Output(OutputStringInterface* out) {
   if (instructions_and_sizes_.empty()) {
     VCD_WARNING << "Empty input; no delta window produced" << VCD_ENDL;
   } else {
+    // The header fields of the window are built here, and passed to the
+    // output string along with the three sections, which are not copied.
+    // The fields at the start of the delta encoding are written first, so
+    // that the length of the delta encoding is known when the fields that
+    // precede it are written into the space left for them.
+    char header[kMaxWindowPrefixSize + kMaxDeltaEncodingHeaderSize];
+    char* const start_of_delta_encoding = header + kMaxWindowPrefixSize;
+    char* header_end = start_of_delta_encoding;
+    header_end = EncodeSize(target_length_, header_end);
+    *header_end++ = 0x00;  // Delta_Indicator: no compression
+    header_end = EncodeSize(separate_data_for_add_and_run_.size(), header_end);
+    header_end = EncodeSize(instructions_and_sizes_.size(), header_end);
+    header_end = EncodeSize(separate_addresses_for_copy_.size(), header_end);
+    if (add_checksum_) {
+      // The checksum is a 32-bit *unsigned* integer.  VarintBE requires a
+      // signed type, so use a 64-bit signed integer to store the checksum.
+      header_end += VarintBE<int64_t>::Encode(static_cast<int64_t>(checksum_),
+                                              header_end);
+    }
     const size_t length_of_the_delta_encoding =
-        CalculateLengthOfTheDeltaEncoding();
-    const size_t delta_window_size =
-        length_of_the_delta_encoding +
-        1 +  // Win_Indicator
-        CalculateLengthOfSizeAsVarint(dictionary_size_) +
-        CalculateLengthOfSizeAsVarint(0) +
-        CalculateLengthOfSizeAsVarint(length_of_the_delta_encoding);
-    // append() will be called many times on the output string; make sure
-    // the output string is resized only once at most.
-    out->ReserveAdditionalBytes(delta_window_size);
+        (header_end - start_of_delta_encoding) +
+        separate_data_for_add_and_run_.size() +
+        instructions_and_sizes_.size() +
+        separate_addresses_for_copy_.size();
 
+    char prefix[kMaxWindowPrefixSize];
+    char* prefix_end = prefix;
     // Add first element: Win_Indicator
     if (add_checksum_) {
-      out->push_back(VCD_SOURCE | VCD_CHECKSUM);
+      *prefix_end++ = win_indicator_source_ | VCD_CHECKSUM;
     } else {
-      out->push_back(VCD_SOURCE);
+      *prefix_end++ = win_indicator_source_;
     }
-    // Source segment size: dictionary size
-    AppendSizeToOutputString(dictionary_size_, out);
-    // Source segment position: 0 (start of dictionary)
-    AppendSizeToOutputString(0, out);
+    // Source segment size: dictionary size, unless SetTargetSourceSegment()
+    // was called
+    prefix_end = EncodeSize(source_segment_size_, prefix_end);
+    // Source segment position: 0 (start of dictionary), unless
+    // SetTargetSourceSegment() was called
+    prefix_end = EncodeSize(source_segment_position_, prefix_end);
 
     // [Here is where a secondary compressor would be used
     //  if the encoder and decoder supported that feature.]
 
-    AppendSizeToOutputString(length_of_the_delta_encoding, out);
-    // Start of Delta Encoding
-    const size_t size_before_delta_encoding = out->size();
-    AppendSizeToOutputString(target_length_, out);
-    out->push_back(0x00);  // Delta_Indicator: no compression
-    AppendSizeToOutputString(separate_data_for_add_and_run_.size(), out);
-    AppendSizeToOutputString(instructions_and_sizes_.size(), out);
-    AppendSizeToOutputString(separate_addresses_for_copy_.size(), out);
-    if (add_checksum_) {
-      // The checksum is a 32-bit *unsigned* integer.  VarintBE requires a
-      // signed type, so use a 64-bit signed integer to store the checksum.
-      VarintBE<int64_t>::AppendToOutputString(static_cast<int64_t>(checksum_),
-                                              out);
-    }
-    out->append(separate_data_for_add_and_run_.data(),
-                separate_data_for_add_and_run_.size());
-    out->append(instructions_and_sizes_.data(),
-                instructions_and_sizes_.size());
-    out->append(separate_addresses_for_copy_.data(),
-                separate_addresses_for_copy_.size());
-    // End of Delta Encoding
-    const size_t size_after_delta_encoding = out->size();
-    if (length_of_the_delta_encoding !=
-        (size_after_delta_encoding - size_before_delta_encoding)) {
-      VCD_DFATAL << "Internal error: calculated length of the delta encoding ("
-                 << length_of_the_delta_encoding
-                 << ") does not match actual length ("
-                 << (size_after_delta_encoding - size_before_delta_encoding)
-                 << VCD_ENDL;
-    }
+    prefix_end = EncodeSize(length_of_the_delta_encoding, prefix_end);
+    const size_t prefix_size = prefix_end - prefix;
+    char* const header_start = start_of_delta_encoding - prefix_size;
+    memcpy(header_start, prefix, prefix_size);
+
+    const OutputSpan spans[] = {
+      { header_start, static_cast<size_t>(header_end - header_start) },
+      { separate_data_for_add_and_run_.data(),
+        separate_data_for_add_and_run_.size() },
+      { instructions_and_sizes_.data(), instructions_and_sizes_.size() },
+      { separate_addresses_for_copy_.data(),
+        separate_addresses_for_copy_.size() }
+    };
+    out->AppendSpans(spans, sizeof(spans) / sizeof(spans[0]));
     separate_data_for_add_and_run_.clear();
     instructions_and_sizes_.clear();
     separate_addresses_for_copy_.clear();
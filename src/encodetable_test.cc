@@ -18,6 +18,7 @@
 #include <string.h>  // strlen
 #include <algorithm>
 #include <string>
+#include <vector>
 #include "addrcache.h"  // VCDiffAddressCache::kDefaultNearCacheSize
 #include "checksum.h"
 #include "codetable.h"
@@ -294,6 +295,78 @@ TEST_F(CodeTableWriterTest, StandardWriterEncodeCopy) {
   ExpectNoMoreBytes();
 }
 
+// COPY addresses are relative to the source segment set by
+// SetTargetSourceSegment(), which applies only to the next window.
+TEST_F(CodeTableWriterTest, StandardWriterEncodeTargetSourceSegment) {
+  EXPECT_TRUE(standard_writer.Init(0x11));
+  standard_writer.SetTargetSourceSegment(0x30, 0x05);
+  standard_writer.Copy(2, 8);
+  standard_writer.Copy(12, 4);
+  standard_writer.Output(&output_string);
+  standard_writer.Add("foo", 3);
+  standard_writer.Output(&output_string);
+  ExpectByte(VCD_TARGET);  // Win_Indicator: VCD_TARGET (earlier target data)
+  ExpectByte(0x05);  // Source segment size
+  ExpectByte(0x30);  // Source segment position within the target file
+  ExpectByte(0x09);  // Length of the delta encoding
+  ExpectByte(0x0C);  // Size of the target window
+  ExpectByte(0x00);  // Delta_indicator (no compression)
+  ExpectByte(0x00);  // length of data for ADDs and RUNs
+  ExpectByte(0x02);  // length of instructions section
+  ExpectByte(0x02);  // length of addresses for COPYs
+  ExpectByte(0x18);  // COPY mode SELF, size 8
+  ExpectByte(0x24);  // COPY mode HERE, size 4
+  ExpectByte(0x02);  // COPY address (2)
+  ExpectByte(0x01);  // COPY address (HERE (5 + 8) - 12)
+  ExpectByte(VCD_SOURCE);  // Win_Indicator: VCD_SOURCE (dictionary)
+  ExpectByte(0x11);  // Source segment size: dictionary length
+  ExpectByte(0x00);  // Source segment position: start of dictionary
+  ExpectByte(0x09);  // Length of the delta encoding
+  ExpectByte(0x03);  // Size of the target window
+  ExpectByte(0x00);  // Delta_indicator (no compression)
+  ExpectByte(0x03);  // length of data for ADDs and RUNs
+  ExpectByte(0x01);  // length of instructions section
+  ExpectByte(0x00);  // length of addresses for COPYs
+  ExpectString("foo");
+  ExpectByte(0x04);  // ADD(3) opcode
+  ExpectNoMoreBytes();
+}
+
+// Swapping in section buffers that contain stale data must not change
+// the encoding, and must give back the writer's own buffers cleared.
+TEST_F(CodeTableWriterTest, StandardWriterSwapSectionBuffers) {
+  EXPECT_TRUE(standard_writer.Init(0x11));
+  string instructions_and_sizes("stale instructions");
+  string data_for_add_and_run("stale data");
+  string addresses_for_copy("stale addresses");
+  standard_writer.SwapSectionBuffers(&instructions_and_sizes,
+                                     &data_for_add_and_run,
+                                     &addresses_for_copy);
+  EXPECT_TRUE(instructions_and_sizes.empty());
+  EXPECT_TRUE(data_for_add_and_run.empty());
+  EXPECT_TRUE(addresses_for_copy.empty());
+  standard_writer.Add("foo", 3);
+  standard_writer.Output(&output_string);
+  ExpectByte(VCD_SOURCE);  // Win_Indicator: VCD_SOURCE (dictionary)
+  ExpectByte(0x11);  // Source segment size: dictionary length
+  ExpectByte(0x00);  // Source segment position: start of dictionary
+  ExpectByte(0x09);  // Length of the delta encoding
+  ExpectByte(0x03);  // Size of the target window
+  ExpectByte(0x00);  // Delta_indicator (no compression)
+  ExpectByte(0x03);  // length of data for ADDs and RUNs
+  ExpectByte(0x01);  // length of instructions section
+  ExpectByte(0x00);  // length of addresses for COPYs
+  ExpectString("foo");
+  ExpectByte(0x04);  // ADD(3) opcode
+  ExpectNoMoreBytes();
+  standard_writer.SwapSectionBuffers(&instructions_and_sizes,
+                                     &data_for_add_and_run,
+                                     &addresses_for_copy);
+  EXPECT_TRUE(instructions_and_sizes.empty());
+  EXPECT_TRUE(data_for_add_and_run.empty());
+  EXPECT_TRUE(addresses_for_copy.empty());
+}
+
 // The exercise code table can't be used to test how the code table
 // writer encodes COPY instructions because the code table writer
 // always uses the default cache sizes, which exceed the maximum mode
@@ -343,6 +416,59 @@ TEST_F(CodeTableWriterTest, StandardWriterEncodeCombo) {
   ExpectNoMoreBytes();
 }
 
+// An output string that records the ranges passed to AppendSpans(), which
+// are valid only during the call.
+class SpanRecordingOutputString : public OutputString<std::string> {
+ public:
+  explicit SpanRecordingOutputString(std::string* impl)
+      : OutputString<std::string>(impl) { }
+
+  virtual OutputStringInterface& AppendSpans(const OutputSpan* spans,
+                                             size_t count) {
+    spans_.clear();
+    for (size_t i = 0; i < count; ++i) {
+      spans_.push_back(std::string(spans[i].data, spans[i].size));
+    }
+    return OutputString<std::string>::AppendSpans(spans, count);
+  }
+
+  const std::vector<std::string>& spans() const { return spans_; }
+
+ private:
+  std::vector<std::string> spans_;
+};
+
+TEST_F(CodeTableWriterTest, StandardWriterOutputsSpans) {
+  SpanRecordingOutputString span_output(&out);
+  EXPECT_TRUE(standard_writer.Init(0x11));
+  standard_writer.Add("rayo", 4);
+  standard_writer.Copy(2, 5);
+  standard_writer.Copy(0, 4);
+  standard_writer.Add("X", 1);
+  standard_writer.Output(&span_output);
+  // Header, data for ADDs and RUNs, instructions, and addresses for COPYs.
+  ASSERT_EQ(4U, span_output.spans().size());
+  EXPECT_EQ(9U, span_output.spans()[0].size());
+  EXPECT_EQ("rayoX", span_output.spans()[1]);
+  EXPECT_EQ(2U, span_output.spans()[2].size());
+  EXPECT_EQ(2U, span_output.spans()[3].size());
+  ExpectByte(VCD_SOURCE);  // Win_Indicator: VCD_SOURCE (dictionary)
+  ExpectByte(0x11);  // Source segment size: dictionary length
+  ExpectByte(0x00);  // Source segment position: start of dictionary
+  ExpectByte(0x0E);  // Length of the delta encoding
+  ExpectByte(0x0E);  // Size of the target window
+  ExpectByte(0x00);  // Delta_indicator (no compression)
+  ExpectByte(0x05);  // length of data for ADDs and RUNs
+  ExpectByte(0x02);  // length of instructions section
+  ExpectByte(0x02);  // length of addresses for COPYs
+  ExpectString("rayoX");
+  ExpectByte(0xAD);  // Combo: Add size 4 + COPY mode SELF, size 5
+  ExpectByte(0xFD);  // Combo: COPY mode SAME(0), size 4 + Add size 1
+  ExpectByte(0x02);  // COPY address (2)
+  ExpectByte(0x00);  // COPY address (0)
+  ExpectNoMoreBytes();
+}
+
 TEST_F(CodeTableWriterTest, InterleavedWriterEncodeCombo) {
   EXPECT_TRUE(interleaved_writer.Init(0x11));
   interleaved_writer.Add("rayo", 4);
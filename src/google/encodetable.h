@@ -31,7 +31,7 @@ class VCDiffInstructionMap;
 
 // The method calls after construction *must* conform
 // to the following pattern:
-//    {{Add|Copy|Run}* [AddChecksum] Output}*
+//    {[SetTargetSourceSegment] {Add|Copy|Run}* [AddChecksum] Output}*
 //
 // When Output has been called in this sequence, a complete target window
 // (as defined in RFC 3284 section 4.3) will have been appended to
@@ -101,6 +101,27 @@ class VCDiffCodeTableWriter : public CodeTableWriterInterface {
     checksum_ = checksum;
   }
 
+  // By default, the source segment of each delta window is the whole
+  // dictionary (VCD_SOURCE).  This function makes the source segment of the
+  // current window the source_segment_size bytes of previously decoded
+  // target data that begin at source_segment_position within the target file
+  // (VCD_TARGET, see RFC section 4.2), so that COPY addresses below
+  // source_segment_size refer to that data.  It must be called before any
+  // call to Add(), Copy() or Run() for the window, and applies only to that
+  // window: Output() restores the default.
+  void SetTargetSourceSegment(size_t source_segment_position,
+                              size_t source_segment_size);
+
+  // Exchanges the buffers that hold the three sections of the delta window
+  // being built with the strings passed as arguments, so that their memory
+  // (which is retained from one window to the next) can be passed from one
+  // writer to another.  It must not be called while a window is being built,
+  // that is, after a call to Add(), Copy() or Run() that has not been
+  // followed by Output().  The strings passed as arguments are cleared.
+  void SwapSectionBuffers(std::string* instructions_and_sizes,
+                          std::string* data_for_add_and_run,
+                          std::string* addresses_for_copy);
+
   // Appends the encoded delta window to the output
   // string.  The output string is not null-terminated and may contain embedded
   // '\0' characters.
@@ -147,20 +168,12 @@ class VCDiffCodeTableWriter : public CodeTableWriterInterface {
     return EncodeInstruction(inst, size, 0);
   }
 
-  // Calculates the number of bytes needed to store the given size value as a
-  // variable-length integer (VarintBE).
-  static size_t CalculateLengthOfSizeAsVarint(size_t size);
-
   // Appends the size value to the string as a variable-length integer.
   static void AppendSizeToString(size_t size, string* out);
 
-  // Appends the size value to the output string as a variable-length integer.
-  static void AppendSizeToOutputString(size_t size, OutputStringInterface* out);
-
-  // Calculates the "Length of the delta encoding" field for the delta window
-  // header, based on the sizes of the sections and of the other header
-  // elements.
-  size_t CalculateLengthOfTheDeltaEncoding() const;
+  // Encodes the size value as a variable-length integer at ptr, and returns
+  // a pointer to the byte that follows it.
+  static char* EncodeSize(size_t size, char* ptr);
 
   // None of the following 'string' objects are null-terminated.
 
@@ -188,6 +201,13 @@ class VCDiffCodeTableWriter : public CodeTableWriterInterface {
 
   size_t dictionary_size_;
 
+  // The source segment of the current delta window.  win_indicator_source_ is
+  // VCD_SOURCE (the source segment is the dictionary) or VCD_TARGET (see
+  // SetTargetSourceSegment.)
+  unsigned char win_indicator_source_;
+  size_t source_segment_size_;
+  size_t source_segment_position_;
+
   // The number of bytes of target data that has been encoded so far.
   // Each time Add(), Copy(), or Run() is called, this will be incremented.
   // The target length is used to compute HERE mode addresses
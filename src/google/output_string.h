@@ -16,6 +16,7 @@
 #define OPEN_VCDIFF_OUTPUT_STRING_H_
 
 #include <stddef.h>  // size_t
+#include <string>
 
 namespace open_vcdiff {
 
@@ -41,6 +42,23 @@ namespace open_vcdiff {
 // append() operations.  For output types that gain no advantage from knowing in
 // advance how many bytes will be appended, ReserveAdditionalBytes() can be
 // defined to do nothing.
+//
+// An output type can also let the decoder write directly into its memory, to
+// avoid copying each decoded target window, by implementing
+// GetWritableRegion() and Commit().  The default implementations of these
+// methods tell the decoder to use append() instead.
+//
+// The encoder appends each delta window by calling AppendSpans() once with a
+// list of byte ranges: the window header, followed by the sections of the
+// window, which are passed from the encoder's buffers without being copied.
+// The default implementation appends the ranges one by one.  An output type
+// that can consume them without copying (for example, by passing them to
+// writev()) can override AppendSpans().
+struct OutputSpan {
+  const char* data;
+  size_t size;
+};
+
 class OutputStringInterface {
  public:
   virtual ~OutputStringInterface() { }
@@ -54,6 +72,31 @@ class OutputStringInterface {
   virtual void ReserveAdditionalBytes(size_t res_arg) = 0;
 
   virtual size_t size() const = 0;
+
+  // Returns a pointer to n writable bytes at the end of the output, or NULL if
+  // the output type does not support this.  The bytes become part of the
+  // output only when Commit() is called.  No other method may be called
+  // between GetWritableRegion() and Commit().
+  virtual char* GetWritableRegion(size_t /*n*/) { return NULL; }
+
+  // Appends the first n bytes of the region returned by the last call to
+  // GetWritableRegion() to the output, and discards the rest of the region.
+  virtual void Commit(size_t /*n*/) { }
+
+  // Appends the count ranges in spans, in order.  The ranges are valid only
+  // until AppendSpans() returns.
+  virtual OutputStringInterface& AppendSpans(const OutputSpan* spans,
+                                             size_t count) {
+    size_t total_size = 0;
+    for (size_t i = 0; i < count; ++i) {
+      total_size += spans[i].size;
+    }
+    ReserveAdditionalBytes(total_size);
+    for (size_t i = 0; i < count; ++i) {
+      append(spans[i].data, spans[i].size);
+    }
+    return *this;
+  }
 };
 
 // This template can be used to wrap any class that supports the operations
@@ -64,7 +107,9 @@ class OutputStringInterface {
 template<class StringClass>
 class OutputString : public OutputStringInterface {
  public:
-  explicit OutputString(StringClass* impl) : impl_(impl) { }
+  explicit OutputString(StringClass* impl)
+      : impl_(impl),
+        size_before_region_(0) { }
 
   virtual ~OutputString() { }
 
@@ -89,15 +134,40 @@ class OutputString : public OutputStringInterface {
     return impl_->size();
   }
 
+  // These are declared here so that they can be specialized for string types
+  // that support them, as they are for std::string below.
+  virtual char* GetWritableRegion(size_t n) {
+    return OutputStringInterface::GetWritableRegion(n);
+  }
+
+  virtual void Commit(size_t n) {
+    OutputStringInterface::Commit(n);
+  }
+
  protected:
   StringClass* impl_;
 
+  // The size of *impl_ before the last call to GetWritableRegion().
+  size_t size_before_region_;
+
  private:
   // Making these private avoids implicit copy constructor & assignment operator
   OutputString(const OutputString&);
   void operator=(const OutputString&);
 };
 
+template<>
+inline char* OutputString<std::string>::GetWritableRegion(size_t n) {
+  size_before_region_ = impl_->size();
+  impl_->resize(size_before_region_ + n);
+  return &(*impl_)[size_before_region_];
+}
+
+template<>
+inline void OutputString<std::string>::Commit(size_t n) {
+  impl_->resize(size_before_region_ + n);
+}
+
 // Don't allow the OutputString template to be based upon a pointer to
 // OutputStringInterface.  Enforce this restriction by defining this class to
 // lack any functions expected of an OutputString.
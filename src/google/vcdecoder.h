@@ -44,6 +44,8 @@ class VCDiffStreamingDecoderImpl;
 //
 // I.e., the allowed pattern of calls is
 //    StartDecoding DecodeChunk* FinishDecoding
+// or, to decode into a buffer supplied by the client,
+//    StartDecodingToBuffer DecodeChunkToBuffer* FinishDecoding
 //
 // NOTE: It is not necessary to call FinishDecoding if DecodeChunk
 //       returns false.  When DecodeChunk returns false to signal an
@@ -86,6 +88,31 @@ class VCDiffStreamingDecoder {
   bool DecodeChunkToInterface(const char* data, size_t len,
                               OutputStringInterface* output_string);
 
+  // Like StartDecoding(), but the target file is decoded into the client's
+  // buffer "buffer[0,buffer_size-1]", and DecodeChunkToBuffer() must be called
+  // in place of DecodeChunk().  The decoder writes each target window directly
+  // into the buffer, and finds the earlier target data used by VCD_TARGET
+  // windows there, so it does not keep its own copy of the target file or copy
+  // any of it after decoding.  Decoding fails if the target file would not fit
+  // in the buffer.  The client is responsible for ensuring that both
+  // dictionary_ptr and buffer are valid until FinishDecoding is called.
+  //
+  void StartDecodingToBuffer(const char* dictionary_ptr,
+                             size_t dictionary_size,
+                             char* buffer,
+                             size_t buffer_size);
+
+  // Accepts "data[0,len-1]" as additional data received in the compressed
+  // stream, and decodes as much of it as possible into the buffer that was
+  // passed to StartDecodingToBuffer().  Sets *target_size to the number of
+  // bytes at the start of the buffer that have been decoded so far.
+  //
+  // Returns true on success, and false if the data was malformed, if there
+  // was an error in decoding it, or if the target file would not fit in the
+  // buffer.
+  //
+  bool DecodeChunkToBuffer(const char* data, size_t len, size_t* target_size);
+
   // Finishes decoding after all data has been received.  Returns true
   // if decoding of the entire stream was successful.  FinishDecoding()
   // must be called for the current target before StartDecoding() can be
@@ -125,6 +152,30 @@ class VCDiffStreamingDecoder {
   // decoded target data prior to the current window.
   void SetAllowVcdTarget(bool allow_vcd_target);
 
+  // By default, the decoder keeps all of the target data that it has decoded,
+  // because a VCD_TARGET window may take its source segment from anywhere in
+  // it, so its memory use grows with the size of the target file.  If
+  // history_size is nonzero, then the decoder keeps only the last history_size
+  // bytes (or somewhat more, up to twice history_size) of earlier target data,
+  // so that its memory use stays about the same however large the target file
+  // is, and reports an error if a VCD_TARGET source segment starts before
+  // that data.  To decode the output of an encoder that used
+  // VCDiffStreamingEncoder::SetTargetHistory, history_size must be at least
+  // twice the encoder's history_size.  Has no effect when decoding into a
+  // buffer (see StartDecodingToBuffer), which holds the whole target anyway.
+  //
+  // The target history only bounds the memory used by the decoder; it does
+  // not raise the limit on the total size of the target file, which is
+  // 64 MB unless changed by SetMaximumTargetFileSize().  To decode a
+  // target file larger than that (such as a multi-gigabyte patch), call
+  // SetMaximumTargetFileSize() with a suitable limit as well, or decoding
+  // will fail with a size-limit error once the target reaches 64 MB.
+  //
+  // This function must be called before StartDecoding().  It returns false,
+  // and has no effect, if called after StartDecoding() or if history_size
+  // exceeds INT32_MAX.  Passing zero keeps all of the target data.
+  bool SetTargetHistory(size_t history_size);
+
  private:
   VCDiffStreamingDecoderImpl* const impl_;
 
@@ -164,6 +215,20 @@ class VCDiffDecoder {
                              &output_string);
   }
 
+  // Decodes the bytes found in "encoding" into "buffer[0,buffer_size-1]" and
+  // sets *target_size to the size of the target.  No intermediate copy of the
+  // target is made.
+  //
+  // Returns true if "encoding" was a well-formed sequence of instructions
+  // whose target fits in the buffer, and returns false if not.
+  //
+  bool DecodeToBuffer(const char* dictionary_ptr,
+                      size_t dictionary_size,
+                      const string& encoding,
+                      char* buffer,
+                      size_t buffer_size,
+                      size_t* target_size);
+
  private:
   bool DecodeToInterface(const char* dictionary_ptr,
                          size_t dictionary_size,
@@ -21,6 +21,7 @@
 
 namespace open_vcdiff {
 
+class VCDiffEncoderArenaImpl;
 class VCDiffEngine;
 class VCDiffStreamingEncoderImpl;
 class CodeTableWriterInterface;
@@ -32,13 +33,29 @@ class CodeTableWriterInterface;
 // is thread-safe: the same const HashedDictionary can be used
 // by several threads simultaneously, each with its own VCDiffStreamingEncoder.
 //
-// dictionary_contents is copied into the HashedDictionary, so the
+// By default, dictionary_contents is copied into the HashedDictionary, so the
 // caller may free that string, if desired, after the constructor returns.
+// A caller that already holds the dictionary in long-lived memory (for
+// example, a file mapped into memory with mmap) can avoid that copy by using
+// the three-argument constructor with copy_dictionary = false.
 //
 class HashedDictionary {
  public:
   HashedDictionary(const char* dictionary_contents,
                    size_t dictionary_size);
+
+  // If copy_dictionary is true, this is equivalent to the two-argument
+  // constructor.  If copy_dictionary is false, the HashedDictionary borrows
+  // dictionary_contents instead of copying it.  In that case the caller
+  // must keep dictionary_contents[0, dictionary_size - 1] valid and
+  // unchanged until the HashedDictionary has been deleted.  Since every
+  // VCDiffStreamingEncoder that uses a HashedDictionary must itself be
+  // deleted before the HashedDictionary, this rule also covers the encoders.
+  // Modifying or freeing the borrowed memory any sooner than that results
+  // in undefined behavior.
+  HashedDictionary(const char* dictionary_contents,
+                   size_t dictionary_size,
+                   bool copy_dictionary);
   ~HashedDictionary();
 
   // Init() must be called before using the HashedDictionary as an argument
@@ -48,9 +65,165 @@ class HashedDictionary {
   // without using it.
   bool Init();
 
+  // Selects the layout of the index that Init() will build for the
+  // dictionary.  kChainedIndex (the default) keeps one linked list of
+  // candidate blocks for each hash value.  kBucketizedIndex keeps the
+  // candidates in cache-line-sized buckets together with a fingerprint of
+  // each block, so that most non-matching candidates can be rejected without
+  // reading the dictionary contents.  It uses about the same amount of memory
+  // and usually encodes faster with large dictionaries, at the cost of
+  // occasionally missing a match in highly repetitive data.  A bucketized
+  // index cannot be serialized, and it is always built in a single thread.
+  //
+  // This function must be called before Init().  It returns false, and has
+  // no effect, if Init() has already been called.
+  enum IndexLayout { kChainedIndex, kBucketizedIndex };
+  bool SetIndexLayout(IndexLayout layout);
+
+  // Sets the size of the blocks of dictionary contents that Init() will
+  // index.  block_size must be 8, 16 (the default), 32 or 64.  The encoder
+  // only finds matches that contain a whole, aligned dictionary block, so
+  // smaller blocks find shorter matches (which suits small text dictionaries)
+  // at the cost of a larger index and slower encoding; larger blocks reduce
+  // the size of the index and the encoding time for large binary dictionaries
+  // but miss matches shorter than about twice the block size.  The block size
+  // is recorded by Serialize().
+  //
+  // This function must be called before Init().  It returns false, and has
+  // no effect, if Init() has already been called or if block_size is not
+  // one of the allowed values.
+  bool SetBlockSize(int block_size);
+
+  // Sets the minimum size of a match for which the encoder will produce a
+  // COPY instruction; shorter matches are encoded as ADD instructions.  The
+  // default is 32 bytes.  A value below the block size has the same effect as
+  // the block size.  The minimum match size is recorded by Serialize().
+  //
+  // This function must be called before Init().  It returns false, and has
+  // no effect, if Init() has already been called.
+  bool SetMinimumMatchSize(size_t minimum_match_size);
+
+  // Makes Init() index only every sampling_interval-th block of the
+  // dictionary contents, which divides the memory used by the index by
+  // sampling_interval.  Matches that span at least
+  // (sampling_interval + 1) * block_size - 1 bytes are still always found,
+  // but shorter ones may be missed, so this is mainly useful for very large
+  // dictionaries whose useful matches are long.  The default is 1 (every
+  // block is indexed); the maximum is 65536.
+  //
+  // This function must be called before Init().  It returns false, and has
+  // no effect, if Init() has already been called or if sampling_interval
+  // is out of range.
+  bool SetSamplingInterval(int sampling_interval);
+
+  // Limits the memory used by the index (not counting the dictionary contents
+  // themselves) to about max_index_bytes, by making Init() double the sampling
+  // interval (see SetSamplingInterval) until the index fits.  Zero, the
+  // default, means there is no limit.  The resulting sampling interval is
+  // recorded by Serialize().
+  //
+  // This function must be called before Init().  It returns false, and has
+  // no effect, if Init() has already been called.
+  bool SetIndexMemoryBudget(size_t max_index_bytes);
+
+  // Enables lazy matching.  By default, the encoder produces a COPY
+  // instruction for the first match it finds that is long enough, even if a
+  // longer match starts a byte or two later.  With a lookahead of N, it also
+  // looks for matches at the next N target positions before choosing one,
+  // and uses the longest of them.  This usually makes the delta smaller at
+  // the cost of some encoding speed; values from 1 to 4 give most of the
+  // benefit.  The default is 0 (no lazy matching); the maximum is 64.  The
+  // lookahead is recorded by Serialize().
+  //
+  // This function must be called before Init().  It returns false, and has
+  // no effect, if Init() has already been called or if lookahead is out
+  // of range.
+  bool SetLazyMatchLookahead(int lookahead);
+
+  // Enables optimal parsing, a high-compression mode intended for deltas
+  // that are encoded once and downloaded many times.  Instead of taking
+  // matches as it finds them, the encoder first finds the longest match that
+  // starts at each position of the target, then chooses the sequence of ADD
+  // and COPY instructions with the smallest estimated encoded size, taking
+  // into account opcode, size and address costs.  Encoding is several times
+  // slower than the default.  Lazy matching (see SetLazyMatchLookahead) is
+  // ignored when optimal parsing is enabled.  The setting is recorded by
+  // Serialize().
+  //
+  // This function must be called before Init().  It returns false, and has
+  // no effect, if Init() has already been called.
+  bool SetOptimalParse(bool optimal_parse);
+
+  // Enables COPY instructions that start in the dictionary and extend past
+  // its end into the beginning of the target data (see the description of
+  // look_for_target_matches in VCDiffStreamingEncoder.)  When a match with
+  // the dictionary reaches the end of the dictionary, the encoder goes on
+  // comparing the target with the beginning of the current target window.
+  // This helps when the target repeats the end of the dictionary followed by
+  // the beginning of the target, as often happens with append-only data such
+  // as log files.  The extra comparison is only made for matches that reach
+  // the end of the dictionary, so the cost is small.  The default is false.
+  // The setting is recorded by Serialize().
+  //
+  // This function must be called before Init().  It returns false, and has
+  // no effect, if Init() has already been called.
+  bool SetCrossBoundaryMatching(bool cross_boundary_matching);
+
+  // Like Init(), but hashes the dictionary contents using up to thread_count
+  // threads, which can greatly reduce the time needed to initialize a large
+  // dictionary on a multi-core machine.  The resulting HashedDictionary is
+  // identical to the one produced by Init(), so the encoder output does not
+  // depend on thread_count.  Threads are only used if the library was built
+  // with C++11 or later; otherwise this is equivalent to Init().
+  bool Init(int thread_count);
+
+  // Appends to *index_image a persistable image of the dictionary contents
+  // and all the hash tables that Init() computed for them.  Init() must have
+  // been called successfully before calling this function.  The image is
+  // versioned and uses the native byte order, so it is intended to be written
+  // to a file once (for example, when a dictionary is deployed) and then
+  // loaded using CreateFromSerialized() by any number of encoder processes
+  // on the same platform.  Returns true on success, or false if the
+  // dictionary uses a bucketized index (see SetIndexLayout).
+  template<class OutputType>
+  bool Serialize(OutputType* index_image) const {
+    OutputString<OutputType> output_string(index_image);
+    return SerializeToInterface(&output_string);
+  }
+
+  bool SerializeToInterface(OutputStringInterface* index_image) const;
+
+  // Creates an initialized HashedDictionary from an image that was produced
+  // by Serialize().  No hash values are recomputed and neither the dictionary
+  // contents nor the hash tables are copied, so loading is fast even for a
+  // large dictionary.  The caller must keep index_image valid and unchanged,
+  // and aligned to at least sizeof(int) bytes, until the returned object
+  // has been deleted.  A typical use is to map the image file into memory
+  // with mmap(PROT_READ, MAP_SHARED), so that all processes that use the same
+  // dictionary share a single copy of its pages:
+  //
+  //    const HashedDictionary* hd =
+  //        HashedDictionary::CreateFromSerialized(mapped_file, file_size);
+  //    if (!hd) {
+  //      HandleError();
+  //      return;
+  //    }
+  //    ... use hd as the argument to VCDiffStreamingEncoder ...
+  //    delete hd;
+  //    munmap(mapped_file, file_size);
+  //
+  // Init() must not be called on the returned object.  Returns NULL if the
+  // image is truncated or corrupted, or if it was produced by an incompatible
+  // version of this library or on an incompatible platform.
+  static const HashedDictionary* CreateFromSerialized(const char* index_image,
+                                                      size_t image_size);
+
   const VCDiffEngine* engine() const { return engine_; }
 
  private:
+  // Used by CreateFromSerialized().  Takes ownership of engine.
+  explicit HashedDictionary(const VCDiffEngine* engine);
+
   const VCDiffEngine* engine_;
 
   // Make the copy constructor and assignment operator private
@@ -59,6 +232,42 @@ class HashedDictionary {
   void operator=(const HashedDictionary&);
 };
 
+// Holds the memory that a VCDiffStreamingEncoder uses while it encodes: the
+// buffers in which each delta window is built, and the hash table used to find
+// matches within the target data (see look_for_target_matches below.)  An
+// encoder normally allocates this memory itself and frees it when it is
+// deleted.  An encoder that has been given an arena (see
+// VCDiffStreamingEncoder::SetArena) borrows the arena's memory from
+// StartEncoding() until FinishEncoding(), and leaves behind any memory that it
+// has added, for the next encoder to use.  For example, a server that creates
+// an encoder for each request can keep one arena per thread, so that most
+// requests are encoded without allocating memory.
+//
+// An arena can be lent to only one encoder at a time, and must not be deleted
+// while it is lent.  NOT threadsafe.
+class VCDiffEncoderArena {
+ public:
+  // If max_retained_bytes is nonzero, then the arena frees its memory
+  // whenever an encoder gives back more than max_retained_bytes bytes of it,
+  // so that one unusually large target does not hold memory indefinitely.
+  explicit VCDiffEncoderArena(size_t max_retained_bytes = 0);
+
+  ~VCDiffEncoderArena();
+
+  // The number of bytes of memory held by the arena.
+  size_t retained_bytes() const;
+
+ private:
+  friend class VCDiffStreamingEncoder;
+
+  VCDiffEncoderArenaImpl* const impl_;
+
+  // Make the copy constructor and assignment operator private
+  // so that they don't inadvertently get used.
+  VCDiffEncoderArena(const VCDiffEncoderArena&);  // NOLINT
+  void operator=(const VCDiffEncoderArena&);
+};
+
 // The standard streaming interface to the VCDIFF (RFC 3284) encoder.
 // "Streaming" in this context means that, even though the entire set of
 // input data to be encoded may not be available at once, the encoder
@@ -96,10 +305,11 @@ class VCDiffStreamingEncoder {
   //
   // There is a third type of COPY instruction that starts within
   // the source data and extends from the end of the source data
-  // into the beginning of the target data.  This VCDIFF encoder will never
-  // produce a COPY instruction of this third type (regardless of the value of
-  // look_for_target_matches) because the cost of checking for matches
-  // across the source-target boundary would not justify its benefits.
+  // into the beginning of the target data.  By default, this VCDIFF encoder
+  // will never produce a COPY instruction of this third type (regardless of
+  // the value of look_for_target_matches) because for most data the cost of
+  // checking for matches across the source-target boundary would not justify
+  // its benefits.  HashedDictionary::SetCrossBoundaryMatching() enables them.
   //
   // Second version of constructor uses provided CodeTableInterfaceWriter
   // pointer instead of constructing one based on format_extenstions and will
@@ -202,6 +412,70 @@ class VCDiffStreamingEncoder {
 
   bool FinishEncodingToInterface(OutputStringInterface* output_string);
 
+  // *** Adjustable parameters ***
+
+  // By default, each call to EncodeChunk() produces a single delta window.
+  // If window_size is nonzero, then EncodeChunk() instead divides its data
+  // into consecutive windows of window_size bytes (the last window may be
+  // shorter), and the output is byte-for-byte identical to calling
+  // EncodeChunk() once for each of those windows.  Smaller windows allow
+  // the decoder to use less memory, at some cost in compression, because
+  // look_for_target_matches can only find matches within a window.
+  //
+  // Since the windows produced in this way are independent of one another,
+  // they can be encoded at the same time: if thread_count is 2 or more,
+  // EncodeChunk() encodes the windows of each chunk using up to thread_count
+  // threads, all sharing the same const HashedDictionary, and appends them
+  // to the output in order.  The encoded windows of a chunk are buffered
+  // until the whole chunk has been encoded, so this requires additional
+  // memory roughly equal to the size of the encoded chunk.  Threads are only
+  // used if the library was built with C++11 or later.
+  //
+  // This function must be called before StartEncoding().  It returns false,
+  // and has no effect, if called after StartEncoding(), if VCD_FORMAT_JSON was
+  // specified, or if the encoder was constructed with a custom
+  // CodeTableWriterInterface (because each thread needs its own writer.)
+  bool SetWindowedEncoding(size_t window_size, int thread_count);
+
+  // By default, each delta window is encoded against the dictionary only
+  // (and, if look_for_target_matches is true, against earlier data in the
+  // same window), so a long target that is streamed in many chunks cannot
+  // refer to data from earlier chunks.  If history_size is nonzero, then the
+  // encoder also keeps the last history_size bytes (or somewhat more) of the
+  // target data that it has encoded, hashed incrementally as each window is
+  // encoded.  Each window is encoded both against the dictionary and against
+  // that history, and whichever delta window is smaller is appended to the
+  // output; a window encoded against the history uses it as a VCD_TARGET
+  // source segment (see RFC 3284 section 4.2).  This roughly doubles the
+  // encoding time and requires memory of about twice history_size, plus the
+  // size of the largest window.  The decoder must allow VCD_TARGET (see
+  // VCDiffStreamingDecoder::SetAllowVcdTarget), which it does by default, and
+  // if it limits the target data that it keeps (see
+  // VCDiffStreamingDecoder::SetTargetHistory), it must keep at least twice
+  // history_size.
+  // Since VCD_TARGET cannot address target data beyond 2 GB, windows that
+  // end past that point are encoded against the dictionary only.
+  //
+  // This function must be called before StartEncoding().  It returns false,
+  // and has no effect, if called after StartEncoding(), if VCD_FORMAT_JSON was
+  // specified, if the encoder was constructed with a custom
+  // CodeTableWriterInterface, if history_size is larger than 1 GB, or if
+  // SetWindowedEncoding() has been called with a thread_count of 2 or more
+  // (because each window depends on the windows before it.)  Passing zero
+  // disables the target history.
+  bool SetTargetHistory(size_t history_size);
+
+  // Makes the encoder borrow its working memory from arena (see
+  // VCDiffEncoderArena) rather than allocating its own.  The arena is lent
+  // to the encoder by each call to StartEncoding(), which returns false if
+  // the arena is already lent to another encoder, and is given back by
+  // FinishEncoding() or by the destructor.  Passing NULL makes the encoder
+  // use its own memory again.  This function must be called before
+  // StartEncoding(), or after FinishEncoding().  It returns false, and has no
+  // effect, if called while encoding, if VCD_FORMAT_JSON was specified, or if
+  // the encoder was constructed with a custom CodeTableWriterInterface.
+  bool SetArena(VCDiffEncoderArena* arena);
+
  private:
   VCDiffStreamingEncoderImpl* const impl_;
 
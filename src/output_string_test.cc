@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <config.h>
+#include <string.h>  // memcpy
 #include <string>
 #include "google/output_string.h"
 #include "testing.h"
@@ -69,6 +70,20 @@ TEST_F(OutputStringTest, Size) {
   EXPECT_EQ(string_.size(), output_string_.size());
 }
 
+TEST_F(OutputStringTest, WritableRegion) {
+  char* region = output_string_.GetWritableRegion(4);
+  ASSERT_TRUE(region != NULL);
+  memcpy(region, "cdef", 4);
+  output_string_.Commit(2);
+  EXPECT_EQ("abcd", string_);
+}
+
+TEST_F(OutputStringTest, DiscardWritableRegion) {
+  output_string_.GetWritableRegion(4);
+  output_string_.Commit(0);
+  EXPECT_EQ("ab", string_);
+}
+
 #ifdef HAVE_EXT_ROPE
 class OutputCRopeTest : public testing::Test {
  public:
@@ -101,6 +116,12 @@ TEST_F(OutputCRopeTest, PushBack) {
   EXPECT_EQ(expected_abc, crope_);
 }
 
+// The decoder falls back to append() for output types that do not support
+// GetWritableRegion().
+TEST_F(OutputCRopeTest, NoWritableRegion) {
+  EXPECT_TRUE(output_crope_.GetWritableRegion(4) == NULL);
+}
+
 TEST_F(OutputCRopeTest, Size) {
   EXPECT_EQ(crope_.size(), output_crope_.size());
   crope_.push_back('c');
@@ -0,0 +1,90 @@
+// Copyright 2026 The open-vcdiff Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <config.h>
+#include "parallel.h"
+
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <system_error>
+#include <thread>
+#include <vector>
+#define VCDIFF_HAVE_THREADS 1
+#endif  // __cplusplus >= 201103L
+
+namespace open_vcdiff {
+
+#ifdef VCDIFF_HAVE_THREADS
+
+namespace {
+
+// Each thread repeatedly claims the next piece that has not yet been started,
+// so that the pieces are balanced among the threads even if they take
+// different amounts of time to run.
+void RunPieces(ParallelTask* task,
+               int task_count,
+               std::atomic<int>* next_task_number) {
+  for (int task_number = (*next_task_number)++;
+       task_number < task_count;
+       task_number = (*next_task_number)++) {
+    task->Run(task_number);
+  }
+}
+
+}  // anonymous namespace
+
+void RunInParallel(ParallelTask* task, int task_count, int thread_count) {
+  if (thread_count > task_count) {
+    thread_count = task_count;
+  }
+  if (thread_count < 2) {
+    for (int task_number = 0; task_number < task_count; ++task_number) {
+      task->Run(task_number);
+    }
+    return;
+  }
+  std::atomic<int> next_task_number(0);
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count - 1);
+  for (int i = 0; i < thread_count - 1; ++i) {
+    try {
+      threads.push_back(std::thread(RunPieces,
+                                    task,
+                                    task_count,
+                                    &next_task_number));
+    } catch (const std::system_error&) {
+      // Could not create another thread.  The threads that were created,
+      // together with the calling thread, will run all the pieces.
+      break;
+    }
+  }
+  RunPieces(task, task_count, &next_task_number);
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+}
+
+#else  // !VCDIFF_HAVE_THREADS
+
+void RunInParallel(ParallelTask* task,
+                   int task_count,
+                   int /* thread_count */) {
+  for (int task_number = 0; task_number < task_count; ++task_number) {
+    task->Run(task_number);
+  }
+}
+
+#endif  // VCDIFF_HAVE_THREADS
+
+}  // namespace open_vcdiff
@@ -0,0 +1,45 @@
+// Copyright 2026 The open-vcdiff Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OPEN_VCDIFF_PARALLEL_H_
+#define OPEN_VCDIFF_PARALLEL_H_
+
+#include <config.h>
+
+namespace open_vcdiff {
+
+// A job that has been divided into a fixed number of independent pieces,
+// which RunInParallel() may execute concurrently in different threads.
+// Each piece must write only to data that no other piece reads or writes.
+class ParallelTask {
+ public:
+  virtual ~ParallelTask() { }
+
+  // Performs piece number task_number (0 <= task_number < task_count) of the
+  // job.  Will be called exactly once for each piece.
+  virtual void Run(int task_number) = 0;
+};
+
+// Calls task->Run(i) once for each i in [0, task_count), using at most
+// thread_count threads (including the calling thread), and returns after all
+// the calls have completed.  The pieces may run in any order.  If thread_count
+// is less than 2, or if the library was built without thread support (which
+// requires C++11), or if new threads cannot be created, then some or all of
+// the pieces are run sequentially in the calling thread; the result is the
+// same either way.
+void RunInParallel(ParallelTask* task, int task_count, int thread_count);
+
+}  // namespace open_vcdiff
+
+#endif  // OPEN_VCDIFF_PARALLEL_H_
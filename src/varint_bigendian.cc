@@ -14,8 +14,8 @@
 
 #include <config.h>
 #include "varint_bigendian.h"
-#include <stdint.h>  // int32_t, int64_t
-#include <string.h>  // memcpy
+#include <stddef.h>  // ptrdiff_t
+#include <stdint.h>  // int32_t, int64_t, uint64_t
 #include <string>
 #include "logging.h"
 #include "google/output_string.h"
@@ -25,6 +25,59 @@ namespace open_vcdiff {
 template<> const int32_t VarintBE<int32_t>::kMaxVal = 0x7FFFFFFF;
 template<> const int64_t VarintBE<int64_t>::kMaxVal = 0x7FFFFFFFFFFFFFFFULL;
 
+// Returns the number of leading zero bits in bits, which must not be zero.
+static inline int LeadingZeroBits(uint64_t bits) {
+#ifdef __GNUC__
+  return __builtin_clzll(bits);
+#else
+  int zero_bits = 0;
+  while (!(bits & 0x8000000000000000ULL)) {
+    bits <<= 1;
+    ++zero_bits;
+  }
+  return zero_bits;
+#endif  // __GNUC__
+}
+
+// Returns the number of leading zero bytes in bits, which must not be zero.
+static inline int LeadingZeroBytes(uint64_t bits) {
+  return LeadingZeroBits(bits) >> 3;
+}
+
+// Parses a varint of up to eight bytes from the eight bytes at varint_ptr,
+// all of which must be readable.  Returns the length of the varint and
+// stores its value (which may be too large for the expected integer type)
+// in *value, or returns 0 if none of the eight bytes ends the varint.
+static inline int ParseEightBytes(const char* varint_ptr, uint64_t* value) {
+  const unsigned char* const bytes =
+      reinterpret_cast<const unsigned char*>(varint_ptr);
+  // Assemble the bytes in big-endian order whatever the byte order of the
+  // platform; compilers turn this into a single load (plus a byte swap.)
+  const uint64_t word = (static_cast<uint64_t>(bytes[0]) << 56) |
+                        (static_cast<uint64_t>(bytes[1]) << 48) |
+                        (static_cast<uint64_t>(bytes[2]) << 40) |
+                        (static_cast<uint64_t>(bytes[3]) << 32) |
+                        (static_cast<uint64_t>(bytes[4]) << 24) |
+                        (static_cast<uint64_t>(bytes[5]) << 16) |
+                        (static_cast<uint64_t>(bytes[6]) << 8) |
+                        static_cast<uint64_t>(bytes[7]);
+  // The continuation bit is clear in the last byte of the varint.
+  const uint64_t last_bytes = ~word & 0x8080808080808080ULL;
+  if (!last_bytes) {
+    return 0;
+  }
+  const int length = LeadingZeroBytes(last_bytes) + 1;
+  // Keep only the bytes of the varint, without their continuation bits, and
+  // then squeeze out the gaps: first in each pair of bytes, then in each
+  // pair of 14-bit groups, then in the pair of 28-bit groups.
+  uint64_t v = (word >> (64 - 8 * length)) & 0x7F7F7F7F7F7F7F7FULL;
+  v = ((v & 0x7F007F007F007F00ULL) >> 1) | (v & 0x007F007F007F007FULL);
+  v = ((v & 0x3FFF00003FFF0000ULL) >> 2) | (v & 0x00003FFF00003FFFULL);
+  v = ((v & 0x0FFFFFFF00000000ULL) >> 4) | (v & 0x000000000FFFFFFFULL);
+  *value = v;
+  return length;
+}
+
 // Reads a variable-length integer from **varint_ptr
 // and returns it in a fixed-length representation.  Increments
 // *varint_ptr by the number of bytes read.  Will not read
@@ -39,8 +92,30 @@ SignedIntegerType VarintBE<SignedIntegerType>::Parse(const char* limit,
   if (!limit) {
     return RESULT_ERROR;
   }
+  const char* const start = *varint_ptr;
+  if (limit - start >= static_cast<ptrdiff_t>(sizeof(uint64_t))) {
+    // Most varints are a single byte long.
+    if (!(*start & 0x80)) {
+      *varint_ptr = start + 1;
+      return *start;
+    }
+    // At least eight bytes are available, so there is no need to check
+    // the limit before reading each byte.  The value only grows as bytes are
+    // added to it, so it overflows exactly when the complete value does not
+    // fit in a SignedIntegerType.  If the varint is longer than eight bytes,
+    // parse it one byte at a time below.
+    uint64_t value = 0;
+    const int length = ParseEightBytes(start, &value);
+    if (length) {
+      if (value > static_cast<uint64_t>(kMaxVal)) {
+        return RESULT_ERROR;
+      }
+      *varint_ptr = start + length;
+      return static_cast<SignedIntegerType>(value);
+    }
+  }
   SignedIntegerType result = 0;
-  for (const char* parse_ptr = *varint_ptr; parse_ptr < limit; ++parse_ptr) {
+  for (const char* parse_ptr = start; parse_ptr < limit; ++parse_ptr) {
     result += *parse_ptr & 0x7F;
     if (!(*parse_ptr & 0x80)) {
       *varint_ptr = parse_ptr + 1;
@@ -57,42 +132,51 @@ SignedIntegerType VarintBE<SignedIntegerType>::Parse(const char* limit,
 }
 
 template <typename SignedIntegerType>
-int VarintBE<SignedIntegerType>::EncodeInternal(SignedIntegerType v,
-                                                char* varint_buf) {
-  if (v < 0) {
-    VCD_DFATAL << "Negative value " << v
-               << " passed to VarintBE::EncodeInternal,"
-                  " which requires non-negative argument" << VCD_ENDL;
-    return 0;
-  }
-  int length = 1;
-  char* buf_ptr = &varint_buf[kMaxBytes - 1];
-  *buf_ptr = static_cast<char>(v & 0x7F);
-  --buf_ptr;
-  v >>= 7;
-  while (v) {
-    *buf_ptr = static_cast<char>((v & 0x7F) | 0x80);  // add continuation bit
-    --buf_ptr;
-    ++length;
+inline void VarintBE<SignedIntegerType>::EncodeWithLength(SignedIntegerType v,
+                                                         int length,
+                                                         char* ptr) {
+  // Write the bytes from last to first, so that the lowest 7 bits of v
+  // (which have no continuation bit) end up in the last byte.
+  char* byte_ptr = ptr + length - 1;
+  *byte_ptr = static_cast<char>(v & 0x7F);
+  while (byte_ptr != ptr) {
     v >>= 7;
+    --byte_ptr;
+    *byte_ptr = static_cast<char>((v & 0x7F) | 0x80);  // add continuation bit
   }
-  return length;
 }
 
 template <typename SignedIntegerType>
 int VarintBE<SignedIntegerType>::Encode(SignedIntegerType v, char* ptr) {
-  char varint_buf[kMaxBytes];
-  const int length = EncodeInternal(v, varint_buf);
-  memcpy(ptr, &varint_buf[kMaxBytes - length], length);
+  if (v < 0) {
+    VCD_DFATAL << "Negative value " << v
+               << " passed to VarintBE::Encode,"
+                  " which requires non-negative argument" << VCD_ENDL;
+    return 0;
+  }
+  const int length = Length(v);
+  EncodeWithLength(v, length, ptr);
   return length;
 }
 
 template <typename SignedIntegerType>
 void VarintBE<SignedIntegerType>::AppendToString(SignedIntegerType value,
                                                  string* s) {
+  if (value < 0) {
+    VCD_DFATAL << "Negative value " << value
+               << " passed to VarintBE::AppendToString,"
+                  " which requires non-negative argument" << VCD_ENDL;
+    return;
+  }
+  if (value < 0x80) {
+    // A single byte, which is the most common case.
+    s->push_back(static_cast<char>(value));
+    return;
+  }
   char varint_buf[kMaxBytes];
-  const int length = EncodeInternal(value, varint_buf);
-  s->append(&varint_buf[kMaxBytes - length], length);
+  const int length = Length(value);
+  EncodeWithLength(value, length, varint_buf);
+  s->append(varint_buf, length);
 }
 
 template <typename SignedIntegerType>
@@ -100,8 +184,8 @@ void VarintBE<SignedIntegerType>::AppendToOutputString(
     SignedIntegerType value,
     OutputStringInterface* output_string) {
   char varint_buf[kMaxBytes];
-  const int length = EncodeInternal(value, varint_buf);
-  output_string->append(&varint_buf[kMaxBytes - length], length);
+  const int length = Encode(value, varint_buf);
+  output_string->append(varint_buf, length);
 }
 
 // Returns the encoding length of the specified value.
@@ -113,12 +197,10 @@ int VarintBE<SignedIntegerType>::Length(SignedIntegerType v) {
                   " which requires non-negative argument" << VCD_ENDL;
     return 0;
   }
-  int length = 0;
-  do {
-    v >>= 7;
-    ++length;
-  } while (v);
-  return length;
+  // Each byte holds 7 bits of the value.  A value of 0 takes one byte.
+  const int significant_bits =
+      64 - LeadingZeroBits(static_cast<uint64_t>(v) | 1);
+  return (significant_bits + 6) / 7;
 }
 
 template class VarintBE<int32_t>;
@@ -112,12 +112,9 @@ class VarintBE {  // BE stands for Big-Endian
                                    OutputStringInterface* output_string);
 
  private:
-  // Encodes "v" into the LAST few bytes of varint_buf (which is a char array
-  // of size kMaxBytes) and returns the length of the encoding.
-  // The result will be stored in buf[(kMaxBytes - length) : (kMaxBytes - 1)],
-  // rather than in buf[0 : length].
-  // The value of v must not be negative.
-  static int EncodeInternal(SignedIntegerType v, char* varint_buf);
+  // Encodes "v" into the "length" bytes starting at ptr, where "length"
+  // must be equal to Length(v).  The value of v must not be negative.
+  static void EncodeWithLength(SignedIntegerType v, int length, char* ptr);
 
   // These are private to avoid constructing any objects of this type
   VarintBE();
@@ -94,8 +94,37 @@ class VarintBETestTemplate : public VarintBETestCommon {
   void TemplateTestDecode31Bits();
   void TemplateTestEncodeDecodeRandom();
   void TemplateTestContinuationBytesPastEndOfInput();
+  void TemplateTestParseWithDataAfterVarint();
+  void TemplateTestParseMatchesByteAtATime();
+
+  // Parses the varint at *ptr one byte at a time, in the way described by
+  // RFC 3284, without reading past limit.  Used to check the results of
+  // Parse(), which reads several bytes at once when it can.
+  static SignedIntegerType ReferenceParse(const char* limit, const char** ptr);
 };
 
+template <typename SignedIntegerType>
+SignedIntegerType VarintBETestTemplate<SignedIntegerType>::ReferenceParse(
+    const char* limit,
+    const char** ptr) {
+  uint64_t value = 0;
+  for (const char* p = *ptr; p < limit; ++p) {
+    value = (value << 7) | (*p & 0x7F);
+    if (!(*p & 0x80)) {
+      if (value > static_cast<uint64_t>(VarintType::kMaxVal)) {
+        return RESULT_ERROR;
+      }
+      *ptr = p + 1;
+      return static_cast<SignedIntegerType>(value);
+    }
+    if (value > static_cast<uint64_t>(VarintType::kMaxVal >> 7)) {
+      // Any further byte would make the value overflow.
+      return RESULT_ERROR;
+    }
+  }
+  return RESULT_END_OF_DATA;
+}
+
 typedef VarintBETestTemplate<int32_t> VarintBEInt32Test;
 typedef VarintBETestTemplate<int64_t> VarintBEInt64Test;
 
@@ -347,5 +376,77 @@ TEMPLATE_TEST_F(Test, ContinuationBytesPastEndOfInput) {
                               &parse_data_ptr_));
 }
 
+// The following tests leave data after the varint, so that Parse() can read
+// several bytes at once.
+
+TEMPLATE_TEST_F(Test, ParseWithDataAfterVarint) {
+  const uint8_t parse_data[] =
+      { 0x88, 0x80, 0x80, 0x80, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  parse_data_ptr_ = reinterpret_cast<const char*>(parse_data);
+  const SignedIntType result =
+      VarintType::Parse(parse_data_ptr_ + sizeof(parse_data),
+                        &parse_data_ptr_);
+  if (sizeof(SignedIntType) == sizeof(int32_t)) {
+    EXPECT_EQ(RESULT_ERROR, result);
+    EXPECT_EQ(reinterpret_cast<const char*>(parse_data), parse_data_ptr_);
+  } else {
+    EXPECT_EQ(0x80000000LL, static_cast<int64_t>(result));
+    EXPECT_EQ(reinterpret_cast<const char*>(parse_data + 5), parse_data_ptr_);
+  }
+}
+
+TEST_F(VarintBEInt64Test, Parse63BitsWithDataAfterVarint) {
+  const uint8_t parse_data[] =
+      { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F, 0x00, 0x00 };
+  parse_data_ptr_ = reinterpret_cast<const char*>(parse_data);
+  EXPECT_EQ(VarintType::kMaxVal,
+            VarintType::Parse(parse_data_ptr_ + sizeof(parse_data),
+                              &parse_data_ptr_));
+  EXPECT_EQ(reinterpret_cast<const char*>(parse_data + 9), parse_data_ptr_);
+}
+
+// Parse random values, with varying numbers of leading 0x80 bytes (which are
+// allowed by RFC 3284 and add nothing to the value) and varying amounts of
+// data after the varint, and compare the results with ReferenceParse().
+TEMPLATE_TEST_F(Test, ParseMatchesByteAtATime) {
+  const int test_size = 1024;
+  srand(1);
+  for (int i = 0; i < test_size; ++i) {
+    s_.clear();
+    const int padding_bytes = i % 12;
+    for (int j = 0; j < padding_bytes; ++j) {
+      s_.push_back(static_cast<char>(0x80));
+    }
+    // Values near the top of the range, which overflow if a leading byte is
+    // added, test the overflow check.
+    SignedIntType value = PortableRandomInRange(VarintType::kMaxVal);
+    if (i % 4 == 0) {
+      value = VarintType::kMaxVal - (value & 0xFF);
+    }
+    VarintType::AppendToString(value, &s_);
+    if (i % 8 == 1) {
+      s_[padding_bytes] |= 0x40;  // May overflow.
+    }
+    const size_t varint_end = s_.size();
+    for (int j = 0; j < (i % 10); ++j) {
+      s_.push_back(static_cast<char>(rand() & 0xFF));
+    }
+    for (size_t limit = 0; limit <= s_.size(); ++limit) {
+      const char* parse_pointer = s_.data();
+      const char* reference_pointer = s_.data();
+      const SignedIntType result =
+          VarintType::Parse(s_.data() + limit, &parse_pointer);
+      EXPECT_EQ(ReferenceParse(s_.data() + limit, &reference_pointer), result)
+          << "varint " << i << " with limit " << limit;
+      EXPECT_EQ(reference_pointer, parse_pointer);
+      if ((limit >= varint_end) && (i % 8 != 1)) {
+        // A value that was not altered must be parsed completely.
+        EXPECT_LE(0, result);
+        EXPECT_EQ(s_.data() + varint_end, parse_pointer);
+      }
+    }
+  }
+}
+
 }  // anonymous namespace
 }  // namespace open_vcdiff
@@ -119,7 +119,8 @@ class VCDiffDeltaFileWindow {
   }
 
   // Decodes a single delta window using the input data from *parseable_chunk.
-  // Appends the decoded target window to parent_->decoded_target().  Returns
+  // Writes the decoded target window to the memory returned by
+  // parent_->PrepareTargetWindow(), which may be part of output_string.  Returns
   // RESULT_SUCCESS if an entire window was decoded, or RESULT_END_OF_DATA if
   // the end of input was reached before the entire window could be decoded and
   // more input is expected (only possible if IsInterleaved() is true), or
@@ -128,7 +129,8 @@ class VCDiffDeltaFileWindow {
   // parseable_chunk->Advance() is called to point to the input data position
   // just after the data that has been decoded.
   //
-  VCDiffResult DecodeWindow(ParseableChunk* parseable_chunk);
+  VCDiffResult DecodeWindow(ParseableChunk* parseable_chunk,
+                            OutputStringInterface* output_string);
 
   bool FoundWindowHeader() const {
     return found_header_;
@@ -150,6 +152,9 @@ class VCDiffDeltaFileWindow {
     target_window_start_pos_ = new_start_pos;
   }
 
+  // Returns the number of bytes already decoded into the target window.
+  size_t TargetBytesDecoded() const { return target_bytes_decoded_; }
+
   // Returns the number of bytes remaining to be decoded in the target window.
   // If not in the process of decoding a window, returns 0.
   size_t TargetBytesRemaining();
@@ -166,7 +171,8 @@ class VCDiffDeltaFileWindow {
   // Otherwise, returns RESULT_SUCCESS and advances parseable_chunk past the
   // parsed header.
   //
-  VCDiffResult ReadHeader(ParseableChunk* parseable_chunk);
+  VCDiffResult ReadHeader(ParseableChunk* parseable_chunk,
+                          OutputStringInterface* output_string);
 
   // After the window header has been parsed as far as the Delta_Indicator,
   // this function is called to parse the following delta window header fields:
@@ -195,23 +201,58 @@ class VCDiffDeltaFileWindow {
   // non-negative value on success, or RESULT_END_OF_DATA if the end of input
   // was reached before the entire window could be decoded (only possible if
   // IsInterleaved() is true), or RESULT_ERROR if an error occurred during
-  // decoding.  Appends as much of the decoded target window as possible to
-  // parent->decoded_target().
+  // decoding.  Writes as much of the decoded target window as possible to
+  // target_window_ptr_.
   //
   int DecodeBody(ParseableChunk* parseable_chunk);
 
-  // Returns the number of bytes already decoded into the target window.
-  size_t TargetBytesDecoded();
-
-  // Decodes a single ADD instruction, updating parent_->decoded_target_.
+  // Decodes the body of the window section in the same way as DecodeBody(),
+  // but may only be used if entire_window_available_ is true.  Since the
+  // decoding of the window will never need to be resumed, running out of
+  // instructions, data or addresses means that the window is invalid, and
+  // there is no need to keep track of where the last instruction started.
+  // This lets it interpret the opcodes directly through the packed opcode
+  // table of reader_, both instructions of an opcode in the same iteration,
+  // instead of calling GetNextInstruction() for each instruction.
+  // Returns RESULT_SUCCESS, or RESULT_END_OF_DATA if one of the window
+  // sections ended before the target window was complete, or RESULT_ERROR if
+  // any other error occurred during decoding.
+  //
+  VCDiffResult DecodeWholeBody(ParseableChunk* parseable_chunk);
+
+  // Decodes one of the instructions of an opcode for DecodeWholeBody().  If
+  // size is 0, the size of the instruction is read from the instructions
+  // section.  Returns RESULT_SUCCESS, RESULT_END_OF_DATA if a window section
+  // ended too early, or RESULT_ERROR.
+  VCDiffResult DecodeWholeInstruction(unsigned char instruction,
+                                      size_t size,
+                                      unsigned char mode);
+
+  // Returns true if an instruction of the given size fits in the part of the
+  // target window that has not been decoded yet.  Otherwise, logs an error
+  // and returns false.
+  bool InstructionFitsInWindow(VCDiffInstructionType instruction,
+                               size_t size) const;
+
+  // Called by DecodeBody() and DecodeWholeBody() once the instructions
+  // have produced target_window_length_ bytes.  Verifies the checksum (if any)
+  // and that no data is left over in the window sections, then advances
+  // *parseable_chunk past the end of the window.
+  VCDiffResult FinishBody(ParseableChunk* parseable_chunk);
+
+  // Decodes a single ADD instruction, updating the target window.
   VCDiffResult DecodeAdd(size_t size);
 
-  // Decodes a single RUN instruction, updating parent_->decoded_target_.
+  // Decodes a single RUN instruction, updating the target window.
   VCDiffResult DecodeRun(size_t size);
 
-  // Decodes a single COPY instruction, updating parent_->decoded_target_.
+  // Decodes a single COPY instruction, updating the target window.
   VCDiffResult DecodeCopy(size_t size, unsigned char mode);
 
+  // Executes a COPY instruction whose address has already been decoded (and
+  // checked to be before the current position), updating the target window.
+  void CopyFromAddress(size_t address, size_t size);
+
   // When using the interleaved format, this function is called both on parsing
   // the header and on resuming after a RESULT_END_OF_DATA was returned from a
   // previous call to DecodeBody().  It sets up all three section pointers to
@@ -243,14 +284,18 @@ class VCDiffDeltaFileWindow {
     return !addresses_for_copy_.IsOwned();
   }
 
-  // Executes a single COPY or ADD instruction, appending data to
-  // parent_->decoded_target().
+  // Executes a single COPY or ADD instruction, appending data to the
+  // target window.  data must not overlap the bytes being written.
   void CopyBytes(const char* data, size_t size);
 
-  // Executes a single RUN instruction, appending data to
-  // parent_->decoded_target().
+  // Executes a single RUN instruction, appending data to the target window.
   void RunByte(unsigned char byte, size_t size);
 
+  // Executes the part of a COPY instruction whose data overlaps the bytes
+  // being written: appends size bytes to the target window by repeating the
+  // last "distance" bytes decoded, where 0 < distance < size.
+  void CopyRepeatedPattern(size_t distance, size_t size);
+
   // Advance *parseable_chunk to point to the current position in the
   // instructions/sizes section.  If interleaved format is used, then
   // decrement the number of expected bytes in the instructions/sizes section
@@ -289,10 +334,23 @@ class VCDiffDeltaFileWindow {
   // The expected length of the target window once it has been decoded.
   size_t target_window_length_;
 
+  // True if all the input data for the current window was available when
+  // its header was read, so that DecodeWholeBody() can be used.
+  bool entire_window_available_;
+
   // The index in decoded_target at which the first byte of the current
   // target window was/will be written.
   size_t target_window_start_pos_;
 
+  // The memory into which the current target window is decoded, and the
+  // number of bytes of it that have been decoded so far.  The instructions
+  // write directly to this memory, which has room for the whole window,
+  // rather than appending to a string.  target_window_ptr_ usually points
+  // into parent_->decoded_target_data(), which is not resized while a window
+  // is being decoded.
+  char* target_window_ptr_;
+  size_t target_bytes_decoded_;
+
   // If has_checksum_ is true, then expected_checksum_ contains an Adler32
   // checksum of the target window data.  This is an extension included in the
   // VCDIFF 'S' (SDCH) format, but is not part of the RFC 3284 draft standard.
@@ -350,6 +408,13 @@ class VCDiffStreamingDecoderImpl {
                    size_t len,
                    OutputStringInterface* output_string);
 
+  void StartDecodingToBuffer(const char* dictionary_ptr,
+                             size_t dictionary_size,
+                             char* buffer,
+                             size_t buffer_size);
+
+  bool DecodeChunkToBuffer(const char* data, size_t len, size_t* target_size);
+
   bool FinishDecoding();
 
   // If true, the version of VCDIFF used in the current delta file allows
@@ -474,7 +539,36 @@ class VCDiffStreamingDecoderImpl {
 
   VCDiffAddressCache* addr_cache() { return addr_cache_.get(); }
 
-  string* decoded_target() { return &decoded_target_; }
+  // The target data decoded so far, including the space reserved by
+  // PrepareTargetWindow() for the target window being decoded.  This is
+  // either decoded_target_ or the client's buffer (see
+  // StartDecodingToBuffer().)
+  const char* decoded_target_data() const {
+    return target_buffer_ ? target_buffer_ : decoded_target_.data();
+  }
+
+  size_t decoded_target_size() const {
+    return target_buffer_ ? target_buffer_used_ : decoded_target_.size();
+  }
+
+  // The number of bytes at the start of the target file that are no longer
+  // kept in decoded_target_ (see SetTargetHistory().)  decoded_target_data()
+  // holds the target data from this position onward.
+  size_t discarded_target_bytes() const { return discarded_target_bytes_; }
+
+  // Returns a pointer to the memory into which the window decoder should
+  // write a target window of target_window_length bytes.  When decoding into
+  // the client's buffer, this is the next unused part of that buffer.
+  // Otherwise, it is normally the end of decoded_target_, which is resized to
+  // hold the window.  But if
+  // no data from earlier target windows needs to be kept (allow_vcd_target_
+  // is false,) entire_window_available is true (so the window will be
+  // completely decoded before DecodeChunk() returns,) and output_string
+  // supports GetWritableRegion(), then the window is decoded directly into
+  // output_string, saving a copy.
+  char* PrepareTargetWindow(size_t target_window_length,
+                            bool entire_window_available,
+                            OutputStringInterface* output_string);
 
   bool allow_vcd_target() const { return allow_vcd_target_; }
 
@@ -487,6 +581,22 @@ class VCDiffStreamingDecoderImpl {
     allow_vcd_target_ = allow_vcd_target;
   }
 
+  bool SetTargetHistory(size_t history_size) {
+    if (start_decoding_was_called_) {
+      VCD_ERROR << "SetTargetHistory() called after StartDecoding()"
+                << VCD_ENDL;
+      return false;
+    }
+    if (history_size > kTargetSizeLimit) {
+      VCD_ERROR << "Specified target history size " << history_size
+                << " exceeds limit of " << kTargetSizeLimit << " bytes"
+                << VCD_ENDL;
+      return false;
+    }
+    target_history_size_ = history_size;
+    return true;
+  }
+
  private:
   // Reads the VCDiff delta file header section as described in RFC section 4.1,
   // except the custom code table data.  Returns RESULT_ERROR if an error
@@ -536,6 +646,19 @@ class VCDiffStreamingDecoderImpl {
   // target data from any window except the current window.
   void FlushDecodedTarget(OutputStringInterface* output_string);
 
+  // Called after each complete target window has been decoded if a target
+  // history size has been set.  Once decoded_target_ has grown to twice the
+  // history size, appends to output_string the portion of decoded_target_
+  // that has not yet been output, then discards all but the last
+  // target_history_size_ bytes of decoded_target_.
+  void TrimDecodedTarget(OutputStringInterface* output_string);
+
+  // Implements DecodeChunk() and DecodeChunkToBuffer().  output_string is
+  // NULL when decoding into the client's buffer.
+  bool DecodeChunkInternal(const char* data,
+                           size_t len,
+                           OutputStringInterface* output_string);
+
   // Contents and length of the source (dictionary) data.
   const char* dictionary_ptr_;
   size_t dictionary_size_;
@@ -600,6 +723,29 @@ class VCDiffStreamingDecoderImpl {
   // has not yet been output by AppendNewOutputText().
   size_t decoded_target_output_position_;
 
+  // If nonzero, the decoder only needs to keep this many bytes of earlier
+  // target data for VCD_TARGET windows (see SetTargetHistory().)
+  size_t target_history_size_;
+
+  // The number of bytes that TrimDecodedTarget() has discarded from the start
+  // of decoded_target_.
+  size_t discarded_target_bytes_;
+
+  // If StartDecodingToBuffer() was called, these hold the client's buffer,
+  // its size, and the number of bytes of it that have been used so far, which
+  // includes the whole of the target window being decoded.  Otherwise,
+  // target_buffer_ is NULL, and the target is decoded into decoded_target_.
+  char* target_buffer_;
+  size_t target_buffer_size_;
+  size_t target_buffer_used_;
+
+  // If the current target window is being decoded directly into the output
+  // string (see PrepareTargetWindow()), then these hold the pointer returned
+  // by GetWritableRegion() and the length of the target window.  Otherwise,
+  // output_region_ is NULL.
+  char* output_region_;
+  size_t output_region_size_;
+
   // This value is used to ensure the correct order of calls to the interface
   // functions, i.e., a single call to StartDecoding(), followed by zero or
   // more calls to DecodeChunk(), followed by a single call to
@@ -626,6 +772,7 @@ const size_t VCDiffStreamingDecoderImpl::kUnlimitedBytes;
 VCDiffStreamingDecoderImpl::VCDiffStreamingDecoderImpl()
     : maximum_target_file_size_(kDefaultMaximumTargetFileSize),
       maximum_target_window_size_(kDefaultMaximumTargetFileSize),
+      target_history_size_(0),
       allow_vcd_target_(true) {
   delta_window_.Init(this);
   Reset();
@@ -646,6 +793,12 @@ void VCDiffStreamingDecoderImpl::Reset() {
   custom_code_table_decoder_.reset();
   delta_window_.Reset();
   decoded_target_output_position_ = 0;
+  discarded_target_bytes_ = 0;
+  output_region_ = NULL;
+  output_region_size_ = 0;
+  target_buffer_ = NULL;
+  target_buffer_size_ = 0;
+  target_buffer_used_ = 0;
 }
 
 void VCDiffStreamingDecoderImpl::StartDecoding(const char* dictionary_ptr,
@@ -847,6 +1000,29 @@ VCDiffResult VCDiffStreamingDecoderImpl::ReadCustomCodeTable(
   return RESULT_SUCCESS;
 }
 
+char* VCDiffStreamingDecoderImpl::PrepareTargetWindow(
+    size_t target_window_length,
+    bool entire_window_available,
+    OutputStringInterface* output_string) {
+  if (target_buffer_) {
+    // TargetWindowWouldExceedSizeLimits() has checked that the window fits.
+    char* const target_window = target_buffer_ + target_buffer_used_;
+    target_buffer_used_ += target_window_length;
+    return target_window;
+  }
+  if (!allow_vcd_target_ && entire_window_available &&
+      decoded_target_.empty() && (target_window_length > 0)) {
+    output_region_ = output_string->GetWritableRegion(target_window_length);
+    if (output_region_) {
+      output_region_size_ = target_window_length;
+      return output_region_;
+    }
+  }
+  const size_t target_window_start_pos = decoded_target_.size();
+  decoded_target_.resize(target_window_start_pos + target_window_length);
+  return &decoded_target_[target_window_start_pos];
+}
+
 void VCDiffStreamingDecoderImpl::FlushDecodedTarget(
     OutputStringInterface* output_string) {
   output_string->append(
@@ -857,10 +1033,29 @@ void VCDiffStreamingDecoderImpl::FlushDecodedTarget(
   decoded_target_output_position_ = 0;
 }
 
+void VCDiffStreamingDecoderImpl::TrimDecodedTarget(
+    OutputStringInterface* output_string) {
+  // Waiting until decoded_target_ holds twice the history size means that
+  // erase() moves each byte at most once on average.
+  if ((decoded_target_.size() < target_history_size_) ||
+      (decoded_target_.size() - target_history_size_ < target_history_size_)) {
+    return;
+  }
+  AppendNewOutputText(output_string);
+  const size_t bytes_to_discard =
+      decoded_target_.size() - target_history_size_;
+  decoded_target_.erase(0, bytes_to_discard);
+  discarded_target_bytes_ += bytes_to_discard;
+  decoded_target_output_position_ -= bytes_to_discard;
+  delta_window_.set_target_window_start_pos(decoded_target_.size());
+}
+
 void VCDiffStreamingDecoderImpl::AppendNewOutputText(
     OutputStringInterface* output_string) {
+  // decoded_target_ already has room for the rest of the current window.
   const size_t bytes_decoded_this_chunk =
-      decoded_target_.size() - decoded_target_output_position_;
+      delta_window_.target_window_start_pos() +
+      delta_window_.TargetBytesDecoded() - decoded_target_output_position_;
   if (bytes_decoded_this_chunk > 0) {
     size_t target_bytes_remaining = delta_window_.TargetBytesRemaining();
     if (target_bytes_remaining > 0) {
@@ -873,7 +1068,7 @@ void VCDiffStreamingDecoderImpl::AppendNewOutputText(
     output_string->append(
         decoded_target_.data() + decoded_target_output_position_,
         bytes_decoded_this_chunk);
-    decoded_target_output_position_ = decoded_target_.size();
+    decoded_target_output_position_ += bytes_decoded_this_chunk;
   }
 }
 
@@ -886,6 +1081,52 @@ bool VCDiffStreamingDecoderImpl::DecodeChunk(
     Reset();
     return false;
   }
+  if (target_buffer_) {
+    VCD_DFATAL << "DecodeChunk() called after StartDecodingToBuffer()"
+               << VCD_ENDL;
+    Reset();
+    return false;
+  }
+  return DecodeChunkInternal(data, len, output_string);
+}
+
+void VCDiffStreamingDecoderImpl::StartDecodingToBuffer(
+    const char* dictionary_ptr,
+    size_t dictionary_size,
+    char* buffer,
+    size_t buffer_size) {
+  if (start_decoding_was_called_) {
+    VCD_DFATAL << "StartDecodingToBuffer() called twice without"
+                  " FinishDecoding()" << VCD_ENDL;
+    return;
+  }
+  StartDecoding(dictionary_ptr, dictionary_size);
+  target_buffer_ = buffer;
+  target_buffer_size_ = buffer_size;
+  target_buffer_used_ = 0;
+}
+
+bool VCDiffStreamingDecoderImpl::DecodeChunkToBuffer(const char* data,
+                                                     size_t len,
+                                                     size_t* target_size) {
+  if (!start_decoding_was_called_ || !target_buffer_) {
+    VCD_DFATAL << "DecodeChunkToBuffer() called without"
+                  " StartDecodingToBuffer()" << VCD_ENDL;
+    Reset();
+    return false;
+  }
+  if (!DecodeChunkInternal(data, len, NULL)) {
+    return false;
+  }
+  *target_size = delta_window_.target_window_start_pos() +
+                 delta_window_.TargetBytesDecoded();
+  return true;
+}
+
+bool VCDiffStreamingDecoderImpl::DecodeChunkInternal(
+    const char* data,
+    size_t len,
+    OutputStringInterface* output_string) {
   ParseableChunk parseable_chunk(data, len);
   if (!unparsed_bytes_.empty()) {
     unparsed_bytes_.append(data, len);
@@ -898,7 +1139,20 @@ bool VCDiffStreamingDecoderImpl::DecodeChunk(
   }
   if (RESULT_SUCCESS == result) {
     while (!parseable_chunk.Empty()) {
-      result = delta_window_.DecodeWindow(&parseable_chunk);
+      result = delta_window_.DecodeWindow(&parseable_chunk, output_string);
+      if (output_region_) {
+        // The window was decoded directly into output_string.  Keep it only
+        // if it was decoded completely.
+        if (RESULT_END_OF_DATA == result) {
+          VCD_DFATAL << "Internal error: the entire target window was expected"
+                        " to be available" << VCD_ENDL;
+          result = RESULT_ERROR;
+        }
+        output_string->Commit((RESULT_SUCCESS == result) ?
+                              output_region_size_ : 0);
+        output_region_ = NULL;
+        output_region_size_ = 0;
+      }
       if (RESULT_SUCCESS != result) {
         break;
       }
@@ -906,11 +1160,13 @@ bool VCDiffStreamingDecoderImpl::DecodeChunk(
         // Found exactly the length we expected.  Stop decoding.
         break;
       }
-      if (!allow_vcd_target()) {
+      if (!allow_vcd_target() && !target_buffer_) {
         // VCD_TARGET will never be used to reference target data before the
         // start of the current window, so flush and clear the contents of
         // decoded_target_.
         FlushDecodedTarget(output_string);
+      } else if ((target_history_size_ > 0) && !target_buffer_) {
+        TrimDecodedTarget(output_string);
       }
     }
   }
@@ -920,7 +1176,9 @@ bool VCDiffStreamingDecoderImpl::DecodeChunk(
   }
   unparsed_bytes_.assign(parseable_chunk.UnparsedData(),
                          parseable_chunk.UnparsedSize());
-  AppendNewOutputText(output_string);
+  if (!target_buffer_) {
+    AppendNewOutputText(output_string);
+  }
   return true;
 }
 
@@ -980,6 +1238,15 @@ bool VCDiffStreamingDecoderImpl::TargetWindowWouldExceedSizeLimits(
               << maximum_target_file_size_ << " bytes" << VCD_ENDL;
     return true;
   }
+  if (target_buffer_ &&
+      (window_size > target_buffer_size_ - target_buffer_used_)) {
+    VCD_ERROR << "Length of target window (" << window_size
+              << " bytes) plus previous windows ("
+              << target_buffer_used_
+              << " bytes) would exceed size of output buffer ("
+              << target_buffer_size_ << " bytes)" << VCD_ENDL;
+    return true;
+  }
   return false;
 }
 
@@ -989,8 +1256,11 @@ void VCDiffDeltaFileWindow::Reset() {
   found_header_ = false;
 
   // Mark the start of the current target window.
-  target_window_start_pos_ = parent_ ? parent_->decoded_target()->size() : 0U;
+  target_window_start_pos_ = parent_ ? parent_->decoded_target_size() : 0U;
   target_window_length_ = 0;
+  entire_window_available_ = false;
+  target_window_ptr_ = NULL;
+  target_bytes_decoded_ = 0;
 
   source_segment_ptr_ = NULL;
   source_segment_length_ = 0;
@@ -1071,21 +1341,29 @@ VCDiffResult VCDiffDeltaFileWindow::SetUpWindowSections(
 //                 Addresses section for COPYs      - array of bytes
 //
 VCDiffResult VCDiffDeltaFileWindow::ReadHeader(
-    ParseableChunk* parseable_chunk) {
-  std::string* decoded_target = parent_->decoded_target();
+    ParseableChunk* parseable_chunk,
+    OutputStringInterface* output_string) {
   VCDiffHeaderParser header_parser(parseable_chunk->UnparsedData(),
                                    parseable_chunk->End());
   size_t source_segment_position = 0;
   unsigned char win_indicator = 0;
+  const size_t discarded_target_bytes = parent_->discarded_target_bytes();
   if (!header_parser.ParseWinIndicatorAndSourceSegment(
           parent_->dictionary_size(),
-          decoded_target->size(),
+          discarded_target_bytes + parent_->decoded_target_size(),
           parent_->allow_vcd_target(),
           &win_indicator,
           &source_segment_length_,
           &source_segment_position)) {
     return header_parser.GetResult();
   }
+  if ((win_indicator & VCD_TARGET) &&
+      (source_segment_position < discarded_target_bytes)) {
+    VCD_ERROR << "Source segment position (" << source_segment_position
+              << ") is before the start of the target history kept by the"
+                 " decoder (" << discarded_target_bytes << ")" << VCD_ENDL;
+    return RESULT_ERROR;
+  }
   has_checksum_ = parent_->AllowChecksum() && (win_indicator & VCD_CHECKSUM);
   if (!header_parser.ParseWindowLengths(&target_window_length_)) {
     return header_parser.GetResult();
@@ -1099,20 +1377,24 @@ VCDiffResult VCDiffDeltaFileWindow::ReadHeader(
   if (RESULT_SUCCESS != setup_return_code) {
     return setup_return_code;
   }
-  // Reserve enough space in the output string for the current target window.
-  const size_t wanted_capacity =
-      target_window_start_pos_ + target_window_length_;
-  if (decoded_target->capacity() < wanted_capacity) {
-    decoded_target->reserve(wanted_capacity);
-  }
+  // Make room for the current target window.  If the interleaved format is
+  // used, the window may not be complete until more data arrives.
+  entire_window_available_ =
+      !IsInterleaved() ||
+      (instructions_and_sizes_.UnparsedSize() ==
+           static_cast<size_t>(interleaved_bytes_expected_));
+  target_window_ptr_ = parent_->PrepareTargetWindow(target_window_length_,
+                                                    entire_window_available_,
+                                                    output_string);
   // Get a pointer to the start of the source segment.
   if (win_indicator & VCD_SOURCE) {
     source_segment_ptr_ = parent_->dictionary_ptr() + source_segment_position;
   } else if (win_indicator & VCD_TARGET) {
-    // This assignment must happen after the reserve().
+    // This assignment must happen after PrepareTargetWindow().
     // decoded_target should not be resized again while processing this window,
     // so source_segment_ptr_ should remain valid.
-    source_segment_ptr_ = decoded_target->data() + source_segment_position;
+    source_segment_ptr_ = parent_->decoded_target_data() +
+                          (source_segment_position - discarded_target_bytes);
   }
   // The whole window header was found and parsed successfully.
   found_header_ = true;
@@ -1131,10 +1413,6 @@ void VCDiffDeltaFileWindow::UpdateInstructionPointer(
   }
 }
 
-inline size_t VCDiffDeltaFileWindow::TargetBytesDecoded() {
-  return parent_->decoded_target()->size() - target_window_start_pos_;
-}
-
 size_t VCDiffDeltaFileWindow::TargetBytesRemaining() {
   if (target_window_length_ == 0) {
     // There is no window being decoded at present
@@ -1145,11 +1423,88 @@ size_t VCDiffDeltaFileWindow::TargetBytesRemaining() {
 }
 
 inline void VCDiffDeltaFileWindow::CopyBytes(const char* data, size_t size) {
-  parent_->decoded_target()->append(data, size);
+  memcpy(target_window_ptr_ + target_bytes_decoded_, data, size);
+  target_bytes_decoded_ += size;
 }
 
 inline void VCDiffDeltaFileWindow::RunByte(unsigned char byte, size_t size) {
-  parent_->decoded_target()->append(size, byte);
+  memset(target_window_ptr_ + target_bytes_decoded_, byte, size);
+  target_bytes_decoded_ += size;
+}
+
+void VCDiffDeltaFileWindow::CopyRepeatedPattern(size_t distance,
+                                                size_t size) {
+  // The width of the blocks written for short patterns.  A memcpy() of this
+  // fixed size compiles to a single unaligned vector load and store.
+  static const size_t kBlockSize = 16;
+  // The largest amount copied at once for longer patterns.
+  static const size_t kMaxCopyChunk = 16384;
+  char* out = target_window_ptr_ + target_bytes_decoded_;
+  const char* const pattern = out - distance;
+  target_bytes_decoded_ += size;
+  if (distance == 1) {
+    memset(out, *pattern, size);
+    return;
+  }
+  if (distance <= kBlockSize) {
+    // Fill a block with as many whole repetitions of the pattern as fit in it,
+    // then write the whole block at each step but advance only by the length
+    // of those repetitions, so that every block starts at the same phase of
+    // the pattern.
+    char block[kBlockSize];
+    memcpy(block, pattern, distance);
+    for (size_t i = distance; i < kBlockSize; ++i) {
+      block[i] = block[i - distance];
+    }
+    const size_t stride = (kBlockSize / distance) * distance;
+    while (size >= kBlockSize) {
+      memcpy(out, block, kBlockSize);
+      out += stride;
+      size -= stride;
+    }
+    memcpy(out, block, size);
+    return;
+  }
+  // For longer patterns, copy the data that precedes the output position,
+  // doubling the amount copied each time (up to kMaxCopyChunk bytes): once it
+  // has been written, the pattern is repeated twice as far back as before.
+  // The source and destination of each memcpy() do not overlap, and the
+  // source stays close enough to the destination to remain in the cache.
+  while (size > distance) {
+    memcpy(out, out - distance, distance);
+    out += distance;
+    size -= distance;
+    if (distance < kMaxCopyChunk) {
+      distance *= 2;
+    }
+  }
+  memcpy(out, out - distance, size);
+}
+
+inline void VCDiffDeltaFileWindow::CopyFromAddress(size_t address,
+                                                   size_t size) {
+  if ((address + size) <= source_segment_length_) {
+    // Copy all data from source segment
+    CopyBytes(&source_segment_ptr_[address], size);
+    return;
+  }
+  // Copy some data from target window...
+  if (address < source_segment_length_) {
+    // ... plus some data from source segment
+    const size_t partial_copy_size = source_segment_length_ - address;
+    CopyBytes(&source_segment_ptr_[address], partial_copy_size);
+    address += partial_copy_size;
+    size -= partial_copy_size;
+  }
+  address -= source_segment_length_;
+  // address is now based at start of target window
+  const size_t distance = target_bytes_decoded_ - address;
+  if (size > distance) {
+    // Recursive copy that extends into the yet-to-be-copied target data
+    CopyRepeatedPattern(distance, size);
+    return;
+  }
+  CopyBytes(&target_window_ptr_[address], size);
 }
 
 VCDiffResult VCDiffDeltaFileWindow::DecodeAdd(size_t size) {
@@ -1174,11 +1529,8 @@ VCDiffResult VCDiffDeltaFileWindow::DecodeRun(size_t size) {
 
 VCDiffResult VCDiffDeltaFileWindow::DecodeCopy(size_t size,
                                                unsigned char mode) {
-  // Keep track of the number of target bytes decoded as a local variable
-  // to avoid recalculating it each time it is needed.
-  size_t target_bytes_decoded = TargetBytesDecoded();
   const VCDAddress here_address =
-      static_cast<VCDAddress>(source_segment_length_ + target_bytes_decoded);
+      static_cast<VCDAddress>(source_segment_length_ + target_bytes_decoded_);
   const VCDAddress decoded_address = parent_->addr_cache()->DecodeAddress(
       here_address,
       mode,
@@ -1199,37 +1551,28 @@ VCDiffResult VCDiffDeltaFileWindow::DecodeCopy(size_t size,
       }
       break;
   }
-  size_t address = static_cast<size_t>(decoded_address);
-  if ((address + size) <= source_segment_length_) {
-    // Copy all data from source segment
-    CopyBytes(&source_segment_ptr_[address], size);
-    return RESULT_SUCCESS;
-  }
-  // Copy some data from target window...
-  if (address < source_segment_length_) {
-    // ... plus some data from source segment
-    const size_t partial_copy_size = source_segment_length_ - address;
-    CopyBytes(&source_segment_ptr_[address], partial_copy_size);
-    target_bytes_decoded += partial_copy_size;
-    address += partial_copy_size;
-    size -= partial_copy_size;
-  }
-  address -= source_segment_length_;
-  // address is now based at start of target window
-  const char* const target_segment_ptr = parent_->decoded_target()->data() +
-                                         target_window_start_pos_;
-  while (size > (target_bytes_decoded - address)) {
-    // Recursive copy that extends into the yet-to-be-copied target data
-    const size_t partial_copy_size = target_bytes_decoded - address;
-    CopyBytes(&target_segment_ptr[address], partial_copy_size);
-    target_bytes_decoded += partial_copy_size;
-    address += partial_copy_size;
-    size -= partial_copy_size;
-  }
-  CopyBytes(&target_segment_ptr[address], size);
+  CopyFromAddress(static_cast<size_t>(decoded_address), size);
   return RESULT_SUCCESS;
 }
 
+inline bool VCDiffDeltaFileWindow::InstructionFitsInWindow(
+    VCDiffInstructionType instruction,
+    size_t size) const {
+  // The value of "size" itself could be enormous (say, INT32_MAX),
+  // so compare it with the number of bytes remaining in the target window
+  // (which cannot underflow) rather than adding it to something else.
+  if (size > (target_window_length_ - target_bytes_decoded_)) {
+    VCD_ERROR << VCDiffInstructionName(instruction)
+              << " with size " << size
+              << " plus existing " << TargetBytesDecoded()
+              << " bytes of target data exceeds length of target"
+                 " window (" << target_window_length_ << " bytes)"
+              << VCD_ENDL;
+    return false;
+  }
+  return true;
+}
+
 int VCDiffDeltaFileWindow::DecodeBody(ParseableChunk* parseable_chunk) {
   if (IsInterleaved() && (instructions_and_sizes_.UnparsedData()
                               != parseable_chunk->UnparsedData())) {
@@ -1238,7 +1581,7 @@ int VCDiffDeltaFileWindow::DecodeBody(ParseableChunk* parseable_chunk) {
                << VCD_ENDL;
     return RESULT_ERROR;
   }
-  while (TargetBytesDecoded() < target_window_length_) {
+  while (target_bytes_decoded_ < target_window_length_) {
     int32_t decoded_size = VCD_INSTRUCTION_ERROR;
     unsigned char mode = 0;
     VCDiffInstructionType instruction =
@@ -1253,17 +1596,7 @@ int VCDiffDeltaFileWindow::DecodeBody(ParseableChunk* parseable_chunk) {
         break;
     }
     const size_t size = static_cast<size_t>(decoded_size);
-    // The value of "size" itself could be enormous (say, INT32_MAX)
-    // so check it individually against the limit to protect against
-    // overflow when adding it to something else.
-    if ((size > target_window_length_) ||
-        ((size + TargetBytesDecoded()) > target_window_length_)) {
-      VCD_ERROR << VCDiffInstructionName(instruction)
-                << " with size " << size
-                << " plus existing " << TargetBytesDecoded()
-                << " bytes of target data exceeds length of target"
-                   " window (" << target_window_length_ << " bytes)"
-                << VCD_ENDL;
+    if (!InstructionFitsInWindow(instruction, size)) {
       return RESULT_ERROR;
     }
     VCDiffResult result = RESULT_SUCCESS;
@@ -1293,16 +1626,139 @@ int VCDiffDeltaFileWindow::DecodeBody(ParseableChunk* parseable_chunk) {
         break;
     }
   }
+  return FinishBody(parseable_chunk);
+}
+
+inline VCDiffResult VCDiffDeltaFileWindow::DecodeWholeInstruction(
+    unsigned char instruction,
+    size_t size,
+    unsigned char mode) {
+  // If the interleaved format is used, the three sections share one position,
+  // so each position must be dereferenced again after another section has
+  // been read.
+  if (size == 0) {
+    // The size was not implicit in the opcode.  Most explicit sizes fit in a
+    // single varint byte, which can be read without calling the parser.
+    const char** const instructions =
+        instructions_and_sizes_.UnparsedDataAddr();
+    const char* const instructions_end = instructions_and_sizes_.End();
+    if ((*instructions < instructions_end) && ((**instructions & 0x80) == 0)) {
+      size = static_cast<unsigned char>(**instructions);
+      ++(*instructions);
+    } else {
+      const int32_t parsed_size =
+          VarintBE<int32_t>::Parse(instructions_end, instructions);
+      switch (parsed_size) {
+        case RESULT_ERROR:
+          VCD_ERROR << "Instruction size is not a valid variable-length "
+                       "integer" << VCD_ENDL;
+          return RESULT_ERROR;
+        case RESULT_END_OF_DATA:
+          return RESULT_END_OF_DATA;
+        default:
+          break;
+      }
+      size = static_cast<size_t>(parsed_size);
+    }
+  }
+  if (!InstructionFitsInWindow(
+          static_cast<VCDiffInstructionType>(instruction), size)) {
+    return RESULT_ERROR;
+  }
+  switch (instruction) {
+    case VCD_ADD: {
+      const char** const data = data_for_add_and_run_.UnparsedDataAddr();
+      if (size > static_cast<size_t>(data_for_add_and_run_.End() - *data)) {
+        return RESULT_END_OF_DATA;
+      }
+      CopyBytes(*data, size);
+      *data += size;
+      return RESULT_SUCCESS;
+    }
+    case VCD_RUN: {
+      const char** const data = data_for_add_and_run_.UnparsedDataAddr();
+      if (*data >= data_for_add_and_run_.End()) {
+        return RESULT_END_OF_DATA;
+      }
+      RunByte(**data, size);
+      ++(*data);
+      return RESULT_SUCCESS;
+    }
+    case VCD_COPY: {
+      // DecodeAddress() checks that the address is before the current
+      // position, which is all that CopyFromAddress() relies on.
+      const VCDAddress address = parent_->addr_cache()->DecodeAddress(
+          static_cast<VCDAddress>(source_segment_length_ +
+                                  target_bytes_decoded_),
+          mode,
+          addresses_for_copy_.UnparsedDataAddr(),
+          addresses_for_copy_.End());
+      if (address < 0) {
+        if (address == RESULT_ERROR) {
+          VCD_ERROR << "Unable to decode address for COPY" << VCD_ENDL;
+        }
+        return static_cast<VCDiffResult>(address);
+      }
+      CopyFromAddress(static_cast<size_t>(address), size);
+      return RESULT_SUCCESS;
+    }
+    default:
+      VCD_DFATAL << "Unexpected instruction type "
+                 << static_cast<int>(instruction) << "in opcode stream"
+                 << VCD_ENDL;
+      return RESULT_ERROR;
+  }
+}
+
+VCDiffResult VCDiffDeltaFileWindow::DecodeWholeBody(
+    ParseableChunk* parseable_chunk) {
+  // The bounds of all three sections were validated against the input data
+  // when the header was read, so the only checks left for each instruction
+  // are those that depend on the values decoded: its size against the rest
+  // of the target window, its data or address against the end of its
+  // section, and the address of a COPY against the current position.
+  const VCDiffCodeTableReader::OpcodeEntry* const opcode_table =
+      reader_.opcode_table();
+  const char** const instructions = instructions_and_sizes_.UnparsedDataAddr();
+  const char* const instructions_end = instructions_and_sizes_.End();
+  while (target_bytes_decoded_ < target_window_length_) {
+    if (*instructions >= instructions_end) {
+      return RESULT_END_OF_DATA;
+    }
+    const VCDiffCodeTableReader::OpcodeEntry& entry =
+        opcode_table[static_cast<unsigned char>(**instructions)];
+    ++(*instructions);
+    if (entry.inst1 != VCD_NOOP) {
+      const VCDiffResult result =
+          DecodeWholeInstruction(entry.inst1, entry.size1, entry.mode1);
+      if (result != RESULT_SUCCESS) {
+        return result;
+      }
+    }
+    // As in DecodeBody(), the second instruction of an opcode is not
+    // decoded if the first one completed the target window.
+    if ((entry.inst2 != VCD_NOOP) &&
+        (target_bytes_decoded_ < target_window_length_)) {
+      const VCDiffResult result =
+          DecodeWholeInstruction(entry.inst2, entry.size2, entry.mode2);
+      if (result != RESULT_SUCCESS) {
+        return result;
+      }
+    }
+  }
+  return FinishBody(parseable_chunk);
+}
+
+VCDiffResult VCDiffDeltaFileWindow::FinishBody(
+    ParseableChunk* parseable_chunk) {
   if (TargetBytesDecoded() != target_window_length_) {
     VCD_ERROR << "Decoded target window size (" << TargetBytesDecoded()
               << " bytes) does not match expected size ("
               << target_window_length_ << " bytes)" << VCD_ENDL;
     return RESULT_ERROR;
   }
-  const char* const target_window_start =
-      parent_->decoded_target()->data() + target_window_start_pos_;
   if (has_checksum_ &&
-      (ComputeAdler32(target_window_start, target_window_length_)
+      (ComputeAdler32(target_window_ptr_, target_window_length_)
            != expected_checksum_)) {
     VCD_ERROR << "Target data does not match checksum; this could mean "
                  "that the wrong dictionary was used" << VCD_ENDL;
@@ -1337,14 +1793,15 @@ int VCDiffDeltaFileWindow::DecodeBody(ParseableChunk* parseable_chunk) {
 }
 
 VCDiffResult VCDiffDeltaFileWindow::DecodeWindow(
-    ParseableChunk* parseable_chunk) {
+    ParseableChunk* parseable_chunk,
+    OutputStringInterface* output_string) {
   if (!parent_) {
     VCD_DFATAL << "Internal error: VCDiffDeltaFileWindow::DecodeWindow() "
                   "called before VCDiffDeltaFileWindow::Init()" << VCD_ENDL;
     return RESULT_ERROR;
   }
   if (!found_header_) {
-    switch (ReadHeader(parseable_chunk)) {
+    switch (ReadHeader(parseable_chunk, output_string)) {
       case RESULT_END_OF_DATA:
         return RESULT_END_OF_DATA;
       case RESULT_ERROR:
@@ -1370,9 +1827,11 @@ VCDiffResult VCDiffDeltaFileWindow::DecodeWindow(
     reader_.UpdatePointers(instructions_and_sizes_.UnparsedDataAddr(),
                            instructions_and_sizes_.End());
   }
-  switch (DecodeBody(parseable_chunk)) {
+  const int body_result = entire_window_available_ ?
+      DecodeWholeBody(parseable_chunk) : DecodeBody(parseable_chunk);
+  switch (body_result) {
     case RESULT_END_OF_DATA:
-      if (MoreDataExpected()) {
+      if (!entire_window_available_ && MoreDataExpected()) {
         return RESULT_END_OF_DATA;
       } else {
         VCD_ERROR << "End of data reached while decoding VCDIFF delta file"
@@ -1400,6 +1859,19 @@ void VCDiffStreamingDecoder::StartDecoding(const char* source, size_t len) {
   impl_->StartDecoding(source, len);
 }
 
+void VCDiffStreamingDecoder::StartDecodingToBuffer(const char* source,
+                                                   size_t len,
+                                                   char* buffer,
+                                                   size_t buffer_size) {
+  impl_->StartDecodingToBuffer(source, len, buffer, buffer_size);
+}
+
+bool VCDiffStreamingDecoder::DecodeChunkToBuffer(const char* data,
+                                                 size_t len,
+                                                 size_t* target_size) {
+  return impl_->DecodeChunkToBuffer(data, len, target_size);
+}
+
 bool VCDiffStreamingDecoder::DecodeChunkToInterface(
     const char* data,
     size_t len,
@@ -1425,6 +1897,10 @@ void VCDiffStreamingDecoder::SetAllowVcdTarget(bool allow_vcd_target) {
   impl_->SetAllowVcdTarget(allow_vcd_target);
 }
 
+bool VCDiffStreamingDecoder::SetTargetHistory(size_t history_size) {
+  return impl_->SetTargetHistory(history_size);
+}
+
 bool VCDiffDecoder::DecodeToInterface(const char* dictionary_ptr,
                                       size_t dictionary_size,
                                       const string& encoding,
@@ -1439,4 +1915,20 @@ bool VCDiffDecoder::DecodeToInterface(const char* dictionary_ptr,
   return decoder_.FinishDecoding();
 }
 
+bool VCDiffDecoder::DecodeToBuffer(const char* dictionary_ptr,
+                                   size_t dictionary_size,
+                                   const string& encoding,
+                                   char* buffer,
+                                   size_t buffer_size,
+                                   size_t* target_size) {
+  decoder_.StartDecodingToBuffer(dictionary_ptr, dictionary_size,
+                                 buffer, buffer_size);
+  if (!decoder_.DecodeChunkToBuffer(encoding.data(),
+                                    encoding.size(),
+                                    target_size)) {
+    return false;
+  }
+  return decoder_.FinishDecoding();
+}
+
 }  // namespace open_vcdiff
@@ -160,6 +160,20 @@ TEST_F(VCDiffInterleavedDecoderTest, FinishAfterDecodingPartialWindowHeader) {
   EXPECT_GE(expected_target_.size(), output_.size());
 }
 
+// Shorten the interleaved section (and the delta encoding) by one byte, so
+// that the last ADD instruction runs past the end of the section.  The whole
+// window is available, so the error should be reported immediately rather
+// than waiting for more data.
+TEST_F(VCDiffInterleavedDecoderTest, InstructionsEndEarly) {
+  --delta_file_[delta_file_header_.size() + 4];
+  --delta_file_[delta_file_header_.size() + 9];
+  decoder_.StartDecoding(dictionary_.data(), dictionary_.size());
+  EXPECT_FALSE(decoder_.DecodeChunk(delta_file_.data(),
+                                    delta_file_.size(),
+                                    &output_));
+  EXPECT_EQ("", output_);
+}
+
 TEST_F(VCDiffInterleavedDecoderTest, TargetMatchesWindowSizeLimit) {
   decoder_.SetMaximumTargetWindowSize(expected_target_.size());
   decoder_.StartDecoding(dictionary_.data(), dictionary_.size());
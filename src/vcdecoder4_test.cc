@@ -299,6 +299,70 @@ TEST_F(VCDiffStandardWindowDecoderTest, DecodeChunkNoVcdTargetAllowed) {
   EXPECT_EQ(expected_target_.substr(0, 89).c_str(), output_);
 }
 
+// An output string that counts the target windows that the decoder writes
+// directly into it.
+class RegionCountingOutputString : public OutputString<std::string> {
+ public:
+  explicit RegionCountingOutputString(std::string* impl)
+      : OutputString<std::string>(impl), regions_(0) { }
+
+  virtual char* GetWritableRegion(size_t n) {
+    ++regions_;
+    return OutputString<std::string>::GetWritableRegion(n);
+  }
+
+  int regions() const { return regions_; }
+
+ private:
+  int regions_;
+};
+
+// If earlier target windows need not be kept, then each complete window is
+// decoded directly into the output string.
+TEST_F(VCDiffStandardWindowDecoderTest, NoVcdTargetDecodesIntoOutputString) {
+  const size_t chunk_1_size = delta_file_header_.size() + 83;
+  RegionCountingOutputString output_string(&output_);
+  decoder_.SetAllowVcdTarget(false);
+  decoder_.StartDecoding(dictionary_.data(), dictionary_.size());
+  EXPECT_TRUE(decoder_.DecodeChunkToInterface(&delta_file_[0], chunk_1_size,
+                                              &output_string));
+  EXPECT_EQ(2, output_string.regions());
+  EXPECT_EQ(expected_target_.substr(0, 89).c_str(), output_);
+}
+
+TEST_F(VCDiffStandardWindowDecoderTest, VcdTargetDecodesIntoDecoderMemory) {
+  RegionCountingOutputString output_string(&output_);
+  decoder_.StartDecoding(dictionary_.data(), dictionary_.size());
+  EXPECT_TRUE(decoder_.DecodeChunkToInterface(delta_file_.data(),
+                                              delta_file_.size(),
+                                              &output_string));
+  EXPECT_TRUE(decoder_.FinishDecoding());
+  EXPECT_EQ(0, output_string.regions());
+  EXPECT_EQ(expected_target_.c_str(), output_);
+}
+
+// Windows 3 and 4 use the VCD_TARGET flag, and find their source segments in
+// the client's buffer.
+TEST_F(VCDiffStandardWindowDecoderTest, DecodeToBuffer) {
+  string buffer(expected_target_.size(), '\0');
+  size_t target_size = 0;
+  VCDiffDecoder decoder;
+  EXPECT_TRUE(decoder.DecodeToBuffer(dictionary_.data(), dictionary_.size(),
+                                     delta_file_, &buffer[0], buffer.size(),
+                                     &target_size));
+  EXPECT_EQ(expected_target_.size(), target_size);
+  EXPECT_EQ(expected_target_, buffer);
+}
+
+TEST_F(VCDiffStandardWindowDecoderTest, TargetDoesNotFitInBuffer) {
+  string buffer(expected_target_.size() - 1, '\0');
+  size_t target_size = 0;
+  VCDiffDecoder decoder;
+  EXPECT_FALSE(decoder.DecodeToBuffer(dictionary_.data(), dictionary_.size(),
+                                      delta_file_, &buffer[0], buffer.size(),
+                                      &target_size));
+}
+
 TEST_F(VCDiffStandardWindowDecoderTest, DecodeInTwoParts) {
   const size_t delta_file_size = delta_file_.size();
   for (size_t i = 1; i < delta_file_size; i++) {
@@ -587,6 +651,24 @@ TEST_F(VCDiffInterleavedWindowDecoderTestByteByByte, Decode) {
   EXPECT_EQ(expected_target_.c_str(), output_);
 }
 
+TEST_F(VCDiffInterleavedWindowDecoderTestByteByByte, DecodeToBuffer) {
+  string buffer(expected_target_.size(), '\0');
+  decoder_.StartDecodingToBuffer(dictionary_.data(), dictionary_.size(),
+                                 &buffer[0], buffer.size());
+  size_t target_size = 0;
+  for (size_t i = 0; i < delta_file_.size(); ++i) {
+    size_t previous_target_size = target_size;
+    EXPECT_TRUE(decoder_.DecodeChunkToBuffer(&delta_file_[i], 1,
+                                             &target_size));
+    EXPECT_LE(previous_target_size, target_size);
+    EXPECT_EQ(expected_target_.substr(0, target_size),
+              buffer.substr(0, target_size));
+  }
+  EXPECT_TRUE(decoder_.FinishDecoding());
+  EXPECT_EQ(expected_target_.size(), target_size);
+  EXPECT_EQ(expected_target_, buffer);
+}
+
 // Windows 3 and 4 use the VCD_TARGET flag, so decoder should signal an error.
 TEST_F(VCDiffInterleavedWindowDecoderTestByteByByte, DecodeNoVcdTarget) {
   decoder_.SetAllowVcdTarget(false);
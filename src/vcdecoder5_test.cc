@@ -14,9 +14,11 @@
 
 #include <config.h>
 #include "google/vcdecoder.h"
+#include <string.h>  // strlen
 #include <string>
 #include "codetable.h"
 #include "testing.h"
+#include "varint_bigendian.h"
 #include "vcdecoder_test.h"
 
 namespace open_vcdiff {
@@ -111,5 +113,82 @@ TEST_F(VCDiffLargeTargetTest, DecodeReachesMaxFileSize) {
                            sizeof(kLargeRunWindow), &output_));
 }
 
+// Decode windows that consist of an ADD instruction followed by a COPY
+// from the target window that overlaps the data it produces, so that the
+// last part of the added data is repeated as a pattern.
+class VCDiffOverlappingCopyTest : public VCDiffDecoderTest {
+ protected:
+  VCDiffOverlappingCopyTest() {
+    UseStandardFileHeader();
+  }
+
+  // Returns a delta window that adds kPrefix followed by the first
+  // pattern_size bytes of kDictionary, then copies copy_size bytes starting at
+  // the start of the pattern.
+  static string MakeWindow(int pattern_size, int copy_size) {
+    const string data = string(kPrefix) + string(kDictionary, pattern_size);
+    string instructions;
+    instructions.push_back(0x01);  // VCD_ADD size 0
+    VarintBE<int32_t>::AppendToString(static_cast<int32_t>(data.size()),
+                                      &instructions);
+    instructions.push_back(0x13);  // VCD_COPY mode VCD_SELF, size 0
+    VarintBE<int32_t>::AppendToString(copy_size, &instructions);
+    string addresses;
+    VarintBE<int32_t>::AppendToString(static_cast<int32_t>(strlen(kPrefix)),
+                                      &addresses);
+    string delta_encoding;
+    VarintBE<int32_t>::AppendToString(
+        static_cast<int32_t>(data.size()) + copy_size, &delta_encoding);
+    delta_encoding.push_back(0x00);  // Delta_indicator (no compression)
+    VarintBE<int32_t>::AppendToString(static_cast<int32_t>(data.size()),
+                                      &delta_encoding);
+    VarintBE<int32_t>::AppendToString(static_cast<int32_t>(instructions.size()),
+                                      &delta_encoding);
+    VarintBE<int32_t>::AppendToString(static_cast<int32_t>(addresses.size()),
+                                      &delta_encoding);
+    delta_encoding += data + instructions + addresses;
+    string window;
+    window.push_back(0x00);  // Win_Indicator: no source segment
+    VarintBE<int32_t>::AppendToString(
+        static_cast<int32_t>(delta_encoding.size()), &window);
+    return window + delta_encoding;
+  }
+
+  static string ExpectedTarget(int pattern_size, int copy_size) {
+    string expected = string(kPrefix) + string(kDictionary, pattern_size);
+    for (int i = 0; i < copy_size; ++i) {
+      expected.push_back(kDictionary[i % pattern_size]);
+    }
+    return expected;
+  }
+
+  // Added before the pattern, so that the pattern does not begin at the start
+  // of the target window.
+  static const char kPrefix[];
+};
+
+const char VCDiffOverlappingCopyTest::kPrefix[] = "xyz";
+
+TEST_F(VCDiffOverlappingCopyTest, RepeatsPattern) {
+  // The number of bytes copied beyond the end of the pattern.
+  const int kExtraSizes[] = { 1, 2, 15, 16, 17, 31, 32, 33, 100, 1000 };
+  for (int pattern_size = 1; pattern_size <= 40; ++pattern_size) {
+    for (size_t i = 0; i < sizeof(kExtraSizes) / sizeof(kExtraSizes[0]); ++i) {
+      const int copy_size = pattern_size + kExtraSizes[i];
+      const string window = MakeWindow(pattern_size, copy_size);
+      output_.clear();
+      decoder_.StartDecoding(dictionary_.data(), dictionary_.size());
+      EXPECT_TRUE(decoder_.DecodeChunk(delta_file_header_.data(),
+                                       delta_file_header_.size(),
+                                       &output_));
+      EXPECT_TRUE(decoder_.DecodeChunk(window.data(), window.size(),
+                                       &output_));
+      EXPECT_TRUE(decoder_.FinishDecoding());
+      EXPECT_EQ(ExpectedTarget(pattern_size, copy_size), output_)
+          << "pattern size " << pattern_size << ", copy size " << copy_size;
+    }
+  }
+}
+
 }  // unnamed namespace
 }  // namespace open_vcdiff
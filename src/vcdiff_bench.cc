@@ -0,0 +1,702 @@
+// Copyright 2026 The open-vcdiff Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A performance harness for the open-vcdiff encoder and decoder.
+//
+// vcdiff_bench generates a dictionary and a target from a seed (either a file
+// given by --seed_file, or pseudo-text generated from --seed), then encodes and
+// decodes the target with every combination of the swept parameters:
+// dictionary size, encoder mode, target similarity, chunk size, interleaved
+// format, checksum, target matching and target history size.  With
+// --append_only, the target continues the dictionary like the next segment of
+// a log file instead of being an edited copy of it.  For each combination it
+// reports the compression ratio, the encode and decode throughput, and
+// percentile latencies of the individual EncodeChunk() and DecodeChunk()
+// calls.  Every decoded target is compared with the original, so the harness
+// also serves as a smoke test.
+//
+// The corpora depend only on the seed and the flags, so results from different
+// builds can be compared directly.
+
+#include <config.h>
+#include <errno.h>
+#include <stdint.h>  // int64_t, uint32_t
+#include <stdio.h>  // printf, FILE
+#include <stdlib.h>  // strtod, strtoul
+#include <string.h>  // strerror
+#include <algorithm>  // std::sort
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>  // gettimeofday
+#endif  // HAVE_SYS_TIME_H
+#include <time.h>  // clock_gettime
+#ifdef HAVE_WINDOWS_H
+#include <windows.h>  // QueryPerformanceCounter
+#endif  // HAVE_WINDOWS_H
+#include "gflags/gflags.h"
+#include "google/vcdecoder.h"
+#include "google/vcencoder.h"
+
+#ifndef HAS_GLOBAL_STRING
+using std::string;
+#endif  // !HAS_GLOBAL_STRING
+using google::ShowUsageWithFlagsRestrict;
+
+// Definitions of command-line flags.  The list-valued flags take
+// comma-separated values; the benchmark runs every combination of them.
+DEFINE_string(seed_file, "",
+              "File whose contents are used as the dictionary.  If it is "
+              "shorter than a dictionary size, it is repeated.  If empty, "
+              "pseudo-text generated from --seed is used instead");
+DEFINE_uint64(seed, 1, "Seed for the corpus generator");
+DEFINE_string(dictionary_sizes, "16384,262144,1048576",
+              "Dictionary sizes in bytes");
+DEFINE_string(similarities, "0.99,0.9,0.5",
+              "Approximate fraction of the target that is copied from the "
+              "dictionary; the rest is edited");
+DEFINE_string(chunk_sizes, "4096,65536,1048576",
+              "Sizes of the pieces passed to EncodeChunk() and DecodeChunk()");
+DEFINE_string(interleaved_modes, "0,1",
+              "Values of the interleaved format flag");
+DEFINE_string(checksum_modes, "0,1", "Values of the checksum format flag");
+DEFINE_string(target_matching_modes, "0,1",
+              "Values of look_for_target_matches");
+DEFINE_string(target_history_sizes, "0",
+              "Values passed to VCDiffStreamingEncoder::SetTargetHistory()");
+DEFINE_string(lazy_match_lookaheads, "0",
+              "Values passed to HashedDictionary::SetLazyMatchLookahead()");
+DEFINE_string(optimal_parse_modes, "0",
+              "Values passed to HashedDictionary::SetOptimalParse()");
+DEFINE_string(cross_boundary_modes, "0",
+              "Values passed to HashedDictionary::SetCrossBoundaryMatching()");
+DEFINE_bool(append_only, false,
+            "Generate targets that consist of the whole dictionary followed by "
+            "new data, as when a log file grows, instead of edited copies of "
+            "the dictionary");
+DEFINE_bool(allow_vcd_target, true,
+            "Let the decoder keep earlier target data for VCD_TARGET windows; "
+            "false lets it decode each window straight into its output, but "
+            "fails with --target_history_sizes other than 0");
+DEFINE_bool(decode_to_buffer, false,
+            "Decode into a preallocated buffer with DecodeChunkToBuffer() "
+            "instead of appending to a string");
+DEFINE_uint64(target_size, 1 << 20, "Size of the target in bytes");
+DEFINE_int32(iterations, 5, "Number of times each combination is measured");
+DEFINE_bool(csv, false, "Print the results as comma-separated values");
+
+static const char* const kUsageString =
+    "[ <options> ]\n"
+    "Measures encoding and decoding speed over generated corpora";
+
+namespace open_vcdiff {
+
+namespace {
+
+// Returns a monotonic time stamp in nanoseconds.
+int64_t NowInNsec() {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (static_cast<int64_t>(now.tv_sec) * 1000000000) + now.tv_nsec;
+#elif defined(HAVE_GETTIMEOFDAY)
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (static_cast<int64_t>(now.tv_sec) * 1000000000)
+      + (static_cast<int64_t>(now.tv_usec) * 1000);
+#elif defined(HAVE_WINDOWS_H)
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER now;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&now);
+  return static_cast<int64_t>(static_cast<double>(now.QuadPart)
+                              * 1e9 / static_cast<double>(frequency.QuadPart));
+#else
+#error NowInNsec needs a monotonic clock for this platform
+#endif
+}
+
+// A small pseudo-random number generator (xorshift32).  rand() is not used
+// because its sequence differs between C libraries, and the corpora must be
+// the same wherever the benchmark is run.
+class BenchRandom {
+ public:
+  explicit BenchRandom(uint32_t seed) : state_(seed ? seed : 0x9E3779B9U) { }
+
+  uint32_t Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 17;
+    state_ ^= state_ << 5;
+    return state_;
+  }
+
+  // Returns a value between 0 and limit - 1.
+  size_t Uniform(size_t limit) {
+    return limit ? (Next() % limit) : 0;
+  }
+
+ private:
+  uint32_t state_;
+};
+
+// Generates text-like data: words drawn from a vocabulary with a skewed
+// distribution, separated by spaces and occasional markup.
+void GeneratePseudoText(BenchRandom* random, size_t size, string* text) {
+  static const size_t kVocabularySize = 2048;
+  std::vector<string> vocabulary(kVocabularySize);
+  for (size_t i = 0; i < kVocabularySize; ++i) {
+    const size_t length = 2 + random->Uniform(9);
+    for (size_t j = 0; j < length; ++j) {
+      vocabulary[i].push_back(static_cast<char>('a' + random->Uniform(26)));
+    }
+  }
+  text->clear();
+  text->reserve(size);
+  while (text->size() < size) {
+    // Multiplying two uniform values favors the lower indices.
+    const size_t word = (random->Uniform(kVocabularySize)
+                         * random->Uniform(kVocabularySize)) / kVocabularySize;
+    text->append(vocabulary[word]);
+    switch (random->Uniform(16)) {
+      case 0: text->append(".</p>\n<p>"); break;
+      case 1: text->append(", "); break;
+      default: text->push_back(' '); break;
+    }
+  }
+  text->resize(size);
+}
+
+// Builds a dictionary of the given size from the seed data.
+void MakeDictionary(const string& seed_data, size_t size, string* dictionary) {
+  dictionary->clear();
+  dictionary->reserve(size);
+  while (dictionary->size() < size) {
+    dictionary->append(seed_data, 0, size - dictionary->size());
+  }
+}
+
+// Builds a target by walking through the dictionary and copying runs of it,
+// interrupted by edits.  Each edit inserts random bytes and then either
+// replaces the same number of dictionary bytes, leaves the dictionary position
+// unchanged, or moves to a random position in the dictionary.  The run lengths
+// are chosen so that about (similarity * target_size) bytes of the target are
+// copied from the dictionary.
+void MakeTarget(const string& dictionary,
+                double similarity,
+                size_t target_size,
+                BenchRandom* random,
+                string* target) {
+  static const size_t kMeanEditSize = 64;
+  target->clear();
+  target->reserve(target_size);
+  const size_t mean_run_size = (similarity >= 1.0) ? target_size :
+      static_cast<size_t>(kMeanEditSize * similarity / (1.0 - similarity));
+  size_t position = 0;
+  while (target->size() < target_size) {
+    size_t run_size = mean_run_size ? 1 + random->Uniform(2 * mean_run_size)
+                                    : 0;
+    while ((run_size > 0) && (target->size() < target_size)) {
+      if (position >= dictionary.size()) {
+        position = 0;
+      }
+      const size_t piece_size = std::min(std::min(run_size,
+                                                  dictionary.size() - position),
+                                         target_size - target->size());
+      target->append(dictionary, position, piece_size);
+      position += piece_size;
+      run_size -= piece_size;
+    }
+    const size_t edit_size = 1 + random->Uniform(2 * kMeanEditSize);
+    for (size_t i = 0; (i < edit_size) && (target->size() < target_size); ++i) {
+      target->push_back(static_cast<char>(random->Next() >> 24));
+    }
+    switch (random->Uniform(3)) {
+      case 0: position += edit_size; break;
+      case 1: break;
+      default: position = random->Uniform(dictionary.size()); break;
+    }
+  }
+}
+
+// Builds a target that continues the dictionary, like the next segment of a
+// log file whose previous segment is the dictionary.  The target is a
+// sequence of records (lines of about 100 bytes).  With probability
+// similarity, the next few records repeat a few consecutive records that
+// appeared shortly before, possibly in the dictionary; otherwise the next
+// record is random.  Repeated records that straddle the end of the dictionary
+// can be encoded as single COPY instructions only with cross-boundary
+// matching.
+void MakeAppendOnlyTarget(const string& dictionary,
+                          double similarity,
+                          size_t target_size,
+                          BenchRandom* random,
+                          string* target) {
+  static const size_t kRecordSize = 100;
+  static const size_t kRecentRecords = 16;
+  static const size_t kMaxRepeatedRecords = 8;
+  string log(dictionary);
+  const size_t log_size = dictionary.size() + target_size;
+  log.reserve(log_size);
+  while (log.size() < log_size) {
+    const size_t recent = std::min(log.size() / kRecordSize, kRecentRecords);
+    if ((recent > 0) &&
+        (random->Uniform(1000) < static_cast<size_t>(similarity * 1000))) {
+      const size_t offset =
+          log.size() - (1 + random->Uniform(recent)) * kRecordSize;
+      const size_t size = std::min(
+          std::min((1 + random->Uniform(kMaxRepeatedRecords)) * kRecordSize,
+                   log.size() - offset),
+          log_size - log.size());
+      log.append(string(log, offset, size));
+    } else {
+      const size_t record_size = std::min(kRecordSize, log_size - log.size());
+      for (size_t i = 0; i + 1 < record_size; ++i) {
+        log.push_back(static_cast<char>(' ' + random->Uniform(95)));
+      }
+      log.push_back('\n');
+    }
+  }
+  target->assign(log, dictionary.size(), target_size);
+}
+
+// Parses a comma-separated list of numbers.  Returns false if the list is
+// empty or contains something that is not a number.
+bool ParseList(const string& flag_name,
+               const string& list,
+               std::vector<double>* values) {
+  values->clear();
+  const char* p = list.c_str();
+  while (*p) {
+    char* end = NULL;
+    const double value = strtod(p, &end);
+    if ((end == p) || ((*end != ',') && (*end != '\0'))) {
+      std::cerr << "Invalid value in --" << flag_name << ": " << list
+                << std::endl;
+      return false;
+    }
+    values->push_back(value);
+    p = (*end == ',') ? end + 1 : end;
+  }
+  if (values->empty()) {
+    std::cerr << "--" << flag_name << " must not be empty" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool ReadSeedFile(const string& file_name, string* contents) {
+  FILE* file = fopen(file_name.c_str(), "rb");
+  if (!file) {
+    std::cerr << "Error opening seed file '" << file_name << "': "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  char buffer[1 << 16];
+  size_t bytes_read;
+  contents->clear();
+  while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    contents->append(buffer, bytes_read);
+  }
+  const bool read_error = (ferror(file) != 0);
+  fclose(file);
+  if (read_error || contents->empty()) {
+    std::cerr << "Error reading seed file '" << file_name << "'" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Latencies of individual calls, in nanoseconds.
+class LatencyRecorder {
+ public:
+  LatencyRecorder() : total_(0) { }
+
+  void Add(int64_t nsec) {
+    samples_.push_back(nsec);
+    total_ += nsec;
+  }
+
+  int64_t total() const { return total_; }
+
+  // Returns the nearest-rank percentile of the recorded latencies, in
+  // microseconds.  Sorts the samples, so it should be called only after all
+  // samples have been added.
+  double PercentileInUsec(int percentile) {
+    if (samples_.empty()) {
+      return 0.0;
+    }
+    std::sort(samples_.begin(), samples_.end());
+    size_t rank = (samples_.size() * percentile + 99) / 100;
+    if (rank > 0) {
+      --rank;
+    }
+    return samples_[rank] / 1000.0;
+  }
+
+ private:
+  std::vector<int64_t> samples_;
+  int64_t total_;
+};
+
+// Megabytes per second for the given number of bytes and nanoseconds.
+double Throughput(size_t bytes, int64_t nsec) {
+  return nsec ? (bytes * 1000.0) / nsec : 0.0;
+}
+
+struct BenchConfig {
+  size_t dictionary_size;
+  int lazy_match_lookahead;
+  bool optimal_parse;
+  bool cross_boundary;
+  double similarity;
+  size_t chunk_size;
+  bool interleaved;
+  bool checksum;
+  bool target_matching;
+  size_t target_history;
+};
+
+// Encodes and decodes the target FLAGS_iterations times with the given
+// configuration and prints one line of results.  Returns false if the encoder
+// or decoder fails, or if the decoded target differs from the original.
+bool RunBenchmark(const BenchConfig& config,
+                  const HashedDictionary& hashed_dictionary,
+                  const string& dictionary,
+                  const string& target,
+                  double index_msec) {
+  VCDiffFormatExtensionFlags format_flags = VCD_STANDARD_FORMAT;
+  if (config.interleaved) {
+    format_flags |= VCD_FORMAT_INTERLEAVED;
+  }
+  if (config.checksum) {
+    format_flags |= VCD_FORMAT_CHECKSUM;
+  }
+  LatencyRecorder encode_latencies;
+  LatencyRecorder decode_latencies;
+  size_t delta_size = 0;
+  string delta;
+  string decoded_target;
+  for (int iteration = 0; iteration < FLAGS_iterations; ++iteration) {
+    VCDiffStreamingEncoder encoder(&hashed_dictionary,
+                                   format_flags,
+                                   config.target_matching);
+    if (!encoder.SetTargetHistory(config.target_history)) {
+      std::cerr << "SetTargetHistory failed" << std::endl;
+      return false;
+    }
+    delta.clear();
+    int64_t start = NowInNsec();
+    if (!encoder.StartEncoding(&delta)) {
+      std::cerr << "StartEncoding failed" << std::endl;
+      return false;
+    }
+    encode_latencies.Add(NowInNsec() - start);
+    for (size_t offset = 0; offset < target.size();
+         offset += config.chunk_size) {
+      const size_t size = std::min(config.chunk_size, target.size() - offset);
+      start = NowInNsec();
+      if (!encoder.EncodeChunk(target.data() + offset, size, &delta)) {
+        std::cerr << "EncodeChunk failed" << std::endl;
+        return false;
+      }
+      encode_latencies.Add(NowInNsec() - start);
+    }
+    start = NowInNsec();
+    if (!encoder.FinishEncoding(&delta)) {
+      std::cerr << "FinishEncoding failed" << std::endl;
+      return false;
+    }
+    encode_latencies.Add(NowInNsec() - start);
+    delta_size = delta.size();
+
+    VCDiffStreamingDecoder decoder;
+    decoder.SetMaximumTargetFileSize(target.size());
+    decoder.SetMaximumTargetWindowSize(target.size());
+    decoder.SetAllowVcdTarget(FLAGS_allow_vcd_target);
+    decoded_target.clear();
+    size_t buffered_target_size = 0;
+    if (FLAGS_decode_to_buffer) {
+      decoded_target.resize(target.size());
+      decoder.StartDecodingToBuffer(dictionary.data(), dictionary.size(),
+                                    &decoded_target[0], decoded_target.size());
+    } else {
+      decoder.StartDecoding(dictionary.data(), dictionary.size());
+    }
+    for (size_t offset = 0; offset < delta.size();
+         offset += config.chunk_size) {
+      const size_t size = std::min(config.chunk_size, delta.size() - offset);
+      start = NowInNsec();
+      const bool decoded = FLAGS_decode_to_buffer ?
+          decoder.DecodeChunkToBuffer(delta.data() + offset, size,
+                                      &buffered_target_size) :
+          decoder.DecodeChunk(delta.data() + offset, size, &decoded_target);
+      if (!decoded) {
+        std::cerr << "DecodeChunk failed" << std::endl;
+        return false;
+      }
+      decode_latencies.Add(NowInNsec() - start);
+    }
+    if (FLAGS_decode_to_buffer) {
+      decoded_target.resize(buffered_target_size);
+    }
+    if (!decoder.FinishDecoding()) {
+      std::cerr << "FinishDecoding failed" << std::endl;
+      return false;
+    }
+    if (decoded_target != target) {
+      std::cerr << "Decoded target does not match original target"
+                << std::endl;
+      return false;
+    }
+  }
+  const size_t total_bytes = target.size() * FLAGS_iterations;
+  const char* const format = FLAGS_csv ?
+      "%lu,%d,%d,%d,%.2f,%lu,%d,%d,%d,%lu,%.2f,%.4f,"
+      "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n" :
+      "%9lu %4d %3d %3d %5.2f %8lu %3d %3d %3d %8lu %9.2f %7.4f %8.1f %8.1f "
+      "%9.1f %9.1f %8.1f %8.1f %9.1f %9.1f\n";
+  printf(format,
+         static_cast<unsigned long>(config.dictionary_size),  // NOLINT
+         config.lazy_match_lookahead,
+         config.optimal_parse ? 1 : 0,
+         config.cross_boundary ? 1 : 0,
+         config.similarity,
+         static_cast<unsigned long>(config.chunk_size),  // NOLINT
+         config.interleaved ? 1 : 0,
+         config.checksum ? 1 : 0,
+         config.target_matching ? 1 : 0,
+         static_cast<unsigned long>(config.target_history),  // NOLINT
+         index_msec,
+         target.empty() ? 0.0 : static_cast<double>(delta_size) / target.size(),
+         Throughput(total_bytes, encode_latencies.total()),
+         Throughput(total_bytes, decode_latencies.total()),
+         encode_latencies.PercentileInUsec(50),
+         encode_latencies.PercentileInUsec(99),
+         decode_latencies.PercentileInUsec(50),
+         decode_latencies.PercentileInUsec(99),
+         encode_latencies.PercentileInUsec(100),
+         decode_latencies.PercentileInUsec(100));
+  fflush(stdout);
+  return true;
+}
+
+void PrintHeader() {
+  if (FLAGS_csv) {
+    printf("dictionary_size,lazy_match_lookahead,optimal_parse,cross_boundary,"
+           "similarity,chunk_size,interleaved,checksum,"
+           "target_matching,target_history,index_ms,ratio,"
+           "encode_mb_per_s,decode_mb_per_s,"
+           "encode_p50_us,encode_p99_us,decode_p50_us,decode_p99_us,"
+           "encode_max_us,decode_max_us\n");
+  } else {
+    printf("%9s %4s %3s %3s %5s %8s %3s %3s %3s %8s %9s %7s %8s %8s "
+           "%9s %9s %8s %8s %9s %9s\n",
+           "dict", "lazy", "opt", "xb", "sim", "chunk", "int", "sum", "tgt",
+           "hist", "index_ms", "ratio",
+           "enc_MB/s", "dec_MB/s", "enc_p50us", "enc_p99us",
+           "dec_p50us", "dec_p99us", "enc_maxus", "dec_maxus");
+  }
+}
+
+// The values of the list-valued flags.
+struct BenchSweep {
+  std::vector<double> dictionary_sizes;
+  std::vector<double> lazy_match_lookaheads;
+  std::vector<double> optimal_parse_modes;
+  std::vector<double> cross_boundary_modes;
+  std::vector<double> similarities;
+  std::vector<double> chunk_sizes;
+  std::vector<double> interleaved_modes;
+  std::vector<double> checksum_modes;
+  std::vector<double> target_matching_modes;
+  std::vector<double> target_history_sizes;
+};
+
+// Parses and checks the list-valued flags.  Returns false if any of them is
+// invalid.
+bool ParseSweep(BenchSweep* sweep) {
+  if (!ParseList("dictionary_sizes", FLAGS_dictionary_sizes,
+                 &sweep->dictionary_sizes) ||
+      !ParseList("lazy_match_lookaheads", FLAGS_lazy_match_lookaheads,
+                 &sweep->lazy_match_lookaheads) ||
+      !ParseList("optimal_parse_modes", FLAGS_optimal_parse_modes,
+                 &sweep->optimal_parse_modes) ||
+      !ParseList("cross_boundary_modes", FLAGS_cross_boundary_modes,
+                 &sweep->cross_boundary_modes) ||
+      !ParseList("similarities", FLAGS_similarities, &sweep->similarities) ||
+      !ParseList("chunk_sizes", FLAGS_chunk_sizes, &sweep->chunk_sizes) ||
+      !ParseList("interleaved_modes", FLAGS_interleaved_modes,
+                 &sweep->interleaved_modes) ||
+      !ParseList("checksum_modes", FLAGS_checksum_modes,
+                 &sweep->checksum_modes) ||
+      !ParseList("target_matching_modes", FLAGS_target_matching_modes,
+                 &sweep->target_matching_modes) ||
+      !ParseList("target_history_sizes", FLAGS_target_history_sizes,
+                 &sweep->target_history_sizes)) {
+    return false;
+  }
+  for (size_t i = 0; i < sweep->similarities.size(); ++i) {
+    if ((sweep->similarities[i] < 0.0) || (sweep->similarities[i] > 1.0)) {
+      std::cerr << "--similarities must be between 0 and 1" << std::endl;
+      return false;
+    }
+  }
+  for (size_t i = 0; i < sweep->dictionary_sizes.size(); ++i) {
+    if (sweep->dictionary_sizes[i] < 1) {
+      std::cerr << "--dictionary_sizes must be positive" << std::endl;
+      return false;
+    }
+  }
+  for (size_t i = 0; i < sweep->chunk_sizes.size(); ++i) {
+    if (sweep->chunk_sizes[i] < 1) {
+      std::cerr << "--chunk_sizes must be positive" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs every combination of the swept parameters that do not affect the
+// HashedDictionary.  The dictionary_size, lazy_match_lookahead,
+// optimal_parse and cross_boundary fields of *config must already be set;
+// dictionary_index is used to seed the target generator.
+bool RunBenchmarksForDictionary(const BenchSweep& sweep,
+                                const HashedDictionary& hashed_dictionary,
+                                const string& dictionary,
+                                size_t dictionary_index,
+                                double index_msec,
+                                BenchConfig* config) {
+  string target;
+  for (size_t s = 0; s < sweep.similarities.size(); ++s) {
+    config->similarity = sweep.similarities[s];
+    // Each target depends only on the seed, the dictionary and the
+    // similarity, not on the order in which the combinations are run.
+    BenchRandom target_random(static_cast<uint32_t>(FLAGS_seed)
+                              + static_cast<uint32_t>(dictionary_index * 1000
+                                                      + s + 1));
+    if (FLAGS_append_only) {
+      MakeAppendOnlyTarget(dictionary, config->similarity,
+                           static_cast<size_t>(FLAGS_target_size),
+                           &target_random, &target);
+    } else {
+      MakeTarget(dictionary, config->similarity,
+                 static_cast<size_t>(FLAGS_target_size), &target_random,
+                 &target);
+    }
+    for (size_t c = 0; c < sweep.chunk_sizes.size(); ++c) {
+      config->chunk_size = static_cast<size_t>(sweep.chunk_sizes[c]);
+      for (size_t i = 0; i < sweep.interleaved_modes.size(); ++i) {
+        config->interleaved = (sweep.interleaved_modes[i] != 0);
+        for (size_t k = 0; k < sweep.checksum_modes.size(); ++k) {
+          config->checksum = (sweep.checksum_modes[k] != 0);
+          for (size_t t = 0; t < sweep.target_matching_modes.size(); ++t) {
+            config->target_matching = (sweep.target_matching_modes[t] != 0);
+            for (size_t h = 0; h < sweep.target_history_sizes.size(); ++h) {
+              config->target_history =
+                  static_cast<size_t>(sweep.target_history_sizes[h]);
+              if (!RunBenchmark(*config, hashed_dictionary, dictionary,
+                                target, index_msec)) {
+                return false;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+}  // anonymous namespace
+
+// Runs every combination of the swept parameters.  Returns 0 if all of them
+// succeed.
+int RunAllBenchmarks() {
+  BenchSweep sweep;
+  if (!ParseSweep(&sweep)) {
+    return 1;
+  }
+  if (FLAGS_iterations <= 0) {
+    std::cerr << "--iterations must be positive" << std::endl;
+    return 1;
+  }
+  BenchRandom random(static_cast<uint32_t>(FLAGS_seed));
+  string seed_data;
+  if (!FLAGS_seed_file.empty()) {
+    if (!ReadSeedFile(FLAGS_seed_file, &seed_data)) {
+      return 1;
+    }
+  } else {
+    double largest_dictionary_size = 1;
+    for (size_t i = 0; i < sweep.dictionary_sizes.size(); ++i) {
+      largest_dictionary_size = std::max(largest_dictionary_size,
+                                         sweep.dictionary_sizes[i]);
+    }
+    GeneratePseudoText(&random,
+                       static_cast<size_t>(largest_dictionary_size),
+                       &seed_data);
+  }
+  PrintHeader();
+  string dictionary;
+  for (size_t d = 0; d < sweep.dictionary_sizes.size(); ++d) {
+    BenchConfig config;
+    config.dictionary_size = static_cast<size_t>(sweep.dictionary_sizes[d]);
+    MakeDictionary(seed_data, config.dictionary_size, &dictionary);
+    for (size_t l = 0; l < sweep.lazy_match_lookaheads.size(); ++l) {
+      config.lazy_match_lookahead =
+          static_cast<int>(sweep.lazy_match_lookaheads[l]);
+      for (size_t o = 0; o < sweep.optimal_parse_modes.size(); ++o) {
+        config.optimal_parse = (sweep.optimal_parse_modes[o] != 0);
+        for (size_t x = 0; x < sweep.cross_boundary_modes.size(); ++x) {
+          config.cross_boundary = (sweep.cross_boundary_modes[x] != 0);
+          const int64_t index_start = NowInNsec();
+          HashedDictionary hashed_dictionary(dictionary.data(),
+                                             dictionary.size());
+          if (!hashed_dictionary.SetLazyMatchLookahead(
+                  config.lazy_match_lookahead) ||
+              !hashed_dictionary.SetOptimalParse(config.optimal_parse) ||
+              !hashed_dictionary.SetCrossBoundaryMatching(
+                  config.cross_boundary) ||
+              !hashed_dictionary.Init()) {
+            std::cerr << "Error initializing HashedDictionary" << std::endl;
+            return 1;
+          }
+          const double index_msec = (NowInNsec() - index_start) / 1e6;
+          if (!RunBenchmarksForDictionary(sweep, hashed_dictionary, dictionary,
+                                          d, index_msec, &config)) {
+            return 1;
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+}  // namespace open_vcdiff
+
+int main(int argc, char** argv) {
+  const char* const command_name = argv[0];
+  google::SetUsageMessage(kUsageString);
+  google::SetVersionString(OPEN_VCDIFF_VERSION);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 1) {
+    std::cerr << command_name << ": Unexpected argument " << argv[1]
+              << std::endl;
+    ShowUsageWithFlagsRestrict(command_name, "vcdiff_bench");
+    return 1;
+  }
+  return open_vcdiff::RunAllBenchmarks();
+}
@@ -23,6 +23,11 @@
 #endif  // WIN32
 #include <stdio.h>
 #include <string.h>  // strerror
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H)
+#include <sys/mman.h>  // mmap, munmap
+#include <unistd.h>  // fileno
+#define VCDIFF_USE_MMAP_FOR_DICTIONARY 1
+#endif  // HAVE_SYS_MMAN_H && HAVE_UNISTD_H
 #include <iostream>
 #include <string>
 #include <vector>
@@ -106,9 +111,10 @@ class VCDiffFileBasedCoder {
                           FILE** file,
                           std::vector<char>* buffer);
 
-  // Opens the dictionary file and reads it into a newly allocated buffer.
-  // If successful, returns true and populates dictionary_ with the dictionary
-  // contents; otherwise, returns false.
+  // Opens the dictionary file and maps it into memory, or, if memory mapping
+  // is not available, reads it into a newly allocated buffer.  If successful,
+  // returns true and sets dictionary_data_ and dictionary_size_ to refer to
+  // the dictionary contents; otherwise, returns false.
   bool OpenDictionary();
 
   // Opens the input file (the delta or target file) for reading.
@@ -151,9 +157,20 @@ class VCDiffFileBasedCoder {
   // otherwise, returns true.
   bool CompareOutput(const string& output);
 
-  // Dictionary contents.  The entire dictionary file will be read into memory.
-  std::vector<char> dictionary_;
+  // Dictionary contents.  These point either to the memory-mapped dictionary
+  // file (if mapped_dictionary_ is true) or to the contents of
+  // dictionary_buffer_.  dictionary_data_ is never NULL, even for an empty
+  // dictionary.
+  const char* dictionary_data_;
+  size_t dictionary_size_;
+  bool mapped_dictionary_;
 
+  // Used to hold the dictionary contents if the dictionary file
+  // cannot be mapped into memory.
+  std::vector<char> dictionary_buffer_;
+
+  // Borrows the dictionary contents rather than copying them, so it must
+  // be deleted before the dictionary is unmapped.
   UNIQUE_PTR<open_vcdiff::HashedDictionary> hashed_dictionary_;
 
   // These should be set to either "delta" or "target".  They are only
@@ -191,12 +208,23 @@ class VCDiffFileBasedCoder {
 };
 
 inline VCDiffFileBasedCoder::VCDiffFileBasedCoder()
-    : input_file_type_(""),
+    : dictionary_data_(""),
+      dictionary_size_(0),
+      mapped_dictionary_(false),
+      input_file_type_(""),
       output_file_type_(""),
       input_file_(NULL),
       output_file_(NULL) { }
 
 VCDiffFileBasedCoder::~VCDiffFileBasedCoder() {
+  // hashed_dictionary_ refers to the dictionary contents.
+  hashed_dictionary_.reset();
+#ifdef VCDIFF_USE_MMAP_FOR_DICTIONARY
+  if (mapped_dictionary_) {
+    munmap(const_cast<char*>(dictionary_data_), dictionary_size_);
+    mapped_dictionary_ = false;
+  }
+#endif  // VCDIFF_USE_MMAP_FOR_DICTIONARY
   if (input_file_ && (input_file_ != stdin)) {
     fclose(input_file_);
     input_file_ = NULL;
@@ -220,7 +248,7 @@ bool VCDiffFileBasedCoder::FileSize(FILE* file, size_t* file_size) {
 }
 
 bool VCDiffFileBasedCoder::OpenDictionary() {
-  assert(dictionary_.empty());
+  assert(dictionary_size_ == 0);
   assert(!FLAGS_dictionary.empty());
   FILE* dictionary_file = fopen(FLAGS_dictionary.c_str(), "rb");
   if (!dictionary_file) {
@@ -232,20 +260,44 @@ bool VCDiffFileBasedCoder::OpenDictionary() {
   if (!FileSize(dictionary_file, &dictionary_size)) {
     std::cerr << "Error finding size of dictionary file '" << FLAGS_dictionary
               << "': " << strerror(errno) << std::endl;
+    fclose(dictionary_file);
     return false;
   }
-  dictionary_.resize(dictionary_size);
-  if (dictionary_size > 0) {
-    if (fread(&dictionary_[0], 1, dictionary_size, dictionary_file)
-            != dictionary_size) {
-      std::cerr << "Unable to read dictionary file '" << FLAGS_dictionary
-                << "': " << strerror(errno) << std::endl;
-      fclose(dictionary_file);
-      dictionary_.clear();
-      return false;
-    }
+  if (dictionary_size == 0) {
+    fclose(dictionary_file);
+    return true;
+  }
+#ifdef VCDIFF_USE_MMAP_FOR_DICTIONARY
+  // Map the dictionary file read-only, so that its pages can be shared
+  // with other processes and need not be copied.  The mapping remains valid
+  // after the file is closed.  If mmap fails (for example, because the
+  // dictionary is a pipe), fall back to reading the file into memory.
+  void* mapped_data = mmap(NULL,
+                           dictionary_size,
+                           PROT_READ,
+                           MAP_SHARED,
+                           fileno(dictionary_file),
+                           0);
+  if (mapped_data != MAP_FAILED) {
+    fclose(dictionary_file);
+    dictionary_data_ = static_cast<const char*>(mapped_data);
+    dictionary_size_ = dictionary_size;
+    mapped_dictionary_ = true;
+    return true;
+  }
+#endif  // VCDIFF_USE_MMAP_FOR_DICTIONARY
+  dictionary_buffer_.resize(dictionary_size);
+  if (fread(&dictionary_buffer_[0], 1, dictionary_size, dictionary_file)
+          != dictionary_size) {
+    std::cerr << "Unable to read dictionary file '" << FLAGS_dictionary
+              << "': " << strerror(errno) << std::endl;
+    fclose(dictionary_file);
+    dictionary_buffer_.clear();
+    return false;
   }
   fclose(dictionary_file);
+  dictionary_data_ = &dictionary_buffer_[0];
+  dictionary_size_ = dictionary_size;
   return true;
 }
 
@@ -375,15 +427,10 @@ bool VCDiffFileBasedCoder::Encode() {
   if (!OpenDictionary() || !OpenInputFile() || !OpenOutputFile()) {
     return false;
   }
-  // Issue 6: Visual Studio STL produces a runtime exception
-  // if &dictionary_[0] is attempted for an empty dictionary.
-  if (dictionary_.empty()) {
-    hashed_dictionary_.reset(new open_vcdiff::HashedDictionary("", 0));
-  } else {
-    hashed_dictionary_.reset(
-        new open_vcdiff::HashedDictionary(&dictionary_[0],
-                                          dictionary_.size()));
-  }
+  hashed_dictionary_.reset(
+      new open_vcdiff::HashedDictionary(dictionary_data_,
+                                        dictionary_size_,
+                                        /* copy_dictionary = */ false));
   if (!hashed_dictionary_->Init()) {
     std::cerr << "Error initializing hashed dictionary" << std::endl;
     return false;
@@ -465,13 +512,7 @@ bool VCDiffFileBasedCoder::Decode() {
   string output;
   size_t input_size = 0;
   size_t output_size = 0;
-  // Issue 6: Visual Studio STL produces a runtime exception
-  // if &dictionary_[0] is attempted for an empty dictionary.
-  if (dictionary_.empty()) {
-    decoder.StartDecoding("", 0);
-  } else {
-    decoder.StartDecoding(&dictionary_[0], dictionary_.size());
-  }
+  decoder.StartDecoding(dictionary_data_, dictionary_size_);
 
   do {
     size_t bytes_read = 0;
@@ -529,13 +570,7 @@ bool VCDiffFileBasedCoder::DecodeAndCompare() {
   string output;
   size_t input_size = 0;
   size_t output_size = 0;
-  // Issue 6: Visual Studio STL produces a runtime exception
-  // if &dictionary_[0] is attempted for an empty dictionary.
-  if (dictionary_.empty()) {
-    decoder.StartDecoding("", 0);
-  } else {
-    decoder.StartDecoding(&dictionary_[0], dictionary_.size());
-  }
+  decoder.StartDecoding(dictionary_data_, dictionary_size_);
 
   do {
     size_t bytes_read = 0;
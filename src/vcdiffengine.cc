@@ -14,83 +14,436 @@
 
 #include <config.h>
 #include "vcdiffengine.h"
+#include <limits.h>  // UCHAR_MAX
 #include <stdint.h>  // uint32_t
-#include <string.h>  // memcpy
+#include <string.h>  // memcmp, memcpy, memset
+#include <algorithm>  // std::lower_bound
+#include <vector>
+#include "addrcache.h"
 #include "blockhash.h"
+#include "codetable.h"
+#include "compile_assert.h"
 #include "google/codetablewriter_interface.h"
+#include "google/output_string.h"
+#include "instruction_map.h"
 #include "logging.h"
 #include "rolling_hash.h"
+#include "varint_bigendian.h"
 
 namespace open_vcdiff {
 
-VCDiffEngine::VCDiffEngine(const char* dictionary, size_t dictionary_size)
+VCDiffEngine::VCDiffEngine(const char* dictionary,
+                           size_t dictionary_size,
+                           bool copy_dictionary)
     // If dictionary_size == 0, then dictionary could be NULL.  Guard against
     // using a NULL value.
-    : dictionary_((dictionary_size > 0) ? new char[dictionary_size] : ""),
+    : dictionary_((dictionary_size == 0) ? "" :
+                      (copy_dictionary ? new char[dictionary_size]
+                                       : dictionary)),
       dictionary_size_(dictionary_size),
-      hashed_dictionary_(NULL) {
-  if (dictionary_size > 0) {
+      owns_dictionary_(copy_dictionary && (dictionary_size > 0)),
+      hashed_dictionary_(NULL),
+      bucketized_index_(false),
+      block_size_(BlockHash::kBlockSize),
+      minimum_match_size_(kMinimumMatchSize),
+      sampling_interval_(1),
+      index_memory_budget_(0),
+      lazy_match_lookahead_(0),
+      optimal_parse_(false),
+      cross_boundary_matching_(false) {
+  if (owns_dictionary_) {
     memcpy(const_cast<char*>(dictionary_), dictionary, dictionary_size);
   }
 }
 
 VCDiffEngine::~VCDiffEngine() {
   delete hashed_dictionary_;
-  if (dictionary_size_ > 0) {
+  if (owns_dictionary_) {
     delete[] dictionary_;
   }
 }
 
-bool VCDiffEngine::Init() {
+namespace {
+
+// Initializes the RollingHash template instance for block_size, which must
+// satisfy BlockHash::IsValidBlockSize().
+void InitRollingHash(int block_size) {
+  switch (block_size) {
+    case 8: RollingHash<8>::Init(); break;
+    case 16: RollingHash<16>::Init(); break;
+    case 32: RollingHash<32>::Init(); break;
+    default: RollingHash<64>::Init(); break;
+  }
+}
+
+}  // anonymous namespace
+
+bool VCDiffEngine::Init(int thread_count) {
   if (hashed_dictionary_) {
     VCD_DFATAL << "Init() called twice for same VCDiffEngine object"
                << VCD_ENDL;
     return false;
   }
-  hashed_dictionary_ = BlockHash::CreateDictionaryHash(dictionary_,
-                                                       dictionary_size());
+  if (index_memory_budget_ > 0) {
+    while ((BlockHash::CalcIndexSize(dictionary_size(),
+                                     block_size_,
+                                     sampling_interval_)
+                > index_memory_budget_) &&
+           (sampling_interval_ < BlockHash::kMaxSamplingInterval)) {
+      sampling_interval_ *= 2;
+      if (sampling_interval_ > BlockHash::kMaxSamplingInterval) {
+        sampling_interval_ = BlockHash::kMaxSamplingInterval;
+      }
+    }
+  }
+  if (bucketized_index_) {
+    hashed_dictionary_ =
+        BlockHash::CreateBucketizedDictionaryHash(dictionary_,
+                                                  dictionary_size(),
+                                                  block_size_,
+                                                  sampling_interval_);
+  } else {
+    hashed_dictionary_ = BlockHash::CreateDictionaryHash(dictionary_,
+                                                         dictionary_size(),
+                                                         block_size_,
+                                                         sampling_interval_,
+                                                         thread_count);
+  }
   if (!hashed_dictionary_) {
     VCD_DFATAL << "Creation of dictionary hash failed" << VCD_ENDL;
     return false;
   }
-  RollingHash<BlockHash::kBlockSize>::Init();
+  InitRollingHash(block_size_);
   return true;
 }
 
-// This helper function tries to find an appropriate match within
-// hashed_dictionary_ for the block starting at the current target position.
-// If target_hash is not NULL, this function will also look for a match
-// within the previously encoded target data.
+bool VCDiffEngine::SetBucketizedIndex(bool bucketized) {
+  if (hashed_dictionary_) {
+    VCD_ERROR << "SetBucketizedIndex() called after Init()" << VCD_ENDL;
+    return false;
+  }
+  bucketized_index_ = bucketized;
+  return true;
+}
+
+bool VCDiffEngine::SetBlockSize(int block_size) {
+  if (hashed_dictionary_) {
+    VCD_ERROR << "SetBlockSize() called after Init()" << VCD_ENDL;
+    return false;
+  }
+  if (!BlockHash::IsValidBlockSize(block_size)) {
+    VCD_ERROR << "Invalid block size " << block_size << "; must be a power"
+                 " of 2 between " << BlockHash::kMinBlockSize << " and "
+              << BlockHash::kMaxBlockSize << VCD_ENDL;
+    return false;
+  }
+  block_size_ = block_size;
+  return true;
+}
+
+bool VCDiffEngine::SetMinimumMatchSize(size_t minimum_match_size) {
+  if (hashed_dictionary_) {
+    VCD_ERROR << "SetMinimumMatchSize() called after Init()" << VCD_ENDL;
+    return false;
+  }
+  minimum_match_size_ = minimum_match_size;
+  return true;
+}
+
+bool VCDiffEngine::SetSamplingInterval(int sampling_interval) {
+  if (hashed_dictionary_) {
+    VCD_ERROR << "SetSamplingInterval() called after Init()" << VCD_ENDL;
+    return false;
+  }
+  if ((sampling_interval < 1) ||
+      (sampling_interval > BlockHash::kMaxSamplingInterval)) {
+    VCD_ERROR << "Invalid sampling interval " << sampling_interval
+              << "; must be between 1 and " << BlockHash::kMaxSamplingInterval
+              << VCD_ENDL;
+    return false;
+  }
+  sampling_interval_ = sampling_interval;
+  return true;
+}
+
+bool VCDiffEngine::SetIndexMemoryBudget(size_t max_index_bytes) {
+  if (hashed_dictionary_) {
+    VCD_ERROR << "SetIndexMemoryBudget() called after Init()" << VCD_ENDL;
+    return false;
+  }
+  index_memory_budget_ = max_index_bytes;
+  return true;
+}
+
+bool VCDiffEngine::SetLazyMatchLookahead(int lookahead) {
+  if (hashed_dictionary_) {
+    VCD_ERROR << "SetLazyMatchLookahead() called after Init()" << VCD_ENDL;
+    return false;
+  }
+  if ((lookahead < 0) || (lookahead > kMaxLazyMatchLookahead)) {
+    VCD_ERROR << "Invalid lazy match lookahead " << lookahead
+              << "; must be between 0 and " << kMaxLazyMatchLookahead
+              << VCD_ENDL;
+    return false;
+  }
+  lazy_match_lookahead_ = lookahead;
+  return true;
+}
+
+bool VCDiffEngine::SetOptimalParse(bool optimal_parse) {
+  if (hashed_dictionary_) {
+    VCD_ERROR << "SetOptimalParse() called after Init()" << VCD_ENDL;
+    return false;
+  }
+  optimal_parse_ = optimal_parse;
+  return true;
+}
+
+bool VCDiffEngine::SetCrossBoundaryMatching(bool cross_boundary_matching) {
+  if (hashed_dictionary_) {
+    VCD_ERROR << "SetCrossBoundaryMatching() called after Init()" << VCD_ENDL;
+    return false;
+  }
+  cross_boundary_matching_ = cross_boundary_matching;
+  return true;
+}
+
+namespace {
+
+// The layout of a serialized dictionary index, as produced by
+// VCDiffEngine::SerializeIndex():
+//
+//   SerializedIndexHeader  (fixed size, a multiple of 8 bytes)
+//   dictionary contents    (dictionary_size bytes, zero-padded to a
+//                           multiple of 8 bytes)
+//   hash table             (hash_table_size ints)
+//   next block table       (number_of_blocks ints)
 //
-// If a match is found, this function will generate an ADD instruction
-// for all unencoded data that precedes the match,
-// and a COPY instruction for the match itself; then it returns
-// the number of bytes processed by both instructions,
-// which is guaranteed to be > 0.
-// If no appropriate match is found, the function returns 0.
+// All fields use the native byte order and int size of the machine that
+// wrote the image.  byte_order_mark and int_size let the reader detect an
+// image that was written on an incompatible machine.  The version number must
+// be incremented whenever the layout or the hashing algorithm changes.
+struct SerializedIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  uint32_t int_size;
+  uint32_t block_size;
+  uint32_t sampling_interval;
+  uint32_t lazy_match_lookahead;
+  uint32_t optimal_parse;
+  uint32_t cross_boundary_matching;
+  uint64_t minimum_match_size;
+  uint64_t dictionary_size;
+  uint64_t hash_table_size;
+  uint64_t number_of_blocks;
+};
+
+const char kSerializedIndexMagic[8] = { 'V', 'C', 'D', 'I', 'D', 'X', '\0',
+                                        '\0' };
+const uint32_t kSerializedIndexVersion = 5;
+const uint32_t kSerializedIndexByteOrderMark = 0x01020304;
+
+VCD_COMPILE_ASSERT(sizeof(SerializedIndexHeader) % 8 == 0,
+                   SerializedIndexHeader_size_must_be_a_multiple_of_8);
+
+inline size_t PadToMultipleOf8(size_t size) {
+  return (size + 7) & ~static_cast<size_t>(7);
+}
+
+}  // anonymous namespace
+
+bool VCDiffEngine::SerializeIndex(OutputStringInterface* index_image) const {
+  if (!hashed_dictionary_) {
+    VCD_DFATAL << "SerializeIndex() called before Init()" << VCD_ENDL;
+    return false;
+  }
+  if (hashed_dictionary_->is_bucketized()) {
+    VCD_ERROR << "SerializeIndex() does not support a bucketized index"
+              << VCD_ENDL;
+    return false;
+  }
+  SerializedIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kSerializedIndexMagic, sizeof(header.magic));
+  header.version = kSerializedIndexVersion;
+  header.byte_order_mark = kSerializedIndexByteOrderMark;
+  header.int_size = sizeof(int);  // NOLINT
+  header.block_size = static_cast<uint32_t>(block_size_);
+  header.sampling_interval = static_cast<uint32_t>(sampling_interval_);
+  header.lazy_match_lookahead = static_cast<uint32_t>(lazy_match_lookahead_);
+  header.optimal_parse = optimal_parse_ ? 1 : 0;
+  header.cross_boundary_matching = cross_boundary_matching_ ? 1 : 0;
+  header.minimum_match_size = minimum_match_size_;
+  header.dictionary_size = dictionary_size_;
+  header.hash_table_size = hashed_dictionary_->hash_table_size();
+  header.number_of_blocks = hashed_dictionary_->next_block_table_size();
+  const size_t padded_dictionary_size = PadToMultipleOf8(dictionary_size_);
+  const size_t hash_table_bytes =
+      hashed_dictionary_->hash_table_size() * sizeof(int);  // NOLINT
+  const size_t next_block_table_bytes =
+      hashed_dictionary_->next_block_table_size() * sizeof(int);  // NOLINT
+  index_image->ReserveAdditionalBytes(sizeof(header)
+                                          + padded_dictionary_size
+                                          + hash_table_bytes
+                                          + next_block_table_bytes);
+  index_image->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  index_image->append(dictionary_, dictionary_size_);
+  static const char kPadding[8] = { 0 };
+  index_image->append(kPadding, padded_dictionary_size - dictionary_size_);
+  index_image->append(
+      reinterpret_cast<const char*>(hashed_dictionary_->hash_table()),
+      hash_table_bytes);
+  if (next_block_table_bytes > 0) {
+    index_image->append(
+        reinterpret_cast<const char*>(hashed_dictionary_->next_block_table()),
+        next_block_table_bytes);
+  }
+  return true;
+}
+
+const VCDiffEngine* VCDiffEngine::CreateFromSerializedIndex(
+    const char* index_image,
+    size_t image_size) {
+  SerializedIndexHeader header;
+  if (!index_image || (image_size < sizeof(header))) {
+    VCD_ERROR << "Serialized dictionary index is too small ("
+              << image_size << " bytes)" << VCD_ENDL;
+    return NULL;
+  }
+  memcpy(&header, index_image, sizeof(header));
+  if (memcmp(header.magic, kSerializedIndexMagic, sizeof(header.magic)) != 0) {
+    VCD_ERROR << "Serialized dictionary index has invalid magic number"
+              << VCD_ENDL;
+    return NULL;
+  }
+  if (header.version != kSerializedIndexVersion) {
+    VCD_ERROR << "Unsupported serialized dictionary index version "
+              << header.version << VCD_ENDL;
+    return NULL;
+  }
+  if ((header.byte_order_mark != kSerializedIndexByteOrderMark) ||
+      (header.int_size != sizeof(int))) {  // NOLINT
+    VCD_ERROR << "Serialized dictionary index was created on an incompatible"
+                 " platform" << VCD_ENDL;
+    return NULL;
+  }
+  if ((header.block_size > static_cast<uint32_t>(BlockHash::kMaxBlockSize)) ||
+      !BlockHash::IsValidBlockSize(static_cast<int>(header.block_size))) {
+    VCD_ERROR << "Serialized dictionary index has invalid block size "
+              << header.block_size << VCD_ENDL;
+    return NULL;
+  }
+  const int block_size = static_cast<int>(header.block_size);
+  if ((header.sampling_interval < 1) ||
+      (header.sampling_interval >
+           static_cast<uint32_t>(BlockHash::kMaxSamplingInterval))) {
+    VCD_ERROR << "Serialized dictionary index has invalid sampling interval "
+              << header.sampling_interval << VCD_ENDL;
+    return NULL;
+  }
+  const int sampling_interval = static_cast<int>(header.sampling_interval);
+  if (header.lazy_match_lookahead >
+          static_cast<uint32_t>(kMaxLazyMatchLookahead)) {
+    VCD_ERROR << "Serialized dictionary index has invalid lazy match lookahead "
+              << header.lazy_match_lookahead << VCD_ENDL;
+    return NULL;
+  }
+  if (header.optimal_parse > 1) {
+    VCD_ERROR << "Serialized dictionary index has invalid parse mode "
+              << header.optimal_parse << VCD_ENDL;
+    return NULL;
+  }
+  if (header.cross_boundary_matching > 1) {
+    VCD_ERROR << "Serialized dictionary index has invalid cross-boundary"
+                 " matching mode " << header.cross_boundary_matching
+              << VCD_ENDL;
+    return NULL;
+  }
+  // Compare each size against what remains of the image before computing
+  // offsets, so that a corrupted header cannot cause an overflow.
+  size_t remaining = image_size - sizeof(header);
+  if ((header.dictionary_size > remaining) ||
+      (header.hash_table_size > remaining / sizeof(int)) ||  // NOLINT
+      (header.number_of_blocks > remaining / sizeof(int))) {  // NOLINT
+    VCD_ERROR << "Serialized dictionary index is truncated" << VCD_ENDL;
+    return NULL;
+  }
+  const size_t dictionary_size = static_cast<size_t>(header.dictionary_size);
+  const size_t hash_table_size = static_cast<size_t>(header.hash_table_size);
+  const size_t number_of_blocks = static_cast<size_t>(header.number_of_blocks);
+  const size_t padded_dictionary_size = PadToMultipleOf8(dictionary_size);
+  if ((padded_dictionary_size > remaining) ||
+      ((remaining - padded_dictionary_size) / sizeof(int)  // NOLINT
+           != hash_table_size + number_of_blocks) ||
+      ((remaining - padded_dictionary_size) % sizeof(int) != 0)) {  // NOLINT
+    VCD_ERROR << "Serialized dictionary index has inconsistent size "
+              << image_size << VCD_ENDL;
+    return NULL;
+  }
+  const char* const dictionary = index_image + sizeof(header);
+  const char* const tables = dictionary + padded_dictionary_size;
+  if (reinterpret_cast<uintptr_t>(tables) % sizeof(int) != 0) {  // NOLINT
+    VCD_ERROR << "Serialized dictionary index is not aligned in memory"
+              << VCD_ENDL;
+    return NULL;
+  }
+  const int* const hash_table = reinterpret_cast<const int*>(tables);
+  const BlockHash* hashed_dictionary =
+      BlockHash::CreateDictionaryHashFromTables(dictionary,
+                                                dictionary_size,
+                                                block_size,
+                                                sampling_interval,
+                                                hash_table,
+                                                hash_table_size,
+                                                hash_table + hash_table_size,
+                                                number_of_blocks);
+  if (!hashed_dictionary) {
+    return NULL;
+  }
+  InitRollingHash(block_size);
+  VCDiffEngine* engine = new VCDiffEngine(dictionary,
+                                          dictionary_size,
+                                          /* copy_dictionary = */ false);
+  engine->block_size_ = block_size;
+  engine->sampling_interval_ = sampling_interval;
+  engine->lazy_match_lookahead_ =
+      static_cast<int>(header.lazy_match_lookahead);
+  engine->optimal_parse_ = (header.optimal_parse != 0);
+  engine->cross_boundary_matching_ = (header.cross_boundary_matching != 0);
+  engine->minimum_match_size_ =
+      static_cast<size_t>(header.minimum_match_size);
+  engine->hashed_dictionary_ = hashed_dictionary;
+  return engine;
+}
+
+// This helper function tries to find an appropriate match within
+// source_hash for the block starting at target_candidate_start.
+// If look_for_target_matches is true, this function will also look for a
+// match within the previously encoded target data.  best_match is updated
+// only if a longer match is found, so this function can be called for
+// several candidate blocks in turn to find the longest match among them.
 //
-// The first four parameters are input parameters which are passed
-// directly to BlockHash::FindBestMatch; please see that function
-// for a description of their allowable values.
+// The first four parameters and target_window_start are input parameters
+// which are passed directly to BlockHash::FindBestMatch; please see that
+// function for a description of their allowable values.
 template<bool look_for_target_matches>
-inline size_t VCDiffEngine::EncodeCopyForBestMatch(
+inline void VCDiffEngine::FindBestMatch(
+    const BlockHash* source_hash,
     uint32_t hash_value,
     const char* target_candidate_start,
     const char* unencoded_target_start,
     size_t unencoded_target_size,
     const BlockHash* target_hash,
-    CodeTableWriterInterface* coder) const {
-  // When FindBestMatch() comes up with a match for a candidate block,
-  // it will populate best_match with the size, source offset,
-  // and target offset of the match.
-  BlockHash::Match best_match;
-
-  // First look for a match in the dictionary.
-  hashed_dictionary_->FindBestMatch(hash_value,
-                                    target_candidate_start,
-                                    unencoded_target_start,
-                                    unencoded_target_size,
-                                    &best_match);
+    const char* target_window_start,
+    BlockHash::Match* best_match) const {
+  // First look for a match in the source data.
+  source_hash->FindBestMatch(hash_value,
+                             target_candidate_start,
+                             unencoded_target_start,
+                             unencoded_target_size,
+                             best_match,
+                             target_window_start);
   // If target matching is enabled, then see if there is a better match
   // within the target data that has been encoded so far.
   if (look_for_target_matches) {
@@ -98,20 +451,70 @@ inline size_t VCDiffEngine::EncodeCopyForBestMatch(
                                target_candidate_start,
                                unencoded_target_start,
                                unencoded_target_size,
-                               &best_match);
+                               best_match);
   }
-  if (!ShouldGenerateCopyInstructionForMatchOfSize(best_match.size())) {
+}
+
+// If match is long enough to be worth a COPY instruction, this function
+// generates an ADD instruction for all unencoded data that precedes the match,
+// and a COPY instruction for the match itself; then it returns the number of
+// bytes processed by both instructions, which is guaranteed to be > 0.
+// Otherwise, the function returns 0.
+inline size_t VCDiffEngine::EncodeCopyForMatch(
+    const BlockHash::Match& match,
+    const char* unencoded_target_start,
+    CodeTableWriterInterface* coder) const {
+  if (!ShouldGenerateCopyInstructionForMatchOfSize(match.size())) {
     return 0;
   }
-  if (best_match.target_offset() > 0) {
+  if (match.target_offset() > 0) {
     // Create an ADD instruction to encode all target bytes
     // from the end of the last COPY match, if any, up to
     // the beginning of this COPY match.
-    coder->Add(unencoded_target_start, best_match.target_offset());
+    coder->Add(unencoded_target_start, match.target_offset());
+  }
+  coder->Copy(match.source_offset(), match.size());
+  return match.target_offset()  // ADD size
+       + match.size();          // + COPY size
+}
+
+// If the block_size bytes at target_candidate_start all have the same value,
+// returns the size of the run of that value which contains them, and sets
+// *run_start to the first byte of the run.  The run is not extended back
+// before unencoded_target_start or past target_end.  Otherwise, returns 0.
+inline size_t VCDiffEngine::FindRun(const char* target_candidate_start,
+                                    int block_size,
+                                    const char* unencoded_target_start,
+                                    const char* target_end,
+                                    const char** run_start) const {
+  const int size_to_right =
+      BlockHash::RunSizeToRight(
+          target_candidate_start,
+          static_cast<int>(target_end - target_candidate_start));
+  if (size_to_right < block_size) {
+    return 0;
+  }
+  const int size_to_left =
+      BlockHash::RunSizeToLeft(
+          target_candidate_start,
+          static_cast<int>(target_candidate_start - unencoded_target_start));
+  *run_start = target_candidate_start - size_to_left;
+  return static_cast<size_t>(size_to_left) + size_to_right;
+}
+
+// Creates an ADD instruction for any target bytes between
+// unencoded_target_start and run_start, followed by a RUN instruction for the
+// run_size bytes at run_start.  Returns the number of bytes encoded.
+inline size_t VCDiffEngine::EncodeRun(const char* run_start,
+                                      size_t run_size,
+                                      const char* unencoded_target_start,
+                                      CodeTableWriterInterface* coder) const {
+  const size_t add_size = run_start - unencoded_target_start;
+  if (add_size > 0) {
+    coder->Add(unencoded_target_start, add_size);
   }
-  coder->Copy(best_match.source_offset(), best_match.size());
-  return best_match.target_offset()  // ADD size
-       + best_match.size();          // + COPY size
+  coder->Run(run_size, static_cast<unsigned char>(run_start[0]));
+  return add_size + run_size;
 }
 
 // Once the encoder loop has finished checking for matches in the target data,
@@ -129,12 +532,14 @@ inline void VCDiffEngine::AddUnmatchedRemainder(
   }
 }
 
-template<bool look_for_target_matches>
-void VCDiffEngine::EncodeInternal(const char* target_data,
+template<bool look_for_target_matches, int block_size>
+void VCDiffEngine::EncodeInternal(const BlockHash* source_hash,
+                                  const char* target_data,
                                   size_t target_size,
+                                  BlockHash* target_hash,
                                   OutputStringInterface* diff,
                                   CodeTableWriterInterface* coder) const {
-  if (!hashed_dictionary_) {
+  if (!source_hash) {
     VCD_DFATAL << "Internal error: VCDiffEngine::Encode() "
                   "called before VCDiffEngine::Init()" << VCD_ENDL;
     return;
@@ -143,44 +548,86 @@ void VCDiffEngine::EncodeInternal(const char* target_data,
     return;  // Do nothing for empty target
   }
   // Special case for really small input
-  if (target_size < static_cast<size_t>(BlockHash::kBlockSize)) {
+  if (target_size < static_cast<size_t>(block_size)) {
     AddUnmatchedRemainder(target_data, target_size, coder);
     coder->Output(diff);
     return;
   }
-  RollingHash<BlockHash::kBlockSize> hasher;
-  BlockHash* target_hash = NULL;
-  if (look_for_target_matches) {
-    // Check matches against previously encoded target data
-    // in this same target window, as well as against the dictionary
-    target_hash = BlockHash::CreateTargetHash(target_data,
-                                              target_size,
-                                              dictionary_size());
-    if (!target_hash) {
-      VCD_DFATAL << "Instantiation of target hash failed" << VCD_ENDL;
-      return;
-    }
-  }
+  RollingHash<block_size> hasher;
   const char* const target_end = target_data + target_size;
-  const char* const start_of_last_block = target_end - BlockHash::kBlockSize;
+  // If cross-boundary matching is enabled, dictionary matches may continue
+  // into the target window, which starts at target_data.
+  const char* const target_window_start =
+      (cross_boundary_matching_ && (source_hash == hashed_dictionary_)) ?
+          target_data : NULL;
+  const char* const start_of_last_block = target_end - block_size;
   // Offset of next bytes in string to ADD if NOT copied (i.e., not found in
   // dictionary)
   const char* next_encode = target_data;
-  // candidate_pos points to the start of the kBlockSize-byte block that may
+  // candidate_pos points to the start of the block_size-byte block that may
   // begin a match with the dictionary or previously encoded target data.
   const char* candidate_pos = target_data;
   uint32_t hash_value = hasher.Hash(candidate_pos);
   while (1) {
-    const size_t bytes_encoded =
-        EncodeCopyForBestMatch<look_for_target_matches>(
-            hash_value,
-            candidate_pos,
-            next_encode,
-            (target_end - next_encode),
-            target_hash,
-            coder);
+    // When FindBestMatch() comes up with a match for a candidate block,
+    // it will populate best_match with the size, source offset,
+    // and target offset of the match.
+    BlockHash::Match best_match;
+    FindBestMatch<look_for_target_matches>(source_hash,
+                                           hash_value,
+                                           candidate_pos,
+                                           next_encode,
+                                           (target_end - next_encode),
+                                           target_hash,
+                                           target_window_start,
+                                           &best_match);
+    // If the candidate block is part of a run of a single byte value, encode
+    // the whole run with a RUN instruction, provided that the run is at least
+    // as long as the minimum match size and no longer match was found.  This
+    // also skips the hash probes for the rest of the run.  Shorter runs are
+    // left to be encoded as part of an ADD or COPY, since they are cheap to
+    // ADD and often lie within a longer match that would otherwise be split.
+    const char* run_start = NULL;
+    size_t run_size = 0;
+    if (candidate_pos[0] == candidate_pos[block_size - 1]) {
+      run_size = FindRun(candidate_pos, block_size, next_encode, target_end,
+                         &run_start);
+    }
+    size_t bytes_encoded = 0;
+    if ((run_size > 0) &&
+        ShouldGenerateCopyInstructionForMatchOfSize(run_size) &&
+        (run_size >= best_match.size())) {
+      bytes_encoded = EncodeRun(run_start, run_size, next_encode, coder);
+    } else if ((lazy_match_lookahead_ > 0) &&
+        ShouldGenerateCopyInstructionForMatchOfSize(best_match.size())) {
+      // Lazy matching: before committing to this match, see whether a
+      // longer one begins at one of the next few positions.  The target hash
+      // is not updated for these positions, so they are only compared
+      // against data that precedes candidate_pos.
+      const char* lookahead_pos = candidate_pos;
+      uint32_t lookahead_hash = hash_value;
+      for (int i = 0;
+           (i < lazy_match_lookahead_) && (lookahead_pos < start_of_last_block);
+           ++i) {
+        lookahead_hash = hasher.UpdateHash(lookahead_hash,
+                                           lookahead_pos[0],
+                                           lookahead_pos[block_size]);
+        ++lookahead_pos;
+        FindBestMatch<look_for_target_matches>(source_hash,
+                                               lookahead_hash,
+                                               lookahead_pos,
+                                               next_encode,
+                                               (target_end - next_encode),
+                                               target_hash,
+                                               target_window_start,
+                                               &best_match);
+      }
+    }
+    if (bytes_encoded == 0) {
+      bytes_encoded = EncodeCopyForMatch(best_match, next_encode, coder);
+    }
     if (bytes_encoded > 0) {
-      next_encode += bytes_encoded;  // Advance past COPYed data
+      next_encode += bytes_encoded;  // Advance past RUN or COPYed data
       candidate_pos = next_encode;
       if (candidate_pos > start_of_last_block) {
         break;  // Reached end of target data
@@ -206,25 +653,874 @@ void VCDiffEngine::EncodeInternal(const char* target_data,
       }
       hash_value = hasher.UpdateHash(hash_value,
                                      candidate_pos[0],
-                                     candidate_pos[BlockHash::kBlockSize]);
+                                     candidate_pos[block_size]);
       ++candidate_pos;
     }
   }
   AddUnmatchedRemainder(next_encode, target_end - next_encode, coder);
   coder->Output(diff);
-  delete target_hash;
+}
+
+namespace {
+
+// The optimal parser divides the target into segments of at most this many
+// bytes and chooses the instructions for each segment separately, which
+// bounds the memory it uses (about 40 bytes per target byte).
+const size_t kOptimalParseSegmentSize = 1 << 18;
+
+// A match or a run of a single byte value at least this long is taken as soon
+// as it is found, without searching for matches at the positions that it
+// covers.  This keeps the time spent on long matches linear in their size.
+const size_t kOptimalParseLongMatchSize = 1024;
+
+// For each position, the optimal parser considers COPY instructions that end
+// where a new match begins, as well as the longest one.  This limits the
+// number of such shorter COPY instructions.
+const int kOptimalParseMaxCopyEnds = 16;
+
+// The cost model of the optimal parser, in bytes of encoded output, follows
+// what VCDiffCodeTableWriter does with the default code table.  The opcode of
+// each instruction, and whether its size needs a separate varint, are looked
+// up in the default VCDiffInstructionMap, including the compound opcodes that
+// combine an instruction with the one before it.  The address of each COPY
+// is given the mode that VCDiffAddressCache::EncodeAddress() would choose,
+// based on the addresses of the COPY instructions that precede it on the
+// cheapest path to its start.
+
+// The cost of a position that cannot be reached.
+const uint32_t kInfiniteCost = 0xFFFFFFFFU;
+
+// The optimal parser considers a RUN instruction at each position where at
+// least this many bytes have the same value.  A shorter RUN instruction can
+// never be cheaper than adding the bytes.
+const size_t kOptimalParseMinimumRunSize = 4;
+
+// The number of earlier COPY addresses that the optimal parser looks up along
+// a path to find the state of the address cache at its end.  It must be at
+// least the size of the NEAR cache.  The SAME cache entries set by older COPY
+// instructions within the segment are estimated (see same_estimate_.)
+const int kOptimalParseAddressHistory = 16;
+
+// In the instructions chosen by the optimal parser, these addresses denote an
+// ADD instruction and a RUN instruction respectively.
+const int32_t kAddStepAddress = -1;
+const int32_t kRunStepAddress = -2;
+
+// Holds the matches found for one segment of the target, and chooses the
+// cheapest sequence of ADD, COPY and RUN instructions to encode the segment.
+// Positions are relative to the start of the segment.  Matches start within
+// the segment but may extend past its end; the last COPY instruction of the
+// segment may then do the same, and the next segment starts where it ends.
+// A single object must be used for all the segments of a target window,
+// because it keeps track of the state of the coder (the address cache, and
+// the opcode that the next instruction may be combined with) from one
+// segment to the next.
+class OptimalParseSegment {
+ public:
+  OptimalParseSegment()
+      : instruction_map_(VCDiffInstructionMap::GetDefaultInstructionMap()),
+        open_opcode_(kNoOpcode),
+        size_(0),
+        pending_add_start_(NULL),
+        pending_add_size_(0),
+        initial_add_size_(0) {
+    address_cache_.Init();
+    recent_addresses_.assign(address_cache_.near_cache_size(), 0);
+  }
+
+  // Prepares to parse a segment of the given size.
+  void Reset(size_t size) {
+    size_ = size;
+    match_size_.assign(size, 0);
+    match_address_.resize(size);
+  }
+
+  // Records a match of the given size that starts at position and copies
+  // from address, if it is longer than the match already recorded there.
+  void RecordMatch(size_t position, size_t size, int32_t address) {
+    if (size > match_size_[position]) {
+      match_size_[position] = static_cast<uint32_t>(size);
+      match_address_[position] = address;
+    }
+  }
+
+  // Chooses the instructions for the segment starting at segment_start,
+  // whose first byte has the given address in the VCDIFF address space, and
+  // passes them to coder.  Returns the number of bytes encoded, which is at
+  // least the size of the segment.
+  size_t Encode(const char* segment_start,
+                int32_t segment_address,
+                size_t minimum_match_size,
+                CodeTableWriterInterface* coder) {
+    PropagateMatches(minimum_match_size);
+    FindRuns(segment_start);
+    FindCheapestPath(segment_address, minimum_match_size);
+    return EmitCheapestPath(segment_start, segment_address, coder);
+  }
+
+  // Passes any ADD instruction left pending by Encode() to coder.  Must be
+  // called after the last segment.
+  void FlushPendingAdd(CodeTableWriterInterface* coder) {
+    if (pending_add_size_ > 0) {
+      coder->Add(pending_add_start_, pending_add_size_);
+      InstructionCost(VCD_ADD, pending_add_size_, 0, open_opcode_,
+                      &open_opcode_);
+      pending_add_size_ = 0;
+    }
+  }
+
+ private:
+  // The addresses of the last COPY instructions on a path, most recent first.
+  // If complete is true, these are all the COPY instructions of the path
+  // within the segment, so that the older ones are those that were passed to
+  // the coder before the segment.
+  struct RecentAddresses {
+    int32_t address[kOptimalParseAddressHistory];
+    int count;
+    bool complete;
+  };
+
+  // Returns the number of bytes used by the opcode and size of an
+  // instruction, as VCDiffCodeTableWriter::EncodeInstruction() would encode
+  // it.  open_opcode is the opcode that the instruction may be combined with
+  // (see last_opcode_index_ in VCDiffCodeTableWriter), or kNoOpcode, and
+  // *next_open_opcode is set to the one that the next instruction may be
+  // combined with.
+  uint32_t InstructionCost(VCDiffInstructionType inst,
+                           size_t size,
+                           unsigned char mode,
+                           OpcodeOrNone open_opcode,
+                           OpcodeOrNone* next_open_opcode) const {
+    const unsigned char inst_byte = static_cast<unsigned char>(inst);
+    const unsigned char size_byte =
+        (size <= UCHAR_MAX) ? static_cast<unsigned char>(size) : 0;
+    if (open_opcode != kNoOpcode) {
+      const unsigned char first_opcode =
+          static_cast<unsigned char>(open_opcode);
+      *next_open_opcode = kNoOpcode;
+      if ((size_byte != 0) &&
+          (instruction_map_->LookupSecondOpcode(first_opcode, inst_byte,
+                                                size_byte, mode)
+               != kNoOpcode)) {
+        return 0;
+      }
+      if (instruction_map_->LookupSecondOpcode(first_opcode, inst_byte, 0,
+                                               mode) != kNoOpcode) {
+        return VarintBE<int32_t>::Length(static_cast<int32_t>(size));
+      }
+    }
+    if (size_byte != 0) {
+      *next_open_opcode =
+          instruction_map_->LookupFirstOpcode(inst_byte, size_byte, mode);
+      if (*next_open_opcode != kNoOpcode) {
+        return 1;
+      }
+    }
+    *next_open_opcode = instruction_map_->LookupFirstOpcode(inst_byte, 0, mode);
+    return 1 + VarintBE<int32_t>::Length(static_cast<int32_t>(size));
+  }
+
+  // Returns the cost of reaching end with an ADD instruction that starts at
+  // start, and sets *next_open_opcode as InstructionCost() does.  An ADD
+  // instruction that starts at the beginning of the segment continues the
+  // one left pending by the previous segment, if any.
+  uint32_t AddCost(size_t start,
+                   size_t end,
+                   OpcodeOrNone* next_open_opcode) const {
+    const OpcodeOrNone open_opcode =
+        (start == 0) ? open_opcode_ : copy_open_opcode_[start];
+    const size_t prior_size = (start == 0) ? initial_add_size_ : 0;
+    uint32_t cost = ((start == 0) ? 0 : copy_cost_[start])
+        + static_cast<uint32_t>(end - start)
+        + InstructionCost(VCD_ADD, prior_size + end - start, 0, open_opcode,
+                          next_open_opcode);
+    if (prior_size > 0) {
+      OpcodeOrNone unused;
+      cost -= InstructionCost(VCD_ADD, prior_size, 0, open_opcode, &unused);
+    }
+    return cost;
+  }
+
+  // Finds the addresses of the last COPY instructions on the cheapest path
+  // to position, which ends with an ADD instruction if after_add is true.
+  void FindRecentAddresses(size_t position,
+                           bool after_add,
+                           RecentAddresses* recent) const {
+    recent->count = 0;
+    recent->complete = false;
+    // Each RUN instruction takes a step without finding an address.
+    for (int steps = 0; steps < 4 * kOptimalParseAddressHistory; ++steps) {
+      if (after_add) {
+        position = add_start_[position];
+      }
+      if (position == 0) {
+        recent->complete = true;
+        return;
+      }
+      const int32_t address = copy_address_[position];
+      if (address != kRunStepAddress) {
+        recent->address[recent->count++] = address;
+        if (recent->count == kOptimalParseAddressHistory) {
+          return;
+        }
+      }
+      after_add = copy_after_add_[position];
+      position = copy_start_[position];
+    }
+  }
+
+  // Returns the number of bytes used by the address of a COPY instruction
+  // that copies from address and starts at here_address, after the COPY
+  // instructions in recent, and sets *mode to the mode that
+  // VCDiffAddressCache::EncodeAddress() would choose for it.  The slot of
+  // an address within the NEAR cache is not known, but the default code
+  // table treats all NEAR modes alike.
+  uint32_t AddressCost(int32_t address,
+                       int32_t here_address,
+                       const RecentAddresses& recent,
+                       unsigned char* mode) const {
+    const int32_t same_entries = address_cache_.same_cache_size() * 256;
+    if (same_entries > 0) {
+      const int32_t entry = address % same_entries;
+      int k = 0;
+      while ((k < recent.count) &&
+             (recent.address[k] % same_entries != entry)) {
+        ++k;
+      }
+      int32_t same_address;
+      if (k < recent.count) {
+        same_address = recent.address[k];
+      } else if (recent.complete) {
+        same_address = address_cache_.SameAddress(entry);
+      } else {
+        same_address = same_estimate_[entry];
+      }
+      if (same_address == address) {
+        *mode = static_cast<unsigned char>(address_cache_.FirstSameMode()
+                                           + entry / 256);
+        return 1;
+      }
+    }
+    *mode = VCD_SELF_MODE;
+    int32_t encoded_address = address;
+    if (here_address - address < encoded_address) {
+      *mode = VCD_HERE_MODE;
+      encoded_address = here_address - address;
+    }
+    for (int k = 0; k < address_cache_.near_cache_size(); ++k) {
+      int32_t near_address;
+      if (k < recent.count) {
+        near_address = recent.address[k];
+      } else if (recent.complete) {
+        near_address = recent_addresses_[k - recent.count];
+      } else {
+        break;
+      }
+      if ((address >= near_address) &&
+          (address - near_address < encoded_address)) {
+        *mode = static_cast<unsigned char>(VCDiffAddressCache::FirstNearMode()
+                                           + k);
+        encoded_address = address - near_address;
+      }
+    }
+    return VarintBE<int32_t>::Length(encoded_address);
+  }
+
+  // If a match starts at position i, its suffix is a match that starts at
+  // position i + 1.  Makes each position's match at least as long as the
+  // suffix of its predecessor's, and records where new matches begin.
+  void PropagateMatches(size_t minimum_match_size) {
+    match_starts_.clear();
+    for (size_t i = 0; i < size_; ++i) {
+      if ((i > 0) && (match_size_[i - 1] > match_size_[i] + 1)) {
+        match_size_[i] = match_size_[i - 1] - 1;
+        match_address_[i] = match_address_[i - 1] + 1;
+      } else if (match_size_[i] >= minimum_match_size) {
+        match_starts_.push_back(static_cast<uint32_t>(i));
+      }
+    }
+  }
+
+  // Finds the number of bytes starting at each position of the segment that
+  // have the same value, without looking past the end of the segment.
+  void FindRuns(const char* segment_start) {
+    run_size_.resize(size_);
+    if (size_ == 0) {
+      return;
+    }
+    run_size_[size_ - 1] = 1;
+    for (size_t i = size_ - 1; i > 0; --i) {
+      run_size_[i - 1] =
+          (segment_start[i - 1] == segment_start[i]) ? run_size_[i] + 1 : 1;
+    }
+  }
+
+  // Updates the cost of reaching start_position + size with a COPY
+  // instruction, or a RUN instruction if address is kRunStepAddress.  A COPY
+  // that extends past the end of the segment is credited with one byte for
+  // each byte that it encodes beyond the end, which is what those bytes would
+  // cost as part of an ADD instruction.
+  void RelaxCopy(size_t start_position,
+                 size_t size,
+                 uint32_t start_cost,
+                 bool start_after_add,
+                 uint32_t copy_cost,
+                 OpcodeOrNone next_open_opcode,
+                 int32_t address) {
+    const uint32_t cost = start_cost + copy_cost;
+    const size_t end_position = start_position + size;
+    if (end_position > size_) {
+      const int64_t credited_cost = static_cast<int64_t>(cost)
+          - static_cast<int64_t>(end_position - size_);
+      if (credited_cost < last_copy_.credited_cost) {
+        last_copy_.credited_cost = credited_cost;
+        last_copy_.start = start_position;
+        last_copy_.size = size;
+        last_copy_.after_add = start_after_add;
+        last_copy_.address = address;
+      }
+    } else if (cost < copy_cost_[end_position]) {
+      copy_cost_[end_position] = cost;
+      copy_start_[end_position] = static_cast<uint32_t>(start_position);
+      copy_after_add_[end_position] = start_after_add;
+      copy_address_[end_position] = address;
+      copy_open_opcode_[end_position] = next_open_opcode;
+    }
+  }
+
+  // Updates the costs of the COPY and RUN instructions that start at
+  // position after the cheapest path to it that ends with an ADD instruction
+  // (if after_add is true) or with a COPY or RUN instruction.
+  void RelaxFrom(size_t position,
+                 bool after_add,
+                 int32_t segment_address,
+                 size_t minimum_match_size) {
+    const uint32_t cost =
+        after_add ? add_cost_[position] : copy_cost_[position];
+    if (cost == kInfiniteCost) {
+      return;
+    }
+    const OpcodeOrNone open_opcode =
+        after_add ? add_open_opcode_[position]
+                  : ((position == 0) ? open_opcode_
+                                     : copy_open_opcode_[position]);
+    OpcodeOrNone next_open_opcode = kNoOpcode;
+    if (run_size_[position] >= kOptimalParseMinimumRunSize) {
+      const uint32_t run_cost =
+          InstructionCost(VCD_RUN, run_size_[position], 0, open_opcode,
+                          &next_open_opcode) + 1;
+      RelaxCopy(position, run_size_[position], cost, after_add, run_cost,
+                next_open_opcode, kRunStepAddress);
+    }
+    const size_t match_size = match_size_[position];
+    if ((match_size < minimum_match_size) || (match_size == 0)) {
+      return;
+    }
+    const int32_t address = match_address_[position];
+    RecentAddresses recent;
+    FindRecentAddresses(position, after_add, &recent);
+    unsigned char mode = 0;
+    const uint32_t address_cost =
+        AddressCost(address,
+                    segment_address + static_cast<int32_t>(position),
+                    recent,
+                    &mode);
+    RelaxCopy(position, match_size, cost, after_add,
+              InstructionCost(VCD_COPY, match_size, mode, open_opcode,
+                              &next_open_opcode) + address_cost,
+              next_open_opcode, address);
+    // A shorter COPY may be cheaper if it lets a match that extends
+    // further start sooner.
+    std::vector<uint32_t>::const_iterator next_start =
+        std::upper_bound(
+            match_starts_.begin(),
+            match_starts_.end(),
+            static_cast<uint32_t>(position + minimum_match_size - 1));
+    for (int ends = 0;
+         (next_start != match_starts_.end()) &&
+             (*next_start < position + match_size) &&
+             (ends < kOptimalParseMaxCopyEnds);
+         ++next_start) {
+      if (*next_start + match_size_[*next_start] <= position + match_size) {
+        continue;
+      }
+      const size_t copy_size = *next_start - position;
+      RelaxCopy(position, copy_size, cost, after_add,
+                InstructionCost(VCD_COPY, copy_size, mode, open_opcode,
+                                &next_open_opcode) + address_cost,
+                next_open_opcode, address);
+      ++ends;
+    }
+  }
+
+  // Computes, for each position, the cheapest way to encode the segment up
+  // to that position, ending either with an ADD or with a COPY instruction.
+  void FindCheapestPath(int32_t segment_address, size_t minimum_match_size) {
+    add_cost_.assign(size_ + 1, kInfiniteCost);
+    add_start_.resize(size_ + 1);
+    add_open_opcode_.resize(size_ + 1);
+    copy_cost_.assign(size_ + 1, kInfiniteCost);
+    copy_start_.resize(size_ + 1);
+    copy_after_add_.resize(size_ + 1);
+    copy_address_.resize(size_ + 1);
+    copy_open_opcode_.resize(size_ + 1);
+    last_copy_.credited_cost = kInfiniteCost;
+    // An ADD instruction left pending by the previous segment is open at the
+    // start.
+    initial_add_size_ = pending_add_size_;
+    if (initial_add_size_ > 0) {
+      add_cost_[0] = 0;
+      add_start_[0] = 0;
+      InstructionCost(VCD_ADD, initial_add_size_, 0, open_opcode_,
+                      &add_open_opcode_[0]);
+    } else {
+      copy_cost_[0] = 0;
+    }
+    same_estimate_.resize(address_cache_.same_cache_size() * 256);
+    for (size_t entry = 0; entry < same_estimate_.size(); ++entry) {
+      same_estimate_[entry] =
+          address_cache_.SameAddress(static_cast<int>(entry));
+    }
+    for (size_t i = 0; i < size_; ++i) {
+      if ((i > 0) && !same_estimate_.empty() &&
+          (copy_cost_[i] <= add_cost_[i]) && (copy_address_[i] >= 0)) {
+        same_estimate_[copy_address_[i] % same_estimate_.size()] =
+            copy_address_[i];
+      }
+      // Add one byte, either to the current ADD instruction or to a new one.
+      OpcodeOrNone next_open_opcode = kNoOpcode;
+      if (add_cost_[i] != kInfiniteCost) {
+        add_start_[i + 1] = add_start_[i];
+        add_cost_[i + 1] = AddCost(add_start_[i], i + 1, &next_open_opcode);
+        add_open_opcode_[i + 1] = next_open_opcode;
+      }
+      if (copy_cost_[i] != kInfiniteCost) {
+        const uint32_t new_add_cost = AddCost(i, i + 1, &next_open_opcode);
+        if (new_add_cost < add_cost_[i + 1]) {
+          add_start_[i + 1] = static_cast<uint32_t>(i);
+          add_cost_[i + 1] = new_add_cost;
+          add_open_opcode_[i + 1] = next_open_opcode;
+        }
+      }
+      RelaxFrom(i, false, segment_address, minimum_match_size);
+      RelaxFrom(i, true, segment_address, minimum_match_size);
+    }
+  }
+
+  // Walks back along the cheapest path and then passes its instructions to
+  // coder in order, keeping track of the state of the coder.  An ADD
+  // instruction at the end of the segment is left pending, since it may
+  // continue in the next segment.  Returns the number of bytes encoded.
+  size_t EmitCheapestPath(const char* segment_start,
+                          int32_t segment_address,
+                          CodeTableWriterInterface* coder) {
+    path_.clear();
+    size_t position = size_;
+    size_t encoded_size = size_;
+    bool in_add = add_cost_[size_] < copy_cost_[size_];
+    const int64_t end_cost = in_add ? add_cost_[size_] : copy_cost_[size_];
+    if (last_copy_.credited_cost < end_cost) {
+      path_.push_back(Step(last_copy_.start, last_copy_.size,
+                           last_copy_.address));
+      encoded_size = last_copy_.start + last_copy_.size;
+      position = last_copy_.start;
+      in_add = last_copy_.after_add;
+    }
+    while (position > 0) {
+      if (in_add) {
+        const size_t start = add_start_[position];
+        path_.push_back(Step(start, position - start, kAddStepAddress));
+        in_add = false;
+        position = start;
+      } else {
+        const size_t start = copy_start_[position];
+        path_.push_back(Step(start, position - start,
+                             copy_address_[position]));
+        in_add = copy_after_add_[position];
+        position = start;
+      }
+    }
+    for (std::vector<Step>::reverse_iterator step = path_.rbegin();
+         step != path_.rend();
+         ++step) {
+      if (step->address == kAddStepAddress) {
+        if (pending_add_size_ == 0) {
+          pending_add_start_ = segment_start + step->position;
+        }
+        pending_add_size_ += step->size;
+      } else if (step->address == kRunStepAddress) {
+        FlushPendingAdd(coder);
+        coder->Run(step->size,
+                   static_cast<unsigned char>(segment_start[step->position]));
+        InstructionCost(VCD_RUN, step->size, 0, open_opcode_, &open_opcode_);
+      } else {
+        FlushPendingAdd(coder);
+        coder->Copy(step->address, step->size);
+        int32_t encoded_address = 0;
+        const unsigned char mode = address_cache_.EncodeAddress(
+            step->address,
+            segment_address + static_cast<int32_t>(step->position),
+            &encoded_address);
+        InstructionCost(VCD_COPY, step->size, mode, open_opcode_,
+                        &open_opcode_);
+        recent_addresses_.pop_back();
+        recent_addresses_.insert(recent_addresses_.begin(), step->address);
+      }
+    }
+    return encoded_size;
+  }
+
+  // One instruction of the cheapest path: a COPY from address, a RUN if
+  // address is kRunStepAddress, or an ADD if address is kAddStepAddress.
+  struct Step {
+    Step(size_t p, size_t s, int32_t a) : position(p), size(s), address(a) { }
+    size_t position;
+    size_t size;
+    int32_t address;
+  };
+
+  // The cheapest COPY instruction found that extends past the end of the
+  // segment.  (A RUN instruction never does.)
+  struct LastCopy {
+    int64_t credited_cost;
+    size_t start;
+    size_t size;
+    bool after_add;
+    int32_t address;
+  };
+
+  const VCDiffInstructionMap* const instruction_map_;
+
+  // The state of the coder after the instructions passed to it so far: its
+  // address cache, the addresses of the last COPY instructions (most recent
+  // first, as many as the NEAR cache holds), and the opcode that the next
+  // instruction may be combined with.  A pending ADD instruction has not yet
+  // been passed to the coder.
+  VCDiffAddressCache address_cache_;
+  std::vector<int32_t> recent_addresses_;
+  OpcodeOrNone open_opcode_;
+
+  size_t size_;
+
+  // The longest known match that starts at each position.
+  std::vector<uint32_t> match_size_;
+  std::vector<int32_t> match_address_;
+
+  // The positions at which a match begins that is not the suffix of the
+  // match at the preceding position, in increasing order.
+  std::vector<uint32_t> match_starts_;
+
+  // The number of bytes starting at each position that have the same value.
+  std::vector<uint32_t> run_size_;
+
+  // For each position, the lowest cost of encoding the segment up to that
+  // position with the last instruction being an ADD (add_cost_) or a COPY or
+  // RUN (copy_cost_), how that cost was reached, and the opcode that the
+  // next instruction may be combined with.
+  std::vector<uint32_t> add_cost_;
+  std::vector<uint32_t> add_start_;
+  std::vector<OpcodeOrNone> add_open_opcode_;
+  std::vector<uint32_t> copy_cost_;
+  std::vector<uint32_t> copy_start_;
+  std::vector<bool> copy_after_add_;
+  std::vector<int32_t> copy_address_;
+  std::vector<OpcodeOrNone> copy_open_opcode_;
+  LastCopy last_copy_;
+
+  std::vector<Step> path_;
+
+  // The SAME cache entries set by the COPY instructions that end the
+  // cheapest paths to the positions parsed so far.  AddressCost() uses these
+  // for COPY instructions that are too far back along a path to look up.
+  std::vector<int32_t> same_estimate_;
+
+  // The ADD instruction that EmitCheapestPath() has not yet passed to the
+  // coder, and its size when the current segment started.
+  const char* pending_add_start_;
+  size_t pending_add_size_;
+  size_t initial_add_size_;
+
+  // Making these private avoids implicit copy constructor & assignment operator
+  OptimalParseSegment(const OptimalParseSegment&);  // NOLINT
+  void operator=(const OptimalParseSegment&);
+};
+
+}  // anonymous namespace
+
+template<bool look_for_target_matches, int block_size>
+void VCDiffEngine::EncodeOptimal(const BlockHash* source_hash,
+                                 size_t source_size,
+                                 const char* target_data,
+                                 size_t target_size,
+                                 BlockHash* target_hash,
+                                 OutputStringInterface* diff,
+                                 CodeTableWriterInterface* coder) const {
+  if (!source_hash) {
+    VCD_DFATAL << "Internal error: VCDiffEngine::Encode() "
+                  "called before VCDiffEngine::Init()" << VCD_ENDL;
+    return;
+  }
+  if (target_size == 0) {
+    return;  // Do nothing for empty target
+  }
+  if (target_size < static_cast<size_t>(block_size)) {
+    AddUnmatchedRemainder(target_data, target_size, coder);
+    coder->Output(diff);
+    return;
+  }
+  RollingHash<block_size> hasher;
+  OptimalParseSegment segment;
+  const char* const target_end = target_data + target_size;
+  const char* const target_window_start =
+      (cross_boundary_matching_ && (source_hash == hashed_dictionary_)) ?
+          target_data : NULL;
+  const char* const start_of_last_block = target_end - block_size;
+  const char* segment_start = target_data;
+  while (segment_start < target_end) {
+    size_t segment_size = target_end - segment_start;
+    if (segment_size > kOptimalParseSegmentSize) {
+      segment_size = kOptimalParseSegmentSize;
+    }
+    const char* const segment_end = segment_start + segment_size;
+    segment.Reset(segment_size);
+    // Find the longest match for the block at each position in the segment.
+    // A match may extend to the left of its block, so it is recorded at the
+    // position where it starts.
+    const char* candidate_pos = segment_start;
+    if (candidate_pos <= start_of_last_block) {
+      uint32_t hash_value = hasher.Hash(candidate_pos);
+      while (1) {
+        // Every match of at least (2 * block_size - 1) bytes contains a
+        // dictionary block that starts less than block_size bytes after the
+        // start of the match, so a match need not be extended further to the
+        // left than that.  Extending it further could make FindBestMatch()
+        // prefer a match that reaches further back over one that reaches
+        // further ahead.
+        const char* match_limit = segment_start;
+        if (candidate_pos - segment_start > block_size - 1) {
+          match_limit = candidate_pos - (block_size - 1);
+        }
+        BlockHash::Match best_match;
+        FindBestMatch<look_for_target_matches>(source_hash,
+                                               hash_value,
+                                               candidate_pos,
+                                               match_limit,
+                                               target_end - match_limit,
+                                               target_hash,
+                                               target_window_start,
+                                               &best_match);
+        const char* const match_start =
+            match_limit + best_match.target_offset();
+        if (best_match.size() > 0) {
+          segment.RecordMatch(match_start - segment_start,
+                              best_match.size(),
+                              best_match.source_offset());
+        }
+        // Skip the positions covered by a long match or a long run.
+        const char* skip_to = NULL;
+        if (best_match.size() >= kOptimalParseLongMatchSize) {
+          skip_to = match_start + best_match.size();
+        } else if ((candidate_pos[0] == candidate_pos[block_size - 1]) &&
+                   (target_end - candidate_pos >=
+                    static_cast<ptrdiff_t>(kOptimalParseLongMatchSize)) &&
+                   (BlockHash::RunSizeToRight(
+                        candidate_pos,
+                        static_cast<int>(kOptimalParseLongMatchSize)) ==
+                    static_cast<int>(kOptimalParseLongMatchSize))) {
+          skip_to = candidate_pos +
+              BlockHash::RunSizeToRight(
+                  candidate_pos,
+                  static_cast<int>(target_end - candidate_pos));
+        }
+        if (skip_to) {
+          candidate_pos = skip_to;
+          if (look_for_target_matches) {
+            target_hash->AddAllBlocksThroughIndex(
+                static_cast<int>(candidate_pos - target_data));
+          }
+          if ((candidate_pos >= segment_end) ||
+              (candidate_pos > start_of_last_block)) {
+            break;
+          }
+          hash_value = hasher.Hash(candidate_pos);
+        } else {
+          if (((candidate_pos + 1) >= segment_end) ||
+              ((candidate_pos + 1) > start_of_last_block)) {
+            break;
+          }
+          if (look_for_target_matches) {
+            target_hash->AddOneIndexHash(
+                static_cast<int>(candidate_pos - target_data),
+                hash_value);
+          }
+          hash_value = hasher.UpdateHash(hash_value,
+                                         candidate_pos[0],
+                                         candidate_pos[block_size]);
+          ++candidate_pos;
+        }
+      }
+    }
+    segment_start += segment.Encode(
+        segment_start,
+        static_cast<int32_t>(source_size + (segment_start - target_data)),
+        minimum_match_size_,
+        coder);
+    if (look_for_target_matches) {
+      target_hash->AddAllBlocksThroughIndex(
+          static_cast<int>(segment_start - target_data));
+    }
+  }
+  segment.FlushPendingAdd(coder);
+  coder->Output(diff);
+}
+
+template<bool look_for_target_matches, int block_size>
+void VCDiffEngine::EncodeWithParser(const BlockHash* source_hash,
+                                    size_t source_size,
+                                    const char* target_data,
+                                    size_t target_size,
+                                    BlockHash* target_hash,
+                                    OutputStringInterface* diff,
+                                    CodeTableWriterInterface* coder) const {
+  if (optimal_parse_) {
+    EncodeOptimal<look_for_target_matches, block_size>(source_hash,
+                                                       source_size,
+                                                       target_data,
+                                                       target_size,
+                                                       target_hash,
+                                                       diff,
+                                                       coder);
+  } else {
+    EncodeInternal<look_for_target_matches, block_size>(source_hash,
+                                                        target_data,
+                                                        target_size,
+                                                        target_hash,
+                                                        diff,
+                                                        coder);
+  }
+}
+
+template<bool look_for_target_matches>
+void VCDiffEngine::EncodeWithBlockSize(const BlockHash* source_hash,
+                                       size_t source_size,
+                                       const char* target_data,
+                                       size_t target_size,
+                                       BlockHash* target_hash,
+                                       OutputStringInterface* diff,
+                                       CodeTableWriterInterface* coder) const {
+  switch (block_size_) {
+    case 8:
+      EncodeWithParser<look_for_target_matches, 8>(source_hash,
+                                                   source_size,
+                                                   target_data,
+                                                   target_size,
+                                                   target_hash,
+                                                   diff,
+                                                   coder);
+      break;
+    case 16:
+      EncodeWithParser<look_for_target_matches, 16>(source_hash,
+                                                    source_size,
+                                                    target_data,
+                                                    target_size,
+                                                    target_hash,
+                                                    diff,
+                                                    coder);
+      break;
+    case 32:
+      EncodeWithParser<look_for_target_matches, 32>(source_hash,
+                                                    source_size,
+                                                    target_data,
+                                                    target_size,
+                                                    target_hash,
+                                                    diff,
+                                                    coder);
+      break;
+    default:
+      EncodeWithParser<look_for_target_matches, 64>(source_hash,
+                                                    source_size,
+                                                    target_data,
+                                                    target_size,
+                                                    target_hash,
+                                                    diff,
+                                                    coder);
+      break;
+  }
 }
 
 void VCDiffEngine::Encode(const char* target_data,
                           size_t target_size,
                           bool look_for_target_matches,
                           OutputStringInterface* diff,
-                          CodeTableWriterInterface* coder) const {
-  if (look_for_target_matches) {
-    EncodeInternal<true>(target_data, target_size, diff, coder);
-  } else {
-    EncodeInternal<false>(target_data, target_size, diff, coder);
+                          CodeTableWriterInterface* coder,
+                          VCDiffEngineScratch* scratch) const {
+  EncodeWithSource(hashed_dictionary_,
+                   dictionary_size(),
+                   target_data,
+                   target_size,
+                   look_for_target_matches,
+                   diff,
+                   coder,
+                   scratch);
+}
+
+void VCDiffEngine::EncodeWithSource(const BlockHash* source_hash,
+                                    size_t source_size,
+                                    const char* target_data,
+                                    size_t target_size,
+                                    bool look_for_target_matches,
+                                    OutputStringInterface* diff,
+                                    CodeTableWriterInterface* coder,
+                                    VCDiffEngineScratch* scratch) const {
+  if (!look_for_target_matches) {
+    EncodeWithBlockSize<false>(source_hash, source_size,
+                               target_data, target_size, NULL, diff, coder);
+    return;
+  }
+  // Check matches against previously encoded target data
+  // in this same target window, as well as against the dictionary.
+  // A target that is smaller than one block is added without a target hash.
+  BlockHash* target_hash = NULL;
+  if (target_size >= static_cast<size_t>(block_size_)) {
+    if (scratch) {
+      target_hash = scratch->GetTargetHash(target_data,
+                                           target_size,
+                                           source_size,
+                                           block_size_);
+    } else {
+      target_hash = BlockHash::CreateTargetHash(target_data,
+                                                target_size,
+                                                source_size,
+                                                block_size_);
+    }
+    if (!target_hash) {
+      VCD_DFATAL << "Instantiation of target hash failed" << VCD_ENDL;
+      return;
+    }
+  }
+  EncodeWithBlockSize<true>(source_hash, source_size,
+                            target_data, target_size, target_hash, diff, coder);
+  if (!scratch) {
+    delete target_hash;
+  }
+}
+
+BlockHash* VCDiffEngineScratch::GetTargetHash(const char* target_data,
+                                              size_t target_size,
+                                              size_t dictionary_size,
+                                              int block_size) {
+  if (target_hash_ && (target_hash_->block_size() == block_size) &&
+      target_hash_->ResetTargetHash(target_data,
+                                    target_size,
+                                    dictionary_size)) {
+    return target_hash_;
   }
+  delete target_hash_;
+  target_hash_ = BlockHash::CreateTargetHash(target_data,
+                                             target_size,
+                                             dictionary_size,
+                                             block_size);
+  return target_hash_;
 }
 
 }  // namespace open_vcdiff
@@ -18,26 +18,76 @@
 #include <config.h>
 #include <stddef.h>  // size_t
 #include <stdint.h>  // uint32_t
+#include "blockhash.h"
 
 namespace open_vcdiff {
 
-class BlockHash;
 class OutputStringInterface;
 class CodeTableWriterInterface;
 
+// Holds the memory that VCDiffEngine::Encode() would otherwise allocate and
+// free for every target window when look_for_target_matches is true (the
+// tables of the target hash.)  Passing the same object to successive calls
+// lets them reuse that memory, which matters when many small windows are
+// encoded.  An object may be used with any VCDiffEngine, but by only one
+// thread at a time.
+class VCDiffEngineScratch {
+ public:
+  VCDiffEngineScratch() : target_hash_(NULL) { }
+
+  ~VCDiffEngineScratch() { delete target_hash_; }
+
+  // Returns a target hash that is equivalent to the result of
+  // BlockHash::CreateTargetHash() with the same arguments, or NULL if an
+  // error occurs.  The object belongs to this VCDiffEngineScratch, and is
+  // only valid until the next call to GetTargetHash().
+  BlockHash* GetTargetHash(const char* target_data,
+                           size_t target_size,
+                           size_t dictionary_size,
+                           int block_size);
+
+  // The number of bytes of memory held by this object.
+  size_t allocated_bytes() const {
+    return target_hash_ ? target_hash_->allocated_table_bytes() : 0;
+  }
+
+  // Frees the memory held by this object.
+  void Clear() {
+    delete target_hash_;
+    target_hash_ = NULL;
+  }
+
+ private:
+  BlockHash* target_hash_;
+
+  // Making these private avoids implicit copy constructor & assignment operator
+  VCDiffEngineScratch(const VCDiffEngineScratch&);
+  void operator=(const VCDiffEngineScratch&);
+};
+
 // The VCDiffEngine class is used to find the optimal encoding (in terms of COPY
 // and ADD instructions) for a given dictionary and target window.  To write the
 // instructions for this encoding, it calls the Copy() and Add() methods of the
 // code table writer object which is passed as an argument to Encode().
 class VCDiffEngine {
  public:
-  // The minimum size of a string match that is worth putting into a COPY
-  // instruction.  Since this value is more than twice the block size, the
-  // encoder will always discover a match of this size, no matter whether it is
-  // aligned on block boundaries in the dictionary text.
+  // The default minimum size of a string match that is worth putting into a
+  // COPY instruction.  Since this value is more than twice the default block
+  // size, the encoder will always discover a match of this size, no matter
+  // whether it is aligned on block boundaries in the dictionary text.
   static const size_t kMinimumMatchSize = 32;
 
-  VCDiffEngine(const char* dictionary, size_t dictionary_size);
+  // The largest value accepted by SetLazyMatchLookahead().
+  static const int kMaxLazyMatchLookahead = 64;
+
+  // If copy_dictionary is true (the default), the dictionary contents are
+  // copied into memory owned by the VCDiffEngine, and the caller may free
+  // them once the constructor returns.  If copy_dictionary is false, the
+  // VCDiffEngine refers directly to dictionary, which must remain valid and
+  // unchanged until the VCDiffEngine has been deleted.
+  VCDiffEngine(const char* dictionary,
+               size_t dictionary_size,
+               bool copy_dictionary = true);
 
   ~VCDiffEngine();
 
@@ -50,12 +100,108 @@ class VCDiffEngine {
   // on the object.
   // The Init() method is the only one allowed to treat hashed_dictionary_
   // as non-const.
-  bool Init();
+  bool Init() { return Init(1); }
+
+  // If bucketized is true, Init() will build a bucketized dictionary hash
+  // (see BlockHash::CreateBucketizedDictionaryHash) rather than a chained one.
+  // Must be called before Init(); returns false if Init() has already been
+  // called.  A bucketized dictionary hash is always built in a single thread.
+  bool SetBucketizedIndex(bool bucketized);
+
+  // Sets the size of the blocks that Init() will hash, which must satisfy
+  // BlockHash::IsValidBlockSize().  The default is BlockHash::kBlockSize.
+  // Must be called before Init(); returns false if Init() has already been
+  // called or if block_size is not valid.
+  bool SetBlockSize(int block_size);
+
+  // Sets the minimum size of a match for which Encode() will generate a COPY
+  // instruction.  The default is kMinimumMatchSize.  Matches shorter than
+  // the block size are never found, so a value below the block size has the
+  // same effect as the block size.  Must be called before Init(); returns
+  // false if Init() has already been called.
+  bool SetMinimumMatchSize(size_t minimum_match_size);
+
+  // Makes Init() index only every sampling_interval-th block of the
+  // dictionary (see BlockHash::kMaxSamplingInterval.)  The default is 1.
+  // Must be called before Init(); returns false if Init() has already been
+  // called or if sampling_interval is out of range.
+  bool SetSamplingInterval(int sampling_interval);
+
+  // Makes Init() double the sampling interval as many times as necessary
+  // for the hash tables to fit into max_index_bytes (as computed by
+  // BlockHash::CalcIndexSize), or until it reaches its maximum value.
+  // Zero (the default) means there is no limit.  Must be called before
+  // Init(); returns false if Init() has already been called.
+  bool SetIndexMemoryBudget(size_t max_index_bytes);
+
+  // Makes Encode() defer each COPY instruction until it has also looked for
+  // matches at the next lookahead target positions, and use the longest of
+  // the matches found.  Zero (the default) means that the first match that
+  // is long enough is used.  Must be called before Init(); returns false if
+  // Init() has already been called or if lookahead is out of range.
+  bool SetLazyMatchLookahead(int lookahead);
+
+  // Makes Encode() choose its COPY and ADD instructions by minimizing an
+  // estimate of the encoded size of each segment of the target, rather than
+  // by taking the first (or, with lazy matching, the longest nearby) match.
+  // When enabled, the lazy match lookahead is ignored.  The default is false.
+  // Must be called before Init(); returns false if Init() has already been
+  // called.
+  bool SetOptimalParse(bool optimal_parse);
+
+  // Makes Encode() extend a dictionary match that reaches the end of the
+  // dictionary into the beginning of the target window (see
+  // BlockHash::FindBestMatch), producing COPY instructions that cross the
+  // boundary between source and target data.  The default is false.  Must be
+  // called before Init(); returns false if Init() has already been called.
+  bool SetCrossBoundaryMatching(bool cross_boundary_matching);
+
+  // Like Init(), but hashes the dictionary using up to thread_count threads.
+  // The result does not depend on the number of threads used.
+  bool Init(int thread_count);
+
+  // Appends to *index_image a self-contained, versioned image of the
+  // dictionary contents together with its block hash tables.  The image can
+  // later be passed to CreateFromSerializedIndex(), possibly by a different
+  // process, to recreate an equivalent, initialized VCDiffEngine without
+  // recomputing any hash values.  The image uses the native byte order and
+  // int size, and is rejected by CreateFromSerializedIndex() on a machine
+  // where those differ.  Init() must have been called successfully before
+  // calling this function.  Returns true on success.
+  bool SerializeIndex(OutputStringInterface* index_image) const;
+
+  // Creates a VCDiffEngine from an image previously produced by
+  // SerializeIndex().  The dictionary contents and hash tables are NOT copied:
+  // the returned object refers directly to index_image, which must remain
+  // valid and unchanged until the returned object has been deleted.  This
+  // allows the image to be mapped into memory read-only (for example, using
+  // mmap with MAP_SHARED) and shared between processes.  index_image must be
+  // aligned to at least sizeof(int) bytes; memory returned by mmap or new[]
+  // satisfies this requirement.  The returned object has already been
+  // initialized, and Init() must not be called on it.  Returns NULL if the
+  // image is truncated, corrupted, or was produced by an incompatible version
+  // or platform.
+  static const VCDiffEngine* CreateFromSerializedIndex(const char* index_image,
+                                                       size_t image_size);
 
   const char *dictionary() const { return dictionary_; }
 
   size_t dictionary_size() const { return dictionary_size_; }
 
+  int block_size() const { return block_size_; }
+
+  size_t minimum_match_size() const { return minimum_match_size_; }
+
+  // After Init(), returns the sampling interval actually used, which may
+  // have been increased to meet the index memory budget.
+  int sampling_interval() const { return sampling_interval_; }
+
+  int lazy_match_lookahead() const { return lazy_match_lookahead_; }
+
+  bool optimal_parse() const { return optimal_parse_; }
+
+  bool cross_boundary_matching() const { return cross_boundary_matching_; }
+
   // Main worker function.  Finds the best matches between the dictionary
   // (source) and target data, and uses the coder to write a
   // delta file window into *diff.
@@ -69,51 +215,155 @@ class VCDiffEngine {
   // within the previously encoded target data, or just within the source
   // (dictionary) data.  Please see vcencoder.h for a full explanation
   // of this parameter.
+  //
+  // If scratch is not NULL, the memory that it holds is reused rather than
+  // allocating new memory for this window (see VCDiffEngineScratch.)
   void Encode(const char* target_data,
               size_t target_size,
               bool look_for_target_matches,
               OutputStringInterface* diff,
-              CodeTableWriterInterface* coder) const;
+              CodeTableWriterInterface* coder,
+              VCDiffEngineScratch* scratch = NULL) const;
+
+  // Like Encode(), but finds matches within source_hash rather than within
+  // the dictionary.  source_hash must have been created with the same block
+  // size as this object (see block_size()), and must hash the source_size
+  // bytes that the coder will address as the source segment of the window.
+  // The dictionary is not used at all, and cross-boundary matching (see
+  // SetCrossBoundaryMatching) applies only when source_hash is the hash of
+  // the dictionary.
+  void EncodeWithSource(const BlockHash* source_hash,
+                        size_t source_size,
+                        const char* target_data,
+                        size_t target_size,
+                        bool look_for_target_matches,
+                        OutputStringInterface* diff,
+                        CodeTableWriterInterface* coder,
+                        VCDiffEngineScratch* scratch = NULL) const;
 
  private:
-  static bool ShouldGenerateCopyInstructionForMatchOfSize(size_t size) {
-    return size >= kMinimumMatchSize;
+  bool ShouldGenerateCopyInstructionForMatchOfSize(size_t size) const {
+    return size >= minimum_match_size_;
   }
 
+  // Calls the version of EncodeWithParser() for block_size_.
+  template<bool look_for_target_matches>
+  void EncodeWithBlockSize(const BlockHash* source_hash,
+                           size_t source_size,
+                           const char* target_data,
+                           size_t target_size,
+                           BlockHash* target_hash,
+                           OutputStringInterface* diff,
+                           CodeTableWriterInterface* coder) const;
+
+  // Calls EncodeOptimal() if optimal_parse_ is true, or EncodeInternal()
+  // otherwise.
+  template<bool look_for_target_matches, int block_size>
+  void EncodeWithParser(const BlockHash* source_hash,
+                        size_t source_size,
+                        const char* target_data,
+                        size_t target_size,
+                        BlockHash* target_hash,
+                        OutputStringInterface* diff,
+                        CodeTableWriterInterface* coder) const;
+
   // The following two functions use templates to produce two different
   // versions of the code depending on the value of the option
   // look_for_target_matches.  This approach saves a test-and-branch instruction
-  // within the inner loop of EncodeCopyForBestMatch.
-  template<bool look_for_target_matches>
-  void EncodeInternal(const char* target_data,
+  // within the inner loop of EncodeCopyForBestMatch.  EncodeInternal is also
+  // instantiated for each allowed block size, so that the rolling hash
+  // in the inner loop uses a constant window size.  If look_for_target_matches
+  // is true and the target is at least one block long, target_hash must be
+  // an empty target hash of the target data (see
+  // BlockHash::CreateTargetHash); otherwise it is ignored.
+  template<bool look_for_target_matches, int block_size>
+  void EncodeInternal(const BlockHash* source_hash,
+                      const char* target_data,
                       size_t target_size,
+                      BlockHash* target_hash,
                       OutputStringInterface* diff,
                       CodeTableWriterInterface* coder) const;
 
-  // If look_for_target_matches is true, then target_hash must point to a valid
-  // BlockHash object, and cannot be NULL.  If look_for_target_matches is
-  // false, then the value of target_hash is ignored.
+  // The encoder used when optimal_parse_ is true.  It first finds the longest
+  // match that starts at each position of a segment of the target, then picks
+  // the sequence of instructions with the lowest estimated cost.
+  template<bool look_for_target_matches, int block_size>
+  void EncodeOptimal(const BlockHash* source_hash,
+                     size_t source_size,
+                     const char* target_data,
+                     size_t target_size,
+                     BlockHash* target_hash,
+                     OutputStringInterface* diff,
+                     CodeTableWriterInterface* coder) const;
+
+  // Looks for a match for the block at target_candidate_start within
+  // source_hash and, if look_for_target_matches is true, within
+  // target_hash, which must then point to a valid BlockHash object.  If
+  // look_for_target_matches is false, the value of target_hash is ignored.
+  // If target_window_start is not NULL, a dictionary match that reaches the
+  // end of the dictionary continues into the target window that starts there.
+  // Replaces *best_match only with a longer match.
   template<bool look_for_target_matches>
-  size_t EncodeCopyForBestMatch(uint32_t hash_value,
-                                const char* target_candidate_start,
-                                const char* unencoded_target_start,
-                                size_t unencoded_target_size,
-                                const BlockHash* target_hash,
-                                CodeTableWriterInterface* coder) const;
+  void FindBestMatch(const BlockHash* source_hash,
+                     uint32_t hash_value,
+                     const char* target_candidate_start,
+                     const char* unencoded_target_start,
+                     size_t unencoded_target_size,
+                     const BlockHash* target_hash,
+                     const char* target_window_start,
+                     BlockHash::Match* best_match) const;
+
+  size_t EncodeCopyForMatch(const BlockHash::Match& match,
+                            const char* unencoded_target_start,
+                            CodeTableWriterInterface* coder) const;
+
+  size_t FindRun(const char* target_candidate_start,
+                 int block_size,
+                 const char* unencoded_target_start,
+                 const char* target_end,
+                 const char** run_start) const;
+
+  size_t EncodeRun(const char* run_start,
+                   size_t run_size,
+                   const char* unencoded_target_start,
+                   CodeTableWriterInterface* coder) const;
 
   void AddUnmatchedRemainder(const char* unencoded_target_start,
                              size_t unencoded_target_size,
                              CodeTableWriterInterface* coder) const;
 
-  const char* dictionary_;  // A copy of the dictionary contents
+  const char* dictionary_;  // The dictionary contents
 
   const size_t dictionary_size_;
 
-  // A hash that contains one element for every kBlockSize bytes of dictionary_.
+  // True if dictionary_ points to a copy of the dictionary contents that was
+  // allocated by this object; false if it points to memory that belongs to
+  // the caller.
+  const bool owns_dictionary_;
+
+  // A hash that contains one element for every block_size_ bytes of
+  // dictionary_.
   // This can be reused to encode many different target strings using the
   // same dictionary, without the need to compute the hash values each time.
   const BlockHash* hashed_dictionary_;
 
+  // Set by SetBucketizedIndex().
+  bool bucketized_index_;
+
+  // Set by SetBlockSize() and SetMinimumMatchSize().
+  int block_size_;
+  size_t minimum_match_size_;
+
+  // Set by SetSamplingInterval() and SetIndexMemoryBudget().
+  int sampling_interval_;
+  size_t index_memory_budget_;
+
+  // Set by SetLazyMatchLookahead(), SetOptimalParse() and
+  // SetCrossBoundaryMatching().
+  int lazy_match_lookahead_;
+  bool optimal_parse_;
+  bool cross_boundary_matching_;
+
   // Making these private avoids implicit copy constructor & assignment operator
   VCDiffEngine(const VCDiffEngine&);
   void operator=(const VCDiffEngine&);
@@ -27,12 +27,18 @@
 // encoders or accepted by other decoders.
 
 #include <config.h>
+#include <string.h>  // memcpy, memmove
+#include <algorithm>  // std::max, std::min
+#include <string>
+#include <vector>
+#include "blockhash.h"
 #include "checksum.h"
 #include "google/encodetable.h"
 #include "google/output_string.h"
 #include "google/vcencoder.h"
 #include "google/jsonwriter.h"
 #include "logging.h"
+#include "parallel.h"
 #include "unique_ptr.h" // auto_ptr, unique_ptr
 #include "vcdiffengine.h"
 
@@ -60,18 +66,370 @@ HashedDictionary::HashedDictionary(const char* dictionary_contents,
                                    size_t dictionary_size)
     : engine_(new VCDiffEngine(dictionary_contents, dictionary_size)) { }
 
+HashedDictionary::HashedDictionary(const char* dictionary_contents,
+                                   size_t dictionary_size,
+                                   bool copy_dictionary)
+    : engine_(new VCDiffEngine(dictionary_contents,
+                               dictionary_size,
+                               copy_dictionary)) { }
+
 HashedDictionary::~HashedDictionary() { delete engine_; }
 
+HashedDictionary::HashedDictionary(const VCDiffEngine* engine)
+    : engine_(engine) { }
+
 bool HashedDictionary::Init() {
   return const_cast<VCDiffEngine*>(engine_)->Init();
 }
 
+bool HashedDictionary::SetIndexLayout(IndexLayout layout) {
+  return const_cast<VCDiffEngine*>(engine_)->SetBucketizedIndex(
+      layout == kBucketizedIndex);
+}
+
+bool HashedDictionary::SetBlockSize(int block_size) {
+  return const_cast<VCDiffEngine*>(engine_)->SetBlockSize(block_size);
+}
+
+bool HashedDictionary::SetMinimumMatchSize(size_t minimum_match_size) {
+  return const_cast<VCDiffEngine*>(engine_)->SetMinimumMatchSize(
+      minimum_match_size);
+}
+
+bool HashedDictionary::SetSamplingInterval(int sampling_interval) {
+  return const_cast<VCDiffEngine*>(engine_)->SetSamplingInterval(
+      sampling_interval);
+}
+
+bool HashedDictionary::SetIndexMemoryBudget(size_t max_index_bytes) {
+  return const_cast<VCDiffEngine*>(engine_)->SetIndexMemoryBudget(
+      max_index_bytes);
+}
+
+bool HashedDictionary::SetLazyMatchLookahead(int lookahead) {
+  return const_cast<VCDiffEngine*>(engine_)->SetLazyMatchLookahead(lookahead);
+}
+
+bool HashedDictionary::SetOptimalParse(bool optimal_parse) {
+  return const_cast<VCDiffEngine*>(engine_)->SetOptimalParse(optimal_parse);
+}
+
+bool HashedDictionary::SetCrossBoundaryMatching(bool cross_boundary_matching) {
+  return const_cast<VCDiffEngine*>(engine_)->SetCrossBoundaryMatching(
+      cross_boundary_matching);
+}
+
+bool HashedDictionary::Init(int thread_count) {
+  return const_cast<VCDiffEngine*>(engine_)->Init(thread_count);
+}
+
+bool HashedDictionary::SerializeToInterface(
+    OutputStringInterface* index_image) const {
+  return engine_->SerializeIndex(index_image);
+}
+
+const HashedDictionary* HashedDictionary::CreateFromSerialized(
+    const char* index_image,
+    size_t image_size) {
+  const VCDiffEngine* engine =
+      VCDiffEngine::CreateFromSerializedIndex(index_image, image_size);
+  if (!engine) {
+    return NULL;
+  }
+  return new HashedDictionary(engine);
+}
+
+// Encodes each of a sequence of consecutive, equal-sized windows of target
+// data (the last one may be shorter) into a separate string, using a separate
+// code table writer for each window.  Because the engine resets all of its
+// per-window state (the target hash and the address cache) at the start of
+// each window, the result is the same as encoding the windows one at a time
+// with a single writer, and the windows can be encoded in any order.
+class WindowEncodingTask : public ParallelTask {
+ public:
+  WindowEncodingTask(const VCDiffEngine* engine,
+                     VCDiffFormatExtensionFlags format_extensions,
+                     bool look_for_target_matches,
+                     const char* data,
+                     size_t len,
+                     size_t window_size)
+      : engine_(engine),
+        format_extensions_(format_extensions),
+        look_for_target_matches_(look_for_target_matches),
+        data_(data),
+        len_(len),
+        window_size_(window_size),
+        encoded_windows_(NumberOfWindows()),
+        window_succeeded_(NumberOfWindows(), false) { }
+
+  int NumberOfWindows() const {
+    return static_cast<int>((len_ + window_size_ - 1) / window_size_);
+  }
+
+  virtual void Run(int window_number) {
+    const size_t window_start = window_number * window_size_;
+    const size_t window_len = std::min(window_size_, len_ - window_start);
+    UNIQUE_PTR<CodeTableWriterInterface> coder(
+        create_writer(format_extensions_));
+    if (!coder->Init(engine_->dictionary_size())) {
+      return;
+    }
+    if ((format_extensions_ & VCD_FORMAT_CHECKSUM) != 0) {
+      coder->AddChecksum(ComputeAdler32(data_ + window_start, window_len));
+    }
+    OutputString<std::string> out(&encoded_windows_[window_number]);
+    engine_->Encode(data_ + window_start,
+                    window_len,
+                    look_for_target_matches_,
+                    &out,
+                    coder.get());
+    window_succeeded_[window_number] = true;
+  }
+
+  // Appends the encoded windows, in order, to *out.  Returns false if any
+  // window could not be encoded.
+  bool AppendEncodedWindows(OutputStringInterface* out) const {
+    size_t total_size = 0;
+    for (int i = 0; i < NumberOfWindows(); ++i) {
+      if (!window_succeeded_[i]) {
+        VCD_DFATAL << "Internal error: "
+                      "Initialization of code table writer failed" << VCD_ENDL;
+        return false;
+      }
+      total_size += encoded_windows_[i].size();
+    }
+    out->ReserveAdditionalBytes(total_size);
+    for (int i = 0; i < NumberOfWindows(); ++i) {
+      out->append(encoded_windows_[i].data(), encoded_windows_[i].size());
+    }
+    return true;
+  }
+
+ private:
+  const VCDiffEngine* const engine_;
+  const VCDiffFormatExtensionFlags format_extensions_;
+  const bool look_for_target_matches_;
+  const char* const data_;
+  const size_t len_;
+  const size_t window_size_;
+
+  // Each window is encoded into its own element of these vectors,
+  // so that no two threads write to the same memory.
+  std::vector<std::string> encoded_windows_;
+  std::vector<char> window_succeeded_;
+
+  // Making these private avoids implicit copy constructor & assignment operator
+  WindowEncodingTask(const WindowEncodingTask&);  // NOLINT
+  void operator=(const WindowEncodingTask&);
+};
+
+// The largest position or size of a VCD_TARGET source segment that the
+// decoder accepts: both are parsed as non-negative 32-bit integers.
+const size_t kMaxTargetSourceSegmentEnd = 0x7FFFFFFF;
+
+// Holds up to history_size bytes of the most recently encoded target data
+// (see VCDiffStreamingEncoder::SetTargetHistory), together with a BlockHash
+// of that data which is extended as each window is encoded, rather than
+// being rebuilt for every window.  The history is followed in the same buffer
+// by a copy of the window being encoded, so that the buffer has the same
+// layout as the address space of a delta window whose source segment is the
+// history: a match that runs past the end of the history continues into the
+// window itself, just as a COPY instruction may.  When the buffer is full,
+// the last history_size bytes are moved to its beginning and rehashed, so the
+// history holds between history_size and about twice that many bytes.
+class TargetHistory {
+ public:
+  TargetHistory(size_t history_size, int block_size)
+      : history_size_(history_size),
+        block_size_(block_size),
+        hash_(NULL),
+        history_length_(0),
+        hashed_through_index_(0),
+        total_length_(0) { }
+
+  ~TargetHistory() { delete hash_; }
+
+  // Copies data[0, len - 1] into the buffer, immediately after the history,
+  // first discarding the oldest history data if there is not enough room.
+  // Returns false if the window cannot be encoded against the history (for
+  // example, because the target has grown too large to be addressed using
+  // VCD_TARGET), in which case the history is discarded.
+  bool PrepareWindow(const char* data, size_t len) {
+    if ((total_length_ + len > kMaxTargetSourceSegmentEnd) ||
+        (history_size_ + len > kMaxTargetSourceSegmentEnd)) {
+      Discard();
+      return false;
+    }
+    if (!hash_ || (history_length_ + len > buffer_.size())) {
+      const size_t keep = std::min(history_size_, history_length_);
+      const size_t capacity = std::max(2 * history_size_, keep + len);
+      if (capacity > buffer_.size()) {
+        std::vector<char> new_buffer(capacity);
+        if (keep > 0) {
+          memcpy(&new_buffer[0], &buffer_[history_length_ - keep], keep);
+        }
+        buffer_.swap(new_buffer);
+      } else if (keep > 0) {
+        memmove(&buffer_[0], &buffer_[history_length_ - keep], keep);
+      }
+      history_length_ = keep;
+      hashed_through_index_ = 0;
+      delete hash_;
+      hash_ = BlockHash::CreateTargetHash(&buffer_[0],
+                                          buffer_.size(),
+                                          /* dictionary_size = */ 0,
+                                          block_size_);
+      if (!hash_) {
+        Discard();
+        return false;
+      }
+      HashHistory();
+    }
+    memcpy(&buffer_[history_length_], data, len);
+    return true;
+  }
+
+  // Makes the len bytes of the window most recently passed to PrepareWindow()
+  // part of the history.  If PrepareWindow() returned false, only records
+  // that len more bytes of target data have been encoded.
+  void CommitWindow(size_t len) {
+    total_length_ += len;
+    if (hash_) {
+      history_length_ += len;
+      HashHistory();
+    }
+  }
+
+  const BlockHash* hash() const { return hash_; }
+
+  size_t size() const { return history_length_; }
+
+  // The position of the history within the target file.
+  size_t position() const { return total_length_ - history_length_; }
+
+  // The copy of the window made by PrepareWindow().
+  const char* window_data() const { return &buffer_[history_length_]; }
+
+ private:
+  // Adds to hash_ every block that lies entirely within the history.
+  void HashHistory() {
+    if (history_length_ < static_cast<size_t>(block_size_)) {
+      return;
+    }
+    const size_t end_index = history_length_ - block_size_ + 1;
+    if (end_index > hashed_through_index_) {
+      hash_->AddAllBlocksThroughIndex(static_cast<int>(end_index));
+      hashed_through_index_ = end_index;
+    }
+  }
+
+  void Discard() {
+    delete hash_;
+    hash_ = NULL;
+    history_length_ = 0;
+    hashed_through_index_ = 0;
+  }
+
+  const size_t history_size_;
+  const int block_size_;
+
+  std::vector<char> buffer_;
+  BlockHash* hash_;
+
+  // The history is buffer_[0, history_length_ - 1].  The blocks that begin
+  // before hashed_through_index_ have been added to hash_.
+  size_t history_length_;
+  size_t hashed_through_index_;
+
+  // The number of bytes of target data encoded so far.
+  size_t total_length_;
+
+  // Making these private avoids implicit copy constructor & assignment operator
+  TargetHistory(const TargetHistory&);  // NOLINT
+  void operator=(const TargetHistory&);
+};
+
+class VCDiffEncoderArenaImpl {
+ public:
+  explicit VCDiffEncoderArenaImpl(size_t max_retained_bytes)
+      : max_retained_bytes_(max_retained_bytes),
+        lent_(false) { }
+
+  // Lends the section buffers to writer, and scratch() to its encoder.
+  // Returns false if the arena is already lent.
+  bool Lend(VCDiffCodeTableWriter* writer) {
+    if (lent_) {
+      VCD_ERROR << "VCDiffEncoderArena is already in use by another encoder"
+                << VCD_ENDL;
+      return false;
+    }
+    writer->SwapSectionBuffers(&instructions_and_sizes_,
+                               &data_for_add_and_run_,
+                               &addresses_for_copy_);
+    lent_ = true;
+    return true;
+  }
+
+  // Takes back the section buffers from writer, which must be the same
+  // writer that was passed to Lend().
+  void GiveBack(VCDiffCodeTableWriter* writer) {
+    writer->SwapSectionBuffers(&instructions_and_sizes_,
+                               &data_for_add_and_run_,
+                               &addresses_for_copy_);
+    lent_ = false;
+    if ((max_retained_bytes_ > 0) && (retained_bytes() > max_retained_bytes_)) {
+      std::string().swap(instructions_and_sizes_);
+      std::string().swap(data_for_add_and_run_);
+      std::string().swap(addresses_for_copy_);
+      scratch_.Clear();
+    }
+  }
+
+  VCDiffEngineScratch* scratch() { return &scratch_; }
+
+  size_t retained_bytes() const {
+    return AllocatedBytes(instructions_and_sizes_) +
+           AllocatedBytes(data_for_add_and_run_) +
+           AllocatedBytes(addresses_for_copy_) +
+           scratch_.allocated_bytes();
+  }
+
+ private:
+  // Does not count the capacity that an empty string has without allocating.
+  static size_t AllocatedBytes(const std::string& s) {
+    return s.capacity() - std::string().capacity();
+  }
+
+  const size_t max_retained_bytes_;
+  bool lent_;
+
+  // While the arena is not lent, these hold the memory that it retains.
+  std::string instructions_and_sizes_;
+  std::string data_for_add_and_run_;
+  std::string addresses_for_copy_;
+  VCDiffEngineScratch scratch_;
+
+  // Making these private avoids implicit copy constructor & assignment operator
+  VCDiffEncoderArenaImpl(const VCDiffEncoderArenaImpl&);  // NOLINT
+  void operator=(const VCDiffEncoderArenaImpl&);
+};
+
 class VCDiffStreamingEncoderImpl {
  public:
+  // uses_default_writer must be true if writer was created by create_writer().
   VCDiffStreamingEncoderImpl(const HashedDictionary* dictionary,
                              VCDiffFormatExtensionFlags format_extensions,
                              bool look_for_target_matches,
-                             CodeTableWriterInterface* writer);
+                             CodeTableWriterInterface* writer,
+                             bool uses_default_writer);
+
+  ~VCDiffStreamingEncoderImpl();
+
+  bool SetWindowedEncoding(size_t window_size, int thread_count);
+
+  bool SetTargetHistory(size_t history_size);
+
+  bool SetArena(VCDiffEncoderArenaImpl* arena);
 
   // These functions are identical to their counterparts
   // in VCDiffStreamingEncoder.
@@ -82,6 +440,23 @@ class VCDiffStreamingEncoderImpl {
   bool FinishEncoding(OutputStringInterface* out);
 
  private:
+  // Encodes data[0, len - 1] as a single delta window using coder_.
+  void EncodeWindow(const char* data, size_t len, OutputStringInterface* out);
+
+  // Encodes data[0, len - 1] against both the dictionary and history_, and
+  // appends whichever delta window is smaller.
+  void EncodeWindowWithHistory(const char* data,
+                               size_t len,
+                               OutputStringInterface* out);
+
+  // Gives arena_ back if it is lent to this encoder.
+  void GiveBackArena();
+
+  // The memory that the engine reuses from one window to the next.
+  VCDiffEngineScratch* scratch() {
+    return arena_lent_ ? arena_->scratch() : &scratch_;
+  }
+
   const VCDiffEngine* engine_;
 
   UNIQUE_PTR<CodeTableWriterInterface> coder_;
@@ -93,6 +468,30 @@ class VCDiffStreamingEncoderImpl {
   // vcencoder.h for a full explanation of this parameter.
   const bool look_for_target_matches_;
 
+  // True if coder_ was created by create_writer() rather than supplied by
+  // the caller.  Windowed encoding is only supported in that case, because
+  // it creates additional writers of the same type.
+  const bool uses_default_writer_;
+
+  // Memory that the engine reuses from one window to the next, unless
+  // arena_ is lent to this encoder (see VCDiffStreamingEncoder::SetArena.)
+  VCDiffEngineScratch scratch_;
+  VCDiffEncoderArenaImpl* arena_;
+  bool arena_lent_;
+
+  // If nonzero, each chunk is divided into windows of this many bytes (see
+  // VCDiffStreamingEncoder::SetWindowedEncoding), which are encoded using up
+  // to thread_count_ threads.
+  size_t window_size_;
+  int thread_count_;
+
+  // If not NULL, the previously encoded target data that may be used as the
+  // source segment of a window (see VCDiffStreamingEncoder::SetTargetHistory.)
+  // The two trial encodings of each window are written to the scratch strings.
+  UNIQUE_PTR<TargetHistory> history_;
+  std::string dictionary_window_;
+  std::string history_window_;
+
   // This state variable is used to ensure that StartEncoding(), EncodeChunk(),
   // and FinishEncoding() are called in the correct order.  It will be true
   // if StartEncoding() has been called, followed by zero or more calls to
@@ -109,13 +508,96 @@ inline VCDiffStreamingEncoderImpl::VCDiffStreamingEncoderImpl(
     const HashedDictionary* dictionary,
     VCDiffFormatExtensionFlags format_extensions,
     bool look_for_target_matches,
-    CodeTableWriterInterface* writer)
+    CodeTableWriterInterface* writer,
+    bool uses_default_writer)
     : engine_(dictionary->engine()),
       coder_(writer),
       format_extensions_(format_extensions),
       look_for_target_matches_(look_for_target_matches),
+      uses_default_writer_(uses_default_writer),
+      arena_(NULL),
+      arena_lent_(false),
+      window_size_(0),
+      thread_count_(1),
       encode_chunk_allowed_(false) { }
 
+VCDiffStreamingEncoderImpl::~VCDiffStreamingEncoderImpl() {
+  GiveBackArena();
+}
+
+inline bool VCDiffStreamingEncoderImpl::SetWindowedEncoding(
+    size_t window_size,
+    int thread_count) {
+  if (encode_chunk_allowed_) {
+    VCD_ERROR << "SetWindowedEncoding called after StartEncoding" << VCD_ENDL;
+    return false;
+  }
+  if (!uses_default_writer_ || ((format_extensions_ & VCD_FORMAT_JSON) != 0)) {
+    VCD_ERROR << "Windowed encoding is only supported"
+                 " with the standard VCDIFF writer" << VCD_ENDL;
+    return false;
+  }
+  if (history_.get() && (thread_count >= 2)) {
+    VCD_ERROR << "Multithreaded windowed encoding cannot be combined"
+                 " with a target history" << VCD_ENDL;
+    return false;
+  }
+  window_size_ = window_size;
+  thread_count_ = thread_count;
+  return true;
+}
+
+inline bool VCDiffStreamingEncoderImpl::SetTargetHistory(size_t history_size) {
+  if (encode_chunk_allowed_) {
+    VCD_ERROR << "SetTargetHistory called after StartEncoding" << VCD_ENDL;
+    return false;
+  }
+  if (!uses_default_writer_ || ((format_extensions_ & VCD_FORMAT_JSON) != 0)) {
+    VCD_ERROR << "A target history is only supported"
+                 " with the standard VCDIFF writer" << VCD_ENDL;
+    return false;
+  }
+  if ((window_size_ > 0) && (thread_count_ >= 2)) {
+    VCD_ERROR << "A target history cannot be combined"
+                 " with multithreaded windowed encoding" << VCD_ENDL;
+    return false;
+  }
+  if (history_size > kMaxTargetSourceSegmentEnd / 2) {
+    VCD_ERROR << "Target history size " << history_size
+              << " is too large" << VCD_ENDL;
+    return false;
+  }
+  if (history_size == 0) {
+    history_.reset();
+  } else {
+    history_.reset(new TargetHistory(history_size, engine_->block_size()));
+  }
+  return true;
+}
+
+inline bool VCDiffStreamingEncoderImpl::SetArena(
+    VCDiffEncoderArenaImpl* arena) {
+  if (encode_chunk_allowed_) {
+    VCD_ERROR << "SetArena called after StartEncoding" << VCD_ENDL;
+    return false;
+  }
+  if (!uses_default_writer_ || ((format_extensions_ & VCD_FORMAT_JSON) != 0)) {
+    VCD_ERROR << "An encoder arena is only supported"
+                 " with the standard VCDIFF writer" << VCD_ENDL;
+    return false;
+  }
+  GiveBackArena();
+  arena_ = arena;
+  return true;
+}
+
+void VCDiffStreamingEncoderImpl::GiveBackArena() {
+  if (arena_lent_) {
+    arena_->GiveBack(static_cast<VCDiffCodeTableWriter*>(coder_.get()));
+    arena_lent_ = false;
+  }
+}
+
 inline bool VCDiffStreamingEncoderImpl::StartEncoding(
     OutputStringInterface* out) {
   if (!coder_->Init(engine_->dictionary_size())) {
@@ -123,6 +605,13 @@ inline bool VCDiffStreamingEncoderImpl::StartEncoding(
                   "Initialization of code table writer failed" << VCD_ENDL;
     return false;
   }
+  if (arena_ && !arena_lent_) {
+    // SetArena() only accepts the default VCDIFF writer.
+    if (!arena_->Lend(static_cast<VCDiffCodeTableWriter*>(coder_.get()))) {
+      return false;
+    }
+    arena_lent_ = true;
+  }
   if (!coder_->VerifyDictionary(engine_->dictionary(),
                                 engine_->dictionary_size())) {
     VCD_ERROR << "Dictionary not valid for writer" << VCD_ENDL;
@@ -145,11 +634,87 @@ inline bool VCDiffStreamingEncoderImpl::EncodeChunk(
     VCD_ERROR << "Target chunk not valid for writer" << VCD_ENDL;
     return false;
   }
+  if ((window_size_ > 0) && (len > window_size_)) {
+    if (thread_count_ >= 2) {
+      WindowEncodingTask task(engine_,
+                              format_extensions_,
+                              look_for_target_matches_,
+                              data,
+                              len,
+                              window_size_);
+      RunInParallel(&task, task.NumberOfWindows(), thread_count_);
+      return task.AppendEncodedWindows(out);
+    }
+    for (size_t window_start = 0; window_start < len;
+         window_start += window_size_) {
+      EncodeWindow(data + window_start,
+                   std::min(window_size_, len - window_start),
+                   out);
+    }
+    return true;
+  }
+  EncodeWindow(data, len, out);
+  return true;
+}
+
+inline void VCDiffStreamingEncoderImpl::EncodeWindow(
+    const char* data,
+    size_t len,
+    OutputStringInterface* out) {
+  if (history_.get() && (len > 0)) {
+    EncodeWindowWithHistory(data, len, out);
+    return;
+  }
   if ((format_extensions_ & VCD_FORMAT_CHECKSUM) != 0) {
     coder_->AddChecksum(ComputeAdler32(data, len));
   }
-  engine_->Encode(data, len, look_for_target_matches_, out, coder_.get());
-  return true;
+  engine_->Encode(data, len, look_for_target_matches_, out, coder_.get(),
+                  scratch());
+}
+
+void VCDiffStreamingEncoderImpl::EncodeWindowWithHistory(
+    const char* data,
+    size_t len,
+    OutputStringInterface* out) {
+  // SetTargetHistory() only accepts the default VCDIFF writer.
+  VCDiffCodeTableWriter* const writer =
+      static_cast<VCDiffCodeTableWriter*>(coder_.get());
+  const bool add_checksum = ((format_extensions_ & VCD_FORMAT_CHECKSUM) != 0);
+  const VCDChecksum checksum = add_checksum ? ComputeAdler32(data, len) : 0;
+  const bool use_history = history_->PrepareWindow(data, len) &&
+                           (history_->size() > 0);
+  if (use_history) {
+    history_window_.clear();
+    OutputString<std::string> history_out(&history_window_);
+    writer->SetTargetSourceSegment(history_->position(), history_->size());
+    if (add_checksum) {
+      writer->AddChecksum(checksum);
+    }
+    engine_->EncodeWithSource(history_->hash(),
+                              history_->size(),
+                              history_->window_data(),
+                              len,
+                              look_for_target_matches_,
+                              &history_out,
+                              writer,
+                              scratch());
+  }
+  if (!use_history || (engine_->dictionary_size() > 0)) {
+    dictionary_window_.clear();
+    OutputString<std::string> dictionary_out(&dictionary_window_);
+    if (add_checksum) {
+      writer->AddChecksum(checksum);
+    }
+    engine_->Encode(data, len, look_for_target_matches_, &dictionary_out,
+                    writer, scratch());
+  }
+  const std::string* best_window = &dictionary_window_;
+  if (use_history && ((engine_->dictionary_size() == 0) ||
+                      (history_window_.size() < dictionary_window_.size()))) {
+    best_window = &history_window_;
+  }
+  out->append(best_window->data(), best_window->size());
+  history_->CommitWindow(len);
 }
 
 inline bool VCDiffStreamingEncoderImpl::FinishEncoding(
@@ -160,9 +725,19 @@ inline bool VCDiffStreamingEncoderImpl::FinishEncoding(
   }
   encode_chunk_allowed_ = false;
   coder_->FinishEncoding(out);
+  GiveBackArena();
   return true;
 }
 
+VCDiffEncoderArena::VCDiffEncoderArena(size_t max_retained_bytes)
+    : impl_(new VCDiffEncoderArenaImpl(max_retained_bytes)) { }
+
+VCDiffEncoderArena::~VCDiffEncoderArena() { delete impl_; }
+
+size_t VCDiffEncoderArena::retained_bytes() const {
+  return impl_->retained_bytes();
+}
+
 VCDiffStreamingEncoder::VCDiffStreamingEncoder(
     const HashedDictionary* dictionary,
     VCDiffFormatExtensionFlags format_extensions,
@@ -171,7 +746,8 @@ VCDiffStreamingEncoder::VCDiffStreamingEncoder(
           dictionary,
           format_extensions,
           look_for_target_matches,
-          create_writer(format_extensions))) { }
+          create_writer(format_extensions),
+          /* uses_default_writer = */ true)) { }
 
 VCDiffStreamingEncoder::VCDiffStreamingEncoder(
     const HashedDictionary* dictionary,
@@ -181,10 +757,25 @@ VCDiffStreamingEncoder::VCDiffStreamingEncoder(
     : impl_(new VCDiffStreamingEncoderImpl(dictionary,
                                            format_extensions,
                                            look_for_target_matches,
-                                           writer)) { }
+                                           writer,
+                                           /* uses_default_writer = */ false)) {
+}
 
 VCDiffStreamingEncoder::~VCDiffStreamingEncoder() { delete impl_; }
 
+bool VCDiffStreamingEncoder::SetWindowedEncoding(size_t window_size,
+                                                 int thread_count) {
+  return impl_->SetWindowedEncoding(window_size, thread_count);
+}
+
+bool VCDiffStreamingEncoder::SetTargetHistory(size_t history_size) {
+  return impl_->SetTargetHistory(history_size);
+}
+
+bool VCDiffStreamingEncoder::SetArena(VCDiffEncoderArena* arena) {
+  return impl_->SetArena(arena ? arena->impl_ : NULL);
+}
+
 bool VCDiffStreamingEncoder::StartEncodingToInterface(
     OutputStringInterface* out) {
   return impl_->StartEncoding(out);
@@ -22,7 +22,9 @@
 #include "blockhash.h"
 #include "checksum.h"
 #include "testing.h"
+#include "unique_ptr.h" // auto_ptr, unique_ptr
 #include "varint_bigendian.h"
+#include "vcdiffengine.h"
 #include "google/vcdecoder.h"
 #include "google/jsonwriter.h"
 #include "vcdiff_defs.h"
@@ -549,6 +551,793 @@ TEST_F(VCDiffEncoderTest, DictionaryBufferOverwritten) {
   EXPECT_EQ(delta_before, delta_after);
 }
 
+// A HashedDictionary constructed with copy_dictionary = false should refer to
+// the caller's dictionary buffer rather than copying it, and should produce
+// the same encoding as a HashedDictionary that holds a copy.
+TEST_F(VCDiffEncoderTest, DictionaryBufferBorrowed) {
+  string dictionary_copy(kDictionary, sizeof(kDictionary));
+  HashedDictionary hd_borrowed(dictionary_copy.data(),
+                               dictionary_copy.size(),
+                               /* copy_dictionary = */ false);
+  EXPECT_TRUE(hd_borrowed.Init());
+  EXPECT_EQ(dictionary_copy.data(), hd_borrowed.engine()->dictionary());
+  VCDiffStreamingEncoder borrowed_encoder(&hd_borrowed,
+                                          VCD_FORMAT_INTERLEAVED
+                                              | VCD_FORMAT_CHECKSUM,
+                                          /* look_for_target_matches = */ true);
+  EXPECT_TRUE(encoder_.StartEncoding(delta()));
+  EXPECT_TRUE(encoder_.EncodeChunk(kTarget, strlen(kTarget), delta()));
+  EXPECT_TRUE(encoder_.FinishEncoding(delta()));
+  string borrowed_delta;
+  EXPECT_TRUE(borrowed_encoder.StartEncoding(&borrowed_delta));
+  EXPECT_TRUE(borrowed_encoder.EncodeChunk(kTarget,
+                                           strlen(kTarget),
+                                           &borrowed_delta));
+  EXPECT_TRUE(borrowed_encoder.FinishEncoding(&borrowed_delta));
+  EXPECT_EQ(delta_as_const(), borrowed_delta);
+}
+
+TEST_F(VCDiffEncoderTest, EmptyDictionaryBorrowed) {
+  HashedDictionary null_dictionary(NULL, 0, /* copy_dictionary = */ false);
+  EXPECT_TRUE(null_dictionary.Init());
+  VCDiffStreamingEncoder null_encoder(&null_dictionary,
+                                      VCD_STANDARD_FORMAT,
+                                      false);
+  EXPECT_TRUE(null_encoder.StartEncoding(delta()));
+  EXPECT_TRUE(null_encoder.EncodeChunk(kTarget, strlen(kTarget), delta()));
+  EXPECT_TRUE(null_encoder.FinishEncoding(delta()));
+  decoder_.StartDecoding(NULL, 0);
+  EXPECT_TRUE(decoder_.DecodeChunk(delta_data(),
+                                   delta_size(),
+                                   &result_target_));
+  EXPECT_TRUE(decoder_.FinishDecoding());
+  EXPECT_EQ(kTarget, result_target_);
+}
+
+TEST_F(VCDiffEncoderTest, EncodeDecodeBucketizedIndex) {
+  HashedDictionary bucketized_dictionary(kDictionary, sizeof(kDictionary));
+  EXPECT_TRUE(bucketized_dictionary.SetIndexLayout(
+      HashedDictionary::kBucketizedIndex));
+  EXPECT_TRUE(bucketized_dictionary.Init());
+  // The layout cannot be changed once the index has been built, and a
+  // bucketized index cannot be serialized.
+  EXPECT_FALSE(bucketized_dictionary.SetIndexLayout(
+      HashedDictionary::kChainedIndex));
+  string image;
+  EXPECT_FALSE(bucketized_dictionary.Serialize(&image));
+  VCDiffStreamingEncoder bucketized_encoder(&bucketized_dictionary,
+                                            VCD_FORMAT_INTERLEAVED
+                                                | VCD_FORMAT_CHECKSUM,
+                                            /* look_for_target_matches = */
+                                            true);
+  EXPECT_TRUE(bucketized_encoder.StartEncoding(delta()));
+  EXPECT_TRUE(bucketized_encoder.EncodeChunk(kTarget,
+                                             strlen(kTarget),
+                                             delta()));
+  EXPECT_TRUE(bucketized_encoder.FinishEncoding(delta()));
+  decoder_.StartDecoding(kDictionary, sizeof(kDictionary));
+  EXPECT_TRUE(decoder_.DecodeChunk(delta_data(),
+                                   delta_size(),
+                                   &result_target_));
+  EXPECT_TRUE(decoder_.FinishDecoding());
+  EXPECT_EQ(kTarget, result_target_);
+}
+
+// A dictionary indexed with smaller blocks (and a smaller minimum match size)
+// finds shorter matches; every block size must produce a correct encoding.
+TEST_F(VCDiffEncoderTest, EncodeDecodeWithBlockSizes) {
+  const int block_sizes[] = { 8, 16, 32, 64 };
+  size_t previous_delta_size = 0;
+  for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); ++i) {
+    HashedDictionary dictionary(kDictionary, sizeof(kDictionary));
+    EXPECT_TRUE(dictionary.SetBlockSize(block_sizes[i]));
+    EXPECT_TRUE(dictionary.SetMinimumMatchSize(block_sizes[i]));
+    EXPECT_TRUE(dictionary.Init());
+    EXPECT_EQ(block_sizes[i], dictionary.engine()->block_size());
+    EXPECT_FALSE(dictionary.SetBlockSize(16));
+    EXPECT_FALSE(dictionary.SetMinimumMatchSize(32));
+    VCDiffStreamingEncoder encoder(&dictionary,
+                                   VCD_FORMAT_INTERLEAVED | VCD_FORMAT_CHECKSUM,
+                                   /* look_for_target_matches = */ true);
+    string block_size_delta;
+    EXPECT_TRUE(encoder.StartEncoding(&block_size_delta));
+    EXPECT_TRUE(encoder.EncodeChunk(kTarget, strlen(kTarget),
+                                    &block_size_delta));
+    EXPECT_TRUE(encoder.FinishEncoding(&block_size_delta));
+    // Smaller blocks never produce a larger delta for this input.
+    if (i > 0) {
+      EXPECT_LE(previous_delta_size, block_size_delta.size())
+          << "block size " << block_sizes[i];
+    }
+    previous_delta_size = block_size_delta.size();
+    result_target_.clear();
+    decoder_.StartDecoding(kDictionary, sizeof(kDictionary));
+    EXPECT_TRUE(decoder_.DecodeChunk(block_size_delta.data(),
+                                     block_size_delta.size(),
+                                     &result_target_));
+    EXPECT_TRUE(decoder_.FinishDecoding());
+    EXPECT_EQ(kTarget, result_target_) << "block size " << block_sizes[i];
+  }
+}
+
+// Encodes target as JSON using a dictionary with the given lazy match
+// lookahead.
+static std::string EncodeAsJSONWithLazyMatchLookahead(
+    const std::string& dictionary,
+    const std::string& target,
+    int lookahead) {
+  HashedDictionary hashed_dictionary(dictionary.data(), dictionary.size());
+  EXPECT_TRUE(hashed_dictionary.SetLazyMatchLookahead(lookahead));
+  EXPECT_TRUE(hashed_dictionary.Init());
+  EXPECT_EQ(lookahead, hashed_dictionary.engine()->lazy_match_lookahead());
+  VCDiffStreamingEncoder encoder(&hashed_dictionary,
+                                 VCD_FORMAT_JSON,
+                                 /* look_for_target_matches = */ false);
+  std::string delta;
+  EXPECT_TRUE(encoder.StartEncoding(&delta));
+  EXPECT_TRUE(encoder.EncodeChunk(target.data(), target.size(), &delta));
+  EXPECT_TRUE(encoder.FinishEncoding(&delta));
+  return delta;
+}
+
+// The dictionary contains "Q" followed by the first 40 bytes of a string,
+// and later the whole string at offset 64.  For the target "Q" + string,
+// the greedy encoder copies the short match that starts with "Q", while the
+// lazy encoder finds the longer match one byte later.
+TEST_F(VCDiffEncoderTest, LazyMatchingPrefersLongerMatch) {
+  string text;
+  uint32_t random_value = 7;
+  for (int i = 0; i < 120; ++i) {
+    random_value = random_value * 1103515245 + 12345;
+    text.push_back(static_cast<char>('a' + ((random_value >> 16) % 26)));
+  }
+  string dictionary = "Q" + text.substr(0, 40);
+  dictionary.append(64 - dictionary.size(), '!');
+  dictionary.append(text);
+  const string target = "Q" + text;
+  EXPECT_EQ("[0,41,104,80]",
+            EncodeAsJSONWithLazyMatchLookahead(dictionary, target, 0));
+  EXPECT_EQ("[\"Q\",64,120]",
+            EncodeAsJSONWithLazyMatchLookahead(dictionary, target, 1));
+  EXPECT_EQ("[\"Q\",64,120]",
+            EncodeAsJSONWithLazyMatchLookahead(dictionary, target, 4));
+}
+
+// Encodes target in one chunk using hashed_dictionary, checks that the
+// delta decodes to target, and returns the size of the delta.
+static size_t EncodeAndDecode(const HashedDictionary& hashed_dictionary,
+                              const std::string& dictionary,
+                              const std::string& target,
+                              bool look_for_target_matches) {
+  VCDiffStreamingEncoder encoder(&hashed_dictionary,
+                                 VCD_FORMAT_INTERLEAVED | VCD_FORMAT_CHECKSUM,
+                                 look_for_target_matches);
+  std::string delta;
+  EXPECT_TRUE(encoder.StartEncoding(&delta));
+  EXPECT_TRUE(encoder.EncodeChunk(target.data(), target.size(), &delta));
+  EXPECT_TRUE(encoder.FinishEncoding(&delta));
+  VCDiffStreamingDecoder decoder;
+  std::string decoded_target;
+  decoder.StartDecoding(dictionary.data(), dictionary.size());
+  EXPECT_TRUE(decoder.DecodeChunk(delta.data(), delta.size(),
+                                  &decoded_target));
+  EXPECT_TRUE(decoder.FinishDecoding());
+  EXPECT_EQ(target, decoded_target);
+  return delta.size();
+}
+
+TEST_F(VCDiffEncoderTest, OptimalParseFindsLongerMatch) {
+  string text;
+  uint32_t random_value = 7;
+  for (int i = 0; i < 120; ++i) {
+    random_value = random_value * 1103515245 + 12345;
+    text.push_back(static_cast<char>('a' + ((random_value >> 16) % 26)));
+  }
+  string dictionary = "Q" + text.substr(0, 40);
+  dictionary.append(64 - dictionary.size(), '!');
+  dictionary.append(text);
+  const string target = "Q" + text;
+  HashedDictionary hashed_dictionary(dictionary.data(), dictionary.size());
+  EXPECT_TRUE(hashed_dictionary.SetOptimalParse(true));
+  EXPECT_TRUE(hashed_dictionary.Init());
+  EXPECT_FALSE(hashed_dictionary.SetOptimalParse(false));
+  EXPECT_TRUE(hashed_dictionary.engine()->optimal_parse());
+  VCDiffStreamingEncoder encoder(&hashed_dictionary,
+                                 VCD_FORMAT_JSON,
+                                 /* look_for_target_matches = */ false);
+  EXPECT_TRUE(encoder.StartEncoding(&result_target_));
+  EXPECT_TRUE(encoder.EncodeChunk(target.data(), target.size(),
+                                  &result_target_));
+  EXPECT_TRUE(encoder.FinishEncoding(&result_target_));
+  EXPECT_EQ("[\"Q\",64,120]", result_target_);
+}
+
+// The target is made of pieces of a text dictionary separated by short
+// edits, and is longer than one segment of the optimal parser.
+TEST_F(VCDiffEncoderTest, OptimalParseIsNoLargerThanGreedy) {
+  string dictionary;
+  uint32_t random_value = 11;
+  while (dictionary.size() < 100000) {
+    random_value = random_value * 1103515245 + 12345;
+    const int word_length = 2 + ((random_value >> 16) % 7);
+    for (int i = 0; i < word_length; ++i) {
+      random_value = random_value * 1103515245 + 12345;
+      dictionary.push_back(static_cast<char>('a' + ((random_value >> 16) % 4)));
+    }
+    dictionary.push_back(' ');
+  }
+  string target;
+  while (target.size() < 300000) {
+    random_value = random_value * 1103515245 + 12345;
+    const size_t offset = (random_value >> 8) % (dictionary.size() - 200);
+    random_value = random_value * 1103515245 + 12345;
+    target.append(dictionary, offset, 20 + ((random_value >> 16) % 180));
+    target.append("#");
+  }
+  for (int target_matching = 0; target_matching < 2; ++target_matching) {
+    HashedDictionary greedy_dictionary(dictionary.data(), dictionary.size());
+    EXPECT_TRUE(greedy_dictionary.Init());
+    HashedDictionary optimal_dictionary(dictionary.data(), dictionary.size());
+    EXPECT_TRUE(optimal_dictionary.SetOptimalParse(true));
+    EXPECT_TRUE(optimal_dictionary.Init());
+    const size_t greedy_size = EncodeAndDecode(greedy_dictionary, dictionary,
+                                               target, target_matching != 0);
+    const size_t optimal_size = EncodeAndDecode(optimal_dictionary, dictionary,
+                                                target, target_matching != 0);
+    EXPECT_GE(greedy_size, optimal_size) << target_matching;
+  }
+}
+
+// Two matches overlap by 40 bytes.  The second one is cheaper to copy from
+// where it starts after the overlap (address 1540), since an earlier COPY
+// from that address puts it in the SAME cache, than from its own start.
+TEST_F(VCDiffEncoderTest, OptimalParseUsesAddressCache) {
+  string dictionary;
+  uint32_t random_value = 3;
+  for (int i = 0; i < 2000; ++i) {
+    random_value = random_value * 1103515245 + 12345;
+    dictionary.push_back(static_cast<char>('a' + ((random_value >> 16) % 26)));
+  }
+  dictionary.replace(640, 40, dictionary, 1500, 40);
+  dictionary[680] = (dictionary[1540] == 'a') ? 'b' : 'a';
+  string target = dictionary.substr(1540, 40);
+  for (int offset = 100; offset <= 400; offset += 100) {
+    target += "#" + dictionary.substr(offset, 40);
+  }
+  target += "#" + dictionary.substr(600, 40) + dictionary.substr(1500, 100);
+  HashedDictionary hashed_dictionary(dictionary.data(), dictionary.size());
+  EXPECT_TRUE(hashed_dictionary.SetOptimalParse(true));
+  EXPECT_TRUE(hashed_dictionary.Init());
+  VCDiffStreamingEncoder encoder(&hashed_dictionary,
+                                 VCD_FORMAT_JSON,
+                                 /* look_for_target_matches = */ false);
+  EXPECT_TRUE(encoder.StartEncoding(&result_target_));
+  EXPECT_TRUE(encoder.EncodeChunk(target.data(), target.size(),
+                                  &result_target_));
+  EXPECT_TRUE(encoder.FinishEncoding(&result_target_));
+  EXPECT_EQ("[1540,40,\"#\",100,40,\"#\",200,40,\"#\",300,40,\"#\",400,40,"
+            "\"#\",600,80,1540,60]",
+            result_target_);
+}
+
+// The target repeats the end of the dictionary followed by the beginning of
+// the target, which a single COPY instruction can encode only if it may cross
+// the boundary between the source and target data.
+TEST_F(VCDiffEncoderTest, CrossBoundaryMatchingExtendsIntoTarget) {
+  string text;
+  uint32_t random_value = 5;
+  for (int i = 0; i < 100; ++i) {
+    random_value = random_value * 1103515245 + 12345;
+    text.push_back(static_cast<char>('a' + ((random_value >> 16) % 26)));
+  }
+  const string dictionary = string(64, '!') + text.substr(0, 40);
+  const string appended = text.substr(40);
+  const string target = appended + text.substr(0, 40) + appended;
+  for (int cross_boundary = 0; cross_boundary < 2; ++cross_boundary) {
+    HashedDictionary hashed_dictionary(dictionary.data(), dictionary.size());
+    EXPECT_TRUE(
+        hashed_dictionary.SetCrossBoundaryMatching(cross_boundary != 0));
+    EXPECT_TRUE(hashed_dictionary.Init());
+    EXPECT_FALSE(hashed_dictionary.SetCrossBoundaryMatching(false));
+    EXPECT_EQ(cross_boundary != 0,
+              hashed_dictionary.engine()->cross_boundary_matching());
+    VCDiffStreamingEncoder encoder(&hashed_dictionary,
+                                   VCD_FORMAT_JSON,
+                                   /* look_for_target_matches = */ false);
+    string json;
+    EXPECT_TRUE(encoder.StartEncoding(&json));
+    EXPECT_TRUE(encoder.EncodeChunk(target.data(), target.size(), &json));
+    EXPECT_TRUE(encoder.FinishEncoding(&json));
+    if (cross_boundary) {
+      EXPECT_EQ("[\"" + appended + "\",64,100]", json);
+    } else {
+      EXPECT_EQ("[\"" + appended + "\",64,40,\"" + appended + "\"]", json);
+    }
+    // The same target must round-trip through the binary format.
+    EncodeAndDecode(hashed_dictionary, dictionary, target,
+                    /* look_for_target_matches = */ false);
+    EncodeAndDecode(hashed_dictionary, dictionary, target,
+                    /* look_for_target_matches = */ true);
+  }
+}
+
+TEST_F(VCDiffEncoderTest, InvalidLazyMatchLookahead) {
+  HashedDictionary dictionary(kDictionary, sizeof(kDictionary));
+  EXPECT_FALSE(dictionary.SetLazyMatchLookahead(-1));
+  EXPECT_FALSE(dictionary.SetLazyMatchLookahead(65));
+  EXPECT_TRUE(dictionary.SetLazyMatchLookahead(2));
+  EXPECT_TRUE(dictionary.SetOptimalParse(true));
+  EXPECT_TRUE(dictionary.Init());
+  EXPECT_FALSE(dictionary.SetLazyMatchLookahead(3));
+  EXPECT_EQ(2, dictionary.engine()->lazy_match_lookahead());
+}
+
+TEST_F(VCDiffEncoderTest, InvalidSamplingInterval) {
+  HashedDictionary dictionary(kDictionary, sizeof(kDictionary));
+  EXPECT_FALSE(dictionary.SetSamplingInterval(0));
+  EXPECT_FALSE(dictionary.SetSamplingInterval(-1));
+  EXPECT_FALSE(dictionary.SetSamplingInterval(1 << 20));
+  EXPECT_TRUE(dictionary.SetSamplingInterval(3));
+  EXPECT_TRUE(dictionary.Init());
+  EXPECT_EQ(3, dictionary.engine()->sampling_interval());
+}
+
+TEST_F(VCDiffEncoderTest, InvalidBlockSize) {
+  HashedDictionary dictionary(kDictionary, sizeof(kDictionary));
+  EXPECT_FALSE(dictionary.SetBlockSize(0));
+  EXPECT_FALSE(dictionary.SetBlockSize(4));
+  EXPECT_FALSE(dictionary.SetBlockSize(24));
+  EXPECT_FALSE(dictionary.SetBlockSize(128));
+  EXPECT_TRUE(dictionary.Init());
+  EXPECT_EQ(16, dictionary.engine()->block_size());
+}
+
+// Encoding a chunk with SetWindowedEncoding() should produce the same output
+// as passing each window to EncodeChunk() separately, whether the windows
+// are encoded sequentially or in parallel.
+TEST_F(VCDiffEncoderTest, WindowedEncodingMatchesSeparateChunks) {
+  string target;
+  for (int i = 0; i < 200; ++i) {
+    target.append(kTarget);
+    target.append(1, static_cast<char>('A' + (i % 26)));
+  }
+  const size_t kWindowSize = 1000;
+  string sequential_delta;
+  EXPECT_TRUE(encoder_.StartEncoding(&sequential_delta));
+  for (size_t i = 0; i < target.size(); i += kWindowSize) {
+    EXPECT_TRUE(encoder_.EncodeChunk(target.data() + i,
+                                     std::min(kWindowSize, target.size() - i),
+                                     &sequential_delta));
+  }
+  EXPECT_TRUE(encoder_.FinishEncoding(&sequential_delta));
+  const int thread_counts[] = { 1, 2, 4, 64 };
+  for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]);
+       ++i) {
+    VCDiffStreamingEncoder windowed_encoder(&hashed_dictionary_,
+                                            VCD_FORMAT_INTERLEAVED
+                                                | VCD_FORMAT_CHECKSUM,
+                                            /* look_for_target_matches = */
+                                            true);
+    EXPECT_TRUE(windowed_encoder.SetWindowedEncoding(kWindowSize,
+                                                     thread_counts[i]));
+    string windowed_delta;
+    EXPECT_TRUE(windowed_encoder.StartEncoding(&windowed_delta));
+    EXPECT_TRUE(windowed_encoder.EncodeChunk(target.data(),
+                                             target.size(),
+                                             &windowed_delta));
+    EXPECT_TRUE(windowed_encoder.FinishEncoding(&windowed_delta));
+    EXPECT_EQ(sequential_delta, windowed_delta)
+        << "thread count " << thread_counts[i];
+  }
+  decoder_.StartDecoding(kDictionary, sizeof(kDictionary));
+  EXPECT_TRUE(decoder_.DecodeChunk(sequential_delta.data(),
+                                   sequential_delta.size(),
+                                   &result_target_));
+  EXPECT_TRUE(decoder_.FinishDecoding());
+  EXPECT_EQ(target, result_target_);
+}
+
+TEST_F(VCDiffEncoderTest, WindowedEncodingNotSupported) {
+  EXPECT_FALSE(json_encoder_.SetWindowedEncoding(1000, 4));
+  EXPECT_FALSE(external_encoder_.SetWindowedEncoding(1000, 4));
+  EXPECT_TRUE(encoder_.StartEncoding(delta()));
+  EXPECT_FALSE(encoder_.SetWindowedEncoding(1000, 4));
+}
+
+// Each chunk repeats data from an earlier chunk that is not in the
+// dictionary, so only a target history can find matches for it.  The history
+// is small enough that it must be trimmed several times.
+TEST_F(VCDiffEncoderTest, TargetHistoryFindsMatchesInEarlierChunks) {
+  string block;
+  uint32_t seed = 1;
+  for (int i = 0; i < 1500; ++i) {
+    seed = (seed * 1103515245) + 12345;
+    block.push_back(static_cast<char>(seed >> 24));
+  }
+  string target;
+  for (int i = 0; i < 20; ++i) {
+    target.append(block, 0, 500 + (i * 50));
+    target.append(kTarget);
+  }
+  const size_t kChunkSize = 1200;
+  string plain_delta;
+  EXPECT_TRUE(encoder_.StartEncoding(&plain_delta));
+  for (size_t i = 0; i < target.size(); i += kChunkSize) {
+    EXPECT_TRUE(encoder_.EncodeChunk(target.data() + i,
+                                     std::min(kChunkSize, target.size() - i),
+                                     &plain_delta));
+  }
+  EXPECT_TRUE(encoder_.FinishEncoding(&plain_delta));
+  const size_t history_sizes[] = { 100, 2000, 5000, 100000 };
+  for (size_t h = 0; h < sizeof(history_sizes) / sizeof(history_sizes[0]);
+       ++h) {
+    VCDiffStreamingEncoder history_encoder(&hashed_dictionary_,
+                                           VCD_FORMAT_INTERLEAVED
+                                               | VCD_FORMAT_CHECKSUM,
+                                           /* look_for_target_matches = */
+                                           true);
+    EXPECT_TRUE(history_encoder.SetTargetHistory(history_sizes[h]));
+    EXPECT_TRUE(history_encoder.SetWindowedEncoding(kChunkSize / 2, 1));
+    string history_delta;
+    EXPECT_TRUE(history_encoder.StartEncoding(&history_delta));
+    for (size_t i = 0; i < target.size(); i += kChunkSize) {
+      EXPECT_TRUE(history_encoder.EncodeChunk(
+          target.data() + i,
+          std::min(kChunkSize, target.size() - i),
+          &history_delta));
+    }
+    EXPECT_TRUE(history_encoder.FinishEncoding(&history_delta));
+    if (history_sizes[h] >= block.size()) {
+      EXPECT_LT(history_delta.size(), plain_delta.size() / 2)
+          << "history size " << history_sizes[h];
+    }
+    VCDiffStreamingDecoder decoder;
+    string result;
+    decoder.StartDecoding(kDictionary, sizeof(kDictionary));
+    EXPECT_TRUE(decoder.DecodeChunk(history_delta.data(),
+                                    history_delta.size(),
+                                    &result));
+    EXPECT_TRUE(decoder.FinishDecoding());
+    EXPECT_EQ(target, result) << "history size " << history_sizes[h];
+    // A decoder that keeps twice as much target data as the encoder's history
+    // can decode the delta file.
+    VCDiffStreamingDecoder bounded_decoder;
+    EXPECT_TRUE(bounded_decoder.SetTargetHistory(2 * history_sizes[h]));
+    bounded_decoder.StartDecoding(kDictionary, sizeof(kDictionary));
+    result.clear();
+    for (size_t i = 0; i < history_delta.size(); i += 1000) {
+      EXPECT_TRUE(bounded_decoder.DecodeChunk(
+          history_delta.data() + i,
+          std::min<size_t>(1000, history_delta.size() - i),
+          &result));
+    }
+    EXPECT_TRUE(bounded_decoder.FinishDecoding());
+    EXPECT_EQ(target, result) << "history size " << history_sizes[h];
+  }
+}
+
+TEST_F(VCDiffEncoderTest, DecoderTargetHistoryTooSmall) {
+  string target;
+  for (int i = 0; i < 100; ++i) {
+    target.append(kTarget);
+    target.push_back(static_cast<char>(i));
+  }
+  EXPECT_TRUE(encoder_.SetTargetHistory(100000));
+  EXPECT_TRUE(encoder_.StartEncoding(delta()));
+  for (size_t i = 0; i < target.size(); i += 1000) {
+    EXPECT_TRUE(encoder_.EncodeChunk(target.data() + i,
+                                     std::min<size_t>(1000, target.size() - i),
+                                     delta()));
+  }
+  EXPECT_TRUE(encoder_.FinishEncoding(delta()));
+  EXPECT_TRUE(decoder_.SetTargetHistory(100));
+  decoder_.StartDecoding(kDictionary, sizeof(kDictionary));
+  EXPECT_FALSE(decoder_.DecodeChunk(delta_data(), delta_size(),
+                                    &result_target_));
+  EXPECT_TRUE(decoder_.SetTargetHistory(0));
+  decoder_.StartDecoding(kDictionary, sizeof(kDictionary));
+  EXPECT_FALSE(decoder_.SetTargetHistory(100));
+  result_target_.clear();
+  EXPECT_TRUE(decoder_.DecodeChunk(delta_data(), delta_size(),
+                                   &result_target_));
+  EXPECT_TRUE(decoder_.FinishDecoding());
+  EXPECT_EQ(target, result_target_);
+}
+
+TEST_F(VCDiffEncoderTest, TargetHistoryNotSupported) {
+  EXPECT_FALSE(json_encoder_.SetTargetHistory(1000));
+  EXPECT_FALSE(external_encoder_.SetTargetHistory(1000));
+  EXPECT_FALSE(encoder_.SetTargetHistory(static_cast<size_t>(1) << 31));
+  EXPECT_TRUE(encoder_.SetWindowedEncoding(1000, 4));
+  EXPECT_FALSE(encoder_.SetTargetHistory(1000));
+  EXPECT_TRUE(encoder_.SetWindowedEncoding(1000, 1));
+  EXPECT_TRUE(encoder_.SetTargetHistory(1000));
+  EXPECT_FALSE(encoder_.SetWindowedEncoding(1000, 4));
+  EXPECT_TRUE(encoder_.StartEncoding(delta()));
+  EXPECT_FALSE(encoder_.SetTargetHistory(0));
+}
+
+TEST_F(VCDiffEncoderTest, ArenaProducesSameEncoding) {
+  string plain_delta;
+  EXPECT_TRUE(encoder_.StartEncoding(&plain_delta));
+  EXPECT_TRUE(encoder_.EncodeChunk(kTarget, strlen(kTarget), &plain_delta));
+  EXPECT_TRUE(encoder_.FinishEncoding(&plain_delta));
+  VCDiffEncoderArena arena;
+  EXPECT_EQ(0U, arena.retained_bytes());
+  for (int i = 0; i < 3; ++i) {
+    VCDiffStreamingEncoder arena_encoder(&hashed_dictionary_,
+                                         VCD_FORMAT_INTERLEAVED
+                                             | VCD_FORMAT_CHECKSUM,
+                                         /* look_for_target_matches = */ true);
+    EXPECT_TRUE(arena_encoder.SetArena(&arena));
+    string arena_delta;
+    EXPECT_TRUE(arena_encoder.StartEncoding(&arena_delta));
+    EXPECT_TRUE(arena_encoder.EncodeChunk(kTarget, strlen(kTarget),
+                                          &arena_delta));
+    EXPECT_TRUE(arena_encoder.FinishEncoding(&arena_delta));
+    EXPECT_EQ(plain_delta, arena_delta);
+    // The section buffers and the target hash are given back to the arena.
+    EXPECT_LT(strlen(kTarget), arena.retained_bytes());
+  }
+  string result;
+  EXPECT_TRUE(simple_decoder_.Decode(kDictionary, sizeof(kDictionary),
+                                     plain_delta, &result));
+  EXPECT_EQ(kTarget, result);
+}
+
+TEST_F(VCDiffEncoderTest, ArenaIsLentToOneEncoderAtATime) {
+  VCDiffEncoderArena arena;
+  VCDiffStreamingEncoder other_encoder(&hashed_dictionary_,
+                                       VCD_FORMAT_INTERLEAVED,
+                                       /* look_for_target_matches = */ true);
+  EXPECT_TRUE(encoder_.SetArena(&arena));
+  EXPECT_TRUE(other_encoder.SetArena(&arena));
+  EXPECT_TRUE(encoder_.StartEncoding(delta()));
+  string other_delta;
+  EXPECT_FALSE(other_encoder.StartEncoding(&other_delta));
+  EXPECT_TRUE(encoder_.EncodeChunk(kTarget, strlen(kTarget), delta()));
+  EXPECT_TRUE(encoder_.FinishEncoding(delta()));
+  EXPECT_TRUE(other_encoder.StartEncoding(&other_delta));
+  EXPECT_TRUE(other_encoder.EncodeChunk(kTarget, strlen(kTarget),
+                                        &other_delta));
+  EXPECT_TRUE(other_encoder.FinishEncoding(&other_delta));
+  string result;
+  EXPECT_TRUE(simple_decoder_.Decode(kDictionary, sizeof(kDictionary),
+                                     other_delta, &result));
+  EXPECT_EQ(kTarget, result);
+}
+
+TEST_F(VCDiffEncoderTest, ArenaReleasesMemoryAboveLimit) {
+  VCDiffEncoderArena arena(/* max_retained_bytes = */ 1);
+  EXPECT_TRUE(encoder_.SetArena(&arena));
+  EXPECT_TRUE(encoder_.StartEncoding(delta()));
+  EXPECT_TRUE(encoder_.EncodeChunk(kTarget, strlen(kTarget), delta()));
+  EXPECT_TRUE(encoder_.FinishEncoding(delta()));
+  EXPECT_EQ(0U, arena.retained_bytes());
+}
+
+TEST_F(VCDiffEncoderTest, ArenaNotSupported) {
+  VCDiffEncoderArena arena;
+  EXPECT_FALSE(json_encoder_.SetArena(&arena));
+  EXPECT_FALSE(external_encoder_.SetArena(&arena));
+  EXPECT_TRUE(encoder_.StartEncoding(delta()));
+  EXPECT_FALSE(encoder_.SetArena(&arena));
+  EXPECT_TRUE(encoder_.FinishEncoding(delta()));
+  EXPECT_TRUE(encoder_.SetArena(&arena));
+  EXPECT_TRUE(encoder_.SetArena(NULL));
+}
+
+// Copies a serialized dictionary index into an int-aligned buffer, as
+// HashedDictionary::CreateFromSerialized() requires.
+static void CopyToAlignedBuffer(const std::string& image,
+                                std::vector<int>* buffer) {
+  buffer->resize((image.size() / sizeof(int)) + 1);  // NOLINT
+  memcpy(&(*buffer)[0], image.data(), image.size());
+}
+
+// A HashedDictionary loaded from a serialized index should produce exactly
+// the same encoding as the HashedDictionary that was serialized.
+TEST_F(VCDiffEncoderTest, SerializedDictionaryProducesSameEncoding) {
+  string index_image;
+  EXPECT_TRUE(hashed_dictionary_.Serialize(&index_image));
+  std::vector<int> aligned_image;
+  CopyToAlignedBuffer(index_image, &aligned_image);
+  UNIQUE_PTR<const HashedDictionary> loaded_dictionary(
+      HashedDictionary::CreateFromSerialized(
+          reinterpret_cast<const char*>(&aligned_image[0]),
+          index_image.size()));
+  ASSERT_TRUE(loaded_dictionary.get() != NULL);
+  EXPECT_EQ(string(kDictionary, sizeof(kDictionary)),
+            string(loaded_dictionary->engine()->dictionary(),
+                   loaded_dictionary->engine()->dictionary_size()));
+  // Serializing the loaded dictionary again should reproduce the image.
+  string reserialized_image;
+  EXPECT_TRUE(loaded_dictionary->Serialize(&reserialized_image));
+  EXPECT_EQ(index_image, reserialized_image);
+
+  VCDiffStreamingEncoder loaded_encoder(loaded_dictionary.get(),
+                                        VCD_FORMAT_INTERLEAVED
+                                            | VCD_FORMAT_CHECKSUM,
+                                        /* look_for_target_matches = */ true);
+  EXPECT_TRUE(encoder_.StartEncoding(delta()));
+  EXPECT_TRUE(encoder_.EncodeChunk(kTarget, strlen(kTarget), delta()));
+  EXPECT_TRUE(encoder_.FinishEncoding(delta()));
+  string loaded_delta;
+  EXPECT_TRUE(loaded_encoder.StartEncoding(&loaded_delta));
+  EXPECT_TRUE(loaded_encoder.EncodeChunk(kTarget,
+                                         strlen(kTarget),
+                                         &loaded_delta));
+  EXPECT_TRUE(loaded_encoder.FinishEncoding(&loaded_delta));
+  EXPECT_EQ(delta_as_const(), loaded_delta);
+  decoder_.StartDecoding(kDictionary, sizeof(kDictionary));
+  EXPECT_TRUE(decoder_.DecodeChunk(loaded_delta.data(),
+                                   loaded_delta.size(),
+                                   &result_target_));
+  EXPECT_TRUE(decoder_.FinishDecoding());
+  EXPECT_EQ(kTarget, result_target_);
+}
+
+// The block size and minimum match size are part of the serialized index.
+TEST_F(VCDiffEncoderTest, SerializedDictionaryKeepsBlockSize) {
+  HashedDictionary dictionary(kDictionary, sizeof(kDictionary));
+  EXPECT_TRUE(dictionary.SetBlockSize(8));
+  EXPECT_TRUE(dictionary.SetMinimumMatchSize(12));
+  EXPECT_TRUE(dictionary.SetLazyMatchLookahead(2));
+  EXPECT_TRUE(dictionary.SetOptimalParse(true));
+  EXPECT_TRUE(dictionary.SetCrossBoundaryMatching(true));
+  EXPECT_TRUE(dictionary.Init());
+  string index_image;
+  EXPECT_TRUE(dictionary.Serialize(&index_image));
+  std::vector<int> aligned_image;
+  CopyToAlignedBuffer(index_image, &aligned_image);
+  UNIQUE_PTR<const HashedDictionary> loaded_dictionary(
+      HashedDictionary::CreateFromSerialized(
+          reinterpret_cast<const char*>(&aligned_image[0]),
+          index_image.size()));
+  ASSERT_TRUE(loaded_dictionary.get() != NULL);
+  EXPECT_EQ(8, loaded_dictionary->engine()->block_size());
+  EXPECT_EQ(12U, loaded_dictionary->engine()->minimum_match_size());
+  EXPECT_EQ(2, loaded_dictionary->engine()->lazy_match_lookahead());
+  EXPECT_TRUE(loaded_dictionary->engine()->optimal_parse());
+  EXPECT_TRUE(loaded_dictionary->engine()->cross_boundary_matching());
+  VCDiffStreamingEncoder original_encoder(&dictionary,
+                                          VCD_STANDARD_FORMAT,
+                                          /* look_for_target_matches = */
+                                          true);
+  VCDiffStreamingEncoder loaded_encoder(loaded_dictionary.get(),
+                                        VCD_STANDARD_FORMAT,
+                                        /* look_for_target_matches = */ true);
+  string original_delta;
+  EXPECT_TRUE(original_encoder.StartEncoding(&original_delta));
+  EXPECT_TRUE(original_encoder.EncodeChunk(kTarget,
+                                           strlen(kTarget),
+                                           &original_delta));
+  EXPECT_TRUE(original_encoder.FinishEncoding(&original_delta));
+  string loaded_delta;
+  EXPECT_TRUE(loaded_encoder.StartEncoding(&loaded_delta));
+  EXPECT_TRUE(loaded_encoder.EncodeChunk(kTarget,
+                                         strlen(kTarget),
+                                         &loaded_delta));
+  EXPECT_TRUE(loaded_encoder.FinishEncoding(&loaded_delta));
+  EXPECT_EQ(original_delta, loaded_delta);
+}
+
+// With a memory budget, Init() samples the dictionary blocks so that the
+// index fits, and long matches are still encoded as COPY instructions.
+TEST_F(VCDiffEncoderTest, IndexMemoryBudget) {
+  string large_dictionary;
+  uint32_t random_value = 1;
+  for (int i = 0; i < (1 << 18); ++i) {
+    random_value = random_value * 1103515245 + 12345;
+    large_dictionary.push_back(static_cast<char>(random_value >> 24));
+  }
+  // The target consists of long pieces of the dictionary.
+  string target;
+  for (size_t offset = 1001; offset + 4096 < large_dictionary.size();
+       offset += 37 * 1024) {
+    target.append(large_dictionary, offset, 3000);
+    target.append("unmatched");
+  }
+  const size_t full_index_size =
+      BlockHash::CalcIndexSize(large_dictionary.size(),
+                               BlockHash::kBlockSize,
+                               /* sampling_interval = */ 1);
+  const size_t budget = full_index_size / 6;
+  HashedDictionary dictionary(large_dictionary.data(),
+                              large_dictionary.size());
+  EXPECT_TRUE(dictionary.SetIndexMemoryBudget(budget));
+  EXPECT_TRUE(dictionary.Init());
+  EXPECT_FALSE(dictionary.SetSamplingInterval(1));
+  EXPECT_FALSE(dictionary.SetIndexMemoryBudget(0));
+  EXPECT_EQ(8, dictionary.engine()->sampling_interval());
+  EXPECT_GE(budget, BlockHash::CalcIndexSize(large_dictionary.size(),
+                                             BlockHash::kBlockSize,
+                                             8));
+  VCDiffStreamingEncoder encoder(&dictionary,
+                                 VCD_FORMAT_INTERLEAVED | VCD_FORMAT_CHECKSUM,
+                                 /* look_for_target_matches = */ false);
+  string sampled_delta;
+  EXPECT_TRUE(encoder.StartEncoding(&sampled_delta));
+  EXPECT_TRUE(encoder.EncodeChunk(target.data(), target.size(),
+                                  &sampled_delta));
+  EXPECT_TRUE(encoder.FinishEncoding(&sampled_delta));
+  // Every piece of the dictionary should have been found.
+  EXPECT_GT(target.size() / 20, sampled_delta.size());
+  decoder_.StartDecoding(large_dictionary.data(), large_dictionary.size());
+  EXPECT_TRUE(decoder_.DecodeChunk(sampled_delta.data(),
+                                   sampled_delta.size(),
+                                   &result_target_));
+  EXPECT_TRUE(decoder_.FinishDecoding());
+  EXPECT_EQ(target, result_target_);
+  // The sampling interval is part of the serialized index.
+  string index_image;
+  EXPECT_TRUE(dictionary.Serialize(&index_image));
+  std::vector<int> aligned_image;
+  CopyToAlignedBuffer(index_image, &aligned_image);
+  UNIQUE_PTR<const HashedDictionary> loaded_dictionary(
+      HashedDictionary::CreateFromSerialized(
+          reinterpret_cast<const char*>(&aligned_image[0]),
+          index_image.size()));
+  ASSERT_TRUE(loaded_dictionary.get() != NULL);
+  EXPECT_EQ(8, loaded_dictionary->engine()->sampling_interval());
+  VCDiffStreamingEncoder loaded_encoder(loaded_dictionary.get(),
+                                        VCD_FORMAT_INTERLEAVED
+                                            | VCD_FORMAT_CHECKSUM,
+                                        /* look_for_target_matches = */ false);
+  string loaded_delta;
+  EXPECT_TRUE(loaded_encoder.StartEncoding(&loaded_delta));
+  EXPECT_TRUE(loaded_encoder.EncodeChunk(target.data(), target.size(),
+                                         &loaded_delta));
+  EXPECT_TRUE(loaded_encoder.FinishEncoding(&loaded_delta));
+  EXPECT_EQ(sampled_delta, loaded_delta);
+}
+
+TEST_F(VCDiffEncoderTest, SerializedEmptyDictionary) {
+  HashedDictionary nothing_dictionary("", 0);
+  EXPECT_TRUE(nothing_dictionary.Init());
+  string index_image;
+  EXPECT_TRUE(nothing_dictionary.Serialize(&index_image));
+  std::vector<int> aligned_image;
+  CopyToAlignedBuffer(index_image, &aligned_image);
+  UNIQUE_PTR<const HashedDictionary> loaded_dictionary(
+      HashedDictionary::CreateFromSerialized(
+          reinterpret_cast<const char*>(&aligned_image[0]),
+          index_image.size()));
+  ASSERT_TRUE(loaded_dictionary.get() != NULL);
+  EXPECT_EQ(0U, loaded_dictionary->engine()->dictionary_size());
+}
+
+TEST_F(VCDiffEncoderTest, SerializedDictionaryRejectsBadImage) {
+  string index_image;
+  EXPECT_TRUE(hashed_dictionary_.Serialize(&index_image));
+  std::vector<int> aligned_image;
+  // Truncated image
+  CopyToAlignedBuffer(index_image, &aligned_image);
+  EXPECT_TRUE(HashedDictionary::CreateFromSerialized(
+      reinterpret_cast<const char*>(&aligned_image[0]),
+      index_image.size() - sizeof(int)) == NULL);  // NOLINT
+  EXPECT_TRUE(HashedDictionary::CreateFromSerialized(
+      reinterpret_cast<const char*>(&aligned_image[0]), 8) == NULL);
+  EXPECT_TRUE(HashedDictionary::CreateFromSerialized(NULL, 0) == NULL);
+  // Bad magic number
+  string bad_image(index_image);
+  bad_image[0] = 'X';
+  CopyToAlignedBuffer(bad_image, &aligned_image);
+  EXPECT_TRUE(HashedDictionary::CreateFromSerialized(
+      reinterpret_cast<const char*>(&aligned_image[0]),
+      bad_image.size()) == NULL);
+  // Out-of-range block number in the last entry of the next block table
+  bad_image = index_image;
+  const int bad_block_number = 0x7FFFFFFF;
+  bad_image.replace(bad_image.size() - sizeof(int), sizeof(int),  // NOLINT
+                    reinterpret_cast<const char*>(&bad_block_number),
+                    sizeof(int));  // NOLINT
+  CopyToAlignedBuffer(bad_image, &aligned_image);
+  EXPECT_TRUE(HashedDictionary::CreateFromSerialized(
+      reinterpret_cast<const char*>(&aligned_image[0]),
+      bad_image.size()) == NULL);
+}
+
 // Binary data test part 1: The dictionary and target data should not
 // be treated as NULL-terminated.  An embedded NULL should be handled like
 // any other byte of data.
@@ -727,6 +1516,7 @@ class VCDiffHTML1Test : public VerifyEncodedBytesTest {
   static const char kDictionary[];
   static const char kTarget[];
   static const char kRedundantTarget[];
+  static const char kRepeatedPatternTarget[];
 
   VCDiffHTML1Test();
   virtual ~VCDiffHTML1Test() { }
@@ -734,6 +1524,11 @@ class VCDiffHTML1Test : public VerifyEncodedBytesTest {
   void SimpleEncode();
   void StreamingEncode();
 
+  // Expects the rest of the delta to be a window that encodes
+  // kRedundantTarget, a run of a single byte value, as one RUN instruction.
+  // This does not depend on whether target matching is enabled.
+  void ExpectRedundantTargetEncodedAsRun();
+
   HashedDictionary hashed_dictionary_;
   VCDiffStreamingEncoder encoder_;
   VCDiffStreamingDecoder decoder_;
@@ -756,6 +1551,14 @@ const char VCDiffHTML1Test::kRedundantTarget[] =
     "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
     "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA";  // 256
 
+// A repeated multi-byte pattern is not a run, so it can only be encoded
+// compactly using a COPY from the target data.
+const char VCDiffHTML1Test::kRepeatedPatternTarget[] =
+    "WXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZ"
+    "WXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZ"
+    "WXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZ"
+    "WXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZWXYZ";  // 256
+
 VCDiffHTML1Test::VCDiffHTML1Test()
     : hashed_dictionary_(kDictionary, sizeof(kDictionary)),
       encoder_(&hashed_dictionary_,
@@ -846,6 +1649,22 @@ TEST_F(VCDiffHTML1Test, CheckOutputOfSimpleEncoder) {
   ExpectNoMoreBytes();
 }
 
+void VCDiffHTML1Test::ExpectRedundantTargetEncodedAsRun() {
+  ExpectByte(0x0A);  // Length of the delta encoding
+  ExpectSize(strlen(kRedundantTarget));  // Size of the target window
+  ExpectByte(0x00);  // Delta_indicator (no compression)
+  ExpectByte(0x01);  // Length of the data section
+  ExpectByte(0x03);  // Length of the instructions section
+  ExpectByte(0x00);  // Length of the address section
+  // Data section
+  ExpectString("A");      // Data for RUN
+  // Instructions section
+  ExpectByte(0x00);  // RUN size 0
+  ExpectSize(strlen(kRedundantTarget));  // RUN size
+  // Address section empty
+  ExpectNoMoreBytes();
+}
+
 TEST_F(VCDiffHTML1Test, SimpleEncoderPerformsTargetMatching) {
   EXPECT_TRUE(simple_encoder_.Encode(kRedundantTarget,
                                      strlen(kRedundantTarget),
@@ -866,35 +1685,84 @@ TEST_F(VCDiffHTML1Test, SimpleEncoderPerformsTargetMatching) {
   ExpectByte(VCD_SOURCE);  // Win_Indicator: VCD_SOURCE (dictionary)
   ExpectByte(sizeof(kDictionary));  // Dictionary length
   ExpectByte(0x00);  // Source segment position: start of dictionary
-  ExpectByte(0x0C);  // Length of the delta encoding
-  ExpectSize(strlen(kRedundantTarget));  // Size of the target window
+  ExpectRedundantTargetEncodedAsRun();
+}
+
+TEST_F(VCDiffHTML1Test, SimpleEncoderWithoutTargetMatching) {
+  simple_encoder_.SetTargetMatching(false);
+  EXPECT_TRUE(simple_encoder_.Encode(kRedundantTarget,
+                                     strlen(kRedundantTarget),
+                                     delta()));
+  EXPECT_GE(strlen(kRedundantTarget) + kFileHeaderSize + kWindowHeaderSize,
+            delta_size());
+  EXPECT_TRUE(simple_decoder_.Decode(kDictionary,
+                                     sizeof(kDictionary),
+                                     delta_as_const(),
+                                     &result_target_));
+  EXPECT_EQ(kRedundantTarget, result_target_);
+  // These values do not depend on the block size used for encoding
+  ExpectByte(0xD6);  // 'V' | 0x80
+  ExpectByte(0xC3);  // 'C' | 0x80
+  ExpectByte(0xC4);  // 'D' | 0x80
+  ExpectByte(0x00);  // Simple encoder never uses interleaved format
+  ExpectByte(0x00);  // Hdr_Indicator
+  ExpectByte(VCD_SOURCE);  // Win_Indicator: VCD_SOURCE (dictionary)
+  ExpectByte(sizeof(kDictionary));  // Dictionary length
+  ExpectByte(0x00);  // Source segment position: start of dictionary
+  ExpectRedundantTargetEncodedAsRun();
+}
+
+TEST_F(VCDiffHTML1Test, SimpleEncoderCopiesRepeatedPatternFromTarget) {
+  EXPECT_TRUE(simple_encoder_.Encode(kRepeatedPatternTarget,
+                                     strlen(kRepeatedPatternTarget),
+                                     delta()));
+  EXPECT_GE(strlen(kRepeatedPatternTarget) + kFileHeaderSize +
+                kWindowHeaderSize,
+            delta_size());
+  EXPECT_TRUE(simple_decoder_.Decode(kDictionary,
+                                     sizeof(kDictionary),
+                                     delta_as_const(),
+                                     &result_target_));
+  EXPECT_EQ(kRepeatedPatternTarget, result_target_);
+  // These values do not depend on the block size used for encoding
+  ExpectByte(0xD6);  // 'V' | 0x80
+  ExpectByte(0xC3);  // 'C' | 0x80
+  ExpectByte(0xC4);  // 'D' | 0x80
+  ExpectByte(0x00);  // Simple encoder never uses interleaved format
+  ExpectByte(0x00);  // Hdr_Indicator
+  ExpectByte(VCD_SOURCE);  // Win_Indicator: VCD_SOURCE (dictionary)
+  ExpectByte(sizeof(kDictionary));  // Dictionary length
+  ExpectByte(0x00);  // Source segment position: start of dictionary
+  ExpectByte(0x0F);  // Length of the delta encoding
+  ExpectSize(strlen(kRepeatedPatternTarget));  // Size of the target window
   ExpectByte(0x00);  // Delta_indicator (no compression)
-  ExpectByte(0x01);  // Length of the data section
+  ExpectByte(0x04);  // Length of the data section
   ExpectByte(0x04);  // Length of the instructions section
   ExpectByte(0x01);  // Length of the address section
   // Data section
-  ExpectString("A");      // Data for ADD
+  ExpectString("WXYZ");      // Data for ADD
   // Instructions section
-  ExpectByte(0x02);  // ADD size 1
+  ExpectByte(0x05);  // ADD size 4
   ExpectByte(0x23);  // COPY size 0 mode VCD_HERE
-  ExpectSize(strlen(kRedundantTarget) - 1);  // COPY size 255
+  ExpectSize(strlen(kRepeatedPatternTarget) - 4);  // COPY size 252
   // Address section
-  ExpectByte(0x01);  // COPY address (1) mode VCD_HERE
+  ExpectByte(0x04);  // COPY address (4) mode VCD_HERE
   ExpectNoMoreBytes();
 }
 
-TEST_F(VCDiffHTML1Test, SimpleEncoderWithoutTargetMatching) {
+TEST_F(VCDiffHTML1Test, SimpleEncoderWithoutTargetMatchingAddsPattern) {
   simple_encoder_.SetTargetMatching(false);
-  EXPECT_TRUE(simple_encoder_.Encode(kRedundantTarget,
-                                     strlen(kRedundantTarget),
+  EXPECT_TRUE(simple_encoder_.Encode(kRepeatedPatternTarget,
+                                     strlen(kRepeatedPatternTarget),
                                      delta()));
-  EXPECT_GE(strlen(kRedundantTarget) + kFileHeaderSize + kWindowHeaderSize,
+  EXPECT_GE(strlen(kRepeatedPatternTarget) + kFileHeaderSize +
+                kWindowHeaderSize,
             delta_size());
   EXPECT_TRUE(simple_decoder_.Decode(kDictionary,
                                      sizeof(kDictionary),
                                      delta_as_const(),
                                      &result_target_));
-  EXPECT_EQ(kRedundantTarget, result_target_);
+  EXPECT_EQ(kRepeatedPatternTarget, result_target_);
   // These values do not depend on the block size used for encoding
   ExpectByte(0xD6);  // 'V' | 0x80
   ExpectByte(0xC3);  // 'C' | 0x80
@@ -904,17 +1772,18 @@ TEST_F(VCDiffHTML1Test, SimpleEncoderWithoutTargetMatching) {
   ExpectByte(VCD_SOURCE);  // Win_Indicator: VCD_SOURCE (dictionary)
   ExpectByte(sizeof(kDictionary));  // Dictionary length
   ExpectByte(0x00);  // Source segment position: start of dictionary
-  ExpectSize(strlen(kRedundantTarget) + 0x0A);  // Length of the delta encoding
-  ExpectSize(strlen(kRedundantTarget));  // Size of the target window
+  // Length of the delta encoding
+  ExpectSize(strlen(kRepeatedPatternTarget) + 0x0A);
+  ExpectSize(strlen(kRepeatedPatternTarget));  // Size of the target window
   ExpectByte(0x00);  // Delta_indicator (no compression)
-  ExpectSize(strlen(kRedundantTarget));  // Length of the data section
+  ExpectSize(strlen(kRepeatedPatternTarget));  // Length of the data section
   ExpectByte(0x03);  // Length of the instructions section
   ExpectByte(0x00);  // Length of the address section
   // Data section
-  ExpectString(kRedundantTarget);      // Data for ADD
+  ExpectString(kRepeatedPatternTarget);      // Data for ADD
   // Instructions section
   ExpectByte(0x01);  // ADD size 0
-  ExpectSize(strlen(kRedundantTarget));  // ADD size
+  ExpectSize(strlen(kRepeatedPatternTarget));  // ADD size
   // Address section empty
   ExpectNoMoreBytes();
 }